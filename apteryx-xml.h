@@ -32,6 +32,8 @@ typedef enum
     SCH_E_NOTWRITABLE,
     SCH_E_KEYMISSING,
     SCH_E_INVALIDQUERY,
+    SCH_E_INVALIDJSON,
+    SCH_E_KEYMISMATCH,
 } sch_err;
 sch_err sch_last_err (void);
 const char * sch_last_errmsg (void);
@@ -47,15 +49,56 @@ typedef struct _sch_loaded_model
     char *deviations;
 } sch_loaded_model;
 
-/* Schema */
+/* Schema
+ * A single instance may be used for lookups, validation and translation from
+ * many threads at once. It is not immutable: lazy instances merge models on
+ * first use and lookups fill shared caches, both under internal locks. One
+ * thread at a time may sch_reload while others read, but sch_reclaim and
+ * sch_free must not run while any thread still uses nodes of the instance. */
 typedef struct _sch_instance sch_instance;
 typedef void sch_node;
 typedef void sch_ns;
 sch_instance *sch_load (const char *path);
 sch_instance *sch_load_with_model_list_filename (const char *path,
                                                  const char *model_list_filename);
+typedef enum
+{
+    SCH_LOAD_F_PARALLEL         = (1 << 0),  /* Parse model files on a thread pool */
+    SCH_LOAD_F_NO_CACHE         = (1 << 1),  /* Do not read or write the compiled schema cache */
+    SCH_LOAD_F_LAZY             = (1 << 2),  /* Only index the models and merge each on first use */
+    SCH_LOAD_F_COMPACT          = (1 << 3),  /* Drop help text and scripts and share repeated strings */
+} sch_load_flags;
+/* SCH_LOAD_F_COMPACT removes the help attribute of every NODE and all SCRIPT elements
+ * as models load, so they are missing from sch_dump_xml and sch_snapshot_write output
+ * and from attribute reads on the nodes. Lookup, translation and validation are the same */
+sch_instance *sch_load_with_flags (const char *path, const char *model_list_filename,
+                                   int flags);
 void sch_free (sch_instance * instance);
+/* Snapshots of the merged schema, e.g. linked in as C by xml2c -s.
+ * Loading decodes a fresh copy of the schema from the data */
+bool sch_snapshot_write (sch_instance * instance, const char *filename);
+sch_instance *sch_load_snapshot (const void *data, size_t size);
+/* Pick up added, removed or changed model files. Nodes from before the reload stay
+ * valid until sch_reclaim (or sch_free). One reloader per instance at a time.
+ * sch_reclaim does not track readers: call it only once nothing holds an old
+ * node or _ref string, including tables from the Lua api, which cache nodes */
+bool sch_reload (sch_instance * instance);
+void sch_reclaim (sch_instance * instance);
+/* Approximate bytes used by a loaded schema */
+typedef struct _sch_memory
+{
+    size_t nodes;               /* Elements, attributes, namespaces and their descriptors,
+                                 * and the model files sch_reload keeps */
+    size_t strings;             /* Names and values, counting each shared string once */
+    size_t regexes;             /* Compiled patterns */
+    size_t indexes;             /* Child, enum, namespace and name indexes and the lookup caches */
+    size_t total;
+} sch_memory;
+void sch_memory_usage (sch_instance * instance, sch_memory *usage);
 sch_node *sch_lookup (sch_instance * instance, const char *path);
+/* One path element of sch_lookup below parent (NULL for the root). ns holds the
+ * namespace in effect (start with NULL) and is updated for the next element */
+sch_node *sch_lookup_child (sch_instance * instance, sch_node * parent, sch_ns ** ns, const char *name);
 char *sch_dump_xml (sch_instance * instance);
 GList *sch_get_loaded_models (sch_instance * instance);
 
@@ -98,6 +141,29 @@ bool sch_is_proxy (sch_node * node);
 char *sch_translate_to (sch_node * node, char *value);
 char *sch_translate_from (sch_node * node, char *value);
 bool sch_validate_pattern (sch_node * node, const char *value);
+
+/* Validate a whole data tree against the schema in one pass. schema is the node
+ * for the root of the tree (NULL for the top level). Returns a list of
+ * sch_validation_error for every invalid node, or NULL if all are valid */
+typedef struct _sch_validation_error
+{
+    char *path;
+    sch_err error;
+    char *message;
+} sch_validation_error;
+GList *sch_validate_tree (sch_instance * instance, sch_node * schema, GNode * node, int flags);
+void sch_validation_errors_free (GList *errors);
+
+/* Borrowed strings owned by the sch_instance. Valid until sch_free, or for
+ * nodes replaced by sch_reload until sch_reclaim. The translations return
+ * value itself (the caller's pointer) when it has no enum match */
+const char *sch_name_ref (sch_node * node);
+const char *sch_model_ref (sch_node * node, bool ignore_ancestors);
+const char *sch_namespace_ref (sch_node * node);
+const char *sch_prefix_ref (sch_node * node);
+const char *sch_default_value_ref (sch_node * node);
+const char *sch_translate_to_ref (sch_node * node, const char *value);
+const char *sch_translate_from_ref (sch_node * node, const char *value);
 gboolean sch_match_name (const char *s1, const char *s2);
 bool sch_ns_match (sch_node *node, sch_ns *ns);
 
@@ -119,6 +185,8 @@ typedef enum
     SCH_F_ADD_MISSING_NULL      = (1 << 12), /* Add missing nodes with NULL values */
     SCH_F_SET_NULL              = (1 << 13), /* Set all nodes to NULL */
     SCH_F_FILTER_RDEPTH         = (1 << 14), /* Set filter based on depth value */
+    SCH_F_PARALLEL              = (1 << 15), /* Split large lists across threads */
+    SCH_F_PAGED                 = (1 << 16), /* Query had limit, offset or cursor */
 } sch_flags;
 GNode *sch_path_to_gnode (sch_instance * instance, sch_node * schema, const char * path, int flags, sch_node ** rschema);
 bool sch_query_to_gnode (sch_instance * instance, sch_node * schema, GNode *parent, const char * query, int flags, int *rflags);
@@ -126,9 +194,77 @@ bool sch_traverse_tree (sch_instance * instance, sch_node * schema, GNode * node
 GNode *sch_path_to_query (sch_instance * instance, sch_node * schema, const char * path, int flags); //DEPRECATED
 void sch_gnode_sort_children (sch_node * schema, GNode * parent);
 
+/* A window of list entries from the limit, offset and cursor query parameters. It applies
+ * to the outermost lists of the tree, whose entries are taken in key order. The _paged
+ * variants ignore the page unless SCH_F_PAGED is set. Apply a page once, either when
+ * traversing (which frees the entries outside it) or when encoding JSON */
+typedef struct _sch_page
+{
+    guint offset;               /* Entries to skip */
+    guint limit;                /* Entries to keep, 0 for all */
+    char *cursor;               /* Start after the entry with this key, or where it would sort */
+} sch_page;
+void sch_page_clear (sch_page *page);
+bool sch_query_to_gnode_paged (sch_instance * instance, sch_node * schema, GNode *parent, const char * query,
+                               int flags, int *rflags, sch_page *page);
+bool sch_traverse_tree_paged (sch_instance * instance, sch_node * schema, GNode * node, int flags, int rdepth,
+                              const sch_page *page);
+
+/* Request scoped allocation. While an arena is in use by the calling thread, trees built by
+ * sch_path_to_gnode, sch_path_to_query, sch_query_to_gnode, sch_json_to_gnode and the JSON
+ * parser belong to it. Their nodes, names and values are arena copies released all at once
+ * by sch_arena_free. Do not apteryx_free_tree them or keep them beyond sch_arena_free;
+ * sch_traverse_tree refuses them. sch_arena_use returns the previous arena */
+typedef struct _sch_arena sch_arena;
+sch_arena *sch_arena_new (void);
+sch_arena *sch_arena_use (sch_arena *arena);
+void sch_arena_free (sch_arena *arena);
+
+/* Build the same tree as sch_json_to_gnode from JSON text fed in chunks.
+ * sch_json_parser_finish frees the parser and returns NULL on any error */
+typedef struct _sch_json_parser sch_json_parser;
+sch_json_parser *sch_json_parser_new (sch_instance * instance, sch_node * schema, int flags);
+bool sch_json_parser_feed (sch_json_parser *parser, const char *data, size_t len);
+GNode *sch_json_parser_finish (sch_json_parser *parser);
+void sch_json_parser_free (sch_json_parser *parser);
+
+/* Optional call counters and latency histograms for the main entry points. Disabled by
+ * default. Each thread counts into its own shard and sch_stats_snapshot sums them.
+ * histogram[0] counts calls under 1us and histogram[i] calls under 2^i us */
+typedef enum
+{
+    SCH_STAT_LOOKUP,
+    SCH_STAT_PATH_TO_GNODE,
+    SCH_STAT_QUERY_TO_GNODE,
+    SCH_STAT_TRAVERSE_TREE,
+    SCH_STAT_GNODE_TO_JSON,
+    SCH_STAT_JSON_TO_GNODE,
+    SCH_STAT_MAX,
+} sch_stat_id;
+#define SCH_STAT_BUCKETS 20
+typedef struct _sch_stat
+{
+    const char *name;
+    guint64 calls;
+    guint64 hits;               /* Child index (lookup), path or query cache hits */
+    guint64 misses;             /* Child index (lookup), path or query cache misses */
+    guint64 total_ns;
+    guint64 histogram[SCH_STAT_BUCKETS];
+} sch_stat;
+void sch_stats_enable (bool enable);
+bool sch_stats_enabled (void);
+void sch_stats_snapshot (sch_stat stats[SCH_STAT_MAX]);
+void sch_stats_reset (void);
+
 #ifdef APTERYX_XML_JSON
 #include <jansson.h>
 json_t *sch_gnode_to_json (sch_instance * instance, sch_node * schema, GNode * node, int flags);
+json_t *sch_gnode_to_json_paged (sch_instance * instance, sch_node * schema, GNode * node, int flags,
+                                 const sch_page *page);
+/* Stream compact JSON for a GNode tree to callback without building a json_t.
+ * Returns false if there was nothing to write or the callback failed */
+bool sch_gnode_to_json_stream (sch_instance * instance, sch_node * schema, GNode * node, int flags,
+                               json_dump_callback_t callback, void *data);
 GNode *sch_json_to_gnode (sch_instance * instance, sch_node * schema, json_t * json, int flags);
 #endif
 #endif /* _APTERYX_XML_H_ */
@@ -0,0 +1,391 @@
+/**
+ * @file bench.c
+ * Micro-benchmarks for the Apteryx XML Schema
+ *
+ * Copyright 2016, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <glib.h>
+#include <jansson.h>
+#include <apteryx.h>
+#define APTERYX_XML_JSON
+#include "apteryx-xml.h"
+
+/* Results are printed one JSON object per line:
+ * {"benchmark":"sch_lookup","iterations":100000,"total_us":1234,"ns_per_op":12.3} */
+
+static int scale = 100;          /* Containers in the synthetic schema */
+static int entries = 1000;       /* List entries in the synthetic tree */
+static int iterations = 1000;    /* Base iteration count */
+static const char *filter = NULL;
+static char *schema_dir = NULL;
+
+static inline uint64_t
+get_time_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec);
+}
+
+static void
+report (const char *name, int count, uint64_t ns)
+{
+    printf ("{\"benchmark\":\"%s\",\"iterations\":%d,\"total_us\":%" PRIu64 ",\"ns_per_op\":%.1f}\n",
+            name, count, ns / 1000, count ? (double) ns / count : 0.0);
+    fflush (stdout);
+}
+
+static bool
+selected (const char *name)
+{
+    return !filter || strstr (name, filter) != NULL;
+}
+
+/* Write a schema with scale containers of typical leaves and one large list */
+static bool
+generate_schema (const char *dir)
+{
+    char *filename = g_build_filename (dir, "bench.xml", NULL);
+    FILE *f = fopen (filename, "w");
+    g_free (filename);
+    if (!f)
+        return false;
+
+    fprintf (f, "<?xml version='1.0' encoding='UTF-8'?>\n"
+             "<MODULE xmlns=\"http://bench.com/ns/yang/bench\"\n"
+             "        xmlns:bench=\"http://bench.com/ns/yang/bench\"\n"
+             "        model=\"bench\" organization=\"Bench Ltd\" version=\"2024-01-01\">\n"
+             "  <NODE name=\"bench\" help=\"Benchmark root\">\n");
+    for (int i = 0; i < scale; i++)
+    {
+        fprintf (f, "    <NODE name=\"c%d\" help=\"container\">\n"
+                 "      <NODE name=\"name\" mode=\"rw\" help=\"string\"/>\n"
+                 "      <NODE name=\"count\" mode=\"rw\" range=\"0..1000000\" help=\"integer\"/>\n"
+                 "      <NODE name=\"mac\" mode=\"rw\" help=\"mac\" pattern=\"[0-9a-fA-F]{2}(:[0-9a-fA-F]{2}){5}\"/>\n"
+                 "      <NODE name=\"label\" mode=\"rw\" help=\"label\" pattern=\"[A-Za-z][A-Za-z0-9_\\-]{0,31}\"/>\n"
+                 "      <NODE name=\"state\" mode=\"rw\" default=\"down\" help=\"state\">\n"
+                 "        <VALUE name=\"down\" value=\"0\"/>\n"
+                 "        <VALUE name=\"up\" value=\"1\"/>\n"
+                 "      </NODE>\n"
+                 "      <NODE name=\"mtu\" mode=\"rw\" default=\"1500\" range=\"68..9000\" help=\"mtu\"/>\n"
+                 "      <NODE name=\"status\" mode=\"r\" default=\"ok\" help=\"status\"/>\n"
+                 "    </NODE>\n", i);
+    }
+    fprintf (f, "    <NODE name=\"entries\" help=\"A large list\">\n"
+             "      <NODE name=\"*\" help=\"entry with key name\">\n"
+             "        <NODE name=\"name\" mode=\"rw\" help=\"key\"/>\n"
+             "        <NODE name=\"value\" mode=\"rw\" default=\"0\" range=\"0..65535\" help=\"integer\"/>\n"
+             "        <NODE name=\"enabled\" mode=\"rw\" default=\"false\" help=\"boolean\">\n"
+             "          <VALUE name=\"true\" value=\"true\"/>\n"
+             "          <VALUE name=\"false\" value=\"false\"/>\n"
+             "        </NODE>\n"
+             "      </NODE>\n"
+             "    </NODE>\n"
+             "  </NODE>\n"
+             "</MODULE>\n");
+    fclose (f);
+    return true;
+}
+
+static void
+remove_schema (const char *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const char *name;
+    char *filename;
+
+    while (d && (name = g_dir_read_name (d)))
+    {
+        filename = g_build_filename (dir, name, NULL);
+        unlink (filename);
+        g_free (filename);
+    }
+    if (d)
+        g_dir_close (d);
+    rmdir (dir);
+    filename = g_strdup_printf ("%s.cache", dir);
+    unlink (filename);
+    g_free (filename);
+}
+
+/* A data tree rooted at "/" with every container set and a large list */
+static GNode *
+generate_tree (void)
+{
+    GNode *root = APTERYX_NODE (NULL, g_strdup ("/"));
+    GNode *bench = APTERYX_NODE (root, g_strdup ("bench"));
+    GNode *list;
+
+    for (int i = 0; i < scale; i++)
+    {
+        GNode *c = APTERYX_NODE (bench, g_strdup_printf ("c%d", i));
+        APTERYX_LEAF (c, g_strdup ("name"), g_strdup_printf ("container-%d", i));
+        APTERYX_LEAF (c, g_strdup ("count"), g_strdup_printf ("%d", i * 7));
+        APTERYX_LEAF (c, g_strdup ("mac"), g_strdup_printf ("00:11:22:33:44:%02x", i & 0xff));
+        APTERYX_LEAF (c, g_strdup ("state"), g_strdup (i % 2 ? "1" : "0"));
+        APTERYX_LEAF (c, g_strdup ("mtu"), g_strdup (i % 3 ? "1500" : "9000"));
+    }
+    list = APTERYX_NODE (bench, g_strdup ("entries"));
+    for (int i = 0; i < entries; i++)
+    {
+        GNode *e = APTERYX_NODE (list, g_strdup_printf ("entry%d", i));
+        APTERYX_LEAF (e, g_strdup ("name"), g_strdup_printf ("entry%d", i));
+        APTERYX_LEAF (e, g_strdup ("value"), g_strdup_printf ("%d", i % 2 ? i : 0));
+        APTERYX_LEAF (e, g_strdup ("enabled"), g_strdup (i % 2 ? "true" : "false"));
+    }
+    return root;
+}
+
+static gpointer
+copy_data (gconstpointer src, gpointer data)
+{
+    return g_strdup ((const char *) src);
+}
+
+static void
+bench_load (const char *name, bool cached)
+{
+    int flags = cached ? 0 : SCH_LOAD_F_NO_CACHE;
+    int count = MAX (iterations / 100, 1);
+    uint64_t total = 0;
+
+    /* Write the cache up front so every timed cached load reads it */
+    if (cached)
+        sch_free (sch_load (schema_dir));
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t start = get_time_ns ();
+        sch_instance *instance = sch_load_with_flags (schema_dir, NULL, flags);
+        total += get_time_ns () - start;
+        sch_free (instance);
+    }
+    report (name, count, total);
+}
+
+static void
+bench_lookup (sch_instance *instance)
+{
+    int count = iterations * 100;
+    char **paths = g_new0 (char *, scale);
+    uint64_t start;
+
+    for (int i = 0; i < scale; i++)
+        paths[i] = g_strdup_printf ("/bench/c%d/mtu", scale - 1 - i);
+    start = get_time_ns ();
+    for (int i = 0; i < count; i++)
+    {
+        if (!sch_lookup (instance, paths[i % scale]))
+            fprintf (stderr, "ERROR: lookup failed %s\n", paths[i % scale]);
+    }
+    report ("sch_lookup", count, get_time_ns () - start);
+    for (int i = 0; i < scale; i++)
+        g_free (paths[i]);
+    g_free (paths);
+}
+
+static void
+bench_path_to_gnode (sch_instance *instance)
+{
+    int count = iterations * 100;
+    uint64_t start = get_time_ns ();
+
+    for (int i = 0; i < count; i++)
+    {
+        GNode *node = sch_path_to_gnode (instance, NULL, "/bench/entries/entry42/value", 0, NULL);
+        apteryx_free_tree (node);
+    }
+    report ("sch_path_to_gnode", count, get_time_ns () - start);
+}
+
+static void
+bench_query_to_gnode (sch_instance *instance)
+{
+    int count = iterations * 10;
+    uint64_t start = get_time_ns ();
+
+    for (int i = 0; i < count; i++)
+    {
+        sch_node *schema = NULL;
+        GNode *root = sch_path_to_gnode (instance, NULL, "/bench", 0, &schema);
+        if (!sch_query_to_gnode (instance, schema, root, "fields=c1(name;mtu);c2;entries/*/value", 0, NULL))
+            fprintf (stderr, "ERROR: query failed: %s\n", sch_last_errmsg ());
+        apteryx_free_tree (root);
+    }
+    report ("sch_query_to_gnode", count, get_time_ns () - start);
+}
+
+static void
+bench_traverse (sch_instance *instance, GNode *tree, const char *name, int flags)
+{
+    sch_node *schema = sch_lookup (instance, "/bench");
+    int count = MAX (iterations / 10, 1);
+    uint64_t total = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        /* Traversal modifies the tree so only time it on a fresh copy */
+        GNode *copy = g_node_copy_deep (tree, copy_data, NULL);
+        uint64_t start = get_time_ns ();
+        if (!sch_traverse_tree (instance, schema, copy->children, flags, 0))
+            fprintf (stderr, "ERROR: traverse failed: %s\n", sch_last_errmsg ());
+        total += get_time_ns () - start;
+        apteryx_free_tree (copy);
+    }
+    report (name, count, total);
+}
+
+static void
+bench_json (sch_instance *instance, GNode *tree)
+{
+    int flags = SCH_F_JSON_ARRAYS | SCH_F_JSON_TYPES;
+    int count = MAX (iterations / 10, 1);
+    json_t *json = NULL;
+    uint64_t start;
+
+    /* Start from the top level node so the JSON round trips */
+    tree = tree->children;
+
+    if (selected ("sch_gnode_to_json"))
+    {
+        start = get_time_ns ();
+        for (int i = 0; i < count; i++)
+        {
+            json_t *out = sch_gnode_to_json (instance, NULL, tree, flags);
+            json_decref (out);
+        }
+        report ("sch_gnode_to_json", count, get_time_ns () - start);
+    }
+
+    if (selected ("sch_json_to_gnode"))
+    {
+        json = sch_gnode_to_json (instance, NULL, tree, flags);
+        start = get_time_ns ();
+        for (int i = 0; i < count; i++)
+        {
+            GNode *node = sch_json_to_gnode (instance, NULL, json, flags);
+            if (!node)
+                fprintf (stderr, "ERROR: json parse failed: %s\n", sch_last_errmsg ());
+            apteryx_free_tree (node);
+        }
+        report ("sch_json_to_gnode", count, get_time_ns () - start);
+        json_decref (json);
+    }
+}
+
+static void
+bench_validate_pattern (sch_instance *instance)
+{
+    static const char *values[] = {
+        "00:11:22:33:44:55", "AA:BB:CC:DD:EE:FF", "00:11:22:33:44", "not-a-mac",
+    };
+    sch_node *node = sch_lookup (instance, "/bench/c0/mac");
+    int count = iterations * 100;
+    uint64_t start = get_time_ns ();
+
+    for (int i = 0; i < count; i++)
+        sch_validate_pattern (node, values[i % G_N_ELEMENTS (values)]);
+    report ("sch_validate_pattern", count, get_time_ns () - start);
+}
+
+static void
+usage (const char *name)
+{
+    printf ("Usage: %s [-s containers] [-e entries] [-i iterations] [-f filter]\n"
+            "  -s  containers in the synthetic schema (default %d)\n"
+            "  -e  list entries in the synthetic tree (default %d)\n"
+            "  -i  base iteration count (default %d)\n"
+            "  -f  only run benchmarks whose name contains filter\n",
+            name, scale, entries, iterations);
+}
+
+int
+main (int argc, char *argv[])
+{
+    sch_instance *instance;
+    GNode *tree;
+    int i = 0;
+
+    /* Parse options */
+    while ((i = getopt (argc, argv, "s:e:i:f:h")) != -1)
+    {
+        switch (i)
+        {
+        case 's':
+            scale = MAX (atoi (optarg), 1);
+            break;
+        case 'e':
+            entries = MAX (atoi (optarg), 43);
+            break;
+        case 'i':
+            iterations = MAX (atoi (optarg), 1);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'h':
+        default:
+            usage (argv[0]);
+            return 0;
+        }
+    }
+
+    /* Synthetic schema and data tree */
+    schema_dir = g_dir_make_tmp ("apteryx-xml-bench-XXXXXX", NULL);
+    if (!schema_dir || !generate_schema (schema_dir))
+    {
+        fprintf (stderr, "ERROR: failed to generate schema\n");
+        return -1;
+    }
+    instance = sch_load (schema_dir);
+    if (!instance)
+    {
+        fprintf (stderr, "ERROR: failed to load schema from %s\n", schema_dir);
+        remove_schema (schema_dir);
+        return -1;
+    }
+    tree = generate_tree ();
+
+    if (selected ("sch_load_uncached"))
+        bench_load ("sch_load_uncached", false);
+    if (selected ("sch_load_cached"))
+        bench_load ("sch_load_cached", true);
+    if (selected ("sch_lookup"))
+        bench_lookup (instance);
+    if (selected ("sch_path_to_gnode"))
+        bench_path_to_gnode (instance);
+    if (selected ("sch_query_to_gnode"))
+        bench_query_to_gnode (instance);
+    if (selected ("sch_traverse_tree_add_defaults"))
+        bench_traverse (instance, tree, "sch_traverse_tree_add_defaults", SCH_F_ADD_DEFAULTS);
+    if (selected ("sch_traverse_tree_trim_defaults"))
+        bench_traverse (instance, tree, "sch_traverse_tree_trim_defaults", SCH_F_TRIM_DEFAULTS);
+    bench_json (instance, tree);
+    if (selected ("sch_validate_pattern"))
+        bench_validate_pattern (instance);
+
+    apteryx_free_tree (tree);
+    sch_free (instance);
+    remove_schema (schema_dir);
+    g_free (schema_dir);
+    return 0;
+}
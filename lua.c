@@ -52,33 +52,80 @@ lua_apteryx_debug (lua_State * L)
     return 0;
 }
 
+/* Get the path and cached schema node stored in the table at index 1.
+ * The node is only valid until sch_free, or sch_reclaim after a reload */
+static const char *
+get_stored (lua_State * L, sch_node ** node, sch_ns ** ns)
+{
+    const char *path;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    lua_pushstring (L, "__path");
+    lua_rawget (L, 1);
+    path = lua_tostring (L, -1);
+    if (path == NULL)
+    {
+        path = "";
+    }
+    lua_pop (L, 1);
+    lua_pushstring (L, "__node");
+    lua_rawget (L, 1);
+    *node = (sch_node *) lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    lua_pushstring (L, "__ns");
+    lua_rawget (L, 1);
+    *ns = (sch_ns *) lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    return path;
+}
+
+/* Resolve key from the parent's schema node rather than from the root.
+ * Multi-element keys (or a parent with no cached node) use a full lookup */
+static sch_node *
+lookup_key (sch_instance * api, const char *path, sch_node * parent, sch_ns ** ns, const char *key)
+{
+    sch_node *node;
+    char *__path;
+
+    if (!strchr (key, '/') && (parent || path[0] == '\0'))
+    {
+        return sch_lookup_child (api, parent, ns, key);
+    }
+    __path = g_strdup_printf ("%s/%s", path, key);
+    node = sch_lookup (api, __path);
+    g_free (__path);
+    *ns = NULL;
+    return node;
+}
+
 /* Push either a value or table onto the stack */
 static bool
-push_node (lua_State * L, sch_instance * api, const char *path, const char *key)
+push_node (lua_State * L, sch_instance * api, const char *path, sch_node * parent, sch_ns * ns,
+           const char *key)
 {
     char *__path;
     sch_node *node;
-    char *name;
+    const char *name;
 
     /* Lookup the node */
-    __path = g_strdup_printf ("%s/%s", path, key);
-    node = sch_lookup (api, __path);
+    node = lookup_key (api, path, parent, &ns, key);
     if (!node)
     {
         /* Not accessible at all */
-        g_free (__path);
         luaL_error (L, "\'%s\' invalid", key);
         return false;
     }
 
     /* Use the real path name */
-    name = sch_name (node);
+    name = sch_name_ref (node);
     if (strcmp (name, "*") != 0)
     {
-        free (__path);
         __path = g_strdup_printf ("%s/%s", path, name);
     }
-    free (name);
+    else
+    {
+        __path = g_strdup_printf ("%s/%s", path, key);
+    }
 
     /* For leaves we return a value - either from db, default or nil */
     if (sch_is_leaf (node))
@@ -97,23 +144,152 @@ push_node (lua_State * L, sch_instance * api, const char *path, const char *key)
         /* Get the value from Apteryx or its default */
         value = apteryx_get (__path);
         /* Pass back defined values if they exist in the schema */
-        value = sch_translate_to (node, value);
-        lua_pushstring (L, value);
+        lua_pushstring (L, sch_translate_to_ref (node, value));
         free (value);
     }
     else
     {
-        /* Table on the stack */
+        /* Table on the stack with the resolved node for the next lookup */
         lua_newtable (L);
         lua_pushstring (L, "__path");
         lua_pushstring (L, __path);
         lua_rawset (L, -3);
+        if (!strchr (key, '/'))
+        {
+            lua_pushstring (L, "__node");
+            lua_pushlightuserdata (L, node);
+            lua_rawset (L, -3);
+            lua_pushstring (L, "__ns");
+            lua_pushlightuserdata (L, ns);
+            lua_rawset (L, -3);
+        }
         luaL_setmetatable (L, "apteryx_mt");
     }
     g_free (__path);
     return true;
 }
 
+/* Build an apteryx tree below parent from the Lua table at index.
+ * Returns false with err set if any key is invalid or not writable */
+static bool
+table_to_tree (lua_State * L, sch_instance * api, int index, sch_node * snode, sch_ns * ns,
+               GNode * parent, char **err)
+{
+    bool rc = true;
+
+    lua_pushnil (L);
+    while (lua_next (L, index) != 0)
+    {
+        sch_node *child;
+        sch_ns *cns = ns;
+        const char *key;
+        const char *name;
+
+        /* Copy the key so lua_tostring does not confuse lua_next */
+        lua_pushvalue (L, -2);
+        key = lua_tostring (L, -1);
+        child = key ? sch_lookup_child (api, snode, &cns, key) : NULL;
+        if (!child)
+        {
+            *err = g_strdup_printf ("\'%s\' invalid", key ? : "?");
+            rc = false;
+        }
+        else if (lua_istable (L, -2) && !sch_is_leaf (child))
+        {
+            name = sch_name_ref (child);
+            GNode *node = APTERYX_NODE (parent, g_strdup (strcmp (name, "*") != 0 ? name : key));
+            rc = table_to_tree (L, api, lua_gettop (L) - 1, child, cns, node, err);
+        }
+        else
+        {
+            const char *value = lua_istable (L, -2) ? NULL : lua_tostring (L, -2);
+
+            /* Translate and validate the schema version */
+            if (value)
+                value = sch_translate_from_ref (child, value);
+            if (!value || !sch_is_leaf (child) || (!is_root && !sch_is_writable (child)) ||
+                (value[0] != '\0' && !sch_validate_pattern (child, value)))
+            {
+                *err = g_strdup_printf ("\'%s\' not writable", key);
+                rc = false;
+            }
+            else
+            {
+                name = sch_name_ref (child);
+                APTERYX_LEAF (parent, g_strdup (strcmp (name, "*") != 0 ? name : key), g_strdup (value));
+            }
+        }
+        lua_pop (L, 2);
+        if (!rc)
+        {
+            /* Drop the key lua_next left behind */
+            lua_pop (L, 1);
+            break;
+        }
+    }
+    return rc;
+}
+
+/* Validate and set the Lua table at index as the subtree at path/key in one go */
+static bool
+set_table (lua_State * L, sch_instance * api, const char *path, sch_node * parent, sch_ns * ns,
+           const char *key, int index)
+{
+    sch_node *node;
+    const char *name;
+    GNode *root;
+    char *err = NULL;
+    bool rc;
+
+    node = lookup_key (api, path, parent, &ns, key);
+    if (!node || sch_is_leaf (node))
+    {
+        luaL_error (L, "\'%s\' not writable", key);
+        return false;
+    }
+
+    /* Use the real path name */
+    name = sch_name_ref (node);
+    root = APTERYX_NODE (NULL, g_strdup_printf ("%s/%s", path, strcmp (name, "*") != 0 ? name : key));
+    if (!table_to_tree (L, api, index, node, ns, root, &err))
+    {
+        apteryx_free_tree (root);
+        lua_pushstring (L, err);
+        g_free (err);
+        lua_error (L);
+        return false;
+    }
+    rc = root->children ? apteryx_set_tree (root) : true;
+    apteryx_free_tree (root);
+    lua_pushboolean (L, rc);
+    return true;
+}
+
+/* Push an apteryx tree as a nested table using the schema to translate values */
+static void
+push_tree (lua_State * L, sch_instance * api, sch_node * snode, sch_ns * ns, GNode * tree)
+{
+    GNode *iter;
+
+    lua_newtable (L);
+    for (iter = tree->children; iter; iter = iter->next)
+    {
+        sch_ns *cns = ns;
+        sch_node *child = sch_lookup_child (api, snode, &cns, APTERYX_NAME (iter));
+
+        /* Skip anything the schema does not know about or we cannot read */
+        if (!child || (!is_root && !sch_is_readable (child) && sch_is_leaf (child)))
+            continue;
+        if (sch_is_leaf (child) && APTERYX_HAS_VALUE (iter))
+            lua_pushstring (L, sch_translate_to_ref (child, APTERYX_VALUE (iter)));
+        else if (!sch_is_leaf (child))
+            push_tree (L, api, child, cns, iter);
+        else
+            continue;
+        lua_setfield (L, -2, APTERYX_NAME (iter));
+    }
+}
+
 static sch_instance *
 _get_api (lua_State *L)
 {
@@ -133,11 +309,86 @@ _set_api (lua_State *L, sch_instance *api)
     lua_pop(L, 1);
 }
 
+/* State for a list:pairs() iteration */
+typedef struct _list_iter
+{
+    char *path;
+    sch_node *node;
+    sch_ns *ns;
+    GList *paths;
+    GList *next;
+    bool searched;
+} list_iter;
+
+static int
+list_iter_gc (lua_State * L)
+{
+    list_iter *iter = (list_iter *) luaL_checkudata (L, 1, "apteryx_iter");
+
+    g_list_free_full (iter->paths, free);
+    iter->paths = iter->next = NULL;
+    g_free (iter->path);
+    iter->path = NULL;
+    return 0;
+}
+
+/* Hand out the next entry name and its value or table */
+static int
+list_iter_next (lua_State * L)
+{
+    list_iter *iter = (list_iter *) luaL_checkudata (L, lua_upvalueindex (1), "apteryx_iter");
+    sch_instance *api = _get_api (L);
+    const char *key;
+
+    /* Search on first use so an unused iterator costs nothing */
+    if (!iter->searched)
+    {
+        char *__path = g_strdup_printf ("%s/", iter->path);
+        iter->paths = iter->next = apteryx_search (__path);
+        iter->searched = true;
+        g_free (__path);
+    }
+    if (!api || !iter->next)
+    {
+        return 0;
+    }
+    key = strrchr ((char *) iter->next->data, '/') + 1;
+    iter->next = iter->next->next;
+    lua_pushstring (L, key);
+    if (!push_node (L, api, iter->path, iter->node, iter->ns, key))
+    {
+        return 0;
+    }
+    return 2;
+}
+
+/* list:pairs() - iterate entries without building a table of them */
+static int
+list_pairs (lua_State * L)
+{
+    sch_node *node;
+    sch_ns *ns;
+    const char *path;
+    list_iter *iter;
+
+    path = get_stored (L, &node, &ns);
+    iter = (list_iter *) lua_newuserdata (L, sizeof (list_iter));
+    memset (iter, 0, sizeof (list_iter));
+    iter->path = g_strdup (path);
+    iter->node = node;
+    iter->ns = ns;
+    luaL_setmetatable (L, "apteryx_iter");
+    lua_pushcclosure (L, list_iter_next, 1);
+    return 1;
+}
+
 static int
 __index (lua_State * L)
 {
     const char *path;
     const char *key;
+    sch_node *parent;
+    sch_ns *ns;
     sch_instance *api = _get_api(L);
 
     /* If no API, this key does not exist! */
@@ -147,15 +398,7 @@ __index (lua_State * L)
     }
 
     /* Get stored parameters */
-    luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    path = get_stored (L, &parent, &ns);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
@@ -166,8 +409,18 @@ __index (lua_State * L)
 
     DEBUG ("__index: %s/%s\n", path, key);
 
+    /* pairs is a method on lists (whose only child is the "*" wildcard)
+     * and elsewhere unless the schema has a node of that name */
+    sch_ns *pns = ns;
+    if (strcmp (key, "pairs") == 0 &&
+        ((parent && sch_is_list (parent)) || !lookup_key (api, path, parent, &pns, key)))
+    {
+        lua_pushcfunction (L, list_pairs);
+        return 1;
+    }
+
     /* Push the value onto the stack */
-    if (!push_node (L, api, path, key))
+    if (!push_node (L, api, path, parent, ns, key))
     {
         return 0;
     }
@@ -182,7 +435,9 @@ __newindex (lua_State * L)
     const char *path;
     const char *key;
     const char *value;
-    char *name;
+    const char *name;
+    sch_node *parent;
+    sch_ns *ns;
     sch_instance *api = _get_api (L);
 
     /* If no API, this key does not exist! */
@@ -192,15 +447,7 @@ __newindex (lua_State * L)
     }
 
     /* Get stored parameters */
-    luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    path = get_stored (L, &parent, &ns);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
@@ -208,34 +455,30 @@ __newindex (lua_State * L)
     {
         return 0;
     }
+    if (lua_istable (L, 3))
+    {
+        DEBUG ("__newindex: %s/%s = {...}\n", path, key);
+        return set_table (L, api, path, parent, ns, key, 3) ? 1 : 0;
+    }
     value = lua_tostring (L, 3);
 
     DEBUG ("__newindex: %s/%s = %s\n", path, key, value);
 
     /* Validate the node */
-    char *__path = g_strdup_printf ("%s/%s", path, key);
-    sch_node *node = sch_lookup (api, __path);
+    sch_node *node = lookup_key (api, path, parent, &ns, key);
     if (!node || (!is_root && !sch_is_writable (node)) || !sch_is_leaf (node))
     {
         /* Not accessible */
-        g_free ((gpointer) __path);
         luaL_error (L, "\'%s\' not writable", key);
         return 0;
     }
 
     /* Use the real path name */
-    name = sch_name (node);
-    if (strcmp (name, "*") != 0)
-    {
-        free (__path);
-        __path = g_strdup_printf ("%s/%s", path, name);
-    }
-    free (name);
+    name = sch_name_ref (node);
+    char *__path = g_strdup_printf ("%s/%s", path, strcmp (name, "*") != 0 ? name : key);
 
     /* Translate from the schema version */
-    char *val = sch_translate_from (node, g_strdup (value));
-    lua_pushboolean (L, apteryx_set (__path, val));
-    g_free (val);
+    lua_pushboolean (L, apteryx_set (__path, sch_translate_from_ref (node, value)));
     g_free (__path);
     return 1;
 }
@@ -246,6 +489,8 @@ __call (lua_State * L)
     const char *path;
     const char *key;
     const char *value;
+    sch_node *parent;
+    sch_ns *ns;
     sch_instance *api = _get_api (L);
 
     /* If no API, this key does not exist! */
@@ -255,18 +500,15 @@ __call (lua_State * L)
     }
 
     /* Get stored parameters */
-    luaL_checktype (L, 1, LUA_TTABLE);
-    lua_pushstring (L, "__path");
-    lua_rawget (L, 1);
-    path = lua_tostring (L, -1);
-    if (path == NULL)
-    {
-        path = "";
-    }
-    lua_pop (L, 1);
+    path = get_stored (L, &parent, &ns);
 
     /* Get passed in parameters */
     key = lua_tostring (L, 2);
+    if (key && lua_istable (L, 3))
+    {
+        DEBUG ("__call: %s/%s = {...}\n", path, key);
+        return set_table (L, api, path, parent, ns, key, 3) ? 1 : 0;
+    }
     if (lua_isnil (L, 3))
         value = "";
     else
@@ -302,36 +544,27 @@ __call (lua_State * L)
     else if (value)
     {
         /* Validate the node */
-        char *__path = g_strdup_printf ("%s/%s", path, key);
-        sch_node *node = sch_lookup (api, __path);
+        sch_node *node = lookup_key (api, path, parent, &ns, key);
         if (!node || (!is_root && !sch_is_writable (node)) || !sch_is_leaf (node))
         {
             /* Not accessible */
-            g_free ((gpointer) __path);
             luaL_error (L, "\'%s\' not writable", key);
             return 0;
         }
 
         /* Use the real path name */
-        char *name = sch_name (node);
-        if (strcmp (name, "*") != 0)
-        {
-            free (__path);
-            __path = g_strdup_printf ("%s/%s", path, name);
-        }
-        free (name);
+        const char *name = sch_name_ref (node);
+        char *__path = g_strdup_printf ("%s/%s", path, strcmp (name, "*") != 0 ? name : key);
 
         /* Translate from the schema version */
-        char *val = sch_translate_from (node, g_strdup (value));
-        lua_pushboolean (L, apteryx_set (__path, val));
-        g_free (val);
+        lua_pushboolean (L, apteryx_set (__path, sch_translate_from_ref (node, value)));
         g_free (__path);
         return 1;
     }
     else
     {
         /* Push the node/value onto the stack */
-        if (!push_node (L, api, path, key))
+        if (!push_node (L, api, path, parent, ns, key))
         {
             return 0;
         }
@@ -375,6 +608,12 @@ lua_apteryx_api (lua_State * L)
         return 0;
     }
 
+    /* Iterator state */
+    luaL_newmetatable (L, "apteryx_iter");
+    lua_pushcfunction (L, list_iter_gc);
+    lua_setfield (L, -2, "__gc");
+    lua_pop (L, 1);
+
     /* Create the API object */
     luaL_newmetatable (L, "apteryx_mt");
     luaL_setfuncs (L, _apteryx_mt, 0);
@@ -409,6 +648,95 @@ lua_apteryx_valid (lua_State * L)
     return 1;
 }
 
+static int
+lua_apteryx_get (lua_State * L)
+{
+    sch_instance *api = _get_api (L);
+    sch_node *node = NULL;
+    sch_ns *ns = NULL;
+    const char *path = NULL;
+    GNode *tree;
+
+    if (lua_gettop (L) == 1 && lua_istable (L, 1))
+    {
+        path = get_stored (L, &node, &ns);
+        if (!node)
+            node = api ? sch_lookup (api, path) : NULL;
+    }
+    else if (lua_gettop (L) == 1 && lua_isstring (L, 1))
+    {
+        path = lua_tostring (L, 1);
+        node = api ? sch_lookup (api, path) : NULL;
+    }
+    if (!node || sch_is_leaf (node))
+    {
+        luaL_error (L, "Invalid arguments: requires container");
+        return 0;
+    }
+
+    /* Fetch the whole subtree in one request */
+    DEBUG ("get: %s\n", path);
+    tree = apteryx_get_tree (path);
+    if (!tree)
+    {
+        lua_pushnil (L);
+        return 1;
+    }
+    push_tree (L, api, node, ns, tree);
+    apteryx_free_tree (tree);
+    return 1;
+}
+
+static int
+lua_apteryx_stats_enable (lua_State * L)
+{
+    if (lua_gettop (L) < 1 || !lua_isboolean (L, 1))
+    {
+        luaL_error (L, "Invalid arguments: requires boolean");
+        return 0;
+    }
+    sch_stats_enable (lua_toboolean (L, 1));
+    return 0;
+}
+
+static int
+lua_apteryx_stats_reset (lua_State * L)
+{
+    sch_stats_reset ();
+    return 0;
+}
+
+/* Return { lookup = { calls =, hits =, misses =, total_ns =, histogram = {...} }, ... } */
+static int
+lua_apteryx_stats (lua_State * L)
+{
+    sch_stat stats[SCH_STAT_MAX];
+
+    sch_stats_snapshot (stats);
+    lua_createtable (L, 0, SCH_STAT_MAX);
+    for (int i = 0; i < SCH_STAT_MAX; i++)
+    {
+        lua_createtable (L, 0, 5);
+        lua_pushinteger (L, stats[i].calls);
+        lua_setfield (L, -2, "calls");
+        lua_pushinteger (L, stats[i].hits);
+        lua_setfield (L, -2, "hits");
+        lua_pushinteger (L, stats[i].misses);
+        lua_setfield (L, -2, "misses");
+        lua_pushinteger (L, stats[i].total_ns);
+        lua_setfield (L, -2, "total_ns");
+        lua_createtable (L, SCH_STAT_BUCKETS, 0);
+        for (int b = 0; b < SCH_STAT_BUCKETS; b++)
+        {
+            lua_pushinteger (L, stats[i].histogram[b]);
+            lua_rawseti (L, -2, b + 1);
+        }
+        lua_setfield (L, -2, "histogram");
+        lua_setfield (L, -2, stats[i].name);
+    }
+    return 1;
+}
+
 static int
 luaclose_libapteryx_xml (lua_State *L)
 {
@@ -430,6 +758,10 @@ luaopen_libapteryx_xml (lua_State * L)
         {"debug", lua_apteryx_debug},
         {"api", lua_apteryx_api},
         {"valid", lua_apteryx_valid},
+        {"get", lua_apteryx_get},
+        {"stats", lua_apteryx_stats},
+        {"stats_enable", lua_apteryx_stats_enable},
+        {"stats_reset", lua_apteryx_stats_reset},
         {NULL, NULL}
     };
 
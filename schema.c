@@ -23,14 +23,24 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 #include <glib.h>
 #include <dirent.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include <jansson.h>
 #include <regex.h>
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
 #include <apteryx.h>
 #include "apteryx-xml.h"
 
@@ -54,15 +64,137 @@ static __thread char tl_errmsg[BUFSIZ] = {0};
 
 #define READ_BUF_SIZE 512
 
+#define SCH_CACHE_KEY_SIZE  32
+
 typedef struct _sch_instance
 {
     xmlDoc *doc;
     GList *models_list;
     GHashTable *map_hash_table;
     GHashTable *model_hash_table;
-    GList *regexes;
+    GStringChunk *strings;
+    GHashTable *ns_ids;         /* Namespace href to id */
+    GPtrArray *ns_info;         /* sch_ns_info attached to each xmlNs */
+    /* What was loaded, for sch_reload */
+    char *path;
+    char *model_list_filename;
+    int flags;
+    uint8_t key[SCH_CACHE_KEY_SIZE];
+    GHashTable *parsed;         /* Filename to sch_parsed_file kept by sch_reload */
+    GList *retired;             /* Replaced schemas kept until sch_reclaim */
+    struct _sch_lazy *lazy;     /* Models not merged yet (SCH_LOAD_F_LAZY) */
+    GMutex cache_lock;          /* For queries and paths */
+    GHashTable *queries;        /* Parsed query templates (sch_query_key) */
+    GHashTable *paths;          /* Resolved path shapes (sch_path_key) */
+    GQueue path_lru;            /* sch_path_entry, most recently used first */
+    guint cache_gen;            /* Bumped when the caches are dropped */
+    struct _sch_name_index *names; /* Descendant name index (built on first use) */
+    struct _sch_instance *current; /* Schema built by the last sch_reload */
 } sch_instance;
 
+/* The schema to read. sch_reload builds a complete new one and publishes it
+ * with a single store, so callers load this once and use only what it returns */
+static inline sch_instance *
+sch_current (sch_instance *instance)
+{
+    sch_instance *current = instance ? g_atomic_pointer_get (&instance->current) : NULL;
+
+    return current ?: instance;
+}
+
+/* A parsed model file kept for the next reload */
+typedef struct _sch_parsed_file
+{
+    xmlDoc *doc;
+    off_t size;
+    struct timespec mtime;
+} sch_parsed_file;
+
+/* Decoded mode attribute */
+typedef enum
+{
+    SCH_M_PRESENT   = (1 << 0), /* Node has a mode attribute */
+    SCH_M_READ      = (1 << 1),
+    SCH_M_WRITE     = (1 << 2),
+    SCH_M_EXEC      = (1 << 3),
+    SCH_M_HIDDEN    = (1 << 4),
+    SCH_M_CONFIG    = (1 << 5),
+    SCH_M_PROXY     = (1 << 6),
+} sch_mode;
+
+/* Node kind */
+typedef enum
+{
+    SCH_K_LEAF      = (1 << 0),
+    SCH_K_LIST      = (1 << 1),
+    SCH_K_LEAF_LIST = (1 << 2),
+} sch_kind;
+
+/* Per NODE descriptor stored in xmlNode->_private, built when the node is loaded
+ * or lazily merged. After that only pattern is filled in (on first use), apart
+ * from the root whose child count and index grow with each lazy merge */
+typedef struct _sch_node_info
+{
+    const char *name;           /* Raw name attribute */
+    const char *qname;          /* Name as reported by sch_name (may be prefixed) */
+    const char *default_value;
+    xmlNode *key;               /* Key node for lists */
+    uint32_t mode;              /* sch_mode */
+    uint32_t kind;              /* sch_kind */
+    int child_count;            /* Number of NODE children */
+    struct _sch_pattern *pattern; /* Compiled pattern (on first use, published atomically) */
+    const char *index_name;     /* Normalised name used by the child index */
+    int ordinal;                /* Position amongst the parent's NODE children */
+    xmlNode *alias;             /* Next sibling with the same index name */
+    GHashTable *children;       /* Index name to first NODE child (wide parents only) */
+    const char *range;          /* Raw range attribute */
+    struct _sch_range *ranges;  /* Sorted and merged intervals from the range */
+    int range_count;
+    const char *range_error;    /* First interval that failed to parse */
+    struct _sch_enum *values;   /* VALUE children in document order */
+    int value_count;
+    GHashTable *by_name;        /* Enum name to first sch_enum (large enums only) */
+    GHashTable *by_value;       /* Enum value to first sch_enum (large enums only) */
+    uint64_t ns_mask;           /* Namespace id bits of the node and its NODE ancestors */
+    bool ns_wide;               /* An id is above SCH_NS_BITS so bits may be shared */
+} sch_node_info;
+
+typedef struct _sch_enum
+{
+    const char *name;
+    const char *value;
+} sch_enum;
+
+#define NODE_INFO(xml) ((sch_node_info *) ((xmlNode *) (xml))->_private)
+
+/* lazy_merge links new models and namespaces onto the root while other threads
+ * walk it, so links it can publish are loaded with acquire */
+#define XML_NEXT(xml) ((xmlNode *) __atomic_load_n (&((xmlNode *) (xml))->next, __ATOMIC_ACQUIRE))
+#define XML_CHILDREN(xml) ((xmlNode *) __atomic_load_n (&((xmlNode *) (xml))->children, __ATOMIC_ACQUIRE))
+#define NS_NEXT(ns) ((xmlNs *) __atomic_load_n (&(ns)->next, __ATOMIC_ACQUIRE))
+#define NODE_ALIAS(xml) ((xmlNode *) __atomic_load_n (&NODE_INFO (xml)->alias, __ATOMIC_ACQUIRE))
+#define NODE_CHILDREN(info) ((GHashTable *) __atomic_load_n (&(info)->children, __ATOMIC_ACQUIRE))
+
+/* Namespace descriptor in xmlNs->_private. Each href is given a small id at
+ * load time so namespaces compare as integers */
+typedef struct _sch_ns_info
+{
+    guint id;
+    bool native;                /* As _sch_ns_native when it was built */
+} sch_ns_info;
+
+#define NS_INFO(ns) ((sch_ns_info *) __atomic_load_n (&(ns)->_private, __ATOMIC_ACQUIRE))
+#define SCH_NS_BITS 64
+#define NS_BIT(id) ((uint64_t) 1 << (((id) - 1) % SCH_NS_BITS))
+
+/* Parents with fewer NODE children than this are searched linearly */
+#define SCH_CHILD_INDEX_MIN 8
+
+/* Enumerations with fewer values than this are searched linearly */
+#define SCH_ENUM_HASH_MIN 8
+
+static void compile_range (sch_instance *instance, sch_node_info *info);
+
 typedef enum
 {
     ITEM_STATE_INIT,
@@ -78,6 +210,8 @@ typedef struct _sch_load_item
     GList *dependencies;
     char *default_href;
     item_state state;
+    struct stat st;             /* When parsed for a reload */
+    bool reused;                /* doc_new came from the previous reload */
 } sch_load_item;
 
 /* Retrieve the last error code */
@@ -94,6 +228,442 @@ sch_last_errmsg (void)
     return tl_errmsg;
 }
 
+/* Statistics. Counters are only written by their own thread and read
+ * relaxed by sch_stats_snapshot. Shards of exited threads are folded into
+ * stats_retired and sch_stats_reset moves the baseline in stats_base */
+static bool stats_on = false;
+static GMutex stats_lock;
+static GList *stats_shards = NULL;
+static sch_stat stats_retired[SCH_STAT_MAX];
+static sch_stat stats_base[SCH_STAT_MAX];
+static __thread sch_stat *tl_stats = NULL;
+static const char *stats_names[SCH_STAT_MAX] = {
+    "lookup", "path_to_gnode", "query_to_gnode", "traverse_tree", "gnode_to_json", "json_to_gnode",
+};
+
+#define STAT_GET(v) __atomic_load_n (&(v), __ATOMIC_RELAXED)
+#define STAT_ADD(v, n) __atomic_store_n (&(v), (v) + (n), __ATOMIC_RELAXED)
+
+static void
+stats_add (sch_stat *to, sch_stat *from)
+{
+    to->calls += STAT_GET (from->calls);
+    to->hits += STAT_GET (from->hits);
+    to->misses += STAT_GET (from->misses);
+    to->total_ns += STAT_GET (from->total_ns);
+    for (int b = 0; b < SCH_STAT_BUCKETS; b++)
+        to->histogram[b] += STAT_GET (from->histogram[b]);
+}
+
+static void
+stats_retire (gpointer data)
+{
+    sch_stat *stats = (sch_stat *) data;
+
+    g_mutex_lock (&stats_lock);
+    for (int i = 0; i < SCH_STAT_MAX; i++)
+        stats_add (&stats_retired[i], &stats[i]);
+    stats_shards = g_list_remove (stats_shards, stats);
+    g_mutex_unlock (&stats_lock);
+    g_free (stats);
+}
+
+static GPrivate stats_key = G_PRIVATE_INIT (stats_retire);
+
+static sch_stat *
+stats_shard (void)
+{
+    if (!tl_stats)
+    {
+        tl_stats = g_new0 (sch_stat, SCH_STAT_MAX);
+        g_private_set (&stats_key, tl_stats);
+        g_mutex_lock (&stats_lock);
+        stats_shards = g_list_prepend (stats_shards, tl_stats);
+        g_mutex_unlock (&stats_lock);
+    }
+    return tl_stats;
+}
+
+static inline guint64
+stats_now (void)
+{
+    struct timespec ts;
+
+    if (!__atomic_load_n (&stats_on, __ATOMIC_RELAXED))
+        return 0;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (guint64) 1000000000 + ts.tv_nsec + 1;
+}
+
+/* Record one call that started at start (from stats_now) */
+static void
+stats_record (sch_stat_id id, guint64 start)
+{
+    sch_stat *stat;
+    guint64 ns;
+    guint64 us;
+    int b = 0;
+
+    if (!start)
+        return;
+    ns = stats_now ();
+    ns = ns > start ? ns - start : 0;
+    for (us = ns / 1000; us && b < SCH_STAT_BUCKETS - 1; us >>= 1)
+        b++;
+    stat = &stats_shard ()[id];
+    STAT_ADD (stat->calls, 1);
+    STAT_ADD (stat->total_ns, ns);
+    STAT_ADD (stat->histogram[b], 1);
+}
+
+static inline void
+stats_hit (sch_stat_id id, bool hit)
+{
+    if (__atomic_load_n (&stats_on, __ATOMIC_RELAXED))
+    {
+        sch_stat *stat = &stats_shard ()[id];
+        if (hit)
+            STAT_ADD (stat->hits, 1);
+        else
+            STAT_ADD (stat->misses, 1);
+    }
+}
+
+void
+sch_stats_enable (bool enable)
+{
+    __atomic_store_n (&stats_on, enable, __ATOMIC_RELAXED);
+}
+
+bool
+sch_stats_enabled (void)
+{
+    return __atomic_load_n (&stats_on, __ATOMIC_RELAXED);
+}
+
+/* Sum every shard. Called with stats_lock held */
+static void
+stats_total (sch_stat stats[SCH_STAT_MAX])
+{
+    memset (stats, 0, sizeof (sch_stat) * SCH_STAT_MAX);
+    for (int i = 0; i < SCH_STAT_MAX; i++)
+    {
+        stats[i].name = stats_names[i];
+        stats_add (&stats[i], &stats_retired[i]);
+        for (GList *iter = stats_shards; iter; iter = iter->next)
+            stats_add (&stats[i], &((sch_stat *) iter->data)[i]);
+    }
+}
+
+void
+sch_stats_snapshot (sch_stat stats[SCH_STAT_MAX])
+{
+    g_mutex_lock (&stats_lock);
+    stats_total (stats);
+    for (int i = 0; i < SCH_STAT_MAX; i++)
+    {
+        stats[i].calls -= stats_base[i].calls;
+        stats[i].hits -= stats_base[i].hits;
+        stats[i].misses -= stats_base[i].misses;
+        stats[i].total_ns -= stats_base[i].total_ns;
+        for (int b = 0; b < SCH_STAT_BUCKETS; b++)
+            stats[i].histogram[b] -= stats_base[i].histogram[b];
+    }
+    g_mutex_unlock (&stats_lock);
+}
+
+/* Other threads may be counting so keep a baseline rather than clearing */
+void
+sch_stats_reset (void)
+{
+    g_mutex_lock (&stats_lock);
+    stats_total (stats_base);
+    g_mutex_unlock (&stats_lock);
+}
+
+/* Request scoped storage for the trees built from paths, queries and JSON.
+ * GNodes come from blocks and names are arena copies, so nothing in the tree
+ * is freed individually and nothing in it points into the schema */
+#define SCH_ARENA_NODES 256
+
+struct _sch_arena
+{
+    GStringChunk *strings;
+    GSList *blocks;
+    int used;
+};
+
+static __thread sch_arena *tl_arena = NULL;
+
+sch_arena *
+sch_arena_new (void)
+{
+    sch_arena *arena = g_malloc0 (sizeof (sch_arena));
+    arena->strings = g_string_chunk_new (4096);
+    arena->used = SCH_ARENA_NODES;
+    return arena;
+}
+
+sch_arena *
+sch_arena_use (sch_arena *arena)
+{
+    sch_arena *previous = tl_arena;
+    tl_arena = arena;
+    return previous;
+}
+
+void
+sch_arena_free (sch_arena *arena)
+{
+    if (!arena)
+        return;
+    if (tl_arena == arena)
+        tl_arena = NULL;
+    g_slist_free_full (arena->blocks, g_free);
+    g_string_chunk_free (arena->strings);
+    g_free (arena);
+}
+
+/* Create a node with data, appended to parent if there is one (APTERYX_NODE) */
+static GNode *
+node_add (GNode *parent, gpointer data)
+{
+    GNode *node;
+
+    if (!tl_arena)
+        return APTERYX_NODE (parent, data);
+    if (tl_arena->used == SCH_ARENA_NODES)
+    {
+        tl_arena->blocks = g_slist_prepend (tl_arena->blocks, g_new (GNode, SCH_ARENA_NODES));
+        tl_arena->used = 0;
+    }
+    node = &((GNode *) tl_arena->blocks->data)[tl_arena->used++];
+    *node = (GNode) { .data = data };
+    if (parent)
+        g_node_append (parent, node);
+    return node;
+}
+
+static char *
+node_strdup (const char *str)
+{
+    if (!tl_arena)
+        return g_strdup (str);
+    return str ? g_string_chunk_insert_const (tl_arena->strings, str) : NULL;
+}
+
+/* Take ownership of an allocated name or value for a node */
+static char *
+node_take (char *str)
+{
+    char *interned;
+
+    if (!tl_arena || !str)
+        return str;
+    interned = g_string_chunk_insert_const (tl_arena->strings, str);
+    g_free (str);
+    return interned;
+}
+
+/* True if node came from the arena in use on this thread */
+static bool
+node_in_arena (GNode *node)
+{
+    if (!tl_arena || !node)
+        return false;
+    for (GSList *block = tl_arena->blocks; block; block = block->next)
+    {
+        if (node >= (GNode *) block->data && node < (GNode *) block->data + SCH_ARENA_NODES)
+            return true;
+    }
+    return false;
+}
+
+/* Free a tree created with node_add (apteryx_free_tree) */
+static void
+node_free_tree (GNode *tree)
+{
+    if (!tl_arena)
+        apteryx_free_tree (tree);
+    else if (tree)
+        g_node_unlink (tree);
+}
+
+/* Parsed query cache. Clients repeat the same few queries so the nodes each
+ * one adds below the path are kept as a template and copied on the next call */
+#define SCH_QUERY_CACHE_SIZE 128
+
+typedef struct _sch_query_key
+{
+    sch_node *schema;
+    char *query;
+    int flags;
+    int depth;
+    bool paged;                 /* Paging parameters are accepted */
+} sch_query_key;
+
+typedef struct _sch_query_template
+{
+    gint refs;
+    int flags;                  /* Flags after parsing */
+    sch_page page;              /* Page after parsing */
+    GNode *tree;                /* Copy of the path end with the query nodes */
+} sch_query_template;
+
+static guint
+query_key_hash (gconstpointer data)
+{
+    const sch_query_key *key = data;
+
+    return g_str_hash (key->query) ^ g_direct_hash (key->schema) ^
+        (key->flags * 31) ^ (key->depth << 16) ^ key->paged;
+}
+
+static gboolean
+query_key_equal (gconstpointer a, gconstpointer b)
+{
+    const sch_query_key *ka = a;
+    const sch_query_key *kb = b;
+
+    return ka->schema == kb->schema && ka->flags == kb->flags &&
+        ka->depth == kb->depth && ka->paged == kb->paged && strcmp (ka->query, kb->query) == 0;
+}
+
+static void
+query_key_free (gpointer data)
+{
+    sch_query_key *key = data;
+
+    g_free (key->query);
+    g_free (key);
+}
+
+static void
+query_template_unref (gpointer data)
+{
+    sch_query_template *template = data;
+
+    if (g_atomic_int_dec_and_test (&template->refs))
+    {
+        apteryx_free_tree (template->tree);
+        g_free (template->page.cursor);
+        g_free (template);
+    }
+}
+
+static void
+query_template_copy (GNode *template, GNode *parent)
+{
+    for (GNode *child = template->children; child; child = child->next)
+        query_template_copy (child, node_add (parent, node_strdup (child->data)));
+}
+
+/* Resolved path cache. Most requests are for a few path shapes that only
+ * differ in their list keys, e.g. /test/animals/animal=<key>/name, so each
+ * shape keeps the node names it produced with slots for the key values */
+#define SCH_PATH_CACHE_SIZE 256
+
+typedef struct _sch_path_key
+{
+    sch_node *schema;           /* Where the path starts */
+    char *shape;                /* Path with the key values taken out */
+    int flags;
+} sch_path_key;
+
+/* A node of the result. Either a name or the key'th key value in the path */
+typedef struct _sch_path_step
+{
+    char *name;
+    int key;
+} sch_path_step;
+
+typedef struct _sch_path_entry
+{
+    sch_path_key key;
+    GList link;                 /* In path_lru */
+    sch_node *schema;           /* Schema node the path resolved to */
+    guint length;
+    sch_path_step steps[];
+} sch_path_entry;
+
+static guint
+path_key_hash (gconstpointer data)
+{
+    const sch_path_key *key = data;
+
+    return g_str_hash (key->shape) ^ g_direct_hash (key->schema) ^ (key->flags * 31);
+}
+
+static gboolean
+path_key_equal (gconstpointer a, gconstpointer b)
+{
+    const sch_path_key *ka = a;
+    const sch_path_key *kb = b;
+
+    return ka->schema == kb->schema && ka->flags == kb->flags &&
+        strcmp (ka->shape, kb->shape) == 0;
+}
+
+static void
+path_entry_free (gpointer data)
+{
+    sch_path_entry *entry = data;
+
+    for (guint i = 0; i < entry->length; i++)
+        g_free (entry->steps[i].name);
+    g_free (entry->key.shape);
+    g_free (entry);
+}
+
+/* Descendant name index for sch_node_find_name. Every NODE in document
+ * order with the position of its last descendant, so the nodes below a
+ * parent are a range, and the positions of the nodes with each index name */
+typedef struct _sch_name_entry
+{
+    xmlNode *node;
+    guint last;                 /* Position of the last descendant */
+} sch_name_entry;
+
+typedef struct _sch_name_index
+{
+    gint refs;
+    xmlDoc *doc;
+    GArray *entries;            /* sch_name_entry in document order */
+    GHashTable *positions;      /* xmlNode to position + 1 */
+    GHashTable *names;          /* Index name to GArray of positions */
+} sch_name_index;
+
+static void
+name_index_unref (sch_name_index *index)
+{
+    if (index && g_atomic_int_dec_and_test (&index->refs))
+    {
+        g_hash_table_destroy (index->names);
+        g_hash_table_destroy (index->positions);
+        g_array_free (index->entries, TRUE);
+        g_free (index);
+    }
+}
+
+/* Drop every query template, path and the name index. Their schema nodes may be about to change */
+static void
+lookup_caches_clear (sch_instance *instance)
+{
+    sch_name_index *names;
+
+    if (!instance->queries)
+        return;
+    g_mutex_lock (&instance->cache_lock);
+    g_hash_table_remove_all (instance->queries);
+    g_queue_init (&instance->path_lru);
+    g_hash_table_remove_all (instance->paths);
+    names = instance->names;
+    instance->names = NULL;
+    instance->cache_gen++;
+    g_mutex_unlock (&instance->cache_lock);
+    name_index_unref (names);
+}
+
 static void
 list_doc_ns_dependencies (GList *files, sch_load_item *item)
 {
@@ -161,68 +731,140 @@ sort_schema_files (gconstpointer a, gconstpointer b)
     return strcmp (item1->d_name, item2->d_name);
 }
 
-/* List full paths for all schema files in the search path */
+static bool
+is_schema_file (const char *d_name)
+{
+    return (fnmatch ("*.xml", d_name, FNM_PATHNAME) == 0 ||
+            fnmatch ("*.xml.gz", d_name, FNM_PATHNAME) == 0 ||
+            fnmatch ("*.map", d_name, FNM_PATHNAME) == 0);
+}
+
+void sch_load_item_free (void *data);
+
+/* One sch_parallel_foreach call. The pool is shared so each task knows its batch */
+typedef struct _sch_parallel_batch
+{
+    GFunc func;
+    gpointer user_data;
+    GMutex lock;
+    GCond done;
+    guint pending;
+} sch_parallel_batch;
+
+typedef struct _sch_parallel_task
+{
+    sch_parallel_batch *batch;
+    gpointer data;
+} sch_parallel_task;
+
+/* Set in pool threads, which run nested work themselves rather than wait on the pool */
+static __thread bool tl_pool_worker = false;
+
 static void
-load_schema_files (GList ** files, const char *path)
+parallel_task_run (gpointer data, gpointer user_data)
+{
+    sch_parallel_task *task = data;
+    sch_parallel_batch *batch = task->batch;
+
+    batch->func (task->data, batch->user_data);
+    g_mutex_lock (&batch->lock);
+    if (--batch->pending == 0)
+        g_cond_signal (&batch->done);
+    g_mutex_unlock (&batch->lock);
+}
+
+static void
+parallel_pool_run (gpointer data, gpointer user_data)
+{
+    tl_pool_worker = true;
+    parallel_task_run (data, user_data);
+}
+
+static gpointer
+parallel_pool_new (gpointer data)
+{
+    return g_thread_pool_new (parallel_pool_run, NULL, g_get_num_processors (), FALSE, NULL);
+}
+
+/* Run func over every item on the shared pool of worker threads, created on
+ * first use, and wait for completion */
+static void
+sch_parallel_foreach (GList *items, GFunc func, gpointer user_data)
+{
+    static GOnce pool_once = G_ONCE_INIT;
+    sch_parallel_batch batch = { func, user_data };
+    sch_parallel_task *tasks;
+    GThreadPool *pool;
+    guint count = g_list_length (items);
+    guint i = 0;
+
+    if (count < 2 || g_get_num_processors () < 2 || tl_pool_worker)
+    {
+        g_list_foreach (items, func, user_data);
+        return;
+    }
+    pool = g_once (&pool_once, parallel_pool_new, NULL);
+    tasks = g_new (sch_parallel_task, count);
+    g_mutex_init (&batch.lock);
+    g_cond_init (&batch.done);
+    batch.pending = count;
+    for (GList *iter = items; iter; iter = g_list_next (iter), i++)
+    {
+        tasks[i] = (sch_parallel_task) { &batch, iter->data };
+        if (!pool || !g_thread_pool_push (pool, &tasks[i], NULL))
+            parallel_task_run (&tasks[i], NULL);
+    }
+    g_mutex_lock (&batch.lock);
+    while (batch.pending)
+        g_cond_wait (&batch.done, &batch.lock);
+    g_mutex_unlock (&batch.lock);
+    g_mutex_clear (&batch.lock);
+    g_cond_clear (&batch.done);
+    g_free (tasks);
+}
+
+/* Parse one file. user_data is the previous reload's parsed files, if any,
+ * which are used again when the file has not changed since */
+static void
+parse_schema_file (gpointer data, gpointer user_data)
+{
+    GHashTable *parsed = user_data;
+    sch_load_item *item = data;
+
+    if (fnmatch ("*.map", item->d_name, FNM_PATHNAME) == 0)
+        return;
+    if (parsed && stat (item->filename, &item->st) == 0)
+    {
+        sch_parsed_file *file = g_hash_table_lookup (parsed, item->filename);
+        if (file && file->doc && file->size == item->st.st_size &&
+            file->mtime.tv_sec == item->st.st_mtim.tv_sec &&
+            file->mtime.tv_nsec == item->st.st_mtim.tv_nsec)
+        {
+            item->doc_new = file->doc;
+            item->reused = true;
+            return;
+        }
+    }
+    item->doc_new = xmlParseFile (item->filename);
+}
+
+/* Sort parsed files by name and then so that each model follows the models it depends on */
+static void
+order_schema_files (GList **files)
 {
-    DIR *dp;
-    struct dirent *ep;
-    char *saveptr = NULL;
-    char *cpath;
-    char *dpath;
-    sch_load_item *new_item;
     sch_load_item *item;
     GList *iter;
     GList *sorted = NULL;
     xmlNode *node;
     xmlNs *ns;
 
-    cpath = g_strdup (path);
-    dpath = strtok_r (cpath, ":", &saveptr);
-    while (dpath != NULL)
+    *files = g_list_sort (*files, sort_schema_files);
+
+    /* Get the default href for the models */
+    for (iter = g_list_first (*files); iter; iter = g_list_next (iter))
     {
-        dp = opendir (dpath);
-        if (dp != NULL)
-        {
-            while ((ep = readdir (dp)))
-            {
-                if ((fnmatch ("*.xml", ep->d_name, FNM_PATHNAME) != 0) &&
-                    (fnmatch ("*.xml.gz", ep->d_name, FNM_PATHNAME) != 0) &&
-                    (fnmatch ("*.map", ep->d_name, FNM_PATHNAME) != 0))
-                {
-                    continue;
-                }
-                new_item = g_malloc0 (sizeof (sch_load_item));
-                if (dpath[strlen (dpath) - 1] == '/')
-                    new_item->filename = g_strdup_printf ("%s%s", dpath, ep->d_name);
-                else
-                    new_item->filename = g_strdup_printf ("%s/%s", dpath, ep->d_name);
-                new_item->d_name = g_strdup (ep->d_name);
-                if (fnmatch ("*.map", ep->d_name, FNM_PATHNAME) != 0)
-                {
-                    new_item->doc_new = xmlParseFile (new_item->filename);
-                    if (new_item->doc_new == NULL)
-                    {
-                        syslog (LOG_ERR, "XML: failed to parse \"%s\"", new_item->filename);
-                        g_free (new_item->filename);
-                        g_free (new_item);
-                        continue;
-                    }
-                }
-                *files = g_list_append (*files, new_item);
-            }
-            (void) closedir (dp);
-        }
-        dpath = strtok_r (NULL, ":", &saveptr);
-    }
-    free (cpath);
-    *files = g_list_sort (*files, sort_schema_files);
-
-    /* Get the default href for the models */
-    for (iter = g_list_first (*files); iter; iter = g_list_next (iter))
-    {
-        item = iter->data;
-        if (item->doc_new)
+        item = iter->data;
+        if (item->doc_new)
         {
             node = xmlDocGetRootElement (item->doc_new);
             ns = xmlSearchNs (item->doc_new, node, NULL);
@@ -242,8 +884,72 @@ load_schema_files (GList ** files, const char *path)
     resolve_model_dependencies (*files, &sorted);
     g_list_free (*files);
     *files = sorted;
+}
 
-    return;
+/* List full paths for all schema files in the search path */
+static void
+load_schema_files (GList ** files, const char *path, int flags, GHashTable *parsed)
+{
+    DIR *dp;
+    struct dirent *ep;
+    char *saveptr = NULL;
+    char *cpath;
+    char *dpath;
+    sch_load_item *new_item;
+    sch_load_item *item;
+    GList *iter;
+
+    cpath = g_strdup (path);
+    dpath = strtok_r (cpath, ":", &saveptr);
+    while (dpath != NULL)
+    {
+        dp = opendir (dpath);
+        if (dp != NULL)
+        {
+            while ((ep = readdir (dp)))
+            {
+                if (!is_schema_file (ep->d_name))
+                {
+                    continue;
+                }
+                new_item = g_malloc0 (sizeof (sch_load_item));
+                if (dpath[strlen (dpath) - 1] == '/')
+                    new_item->filename = g_strdup_printf ("%s%s", dpath, ep->d_name);
+                else
+                    new_item->filename = g_strdup_printf ("%s/%s", dpath, ep->d_name);
+                new_item->d_name = g_strdup (ep->d_name);
+                *files = g_list_append (*files, new_item);
+            }
+            (void) closedir (dp);
+        }
+        dpath = strtok_r (NULL, ":", &saveptr);
+    }
+    free (cpath);
+
+    /* Parsing is independent per file */
+    if (flags & SCH_LOAD_F_PARALLEL)
+    {
+        xmlInitParser ();
+        sch_parallel_foreach (*files, parse_schema_file, parsed);
+    }
+    else
+    {
+        g_list_foreach (*files, parse_schema_file, parsed);
+    }
+    for (iter = g_list_first (*files); iter;)
+    {
+        GList *next = g_list_next (iter);
+
+        item = iter->data;
+        if (!item->doc_new && fnmatch ("*.map", item->d_name, FNM_PATHNAME) != 0)
+        {
+            syslog (LOG_ERR, "XML: failed to parse \"%s\"", item->filename);
+            *files = g_list_delete_link (*files, iter);
+            sch_load_item_free (item);
+        }
+        iter = next;
+    }
+    order_schema_files (files);
 }
 
 static bool
@@ -394,6 +1100,56 @@ cleanup_nodes (xmlNode * node)
     }
 }
 
+/* Share a name or value through the document dictionary */
+static const xmlChar *
+compact_string (xmlDict *dict, const xmlChar *str)
+{
+    const xmlChar *interned;
+
+    if (!str || xmlDictOwns (dict, str))
+        return str;
+    interned = xmlDictLookup (dict, str, -1);
+    if (!interned)
+        return str;
+    xmlFree ((xmlChar *) str);
+    return interned;
+}
+
+/* Drop help text and SCRIPT elements, which are not used at runtime, and share
+ * repeated element names, attribute names and values (SCH_LOAD_F_COMPACT) */
+static void
+compact_nodes (xmlDoc *doc, xmlNode *node)
+{
+    xmlNode *next;
+
+    if (!doc->dict)
+        doc->dict = xmlDictCreate ();
+    for (; node; node = next)
+    {
+        next = node->next;
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrcmp (node->name, (const xmlChar *) "SCRIPT") == 0)
+        {
+            xmlUnlinkNode (node);
+            xmlFreeNode (node);
+            continue;
+        }
+        xmlUnsetProp (node, (const xmlChar *) "help");
+        node->name = compact_string (doc->dict, node->name);
+        for (xmlAttr *attr = node->properties; attr; attr = attr->next)
+        {
+            attr->name = compact_string (doc->dict, attr->name);
+            for (xmlNode *text = attr->children; text; text = text->next)
+            {
+                if (text->content && text->content != (xmlChar *) &text->properties)
+                    text->content = (xmlChar *) compact_string (doc->dict, text->content);
+            }
+        }
+        compact_nodes (doc, node->children);
+    }
+}
+
 /* Add module organisation and revision to the first child(ren) that matches the namespace */
 static void
 add_module_info_to_children (xmlNode *node, xmlNsPtr ns, xmlChar *mod, xmlChar *org,
@@ -559,8 +1315,22 @@ save_module_info (sch_instance *instance, xmlNode *module)
     return true;
 }
 
+/* The definition of href on the root or, while lazy_merge stages new models,
+ * on its staging node */
+static xmlNs *
+ns_by_href (xmlDoc *doc, xmlNode *to, const xmlChar *href)
+{
+    xmlNode *root = xmlDocGetRootElement (doc);
+    xmlNs *ns = xmlSearchNsByHref (doc, root, href);
+
+    if (!ns && to != root)
+        ns = xmlSearchNsByHref (doc, to, href);
+    return ns;
+}
+
+/* Copy any namespace definitions that are new to the document onto to */
 static void
-copy_nsdef_to_root (xmlDoc *doc, xmlNode *node)
+copy_nsdef_to (xmlDoc *doc, xmlNode *to, xmlNode *node)
 {
     xmlNode *n = node;
     while (n)
@@ -569,13 +1339,13 @@ copy_nsdef_to_root (xmlDoc *doc, xmlNode *node)
         xmlNsPtr ns = n->nsDef;
         while (ns)
         {
-            if (ns->href && !xmlSearchNsByHref (doc, xmlDocGetRootElement (doc), ns->href))
+            if (ns->href && !ns_by_href (doc, to, ns->href))
             {
                 char *prefix = (char *) ns->prefix;
                 if (!prefix)
                     prefix = (char *) xmlGetProp (n, (xmlChar *)"prefix");
                 if (prefix)
-                    xmlNewNs (xmlDocGetRootElement (doc), ns->href, (xmlChar *)prefix);
+                    xmlNewNs (to, ns->href, (xmlChar *)prefix);
                 if (!ns->prefix)
                     free (prefix);
             }
@@ -583,23 +1353,29 @@ copy_nsdef_to_root (xmlDoc *doc, xmlNode *node)
         }
 
         /* Recurse */
-        copy_nsdef_to_root (doc, n->children);
+        copy_nsdef_to (doc, to, n->children);
         n = n->next;
     }
 }
 
-void
-assign_ns_to_root (xmlDoc *doc, xmlNode *node)
+static void
+copy_nsdef_to_root (xmlDoc *doc, xmlNode *node)
+{
+    copy_nsdef_to (doc, xmlDocGetRootElement (doc), node);
+}
+
+static void
+assign_ns_to (xmlDoc *doc, xmlNode *to, xmlNode *node)
 {
     xmlNode *n = node;
     while (n)
     {
         /* Assign this nodes ns to the new root if needed */
         if (n->ns)
-            n->ns = xmlSearchNsByHref (doc, xmlDocGetRootElement (doc), n->ns->href);
+            n->ns = ns_by_href (doc, to, n->ns->href);
 
         /* Recurse */
-        assign_ns_to_root (doc, n->children);
+        assign_ns_to (doc, to, n->children);
 
         /* Chuck away the local NS */
         if (n->nsDef) {
@@ -611,6 +1387,12 @@ assign_ns_to_root (xmlDoc *doc, xmlNode *node)
      }
  }
 
+void
+assign_ns_to_root (xmlDoc *doc, xmlNode *node)
+{
+    assign_ns_to (doc, xmlDocGetRootElement (doc), node);
+}
+
 static void
 sch_load_namespace_mappings (sch_instance *instance, const char *filename)
 {
@@ -712,1895 +1494,2500 @@ sch_load_item_free (void *data)
     g_free (item);
 }
 
-/* Parse all XML files in the search path and merge trees */
-static sch_instance *
-_sch_load (const char *path, const char *model_list_filename)
+static uint32_t
+decode_mode (const char *mode)
 {
-    sch_instance *instance;
-    xmlNode *module;
-    xmlNs *ns;
-    GList *files = NULL;
-    GList *iter;
-
-    /* New instance */
-    instance = g_malloc0 (sizeof (sch_instance));
-
-    /* Create a new doc and root node for the merged MODULE */
-    instance->doc = xmlNewDoc ((xmlChar *) "1.0");
-    module = xmlNewNode (NULL, (xmlChar *) "MODULE");
-    ns = xmlNewNs (module, (const xmlChar *) "https://github.com/alliedtelesis/apteryx", NULL);
-    xmlSetNs (module, ns);
-    xmlNewNs (module, (const xmlChar *) "http://www.w3.org/2001/XMLSchema-instance", (const xmlChar *) "xsi");
-    xmlNewProp (module, (const xmlChar *) "xsi:schemaLocation",
-        (const xmlChar *) "https://github.com/alliedtelesis/apteryx-xml https://github.com/alliedtelesis/apteryx-xml/releases/download/v1.2/apteryx.xsd");
-    xmlDocSetRootElement (instance->doc, module);
+    uint32_t bits = 0;
 
-    if (model_list_filename)
-        sch_load_model_list (instance, path, model_list_filename);
-
-    load_schema_files (&files, path);
-    for (iter = files; iter; iter = g_list_next (iter))
+    if (!mode)
+        return 0;
+    bits |= SCH_M_PRESENT;
+    for (; *mode; mode++)
     {
-        sch_load_item *item;
-        char *filename;
-        char *ext;
-
-        item = iter->data;
-        filename = item->filename;
-        ext = strrchr(filename, '.');
-        if (g_strcmp0 (ext, ".map") == 0)
-        {
-            sch_load_namespace_mappings (instance, filename);
-            continue;
-        }
-
-        xmlNode *module_new = xmlDocGetRootElement (item->doc_new);
-        cleanup_nodes (module_new);
-        /* Sanity check for empty modules */
-        if (!module_new || (module_new->children && (module_new->children->name[0] != 'N' && module_new->children->name[0] != 'S')))
-        {
-            syslog (LOG_ERR, "XML: ignoring empty schema \"%s\"", filename);
-            continue;
-        }
-        copy_nsdef_to_root (instance->doc, module_new);
-        if (save_module_info (instance, module_new))
-        {
-            add_module_info_to_child (instance, module_new);
-            merge_nodes (module_new->ns, module, module->children, module_new->children, 0);
-            xmlFreeDoc (item->doc_new);
-            item->doc_new = NULL;
-            assign_ns_to_root (instance->doc, module->children);
-        }
-        else
+        switch (*mode)
         {
-            xmlFreeDoc (item->doc_new);
-            item->doc_new = NULL;
+        case 'r':
+            bits |= SCH_M_READ;
+            break;
+        case 'w':
+            bits |= SCH_M_WRITE;
+            break;
+        case 'x':
+            bits |= SCH_M_EXEC;
+            break;
+        case 'h':
+            bits |= SCH_M_HIDDEN;
+            break;
+        case 'c':
+            bits |= SCH_M_CONFIG;
+            break;
+        case 'p':
+            bits |= SCH_M_PROXY;
+            break;
+        default:
+            break;
         }
     }
-    g_list_free_full (files, sch_load_item_free);
+    return bits;
+}
 
-    /* Store a link back to the instance in the xmlDoc stucture */
-    instance->doc->_private = (void *) instance;
+static const char *
+intern_string (sch_instance *instance, char *value)
+{
+    const char *interned = NULL;
 
-    return instance;
+    if (value)
+    {
+        interned = g_string_chunk_insert_const (instance->strings, value);
+        free (value);
+    }
+    return interned;
 }
 
-sch_instance *
-sch_load (const char *path)
+/* Map '-' to '_' so names compare as they do with sch_match_name */
+static char *
+normalise_name (char *name)
 {
-    return _sch_load (path, NULL);
+    for (char *c = name; *c; c++)
+    {
+        if (*c == '-')
+            *c = '_';
+    }
+    return name;
 }
 
-/**
- * Only load XML models that are specified in the model list file. If the model list
- * filename is NULL, all models are loaded.
- */
-sch_instance *
-sch_load_with_model_list_filename (const char *path, const char *model_list_filename)
+/* Index name for a schema node. Wildcards all share the same entry */
+static char *
+index_name (const char *name)
 {
-    return _sch_load (path, model_list_filename);
+    if (name[0] == '*')
+        return g_strdup ("*");
+    return normalise_name (g_strdup (name));
 }
 
+/* Table of VALUE name/value pairs, hashed both ways when large */
 static void
-sch_free_loaded_models (GList *loaded_models)
+build_enum (sch_instance *instance, sch_node_info *info, xmlNode *node)
 {
-    GList *list;
-    sch_loaded_model *loaded;
+    int count = 0;
 
-    if (loaded_models)
+    for (xmlNode *n = node->children; n; n = n->next)
     {
-        for (list = g_list_first (loaded_models); list; list = g_list_next (list))
+        if (n->type == XML_ELEMENT_NODE && g_strcmp0 ((char *) n->name, "VALUE") == 0)
+            count++;
+    }
+    if (!count)
+        return;
+
+    info->values = g_new0 (sch_enum, count);
+    for (xmlNode *n = node->children; n; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && g_strcmp0 ((char *) n->name, "VALUE") == 0)
         {
-            loaded = list->data;
-            if (loaded->ns_href)
-            {
-                g_free (loaded->ns_href);
-            }
-            if (loaded->model)
-            {
-                g_free (loaded->model);
-            }
-            if (loaded->organization)
-            {
-                g_free (loaded->organization);
-            }
-            if (loaded->ns_prefix)
-            {
-                g_free (loaded->ns_prefix);
-            }
-            if (loaded->version)
-            {
-                g_free (loaded->version);
-            }
-            if (loaded->features)
-            {
-                g_free (loaded->features);
-            }
-            if (loaded->deviations)
-            {
-                g_free (loaded->deviations);
-            }
-            g_free (loaded);
+            sch_enum *e = &info->values[info->value_count++];
+            e->name = intern_string (instance, (char *) xmlGetProp (n, (xmlChar *) "name"));
+            e->value = intern_string (instance, (char *) xmlGetProp (n, (xmlChar *) "value"));
+        }
+    }
+
+    if (count >= SCH_ENUM_HASH_MIN)
+    {
+        info->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+        info->by_value = g_hash_table_new (g_str_hash, g_str_equal);
+        for (int i = 0; i < count; i++)
+        {
+            sch_enum *e = &info->values[i];
+
+            /* The first entry wins as it would in a linear search */
+            if (e->name && !g_hash_table_contains (info->by_name, e->name))
+                g_hash_table_insert (info->by_name, (gpointer) e->name, e);
+            if (e->value && !g_hash_table_contains (info->by_value, e->value))
+                g_hash_table_insert (info->by_value, (gpointer) e->value, e);
         }
-        g_list_free (loaded_models);
-        loaded_models = NULL;
     }
 }
 
-static void
-free_regex (regex_t *regex_obj)
+static const sch_enum *
+enum_by_name (sch_node_info *info, const char *name)
 {
-    regfree (regex_obj);
-    g_free (regex_obj);
+    if (info->by_name)
+        return g_hash_table_lookup (info->by_name, name);
+    for (int i = 0; i < info->value_count; i++)
+    {
+        if (info->values[i].name && strcmp (info->values[i].name, name) == 0)
+            return &info->values[i];
+    }
+    return NULL;
 }
 
-void
-sch_free (sch_instance * instance)
+static const sch_enum *
+enum_by_value (sch_node_info *info, const char *value)
 {
-    if (instance)
+    if (info->by_value)
+        return g_hash_table_lookup (info->by_value, value);
+    for (int i = 0; i < info->value_count; i++)
     {
-        if (instance->models_list)
-            sch_free_loaded_models (instance->models_list);
-        if (instance->doc)
-            xmlFreeDoc (instance->doc);
-        if (instance->map_hash_table)
-            g_hash_table_destroy (instance->map_hash_table);
-        if (instance->model_hash_table)
-            g_hash_table_destroy (instance->model_hash_table);
-        if (instance->regexes)
-            g_list_free_full (instance->regexes, (GDestroyNotify) free_regex);
-
-        g_free (instance);
+        if (info->values[i].value && strcmp (info->values[i].value, value) == 0)
+            return &info->values[i];
     }
+    return NULL;
 }
 
-GList *
-sch_get_loaded_models (sch_instance * instance)
+static bool _sch_ns_native (sch_instance *instance, xmlNs *ns);
+
+/* The descriptor for a namespace, attached on first use */
+static sch_ns_info *
+ns_intern (sch_instance *instance, xmlNs *ns)
 {
-    return instance->models_list;
-}
+    sch_ns_info *info;
+    guint id;
 
-gboolean
-sch_match_name (const char *s1, const char *s2)
+    if (!ns || !ns->href)
+        return NULL;
+    info = NS_INFO (ns);
+    if (info)
+        return info;
+    if (!instance->ns_ids)
+    {
+        instance->ns_ids = g_hash_table_new (g_str_hash, g_str_equal);
+        instance->ns_info = g_ptr_array_new_with_free_func (g_free);
+    }
+    id = GPOINTER_TO_UINT (g_hash_table_lookup (instance->ns_ids, ns->href));
+    if (!id)
+    {
+        id = g_hash_table_size (instance->ns_ids) + 1;
+        g_hash_table_insert (instance->ns_ids,
+                             g_string_chunk_insert_const (instance->strings, (const char *) ns->href),
+                             GUINT_TO_POINTER (id));
+    }
+    info = g_malloc0 (sizeof (sch_ns_info));
+    info->id = id;
+    info->native = _sch_ns_native (instance, ns);
+    g_ptr_array_add (instance->ns_info, info);
+    __atomic_store_n (&ns->_private, info, __ATOMIC_RELEASE);
+    return info;
+}
+
+/* Index the NODE children of node by normalised name. Each name maps to its
+ * first child and the rest follow in document order through alias */
+static GHashTable *
+index_children (xmlNode *node)
 {
-    char c1, c2;
-    do
+    GHashTable *children = g_hash_table_new (g_str_hash, g_str_equal);
+
+    /* Walk backwards so each alias chain is in document order */
+    for (xmlNode *n = node->last; n; n = n->prev)
     {
-        c1 = *s1;
-        c2 = *s2;
-        if (c1 == '\0' && c2 == '\0')
-            return true;
-        if (c1 == '-')
-            c1 = '_';
-        if (c2 == '-')
-            c2 = '_';
-        s1++;
-        s2++;
+        sch_node_info *cinfo;
+
+        if (n->type != XML_ELEMENT_NODE || n->name[0] != 'N')
+            continue;
+        cinfo = NODE_INFO (n);
+        if (!cinfo->index_name)
+            continue;
+        __atomic_store_n (&cinfo->alias, g_hash_table_lookup (children, cinfo->index_name), __ATOMIC_RELEASE);
+        g_hash_table_insert (children, (gpointer) cinfo->index_name, n);
     }
-    while (c1 == c2);
-    return false;
+    return children;
 }
 
-static bool
-_sch_ns_native (sch_instance *instance, xmlNs *ns)
+/* Build the descriptors for a node and all its descendants.
+ * The accessors fall back to parsing the XML attributes while
+ * the descriptor is not yet attached, so children are done first. */
+static void
+build_node_info (sch_instance *instance, xmlNode *node)
 {
-    /* No namespace means native */
-    if (!ns)
-        return true;
-    /* Root namespace is considered native */
-    if (instance && ns == xmlDocGetRootElement (instance->doc)->ns)
-        return true;
-    /* Check if namespace is in the table of non-native namespaces */
-    if (instance && instance->map_hash_table)
+    sch_node_info *info;
+    char *mode;
+
+    for (xmlNs *def = node->nsDef; def; def = def->next)
+        ns_intern (instance, def);
+    for (xmlNode *n = node->children; n; n = n->next)
     {
-        if (g_hash_table_lookup (instance->map_hash_table, (const char *) ns->href))
-            return false;
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+            build_node_info (instance, n);
     }
-    return true;
+
+    info = g_malloc0 (sizeof (sch_node_info));
+    if (node->name[0] == 'N')
+    {
+        info->name = intern_string (instance, (char *) xmlGetProp (node, (xmlChar *) "name"));
+        info->qname = intern_string (instance, sch_name (node));
+        info->default_value = intern_string (instance, sch_default_value (node));
+        if (info->name)
+            info->index_name = intern_string (instance, index_name (info->name));
+        info->range = intern_string (instance, (char *) xmlGetProp (node, (xmlChar *) "range"));
+        if (info->range)
+            compile_range (instance, info);
+        build_enum (instance, info, node);
+        for (xmlNode *n = node; n && n->type == XML_ELEMENT_NODE && n->name[0] == 'N'; n = n->parent)
+        {
+            sch_ns_info *ns = ns_intern (instance, n->ns);
+
+            if (ns)
+            {
+                info->ns_mask |= NS_BIT (ns->id);
+                info->ns_wide |= ns->id > SCH_NS_BITS;
+            }
+        }
+    }
+    mode = (char *) xmlGetProp (node, (xmlChar *) "mode");
+    info->mode = decode_mode (mode);
+    xmlFree (mode);
+    for (xmlNode *n = node->children; n; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+            NODE_INFO (n)->ordinal = info->child_count++;
+    }
+    if (info->child_count >= SCH_CHILD_INDEX_MIN)
+        info->children = index_children (node);
+    if (sch_is_leaf (node))
+        info->kind |= SCH_K_LEAF;
+    if (sch_is_list (node))
+    {
+        info->kind |= SCH_K_LIST;
+        if (sch_is_leaf_list (node))
+            info->kind |= SCH_K_LEAF_LIST;
+        info->key = sch_node_child_first (sch_node_child_first (node));
+    }
+    node->_private = info;
 }
 
-bool
-sch_ns_native (sch_instance *instance, sch_ns *ns)
+/* A compiled pattern. POSIX regex is the reference and is always compiled.
+ * A native validator or PCRE2 code is used instead when it is known to give
+ * the same result. */
+typedef struct _sch_pattern
 {
-    return _sch_ns_native (instance, (xmlNs *)ns);
+    regex_t regex;
+    bool (*native) (const char *value);
+#ifdef HAVE_PCRE2
+    pcre2_code *code;
+#endif
+} sch_pattern;
+
+static void
+free_pattern (sch_pattern *pattern)
+{
+    regfree (&pattern->regex);
+#ifdef HAVE_PCRE2
+    if (pattern->code)
+        pcre2_code_free (pattern->code);
+#endif
+    g_free (pattern);
 }
 
-static bool
-remove_hidden_children (xmlNode *node)
+static void
+free_node_info (xmlNode *node)
 {
-    xmlNode *child;
+    for (xmlNode *n = node->children; n; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE)
+            free_node_info (n);
+    }
+    if (node->_private && NODE_INFO (node)->children)
+        g_hash_table_destroy (NODE_INFO (node)->children);
+    if (node->_private)
+    {
+        sch_node_info *info = NODE_INFO (node);
 
-    if (node == NULL)
-        return false;
+        if (info->pattern)
+            free_pattern (info->pattern);
+        g_free (info->ranges);
+        g_free (info->values);
+        if (info->by_name)
+            g_hash_table_destroy (info->by_name);
+        if (info->by_value)
+            g_hash_table_destroy (info->by_value);
+    }
+    g_free (node->_private);
+    node->_private = NULL;
+}
 
-    /* Keep all the value nodes */
-    if (node->name[0] == 'V')
-        return true;
+static void sch_free_loaded_models (GList *loaded_models);
 
-    /* Throw away any non schema nodes */
-    if (node->name[0] != 'M' && node->name[0] != 'N')
-        return false;
+/* Compiled schema cache.
+ * The merged and namespace resolved document is written next to the first
+ * directory in the search path as a flat snapshot. It is keyed by the list
+ * of model files with their sizes and modification times, so any change to
+ * the models causes the next load to parse them again and refresh it. */
+#define SCH_CACHE_MAGIC     "APXSCHC"
+#define SCH_CACHE_VERSION   1
+#define SCH_CACHE_NONE      UINT32_MAX
 
-    if (sch_is_hidden (node))
-        return false;
+typedef struct _sch_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t has_map;
+    uint8_t key[SCH_CACHE_KEY_SIZE];
+    uint32_t strings_size;
+    uint32_t ns_count;
+    uint32_t node_count;
+    uint32_t attr_count;
+    uint32_t model_count;
+    uint32_t map_count;
+} sch_cache_header;
+
+typedef struct _sch_cache_ns
+{
+    uint32_t href;
+    uint32_t prefix;
+} sch_cache_ns;
 
-    child = node->children;
-    while (child)
+/* Nodes are stored in preorder with their attributes in a separate table */
+typedef struct _sch_cache_node
+{
+    uint32_t name;
+    uint32_t ns;
+    uint32_t attr_count;
+    uint32_t child_count;
+} sch_cache_node;
+
+typedef struct _sch_cache_attr
+{
+    uint32_t name;
+    uint32_t ns;
+    uint32_t value;
+} sch_cache_attr;
+
+/* One string per sch_loaded_model field */
+#define SCH_CACHE_MODEL_FIELDS 7
+
+typedef struct _sch_cache_writer
+{
+    xmlNode *root;
+    GString *strings;
+    GHashTable *offsets;
+    GString *nodes;
+    GString *attrs;
+    uint32_t node_count;
+    uint32_t attr_count;
+    bool failed;
+} sch_cache_writer;
+
+typedef struct _sch_cache_reader
+{
+    const char *strings;
+    uint32_t strings_size;
+    xmlNs **ns;
+    uint32_t ns_count;
+    const sch_cache_node *nodes;
+    uint32_t node_count;
+    uint32_t node_next;
+    const sch_cache_attr *attrs;
+    uint32_t attr_count;
+    uint32_t attr_next;
+} sch_cache_reader;
+
+/* The cache lives beside the first search directory e.g. /etc/apteryx/schema.cache */
+static char *
+sch_cache_filename (const char *path, const char *model_list_filename)
+{
+    char *first = g_strndup (path, strcspn (path, ":"));
+    char *dir = realpath (first, NULL);
+    char *filename = NULL;
+
+    if (dir && strcmp (dir, "/") != 0)
     {
-        if (!remove_hidden_children (child))
-        {
-            xmlNode *dchild = child;
-            child = child->next;
-            xmlUnlinkNode (dchild);
-            xmlFreeNode (dchild);
-        }
+        if (model_list_filename)
+            filename = g_strdup_printf ("%s.%s.cache", dir, model_list_filename);
         else
-        {
-            child = child->next;
-        }
+            filename = g_strdup_printf ("%s.cache", dir);
     }
-
-    return true;
+    free (dir);
+    g_free (first);
+    return filename;
 }
 
-static void
-format_api_namespaces (sch_instance * instance, xmlNs *ns, xmlNode *node, int depth)
+/* Hash the search path, the model list and every schema file's size and mtime */
+static bool
+sch_cache_key (const char *path, const char *model_list_filename, uint8_t *key)
 {
-    xmlNode *child;
+    GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    GList *entries = NULL;
+    char *saveptr = NULL;
+    char *cpath;
+    char *dpath;
+    gsize len = SCH_CACHE_KEY_SIZE;
+    uint32_t version = SCH_CACHE_VERSION;
 
-    if (node == NULL)
-        return;
+    g_checksum_update (checksum, (const guchar *) &version, sizeof (version));
+    g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
 
-    child = node->children;
-    while (child)
+    cpath = g_strdup (path);
+    dpath = strtok_r (cpath, ":", &saveptr);
+    while (dpath != NULL)
     {
-        if (depth == 0 && child->ns && child->ns->prefix && !_sch_ns_native (instance, child->ns))
+        DIR *dp = opendir (dpath);
+        struct dirent *ep;
+
+        if (dp != NULL)
         {
-            /* Replace top-level nodes of non-native models with the namespace prefixed name */
-            char *old = sch_name (child);
-            char *name = g_strdup_printf ("%s:%s",child->ns->prefix, old);
-            xmlSetProp (child, (const xmlChar *)"name", (const xmlChar *)name);
-            free (name);
-            free (old);
+            while ((ep = readdir (dp)))
+            {
+                struct stat st;
+                char *filename;
+
+                if (!is_schema_file (ep->d_name))
+                    continue;
+                filename = g_strdup_printf ("%s/%s", dpath, ep->d_name);
+                if (stat (filename, &st) == 0)
+                {
+                    entries = g_list_prepend (entries,
+                        g_strdup_printf ("%s %jd %jd.%09ld", filename, (intmax_t) st.st_size,
+                                         (intmax_t) st.st_mtim.tv_sec, st.st_mtim.tv_nsec));
+                }
+                g_free (filename);
+            }
+            (void) closedir (dp);
         }
-        format_api_namespaces (instance, ns, child, depth + 1);
-        /* Everything in the apteryx namespace */
-        child->ns = ns;
-        child = child->next;
+        dpath = strtok_r (NULL, ":", &saveptr);
     }
+    free (cpath);
 
-    /* Get rid of all non default namespace definitions on the root node */
-    if (depth == 0)
+    entries = g_list_sort (entries, (GCompareFunc) strcmp);
+    for (GList *iter = entries; iter; iter = g_list_next (iter))
+        g_checksum_update (checksum, iter->data, strlen (iter->data) + 1);
+    g_list_free_full (entries, g_free);
+
+    /* The model list is small so include its content */
+    if (model_list_filename)
     {
-        xmlNs *cur = node->nsDef;
-        while (cur != NULL)
-        {
-            xmlNs *next = cur->next;
-            if (cur != ns)
-                xmlFreeNs (cur);
-            cur = next;
-        }
-        node->nsDef = ns;
-        ns->next = NULL;
-        xmlNewNs (node, (const xmlChar *) "http://www.w3.org/2001/XMLSchema-instance", (const xmlChar *) "xsi");
+        char *name = g_strdup_printf ("%s/%s", path, model_list_filename);
+        char *contents = NULL;
+        gsize length = 0;
+
+        g_checksum_update (checksum, (const guchar *) model_list_filename, strlen (model_list_filename) + 1);
+        if (g_file_get_contents (name, &contents, &length, NULL))
+            g_checksum_update (checksum, (const guchar *) contents, length);
+        g_free (contents);
+        g_free (name);
     }
 
-    return;
+    g_checksum_get_digest (checksum, key, &len);
+    g_checksum_free (checksum);
+    return len == SCH_CACHE_KEY_SIZE;
 }
 
-static gint
-xmlNodeCmp (gconstpointer a, gconstpointer b)
+static uint32_t
+cache_string (sch_cache_writer *writer, const char *value)
 {
-    char *aname = (char *) xmlGetProp ((xmlNode *) a, (xmlChar *) "name");
-    char *bname = (char *) xmlGetProp ((xmlNode *) b, (xmlChar *) "name");
-    gint result = g_strcmp0 (aname, bname);
-    free (aname);
-    free (bname);
-    return result;
-}
+    gpointer offset;
 
-static void
-sort_root_nodes (xmlNode *module)
-{
-    GList *nodes = NULL;
-    xmlNode *child = module->children;
-    while (child)
-    {
-        xmlNode *next = child->next;
-        nodes = g_list_prepend (nodes, child);
-        xmlUnlinkNode (child);
-        child = next;
-    }
-    nodes = g_list_sort (nodes, xmlNodeCmp);
-    xmlNode *prev = NULL;
-    for (GList *iter = nodes; iter; iter = iter->next)
+    if (!value)
+        return SCH_CACHE_NONE;
+    if (!g_hash_table_lookup_extended (writer->offsets, value, NULL, &offset))
     {
-        child = (xmlNode *) iter->data;
-        if (prev)
-            xmlAddNextSibling (prev, child);
-        else
-            xmlAddChild (module, child);
-        prev = child;
+        offset = GUINT_TO_POINTER (writer->strings->len);
+        g_string_append_len (writer->strings, value, strlen (value) + 1);
+        g_hash_table_insert (writer->offsets, g_strdup (value), offset);
     }
-    g_list_free (nodes);
+    return GPOINTER_TO_UINT (offset);
 }
 
-char *
-sch_dump_xml (sch_instance * instance)
+/* Namespaces are all resolved to the root so are stored by index */
+static uint32_t
+cache_ns (sch_cache_writer *writer, xmlNs *ns)
 {
-    xmlNode *xml = xmlDocGetRootElement (instance->doc);
-    xmlChar *xmlbuf = NULL;
-    int bufsize;
+    uint32_t index = 0;
 
-    xmlDoc *copy = xmlCopyDoc (xml->doc, 1);
-    remove_hidden_children (xmlDocGetRootElement (copy));
-    format_api_namespaces (instance, xmlDocGetRootElement (copy)->ns, xmlDocGetRootElement (copy), 0);
-    sort_root_nodes (xmlDocGetRootElement (copy));
-    xmlDocDumpFormatMemory (copy, &xmlbuf, &bufsize, 1);
-    xmlFreeDoc (copy);
-    return (char *) xmlbuf;
+    if (!ns)
+        return SCH_CACHE_NONE;
+    for (xmlNs *def = writer->root->nsDef; def; def = def->next, index++)
+    {
+        if (def == ns)
+            return index;
+    }
+    writer->failed = true;
+    return SCH_CACHE_NONE;
 }
 
-static bool
-_sch_ns_match (xmlNode *node, xmlNs *ns)
+static void
+cache_write_node (sch_cache_writer *writer, xmlNode *node)
 {
-    sch_instance *instance = node->doc->_private;
-
-    /* Actually the same namespace (object) */
-    if (node->ns == ns)
-        return true;
-
-    /* NULL == the global namespace */
-    if (!ns && node->ns == xmlDocGetRootElement (instance->doc)->ns)
-        return true;
+    sch_cache_node record = { 0 };
 
-    /* Check if both namespaces are part of the global namespace */
-    if (_sch_ns_native (instance, ns) && _sch_ns_native (instance, node->ns))
-        return true;
+    record.name = cache_string (writer, (const char *) node->name);
+    record.ns = cache_ns (writer, node->ns);
+    for (xmlAttr *attr = node->properties; attr; attr = attr->next)
+    {
+        sch_cache_attr arecord;
+        xmlChar *value = xmlNodeListGetString (node->doc, attr->children, 1);
 
-    /* Search up the tree until the root<MODULE> for an exact namespace match */
-    while (ns && node && node->type == XML_ELEMENT_NODE && node->name[0] == 'N')
+        arecord.name = cache_string (writer, (const char *) attr->name);
+        arecord.ns = cache_ns (writer, attr->ns);
+        arecord.value = cache_string (writer, (const char *) value ? : "");
+        xmlFree (value);
+        g_string_append_len (writer->attrs, (const gchar *) &arecord, sizeof (arecord));
+        writer->attr_count++;
+        record.attr_count++;
+    }
+    for (xmlNode *n = node->children; n; n = n->next)
     {
-        if (node->ns && node->ns->href &&
-            g_strcmp0 ((const char *) node->ns->href, (const char *) ns->href) == 0)
-            return true;
-        node = node->parent;
+        /* Only elements survive the merge */
+        if (n->type != XML_ELEMENT_NODE)
+            writer->failed = true;
+        record.child_count++;
     }
+    g_string_append_len (writer->nodes, (const gchar *) &record, sizeof (record));
+    writer->node_count++;
 
-    /* No match */
-    return false;
+    for (xmlNode *n = node->children; n; n = n->next)
+        cache_write_node (writer, n);
 }
 
-bool
-sch_ns_match (sch_node *node, sch_ns *ns)
+/* Flatten the merged document of an instance into the cache format */
+static GString *
+sch_cache_encode (sch_instance *instance, const uint8_t *key)
 {
-    return _sch_ns_match (node, ns);
+    sch_cache_writer writer = { 0 };
+    sch_cache_header header = { { 0 } };
+    GString *ns = g_string_new (NULL);
+    GString *tail = g_string_new (NULL);
+    GString *data = NULL;
+
+    writer.root = xmlDocGetRootElement (instance->doc);
+    writer.strings = g_string_new (NULL);
+    writer.offsets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    writer.nodes = g_string_new (NULL);
+    writer.attrs = g_string_new (NULL);
+
+    for (xmlNs *def = writer.root->nsDef; def; def = def->next)
+    {
+        sch_cache_ns record;
+
+        record.href = cache_string (&writer, (const char *) def->href);
+        record.prefix = cache_string (&writer, (const char *) def->prefix);
+        g_string_append_len (ns, (const gchar *) &record, sizeof (record));
+        header.ns_count++;
+    }
+    cache_write_node (&writer, writer.root);
+
+    for (GList *iter = instance->models_list; iter; iter = g_list_next (iter))
+    {
+        sch_loaded_model *loaded = iter->data;
+        uint32_t fields[SCH_CACHE_MODEL_FIELDS] = {
+            cache_string (&writer, loaded->ns_href),
+            cache_string (&writer, loaded->ns_prefix),
+            cache_string (&writer, loaded->model),
+            cache_string (&writer, loaded->organization),
+            cache_string (&writer, loaded->version),
+            cache_string (&writer, loaded->features),
+            cache_string (&writer, loaded->deviations),
+        };
+        g_string_append_len (tail, (const gchar *) fields, sizeof (fields));
+        header.model_count++;
+    }
+    if (instance->map_hash_table)
+    {
+        GHashTableIter hiter;
+        gpointer hkey, hvalue;
+
+        header.has_map = 1;
+        g_hash_table_iter_init (&hiter, instance->map_hash_table);
+        while (g_hash_table_iter_next (&hiter, &hkey, &hvalue))
+        {
+            uint32_t fields[2] = {
+                cache_string (&writer, hkey),
+                cache_string (&writer, hvalue),
+            };
+            g_string_append_len (tail, (const gchar *) fields, sizeof (fields));
+            header.map_count++;
+        }
+    }
+
+    /* Keep the tables that follow the strings aligned */
+    while (writer.strings->len % sizeof (uint32_t))
+        g_string_append_c (writer.strings, '\0');
+
+    memcpy (header.magic, SCH_CACHE_MAGIC, sizeof (header.magic));
+    header.version = SCH_CACHE_VERSION;
+    memcpy (header.key, key, SCH_CACHE_KEY_SIZE);
+    header.strings_size = writer.strings->len;
+    header.node_count = writer.node_count;
+    header.attr_count = writer.attr_count;
+
+    if (!writer.failed)
+    {
+        data = g_string_sized_new (sizeof (header) + writer.strings->len + ns->len +
+                                   writer.nodes->len + writer.attrs->len + tail->len);
+        g_string_append_len (data, (const gchar *) &header, sizeof (header));
+        g_string_append_len (data, writer.strings->str, writer.strings->len);
+        g_string_append_len (data, ns->str, ns->len);
+        g_string_append_len (data, writer.nodes->str, writer.nodes->len);
+        g_string_append_len (data, writer.attrs->str, writer.attrs->len);
+        g_string_append_len (data, tail->str, tail->len);
+    }
+
+    g_hash_table_destroy (writer.offsets);
+    g_string_free (writer.strings, TRUE);
+    g_string_free (writer.nodes, TRUE);
+    g_string_free (writer.attrs, TRUE);
+    g_string_free (ns, TRUE);
+    g_string_free (tail, TRUE);
+    return data;
 }
 
-sch_ns *
-sch_node_ns (sch_node * node)
+static bool
+sch_cache_write (sch_instance *instance, const char *filename, const uint8_t *key)
 {
-    xmlNode *xml = (xmlNode *) node;
-    return xml ? (sch_ns *) xml->ns : NULL;
+    GString *data = sch_cache_encode (instance, key);
+    bool ret;
+
+    if (!data)
+        return false;
+    /* Written to a temporary and renamed so readers never see a partial file.
+       Failure (e.g. a read-only filesystem) just means no cache. */
+    ret = g_file_set_contents (filename, data->str, data->len, NULL);
+    if (!ret)
+        syslog (LOG_DEBUG, "XML: unable to write schema cache \"%s\"", filename);
+    g_string_free (data, TRUE);
+    return ret;
 }
 
-const char *
-sch_ns_prefix (sch_instance *instance, sch_ns *ns)
+/* Returns NULL for SCH_CACHE_NONE. Offsets are checked against the table */
+static bool
+cache_lookup_string (sch_cache_reader *reader, uint32_t offset, const char **value)
 {
-    return ns ? (const char *) ((xmlNs *)ns)->prefix : NULL;
+    if (offset == SCH_CACHE_NONE)
+    {
+        *value = NULL;
+        return true;
+    }
+    if (offset >= reader->strings_size)
+        return false;
+    *value = reader->strings + offset;
+    return true;
 }
 
-const char *
-sch_ns_href (sch_instance *instance, sch_ns *ns)
+static bool
+cache_lookup_ns (sch_cache_reader *reader, uint32_t index, xmlNs **ns)
 {
-    return ns ? (const char *) ((xmlNs *)ns)->href : NULL;
+    if (index == SCH_CACHE_NONE)
+    {
+        *ns = NULL;
+        return true;
+    }
+    if (index >= reader->ns_count)
+        return false;
+    *ns = reader->ns[index];
+    return true;
 }
 
-sch_node *
-sch_get_root_schema (sch_instance * instance)
+static bool
+cache_read_node (sch_cache_reader *reader, xmlNode *node, const sch_cache_node *record)
 {
-    return (instance ? xmlDocGetRootElement (instance->doc) : NULL);
+    for (uint32_t i = 0; i < record->attr_count; i++)
+    {
+        const sch_cache_attr *attr;
+        const char *name;
+        const char *value;
+        xmlNs *ns;
+
+        if (reader->attr_next >= reader->attr_count)
+            return false;
+        attr = &reader->attrs[reader->attr_next++];
+        if (!cache_lookup_string (reader, attr->name, &name) || !name ||
+            !cache_lookup_string (reader, attr->value, &value) ||
+            !cache_lookup_ns (reader, attr->ns, &ns))
+            return false;
+        xmlNewNsProp (node, ns, (const xmlChar *) name, (const xmlChar *) value);
+    }
+
+    for (uint32_t i = 0; i < record->child_count; i++)
+    {
+        const sch_cache_node *crecord;
+        const char *name;
+        xmlNs *ns;
+        xmlNode *child;
+
+        if (reader->node_next >= reader->node_count)
+            return false;
+        crecord = &reader->nodes[reader->node_next++];
+        if (!cache_lookup_string (reader, crecord->name, &name) || !name ||
+            !cache_lookup_ns (reader, crecord->ns, &ns))
+            return false;
+        child = xmlNewDocNode (node->doc, ns, (const xmlChar *) name, NULL);
+        xmlAddChild (node, child);
+        if (!cache_read_node (reader, child, crecord))
+            return false;
+    }
+    return true;
 }
 
-static xmlNs *
-_sch_lookup_ns (sch_instance * instance, xmlNode *schema, const char *name, int flags, bool href)
+/* Rebuild the merged document from cache data. Without a key any models match */
+static bool
+sch_cache_decode (sch_instance *instance, const void *data, size_t data_size, const uint8_t *key)
 {
-    xmlNs *ns = NULL;
-    xmlNode *xml;
+    sch_cache_reader reader = { 0 };
+    const sch_cache_header *header;
+    const sch_cache_ns *ns;
+    const uint32_t *tail;
+    const char *root_name;
+    xmlDoc *doc = NULL;
+    xmlNode *root;
+    GList *models = NULL;
+    GHashTable *map = NULL;
+    uint64_t size;
+    bool ret = false;
 
-    if (!schema)
-        schema = xmlDocGetRootElement (instance->doc);
+    if (data_size < sizeof (sch_cache_header) || ((uintptr_t) data % sizeof (uint32_t)))
+        return false;
+    header = data;
+    if (memcmp (header->magic, SCH_CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+        header->version != SCH_CACHE_VERSION ||
+        (key && memcmp (header->key, key, SCH_CACHE_KEY_SIZE) != 0))
+        goto exit;
+    size = (uint64_t) sizeof (*header) + header->strings_size +
+           (uint64_t) header->ns_count * sizeof (sch_cache_ns) +
+           (uint64_t) header->node_count * sizeof (sch_cache_node) +
+           (uint64_t) header->attr_count * sizeof (sch_cache_attr) +
+           ((uint64_t) header->model_count * SCH_CACHE_MODEL_FIELDS +
+            (uint64_t) header->map_count * 2) * sizeof (uint32_t);
+    if (size != (uint64_t) data_size || header->node_count == 0 ||
+        header->strings_size % sizeof (uint32_t) ||
+        (header->strings_size && ((const char *) (header + 1))[header->strings_size - 1] != '\0'))
+        goto exit;
 
-    xml = sch_node_child_first (schema);
-    while (xml && xml->type == XML_ELEMENT_NODE)
+    reader.strings = (const char *) (header + 1);
+    reader.strings_size = header->strings_size;
+    ns = (const sch_cache_ns *) (reader.strings + reader.strings_size);
+    reader.ns_count = header->ns_count;
+    reader.nodes = (const sch_cache_node *) (ns + header->ns_count);
+    reader.node_count = header->node_count;
+    reader.attrs = (const sch_cache_attr *) (reader.nodes + header->node_count);
+    reader.attr_count = header->attr_count;
+    tail = (const uint32_t *) (reader.attrs + header->attr_count);
+
+    /* The root MODULE holds every namespace definition */
+    if (!cache_lookup_string (&reader, reader.nodes[0].name, &root_name) || !root_name)
+        goto exit;
+    doc = xmlNewDoc ((xmlChar *) "1.0");
+    root = xmlNewDocNode (doc, NULL, (const xmlChar *) root_name, NULL);
+    xmlDocSetRootElement (doc, root);
+    reader.ns = g_malloc0 ((header->ns_count + 1) * sizeof (xmlNs *));
+    for (uint32_t i = 0; i < header->ns_count; i++)
     {
-        if (flags & SCH_F_NS_MODEL_NAME)
-        {
-            char *model;
+        const char *href;
+        const char *prefix;
 
-            model = (char *) xmlGetProp (xml, (xmlChar *) "model");
-            if (model)
-            {
-                if (g_strcmp0 (model, name) == 0)
-                {
-                    free (model);
-                    ns = xml->ns;
-                    break;
-                }
-                free (model);
-            }
-        }
+        if (!cache_lookup_string (&reader, ns[i].href, &href) ||
+            !cache_lookup_string (&reader, ns[i].prefix, &prefix))
+            goto exit;
+        reader.ns[i] = xmlNewNs (root, (const xmlChar *) href, (const xmlChar *) prefix);
+        if (!reader.ns[i])
+            goto exit;
+    }
+    if (!cache_lookup_ns (&reader, reader.nodes[0].ns, &root->ns))
+        goto exit;
+    reader.node_next = 1;
+    if (!cache_read_node (&reader, root, &reader.nodes[0]) ||
+        reader.node_next != reader.node_count || reader.attr_next != reader.attr_count)
+        goto exit;
 
-        if (xml->ns &&
-            ((href && xml->ns->href && g_strcmp0 ((char *) xml->ns->href, name) == 0) ||
-             (!href && xml->ns->prefix && g_strcmp0 ((char *) xml->ns->prefix, name) == 0)))
+    for (uint32_t i = 0; i < header->model_count; i++, tail += SCH_CACHE_MODEL_FIELDS)
+    {
+        sch_loaded_model *loaded = g_malloc0 (sizeof (sch_loaded_model));
+        const char *fields[SCH_CACHE_MODEL_FIELDS];
+
+        models = g_list_append (models, loaded);
+        for (int f = 0; f < SCH_CACHE_MODEL_FIELDS; f++)
         {
-            ns = xml->ns;
-            break;
+            if (!cache_lookup_string (&reader, tail[f], &fields[f]))
+                goto exit;
         }
-        xml = xml->next;
+        loaded->ns_href = g_strdup (fields[0]);
+        loaded->ns_prefix = g_strdup (fields[1]);
+        loaded->model = g_strdup (fields[2]);
+        loaded->organization = g_strdup (fields[3]);
+        loaded->version = g_strdup (fields[4]);
+        loaded->features = g_strdup (fields[5]);
+        loaded->deviations = g_strdup (fields[6]);
     }
+    if (header->has_map)
+        map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (uint32_t i = 0; i < header->map_count; i++, tail += 2)
+    {
+        const char *mkey;
+        const char *mvalue;
 
-    return ns;
-}
+        if (!map || !cache_lookup_string (&reader, tail[0], &mkey) || !mkey ||
+            !cache_lookup_string (&reader, tail[1], &mvalue) || !mvalue)
+            goto exit;
+        g_hash_table_insert (map, g_strdup (mkey), g_strdup (mvalue));
+    }
 
-sch_ns *
-sch_lookup_ns (sch_instance * instance, sch_node *schema, const char *name, int flags, bool href)
-{
-    return (sch_ns *) _sch_lookup_ns (instance, (xmlNode *)schema, name, flags, href);
+    instance->doc = doc;
+    instance->models_list = models;
+    instance->map_hash_table = map;
+    doc = NULL;
+    models = NULL;
+    map = NULL;
+    ret = true;
+
+exit:
+    if (doc)
+        xmlFreeDoc (doc);
+    if (models)
+        sch_free_loaded_models (models);
+    if (map)
+        g_hash_table_destroy (map);
+    g_free (reader.ns);
+    return ret;
 }
 
-static xmlNode *
-lookup_node (sch_instance *instance, xmlNs *ns, xmlNode *node, const char *path)
+/* Rebuild the merged document from a matching cache file */
+static bool
+sch_cache_read (sch_instance *instance, const char *filename, const uint8_t *key)
 {
-    xmlNode *n;
-    char *name, *mode;
-    char *key = NULL;
-    char *lk = NULL;
-    char *colon;
-    int len;
+    struct stat st;
+    void *data;
+    bool ret;
+    int fd;
 
-    if (!node)
+    fd = open (filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (sch_cache_header))
     {
-        return NULL;
+        close (fd);
+        return false;
     }
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED)
+        return false;
+    ret = sch_cache_decode (instance, data, st.st_size, key);
+    munmap (data, st.st_size);
+    return ret;
+}
 
-    if (path[0] == '/')
-    {
-        path++;
-    }
-    key = strchr (path, '/');
-    if (key)
-    {
-        len = key - path;
-        key = g_strndup (path, len);
-        path += len;
-    }
-    else
-    {
-        key = g_strdup (path);
-        path = NULL;
-    }
+static void
+sch_parsed_file_free (gpointer data)
+{
+    sch_parsed_file *file = data;
 
-    colon = strchr (key, ':');
-    if (colon)
+    if (file->doc)
+        xmlFreeDoc (file->doc);
+    g_free (file);
+}
+
+/* Done with a parsed file. Keep it in kept for the next reload or free it */
+static void
+sch_release_item_doc (sch_load_item *item, GHashTable *parsed, GHashTable *kept)
+{
+    if (!item->doc_new)
+        return;
+    if (kept)
     {
-        colon[0] = '\0';
-        xmlNs *nns = _sch_lookup_ns (instance, node, key, 0/*flags*/, false);
-        if (!nns)
-        {
-            /* No namespace found assume the node is supposed to have a colon in it */
-            colon[0] = ':';
-        }
-        else
+        sch_parsed_file *file = g_new0 (sch_parsed_file, 1);
+
+        if (item->reused)
         {
-            /* We found a namespace. Remove the prefix */
-            char *_key = key;
-            key = g_strdup (colon + 1);
-            free (_key);
-            ns = nns;
+            /* Now owned by kept */
+            sch_parsed_file *old = g_hash_table_lookup (parsed, item->filename);
+            old->doc = NULL;
         }
+        file->doc = item->doc_new;
+        file->size = item->st.st_size;
+        file->mtime = item->st.st_mtim;
+        g_hash_table_replace (kept, g_strdup (item->filename), file);
+    }
+    else if (!item->reused)
+    {
+        xmlFreeDoc (item->doc_new);
     }
+    item->doc_new = NULL;
+}
+
+/* Parse all XML files in the search path and merge trees. With kept the parsed
+ * files are saved there, and unchanged files are taken from parsed */
+static void
+sch_parse_files (sch_instance *instance, const char *path, const char *model_list_filename,
+                 int flags, GHashTable *parsed, GHashTable *kept)
+{
+    xmlNode *module;
+    xmlNs *ns;
+    GList *files = NULL;
+    GList *iter;
+
+    /* Create a new doc and root node for the merged MODULE */
+    instance->doc = xmlNewDoc ((xmlChar *) "1.0");
+    module = xmlNewNode (NULL, (xmlChar *) "MODULE");
+    ns = xmlNewNs (module, (const xmlChar *) "https://github.com/alliedtelesis/apteryx", NULL);
+    xmlSetNs (module, ns);
+    xmlNewNs (module, (const xmlChar *) "http://www.w3.org/2001/XMLSchema-instance", (const xmlChar *) "xsi");
+    xmlNewProp (module, (const xmlChar *) "xsi:schemaLocation",
+        (const xmlChar *) "https://github.com/alliedtelesis/apteryx-xml https://github.com/alliedtelesis/apteryx-xml/releases/download/v1.2/apteryx.xsd");
+    xmlDocSetRootElement (instance->doc, module);
+
+    if (model_list_filename)
+        sch_load_model_list (instance, path, model_list_filename);
 
-    for (n = node->children; n; n = n->next)
+    load_schema_files (&files, path, flags, parsed);
+    for (iter = files; iter; iter = g_list_next (iter))
     {
-        if (n->type != XML_ELEMENT_NODE)
+        sch_load_item *item;
+        char *filename;
+        char *ext;
+
+        item = iter->data;
+        filename = item->filename;
+        ext = strrchr(filename, '.');
+        if (g_strcmp0 (ext, ".map") == 0)
         {
+            sch_load_namespace_mappings (instance, filename);
             continue;
         }
-        name = (char *) xmlGetProp (n, (xmlChar *) "name");
-        if (name && name[0] == '*')
+
+        xmlNode *module_new = xmlDocGetRootElement (item->doc_new);
+        cleanup_nodes (module_new);
+        /* Sanity check for empty modules */
+        if (!module_new || (module_new->children && (module_new->children->name[0] != 'N' && module_new->children->name[0] != 'S')))
         {
-            lk = strchr (key, '=');
-            if (lk)
-                key[lk - key] = '\0';
+            syslog (LOG_ERR, "XML: ignoring empty schema \"%s\"", filename);
+            if (kept)
+                sch_release_item_doc (item, parsed, kept);
+            continue;
         }
-        if (name && (name[0] == '*' || sch_match_name (name, key)) && _sch_ns_match (n, ns))
+        copy_nsdef_to_root (instance->doc, module_new);
+        if (save_module_info (instance, module_new))
         {
-            free (key);
-            if (path)
-            {
-                mode = (char *) xmlGetProp (n, (xmlChar *) "mode");
-                if (mode && strchr (mode, 'p') != NULL)
-                {
-                    xmlFree (name);
-                    xmlFree (mode);
-                    /* restart search from root */
-                    return lookup_node (instance, ns, xmlDocGetRootElement (node->doc), path);
-                }
-                xmlFree (name);
-                if (mode)
-                {
-                    xmlFree (mode);
-                }
-                return lookup_node (instance, ns, n, path);
-            }
-            xmlFree (name);
-            return n;
+            add_module_info_to_child (instance, module_new);
+            merge_nodes (module_new->ns, module, module->children, module_new->children, 0);
+            sch_release_item_doc (item, parsed, kept);
+            assign_ns_to_root (instance->doc, module->children);
         }
-
-        if (name)
+        else
         {
-            xmlFree (name);
+            sch_release_item_doc (item, parsed, kept);
         }
     }
+    g_list_free_full (files, sch_load_item_free);
+}
 
-    free (key);
-    return NULL;
+/* Lazy loading. Each model file is only scanned for its namespace and the
+ * names of its top level nodes. A file is parsed and merged the first time a
+ * lookup at the root asks for one of its names (or its namespace), together
+ * with every other file that shares a top level name with it. The merged
+ * nodes are built on the side and linked onto the root complete, so readers
+ * scanning the root never see a partial model. */
+typedef struct _sch_lazy_file
+{
+    char *filename;
+    char *href;
+    char *prefix;
+    char *model;
+    GList *names;               /* Index names of the top level nodes */
+    bool loading;               /* Being merged (lazy lock held) */
+    bool loaded;                /* Merged and linked onto the root */
+} sch_lazy_file;
+
+typedef struct _sch_lazy
+{
+    GRecMutex lock;
+    xmlDoc *doc;                /* Document the files are merged into */
+    GList *files;               /* sch_lazy_file in load order */
+    GHashTable *by_name;        /* Index name to GList of sch_lazy_file */
+    int pending;                /* Files not loaded yet */
+    GList *retired;             /* Root child indexes replaced by a merge */
+} sch_lazy;
+
+static void
+sch_lazy_file_free (gpointer data)
+{
+    sch_lazy_file *file = data;
+
+    g_free (file->filename);
+    g_free (file->href);
+    g_free (file->prefix);
+    xmlFree (file->model);
+    g_list_free_full (file->names, g_free);
+    g_free (file);
 }
 
-sch_node *
-sch_lookup (sch_instance * instance, const char *path)
+static void
+sch_lazy_free (sch_lazy *lazy)
 {
-    return lookup_node (instance, NULL, xmlDocGetRootElement (instance->doc), path);
+    if (!lazy)
+        return;
+    g_hash_table_destroy (lazy->by_name);
+    g_list_free_full (lazy->files, sch_lazy_file_free);
+    g_list_free_full (lazy->retired, (GDestroyNotify) g_hash_table_destroy);
+    g_rec_mutex_clear (&lazy->lock);
+    g_free (lazy);
 }
 
-static sch_node *
-_sch_node_child (xmlNs *ns, sch_node * parent, const char *child)
+/* Read the MODULE element and the names of its top level NODEs without building
+ * the tree. The MODULE alone is left in item->doc_new for ordering the files */
+static sch_lazy_file *
+lazy_scan_file (sch_load_item *item)
 {
-    xmlNode *xml = (xmlNode *) parent;
-    xmlNode *n = xml->children;
+    xmlTextReader *reader = xmlReaderForFile (item->filename, NULL, 0);
+    sch_lazy_file *file = NULL;
+    int rc;
 
-    while (n)
+    if (!reader)
+        return NULL;
+    rc = xmlTextReaderRead (reader);
+    while (rc == 1)
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+        int depth = xmlTextReaderDepth (reader);
+
+        if (xmlTextReaderNodeType (reader) == XML_READER_TYPE_ELEMENT)
         {
-            char *name = (char *) xmlGetProp (n, (xmlChar *) "name");
-            if (name && (name[0] == '*' || sch_match_name (name, child)) && _sch_ns_match (n, ns))
+            if (depth == 0 && !file)
+            {
+                /* Only the attributes and namespaces of the module are needed */
+                xmlNode *module = xmlCopyNode (xmlTextReaderCurrentNode (reader), 2);
+
+                if (!module)
+                    break;
+                item->doc_new = xmlNewDoc ((xmlChar *) "1.0");
+                xmlDocSetRootElement (item->doc_new, module);
+                file = g_new0 (sch_lazy_file, 1);
+                file->filename = g_strdup (item->filename);
+            }
+            else if (depth == 1 && file &&
+                     g_strcmp0 ((char *) xmlTextReaderConstLocalName (reader), "NODE") == 0)
             {
+                char *name = (char *) xmlTextReaderGetAttribute (reader, (xmlChar *) "name");
+
+                if (name)
+                    file->names = g_list_prepend (file->names, index_name (name));
                 xmlFree (name);
-                break;
+                /* Skip the subtree */
+                rc = xmlTextReaderNext (reader);
+                continue;
             }
-            xmlFree (name);
         }
-        n = n->next;
+        rc = xmlTextReaderRead (reader);
     }
-    return n;
-}
-
-sch_node *
-sch_ns_node_child (sch_ns *ns, sch_node * parent, const char *child)
-{
-    return _sch_node_child ((xmlNs *)ns, parent, child);
+    xmlFreeTextReader (reader);
+    if (rc < 0 || !file)
+    {
+        syslog (LOG_ERR, "XML: failed to parse \"%s\"", item->filename);
+        if (file)
+            sch_lazy_file_free (file);
+        if (item->doc_new)
+            xmlFreeDoc (item->doc_new);
+        item->doc_new = NULL;
+        return NULL;
+    }
+    return file;
 }
 
-static bool
-_sch_node_find_name (xmlNs *ns, sch_node * parent, const char *path_name, GList **path_list)
+/* Build the lazy index instead of parsing and merging every file */
+static void
+sch_lazy_index (sch_instance *instance, const char *path, const char *model_list_filename)
 {
-    xmlNode *xml = (xmlNode *) parent;
-    xmlNode *n = NULL;
-    bool found = false;
+    sch_lazy *lazy = g_new0 (sch_lazy, 1);
+    GHashTable *scanned = g_hash_table_new (NULL, NULL);
+    xmlNode *module;
+    xmlNs *ns;
+    GList *files = NULL;
+    DIR *dp;
+    struct dirent *ep;
+    char *saveptr = NULL;
+    char *cpath;
+    char *dpath;
 
-    n = xml->children;
-    while (n)
+    /* Same empty root as sch_parse_files */
+    instance->doc = xmlNewDoc ((xmlChar *) "1.0");
+    module = xmlNewNode (NULL, (xmlChar *) "MODULE");
+    ns = xmlNewNs (module, (const xmlChar *) "https://github.com/alliedtelesis/apteryx", NULL);
+    xmlSetNs (module, ns);
+    xmlNewNs (module, (const xmlChar *) "http://www.w3.org/2001/XMLSchema-instance", (const xmlChar *) "xsi");
+    xmlNewProp (module, (const xmlChar *) "xsi:schemaLocation",
+        (const xmlChar *) "https://github.com/alliedtelesis/apteryx-xml https://github.com/alliedtelesis/apteryx-xml/releases/download/v1.2/apteryx.xsd");
+    xmlDocSetRootElement (instance->doc, module);
+
+    if (model_list_filename)
+        sch_load_model_list (instance, path, model_list_filename);
+
+    g_rec_mutex_init (&lazy->lock);
+    lazy->doc = instance->doc;
+    lazy->by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_list_free);
+    cpath = g_strdup (path);
+    dpath = strtok_r (cpath, ":", &saveptr);
+    while (dpath != NULL)
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+        dp = opendir (dpath);
+        if (dp != NULL)
         {
-            char *name = (char *) xmlGetProp (n, (xmlChar *) "name");
-            if (sch_match_name (name, path_name) && _sch_ns_match (n, ns))
-            {
-                xmlFree (name);
-                found = true;
-                break;
-            }
-            if (n->children)
+            while ((ep = readdir (dp)))
             {
-                found = _sch_node_find_name (ns, n, path_name, path_list);
-                if (found)
+                sch_load_item *item;
+                sch_lazy_file *file = NULL;
+
+                if (!is_schema_file (ep->d_name))
+                    continue;
+                item = g_malloc0 (sizeof (sch_load_item));
+                if (dpath[strlen (dpath) - 1] == '/')
+                    item->filename = g_strdup_printf ("%s%s", dpath, ep->d_name);
+                else
+                    item->filename = g_strdup_printf ("%s/%s", dpath, ep->d_name);
+                item->d_name = g_strdup (ep->d_name);
+                if (fnmatch ("*.map", item->d_name, FNM_PATHNAME) != 0 &&
+                    !(file = lazy_scan_file (item)))
                 {
-                    *path_list = g_list_prepend (*path_list, g_strdup (name));
-                    xmlFree (name);
-                    break;
+                    sch_load_item_free (item);
+                    continue;
                 }
+                if (file)
+                    g_hash_table_insert (scanned, item, file);
+                files = g_list_prepend (files, item);
             }
-            xmlFree (name);
+            (void) closedir (dp);
         }
-        n = n->next;
+        dpath = strtok_r (NULL, ":", &saveptr);
     }
-    return found;
-}
-
-static bool
-sch_node_find_name (sch_instance *instance, xmlNs *ns, sch_node *parent, const char *path, int flags, GList **path_list)
-{
-    char *name;
-    char *next;
-    char *colon;
-    bool found = false;
+    free (cpath);
 
-    if (path && path[0] == '/')
+    /* Index in the order the full load merges the files */
+    order_schema_files (&files);
+    for (GList *iter = files; iter; iter = g_list_next (iter))
     {
-        path++;
+        sch_load_item *item = iter->data;
+        sch_lazy_file *file = g_hash_table_lookup (scanned, item);
+        xmlNode *module_new;
 
-        /* Parse path element */
-        next = strchr (path, '/');
-        if (next)
-            name = g_strndup (path, next - path);
-        else
-            name = g_strdup (path);
-        colon = strchr (name, ':');
-        if (colon)
+        if (!file)
         {
-            colon[0] = '\0';
-            xmlNs *nns = _sch_lookup_ns (instance, parent, name, flags, false);
-            if (!nns)
-            {
-                /* No namespace found assume the node is supposed to have a colon in it */
-                colon[0] = ':';
-            }
+            sch_load_namespace_mappings (instance, item->filename);
+            continue;
+        }
+        module_new = xmlDocGetRootElement (item->doc_new);
+        copy_nsdef_to_root (instance->doc, module_new);
+        if (!save_module_info (instance, module_new))
+        {
+            sch_lazy_file_free (file);
+            xmlFreeDoc (item->doc_new);
+            continue;
+        }
+        ns = xmlSearchNs (NULL, module_new, NULL);
+        if (ns && ns->href)
+        {
+            xmlNs *rns = xmlSearchNsByHref (instance->doc, module, ns->href);
+            file->href = g_strdup ((char *) ns->href);
+            if (rns && rns->prefix)
+                file->prefix = g_strdup ((char *) rns->prefix);
+        }
+        file->model = (char *) xmlGetProp (module_new, (xmlChar *) "model");
+        xmlFreeDoc (item->doc_new);
+        lazy->files = g_list_prepend (lazy->files, file);
+        lazy->pending++;
+        for (GList *n = file->names; n; n = g_list_next (n))
+        {
+            GList *list = g_hash_table_lookup (lazy->by_name, n->data);
+            if (list)
+                list = g_list_append (list, file);
             else
-            {
-                /* We found a namespace. Remove the prefix */
-                char *_name = name;
-                name = g_strdup (colon + 1);
-                free (_name);
-                ns = nns;
-            }
+                g_hash_table_insert (lazy->by_name, g_strdup (n->data), g_list_append (NULL, file));
         }
-        found = _sch_node_find_name (ns, parent, name, path_list);
-        g_free (name);
     }
-    return found;
-}
-
-sch_node *
-sch_child_first (sch_instance * instance)
-{
-    return instance ? sch_node_child_first (xmlDocGetRootElement (instance->doc)) : NULL;
-}
-
-sch_node *
-sch_node_parent (sch_node *node)
-{
-    xmlNode *xml = (xmlNode *) node;
-    if (!node)
-        return NULL;
-    if (xml->type == XML_ELEMENT_NODE && xml->name[0] == 'N')
-        return (sch_node *) xml->parent;
-    return NULL;
-}
-
-sch_node *
-sch_node_child (sch_node * parent, const char *child)
-{
-    xmlNs *ns = parent ? ((xmlNode *) parent)->ns : NULL;
-    return _sch_node_child (ns, parent, child);
+    lazy->files = g_list_reverse (lazy->files);
+    g_list_free_full (files, sch_load_item_free);
+    g_hash_table_destroy (scanned);
+    instance->lazy = lazy;
 }
 
-sch_node *
-sch_node_namespace_child (sch_node * parent, const char *namespace, const char *child)
+/* Add file and every not yet loaded file sharing a top level name with it */
+static void
+lazy_add_file (sch_lazy *lazy, sch_lazy_file *file, GHashTable *set)
 {
-
-    xmlNs *ns;
-    xmlNode *module;
-    sch_node *node;
-    module = xmlNewNode (NULL, (xmlChar *) "MODULE");
-    ns = xmlNewNs (module, (const xmlChar *) namespace, NULL);
-    node =  _sch_node_child (ns, parent, child);
-
-    /* Note the ns is freed as part of the xmlFreeNode */
-    xmlFreeNode (module);
-    return node;
+    if (file->loading || g_hash_table_contains (set, file))
+        return;
+    g_hash_table_add (set, file);
+    for (GList *n = file->names; n; n = g_list_next (n))
+    {
+        for (GList *f = g_hash_table_lookup (lazy->by_name, n->data); f; f = g_list_next (f))
+            lazy_add_file (lazy, f->data, set);
+    }
 }
 
-sch_node *
-sch_node_by_namespace (sch_instance * instance, const char *namespace, const char *prefix)
+/* Parse and merge the files in set into the document of lazy. Called with
+ * the lazy lock held, which sch_reload also holds while it swaps documents */
+static void
+lazy_merge (sch_lazy *lazy, GHashTable *set)
 {
-    xmlNode *xml = sch_child_first (instance);
+    sch_instance *instance = (sch_instance *) lazy->doc->_private;
+    xmlNode *module = xmlDocGetRootElement (lazy->doc);
+    xmlNode *staging = xmlNewDocNode (lazy->doc, NULL, (xmlChar *) "MODULE", NULL);
+    sch_node_info *info = NODE_INFO (module);
+    xmlNode *n;
 
-    while (xml && xml->type == XML_ELEMENT_NODE)
+    /* Load order is the full load's file order */
+    for (GList *iter = lazy->files; iter; iter = g_list_next (iter))
     {
-        if (xml->ns &&
-            ((namespace && xml->ns->href && g_strcmp0 ((char *) xml->ns->href, namespace) == 0) ||
-             (!namespace && prefix &&
-              xml->ns->prefix && g_strcmp0 ((char *) xml->ns->prefix, prefix) == 0)))
-            return xml;
+        sch_lazy_file *file = iter->data;
+        xmlNode *module_new;
+        xmlDoc *doc_new;
 
-        xml = xml->next;
+        if (!g_hash_table_contains (set, file))
+            continue;
+        file->loading = true;
+        doc_new = xmlParseFile (file->filename);
+        module_new = doc_new ? xmlDocGetRootElement (doc_new) : NULL;
+        if (!module_new)
+        {
+            syslog (LOG_ERR, "XML: failed to parse \"%s\"", file->filename);
+            if (doc_new)
+                xmlFreeDoc (doc_new);
+            continue;
+        }
+        cleanup_nodes (module_new);
+        if (module_new->children && (module_new->children->name[0] != 'N' && module_new->children->name[0] != 'S'))
+        {
+            syslog (LOG_ERR, "XML: ignoring empty schema \"%s\"", file->filename);
+            xmlFreeDoc (doc_new);
+            continue;
+        }
+        copy_nsdef_to (lazy->doc, staging, module_new);
+        add_module_info_to_child (instance, module_new);
+        merge_nodes (module_new->ns, staging, staging->children, module_new->children, 0);
+        xmlFreeDoc (doc_new);
+        assign_ns_to (lazy->doc, staging, staging->children);
     }
-    return NULL;
-}
+    for (xmlNs *def = staging->nsDef; def; def = def->next)
+        ns_intern (instance, def);
 
-sch_node *
-sch_node_child_first (sch_node *parent)
-{
-    xmlNode *xml = (xmlNode *) parent;
-    xmlNode *n = xml->children;
+    if (instance->flags & SCH_LOAD_F_COMPACT)
+        compact_nodes (lazy->doc, staging->children);
 
-    while (n)
+    /* Complete each new top level node before publishing it on the root.
+     * The staging MODULE stands in for the root while the names are built */
+    for (n = staging->children; n; n = n->next)
     {
         if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
-            break;
-        n = n->next;
+        {
+            build_node_info (instance, n);
+            NODE_INFO (n)->ordinal = info->child_count++;
+        }
+        n->parent = module;
     }
-    return n;
-}
 
-sch_node *
-sch_node_next_sibling (sch_node *node)
-{
-    xmlNode *n = ((xmlNode *) node)->next;
+    /* Readers walk the root without the lock. Each chain is complete before
+     * one release store links it after the last definition or child */
+    if (staging->nsDef)
+    {
+        xmlNs **link = &module->nsDef;
 
-    while (n)
+        while (*link)
+            link = &(*link)->next;
+        __atomic_store_n (link, staging->nsDef, __ATOMIC_RELEASE);
+        staging->nsDef = NULL;
+    }
+    if ((n = staging->children))
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
-            break;
-        n = n->next;
+        n->prev = module->last;
+        __atomic_store_n (module->last ? &module->last->next : &module->children, n, __ATOMIC_RELEASE);
+        module->last = staging->last;
+        staging->children = staging->last = NULL;
     }
-    return n;
-}
+    xmlFreeNode (staging);
 
-/*
- * Returns the next node in a preorder traversal of the schema tree, or NULL if this would be the last in the traversal.
- * Only traverses nodes from root downwards. If root is null, will traverse all of tree
- */
-sch_node *
-sch_preorder_next(sch_node *current, sch_node *root) {
-    /* Handle null */
-    if (!current) {
-        return NULL;
-    }
+    /* Swap in an index of all the root's children. Readers may still hold
+     * the old one so it is kept until the instance is freed */
+    if (info->child_count >= SCH_CHILD_INDEX_MIN)
+    {
+        GHashTable *old = __atomic_exchange_n (&info->children, index_children (module), __ATOMIC_ACQ_REL);
 
-    /* Check if this node has children */
-    sch_node *next = sch_node_child_first(current);
-    if (next) {
-        return next;
+        if (old)
+            lazy->retired = g_list_prepend (lazy->retired, old);
     }
 
-    /* Check if this node has siblings */
-    next = sch_node_next_sibling(current);
-    if (next) {
-        return next;
-    }
+    for (GList *iter = lazy->files; iter; iter = g_list_next (iter))
+    {
+        sch_lazy_file *file = iter->data;
 
-    /* Go up the tree, looking for siblings of ancestors */
-    next = ((xmlNode *) current)->parent;
-    while(next) {
-        if (root && next == root) {
-            break;
-        }
-        if (sch_node_next_sibling(next)) {
-            next = sch_node_next_sibling(next);
-            break;
+        if (g_hash_table_contains (set, file))
+        {
+            __atomic_store_n (&file->loaded, true, __ATOMIC_RELEASE);
+            __atomic_sub_fetch (&lazy->pending, 1, __ATOMIC_RELEASE);
         }
-        next = ((xmlNode *) next)->parent;
     }
 
-    /* At this stage either we have a next node or we have finished the tree */
-    return next == root ? NULL : next;
+    /* Queries at the root may now expand to more nodes */
+    lookup_caches_clear (instance);
 }
 
-char *
-sch_name (sch_node * node)
+/* Make sure every model with a top level node called name is merged */
+static void
+lazy_require (sch_instance *instance, const char *name)
 {
-    xmlNode *n = (xmlNode *) node;
-    sch_instance *instance = n ? n->doc->_private : NULL;
-    char *name = (char *) xmlGetProp (n, (xmlChar *) "name");
-    if (!_sch_ns_native (instance, n->ns) && !sch_node_parent (sch_node_parent (node)))
+    sch_lazy *lazy = instance->lazy;
+    GHashTable *set;
+    char *iname;
+
+    GList *files;
+    GList *f;
+
+    if (!__atomic_load_n (&lazy->pending, __ATOMIC_ACQUIRE))
+        return;
+
+    /* The index does not change once built so check it without the lock */
+    iname = index_name (name);
+    files = g_hash_table_lookup (lazy->by_name, iname);
+    g_free (iname);
+    for (f = files; f; f = g_list_next (f))
     {
-        char *_name = g_strdup_printf ("%s:%s", n->ns->prefix, name);
-        free (name);
-        name = _name;
+        if (!__atomic_load_n (&((sch_lazy_file *) f->data)->loaded, __ATOMIC_ACQUIRE))
+            break;
     }
-    return name;
+    if (!f)
+        return;
+
+    g_rec_mutex_lock (&lazy->lock);
+    set = g_hash_table_new (NULL, NULL);
+    for (f = files; f; f = g_list_next (f))
+        lazy_add_file (lazy, f->data, set);
+    if (g_hash_table_size (set))
+        lazy_merge (lazy, set);
+    g_hash_table_destroy (set);
+    g_rec_mutex_unlock (&lazy->lock);
 }
 
-/* Ignoring ancestors allows checking that this is a node with the model data directly attached. */
-char *
-sch_model (sch_node * node, bool ignore_ancestors)
+/* As lazy_require for the models with a namespace, prefix or model name
+ * (or every model when all are NULL) */
+static void
+lazy_require_ns (sch_instance *instance, const char *namespace, const char *prefix,
+                 const char *model)
 {
-    char *model = NULL;
-    while (node)
-    {
-        model = (char *) xmlGetProp (node, (xmlChar *) "model");
-        if (model || ignore_ancestors)
-        {
-            break;
-        }
-        node = ((xmlNode *) node)->parent;
-    }
-    return model;
+    sch_lazy *lazy = instance->lazy;
+    GHashTable *set;
+
+    if (!__atomic_load_n (&lazy->pending, __ATOMIC_ACQUIRE))
+        return;
+    g_rec_mutex_lock (&lazy->lock);
+    set = g_hash_table_new (NULL, NULL);
+    for (GList *iter = lazy->files; iter; iter = g_list_next (iter))
+    {
+        sch_lazy_file *file = iter->data;
+
+        if ((!namespace && !prefix && !model) ||
+            (namespace && g_strcmp0 (file->href, namespace) == 0) ||
+            (prefix && g_strcmp0 (file->prefix, prefix) == 0) ||
+            (model && g_strcmp0 (file->model, model) == 0))
+            lazy_add_file (lazy, file, set);
+    }
+    if (g_hash_table_size (set))
+        lazy_merge (lazy, set);
+    g_hash_table_destroy (set);
+    g_rec_mutex_unlock (&lazy->lock);
 }
 
-char *
-sch_organization (sch_node * node)
+/* Enumerating the children of the MODULE root needs every model */
+static inline void
+lazy_require_root (xmlNode *xml)
 {
-    char *organization = NULL;
-    while (node)
-    {
-        organization = (char *) xmlGetProp (node, (xmlChar *) "organization");
-        if (organization)
-        {
-            break;
-        }
-        node = ((xmlNode *) node)->parent;
-    }
-    return organization;
+    sch_instance *instance;
+
+    if (xml && xml->parent && xml->parent->type == XML_DOCUMENT_NODE &&
+        (instance = (sch_instance *) xml->doc->_private) && instance->lazy)
+        lazy_require_ns (instance, NULL, NULL, NULL);
 }
 
-char *
-sch_version (sch_node * node)
+/* Finish an instance once its merged document is in place */
+static void
+sch_instance_init (sch_instance *instance)
 {
-    char *version = NULL;
-    while (node)
-    {
-        version = (char *) xmlGetProp (node, (xmlChar *) "version");
-        if (version)
-        {
-            break;
-        }
-        node = ((xmlNode *) node)->parent;
-    }
-    return version;
+    /* Store a link back to the instance in the xmlDoc stucture */
+    instance->doc->_private = (void *) instance;
+    if (instance->flags & SCH_LOAD_F_COMPACT)
+        compact_nodes (instance->doc, xmlDocGetRootElement (instance->doc));
+
+    /* Decode the attributes of every node once */
+    instance->strings = g_string_chunk_new (4096);
+    build_node_info (instance, xmlDocGetRootElement (instance->doc));
+
+    g_mutex_init (&instance->cache_lock);
+    instance->queries = g_hash_table_new_full (query_key_hash, query_key_equal,
+                                               query_key_free, query_template_unref);
+    instance->paths = g_hash_table_new_full (path_key_hash, path_key_equal, NULL, path_entry_free);
+    g_queue_init (&instance->path_lru);
 }
 
-char *
-sch_namespace (sch_node * node)
+static sch_instance *
+_sch_load (const char *path, const char *model_list_filename, int flags)
 {
-    xmlNode *xml = ((xmlNode *) node);
-    if (xml->ns && xml->ns->href)
+    sch_instance *instance;
+    uint8_t key[SCH_CACHE_KEY_SIZE];
+    char *cache;
+
+    /* New instance */
+    instance = g_malloc0 (sizeof (sch_instance));
+    instance->path = g_strdup (path);
+    instance->model_list_filename = g_strdup (model_list_filename);
+    instance->flags = flags;
+
+    /* Use the compiled cache if the models have not changed since it was written.
+     * The key is also how sch_reload spots changes */
+    cache = (flags & (SCH_LOAD_F_NO_CACHE | SCH_LOAD_F_LAZY)) ? NULL :
+        sch_cache_filename (path, model_list_filename);
+    if (!sch_cache_key (path, model_list_filename, key))
     {
-        return g_strdup ((char *) xml->ns->href);
+        g_free (cache);
+        cache = NULL;
     }
-    return NULL;
+    else
+    {
+        memcpy (instance->key, key, SCH_CACHE_KEY_SIZE);
+    }
+    if (flags & SCH_LOAD_F_LAZY)
+    {
+        sch_lazy_index (instance, path, model_list_filename);
+    }
+    else if (!cache || !sch_cache_read (instance, cache, key))
+    {
+        sch_parse_files (instance, path, model_list_filename, flags, NULL, NULL);
+        if (cache)
+            sch_cache_write (instance, cache, key);
+    }
+    g_free (cache);
+    sch_instance_init (instance);
+    return instance;
 }
 
-char *
-sch_prefix (sch_node * node)
+sch_instance *
+sch_load (const char *path)
 {
-    xmlNode *xml = ((xmlNode *) node);
-    if (xml->ns && xml->ns->prefix)
-    {
-        return g_strdup ((char *) xml->ns->prefix);
-    }
-    return NULL;
+    return _sch_load (path, NULL, 0);
 }
 
-char *
-sch_default_value (sch_node * node)
+/**
+ * Only load XML models that are specified in the model list file. If the model list
+ * filename is NULL, all models are loaded.
+ */
+sch_instance *
+sch_load_with_model_list_filename (const char *path, const char *model_list_filename)
 {
-    return (char *) xmlGetProp (node, (xmlChar *) "default");
+    return _sch_load (path, model_list_filename, 0);
 }
 
-char *
-sch_path (sch_node * node)
+/**
+ * As sch_load_with_model_list_filename with sch_load_flags to control how the
+ * models are loaded. Model files are still merged in a deterministic order
+ * when parsed in parallel.
+ */
+sch_instance *
+sch_load_with_flags (const char *path, const char *model_list_filename, int flags)
 {
-    char *path = NULL;
+    return _sch_load (path, model_list_filename, flags);
+}
 
-    while (node)
+/**
+ * Load a snapshot written by sch_snapshot_write, such as one linked into the
+ * program by xml2c -s. The schema is decoded from the embedded data into a
+ * new document, so no model files are read or parsed but the instance still
+ * owns its own copy of the tree. It matches the models the snapshot was taken
+ * from and is never reloaded. The data must be 4 byte aligned and is only read
+ * during the call. Returns NULL if the data is not a valid snapshot.
+ */
+sch_instance *
+sch_load_snapshot (const void *data, size_t size)
+{
+    sch_instance *instance = g_malloc0 (sizeof (sch_instance));
+
+    if (!sch_cache_decode (instance, data, size, NULL))
     {
-        char *tmp = NULL;
-        char *name = (char *) xmlGetProp (node, (xmlChar *) "name");
-        if (name == NULL)
-        {
-            break;
-        }
-        tmp = g_strdup_printf ("/%s%s", name, path ? : "");
-        free (path);
-        path = tmp;
-        free (name);
-        node = ((xmlNode *) node)->parent;
+        syslog (LOG_ERR, "XML: invalid schema snapshot");
+        g_free (instance);
+        return NULL;
     }
-    return path;
+    sch_instance_init (instance);
+    return instance;
 }
 
+/**
+ * Write the merged schema of an instance to filename in the compiled cache
+ * format for sch_load_snapshot. Lazy instances load every model first.
+ */
 bool
-sch_is_leaf (sch_node * node)
+sch_snapshot_write (sch_instance * instance, const char *filename)
 {
-    xmlNode *xml = (xmlNode *) node;
-    xmlNode *n;
+    sch_instance *current = sch_current (instance);
 
-    if (!xml->children && xmlHasProp (xml, (const xmlChar *)"mode"))
-    {
-        /* Defintely a leaf */
+    if (current->lazy)
+        lazy_require_ns (current, NULL, NULL, NULL);
+    return sch_cache_write (current, filename, instance->key);
+}
+
+/**
+ * Load the search path again if any file has been added, removed or changed.
+ * Unchanged files are not parsed again after the first reload. That keeps the
+ * parsed tree of every model file, roughly as much memory again as the merged
+ * schema (counted by sch_memory_usage), so compact instances parse every file
+ * on each reload instead and lazy ones only index them. The new schema, with
+ * its own tables and caches, is built on the side and published with a single
+ * pointer store. The replaced one is kept until sch_reclaim or sch_free so
+ * readers holding its nodes keep working. Only one thread may reload an
+ * instance at a time.
+ */
+bool
+sch_reload (sch_instance * instance)
+{
+    sch_instance *fresh;
+    sch_instance *old;
+    uint8_t key[SCH_CACHE_KEY_SIZE];
+    GHashTable *kept;
+    char *cache;
+
+    if (!instance)
+        return false;
+    if (!instance->path)
         return true;
-    }
-    for (n = xml->children; n; n = n->next)
+    if (!sch_cache_key (instance->path, instance->model_list_filename, key))
+        return false;
+    if (memcmp (key, instance->key, SCH_CACHE_KEY_SIZE) == 0)
+        return true;
+
+    /* Build the new schema from the changed files and the ones kept last time.
+     * Lazy instances just index the files again and compact ones keep nothing */
+    fresh = g_malloc0 (sizeof (sch_instance));
+    fresh->flags = instance->flags;
+    if (instance->flags & SCH_LOAD_F_LAZY)
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
-        {
-            /* Defintely not a leaf */
-            return false;
-        }
+        kept = NULL;
+        sch_lazy_index (fresh, instance->path, instance->model_list_filename);
     }
-    if (!xml->children && !xmlHasProp (xml, (const xmlChar *)"mode"))
+    else if (instance->flags & SCH_LOAD_F_COMPACT)
     {
-        /* Probably an empty container - so not a leaf */
-        return false;
+        kept = NULL;
+        sch_parse_files (fresh, instance->path, instance->model_list_filename, instance->flags,
+                         NULL, NULL);
     }
+    else
+    {
+        /* Files are only stat'ed when there is a table, so the first reload
+         * starts with an empty one to record what the next can reuse */
+        if (!instance->parsed)
+            instance->parsed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                      sch_parsed_file_free);
+        kept = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, sch_parsed_file_free);
+        sch_parse_files (fresh, instance->path, instance->model_list_filename, instance->flags,
+                         instance->parsed, kept);
+    }
+    fresh->doc->_private = (void *) fresh;
+    if (instance->flags & SCH_LOAD_F_COMPACT)
+    {
+        /* Refresh the compiled cache before anything is dropped */
+        cache = (instance->flags & (SCH_LOAD_F_NO_CACHE | SCH_LOAD_F_LAZY)) ? NULL :
+            sch_cache_filename (instance->path, instance->model_list_filename);
+        if (cache)
+            sch_cache_write (fresh, cache, key);
+        g_free (cache);
+    }
+    sch_instance_init (fresh);
+
+    /* Swap it in and retire the old one. Readers that loaded the old schema
+     * finish with it, lazy merges included, as it has its own document and tables */
+    old = instance->current;
+    g_atomic_pointer_set (&instance->current, fresh);
+    if (old)
+        instance->retired = g_list_prepend (instance->retired, old);
+
+    /* Files that were removed or changed go with the previous table */
+    if (instance->parsed)
+        g_hash_table_destroy (instance->parsed);
+    instance->parsed = kept;
+    memcpy (instance->key, key, SCH_CACHE_KEY_SIZE);
+
+    /* Refresh the compiled cache for the next sch_load */
+    cache = (instance->flags & (SCH_LOAD_F_NO_CACHE | SCH_LOAD_F_LAZY | SCH_LOAD_F_COMPACT)) ? NULL :
+        sch_cache_filename (instance->path, instance->model_list_filename);
+    if (cache)
+        sch_cache_write (fresh, cache, key);
+    g_free (cache);
     return true;
 }
 
-/* Elements can have different names (e.g. NODE, WATCH, REFRESH),
- * but only count the ones whose name is NODE
- */
-static int
-get_child_count (xmlNode *parent)
+static void
+sch_free_loaded_models (GList *loaded_models)
 {
-    xmlNode *iter;
-    int count = 0;
+    GList *list;
+    sch_loaded_model *loaded;
 
-    for (iter = parent->children; iter; iter = iter->next)
+    if (loaded_models)
     {
-        if (iter->name[0] == 'N')
+        for (list = g_list_first (loaded_models); list; list = g_list_next (list))
         {
-            count++;
+            loaded = list->data;
+            if (loaded->ns_href)
+            {
+                g_free (loaded->ns_href);
+            }
+            if (loaded->model)
+            {
+                g_free (loaded->model);
+            }
+            if (loaded->organization)
+            {
+                g_free (loaded->organization);
+            }
+            if (loaded->ns_prefix)
+            {
+                g_free (loaded->ns_prefix);
+            }
+            if (loaded->version)
+            {
+                g_free (loaded->version);
+            }
+            if (loaded->features)
+            {
+                g_free (loaded->features);
+            }
+            if (loaded->deviations)
+            {
+                g_free (loaded->deviations);
+            }
+            g_free (loaded);
         }
+        g_list_free (loaded_models);
+        loaded_models = NULL;
     }
-    return count;
 }
 
-bool
-sch_is_list (sch_node * node)
+/* Free the schema an instance holds itself, leaving what sch_reload uses */
+static void
+sch_schema_free (sch_instance * instance)
 {
-    xmlNode *xml = (xmlNode *) node;
-    xmlNode *child = xml->children;
-
-    if (child && get_child_count (xml) == 1 && child->type == XML_ELEMENT_NODE && child->name[0] == 'N')
+    if (instance->models_list)
+        sch_free_loaded_models (instance->models_list);
+    if (instance->doc)
     {
-        char *name = (char *) xmlGetProp (child, (xmlChar *) "name");
-        if (name && g_strcmp0 (name, "*") == 0)
-        {
-            xmlFree (name);
-            return true;
-        }
-        if (name)
-            xmlFree (name);
+        free_node_info (xmlDocGetRootElement (instance->doc));
+        xmlFreeDoc (instance->doc);
     }
-    return false;
+    if (instance->map_hash_table)
+        g_hash_table_destroy (instance->map_hash_table);
+    if (instance->model_hash_table)
+        g_hash_table_destroy (instance->model_hash_table);
+    if (instance->strings)
+        g_string_chunk_free (instance->strings);
+    if (instance->ns_ids)
+    {
+        g_hash_table_destroy (instance->ns_ids);
+        g_ptr_array_free (instance->ns_info, TRUE);
+    }
+    sch_lazy_free (instance->lazy);
+    if (instance->queries)
+    {
+        g_hash_table_destroy (instance->queries);
+        g_hash_table_destroy (instance->paths);
+        name_index_unref (instance->names);
+        g_mutex_clear (&instance->cache_lock);
+    }
+    instance->models_list = NULL;
+    instance->doc = NULL;
+    instance->map_hash_table = NULL;
+    instance->model_hash_table = NULL;
+    instance->strings = NULL;
+    instance->ns_ids = NULL;
+    instance->ns_info = NULL;
+    instance->lazy = NULL;
+    instance->queries = NULL;
+    instance->paths = NULL;
+    instance->names = NULL;
 }
 
-bool
-sch_is_leaf_list (sch_node * node)
+/* Free the schemas replaced by sch_reload, including the one the instance was
+ * loaded with. Readers are not tracked, so call once nothing uses their nodes
+ * or strings (Lua api tables cache nodes) */
+void
+sch_reclaim (sch_instance * instance)
 {
-    xmlNode *xml = (xmlNode *) node;
-    xmlNode *child = xml->children;
-
-    if (!sch_is_list (node) || get_child_count (child) > 0)
+    if (instance)
     {
-        return false;
+        g_list_free_full (instance->retired, (GDestroyNotify) sch_free);
+        instance->retired = NULL;
+        if (instance->current)
+            sch_schema_free (instance);
     }
-
-    return true;
 }
 
-char *
-sch_list_key (sch_node * node)
+void
+sch_free (sch_instance * instance)
 {
-    char *key = NULL;
+    if (instance)
+    {
+        sch_reclaim (instance);
+        sch_schema_free (instance);
+        sch_free (instance->current);
+        if (instance->parsed)
+            g_hash_table_destroy (instance->parsed);
+        g_free (instance->path);
+        g_free (instance->model_list_filename);
 
-    if (sch_is_list (node) && sch_node_child_first (sch_node_child_first (node)))
-        key = sch_name (sch_node_child_first (sch_node_child_first (node)));
-    return key;
+        g_free (instance);
+    }
 }
 
-bool
-sch_is_readable (sch_node * node)
+GList *
+sch_get_loaded_models (sch_instance * instance)
 {
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (!mode || strchr (mode, 'r') != NULL || strchr (mode, 'p') != NULL)
-    {
-        access = true;
-    }
-    free (mode);
-    return access;
+    instance = sch_current (instance);
+    return instance->models_list;
 }
 
-bool
-sch_is_writable (sch_node * node)
+gboolean
+sch_match_name (const char *s1, const char *s2)
 {
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (mode && strchr (mode, 'w') != NULL)
+    char c1, c2;
+    do
     {
-        access = true;
+        c1 = *s1;
+        c2 = *s2;
+        if (c1 == '\0' && c2 == '\0')
+            return true;
+        if (c1 == '-')
+            c1 = '_';
+        if (c2 == '-')
+            c2 = '_';
+        s1++;
+        s2++;
     }
-    free (mode);
-    return access;
+    while (c1 == c2);
+    return false;
 }
 
-bool
-sch_is_executable (sch_node * node)
+static bool
+_sch_ns_native (sch_instance *instance, xmlNs *ns)
 {
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (mode && strchr (mode, 'x') != NULL)
+    /* No namespace means native */
+    if (!ns)
+        return true;
+    /* Root namespace is considered native */
+    if (instance && ns == xmlDocGetRootElement (instance->doc)->ns)
+        return true;
+    /* Check if namespace is in the table of non-native namespaces */
+    if (instance && instance->map_hash_table)
     {
-        access = true;
+        if (g_hash_table_lookup (instance->map_hash_table, (const char *) ns->href))
+            return false;
     }
-    free (mode);
-    return access;
+    return true;
 }
 
 bool
-sch_is_hidden (sch_node * node)
+sch_ns_native (sch_instance *instance, sch_ns *ns)
 {
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (mode && strchr (mode, 'h') != NULL)
-    {
-        access = true;
-    }
-    free (mode);
-    return access;
+    instance = sch_current (instance);
+    return _sch_ns_native (instance, (xmlNs *)ns);
 }
 
-bool
-sch_is_config (sch_node * node)
+static bool
+remove_hidden_children (xmlNode *node)
 {
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (mode && strchr (mode, 'c') != NULL)
-    {
-        access = true;
-    }
-    free (mode);
-    return access;
-}
+    xmlNode *child;
 
-bool
-sch_is_proxy (sch_node * node)
-{
-    xmlNode *xml = (xmlNode *) node;
-    bool access = false;
-    char *mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
-    if (mode && strchr (mode, 'p') != NULL)
+    if (node == NULL)
+        return false;
+
+    /* Keep all the value nodes */
+    if (node->name[0] == 'V')
+        return true;
+
+    /* Throw away any non schema nodes */
+    if (node->name[0] != 'M' && node->name[0] != 'N')
+        return false;
+
+    if (sch_is_hidden (node))
+        return false;
+
+    child = node->children;
+    while (child)
     {
-        access = true;
+        if (!remove_hidden_children (child))
+        {
+            xmlNode *dchild = child;
+            child = child->next;
+            xmlUnlinkNode (dchild);
+            xmlFreeNode (dchild);
+        }
+        else
+        {
+            child = child->next;
+        }
     }
-    free (mode);
-    return access;
+
+    return true;
 }
 
-char *
-sch_translate_to (sch_node * node, char *value)
+static void
+format_api_namespaces (sch_instance * instance, xmlNs *ns, xmlNode *node, int depth)
 {
-    xmlNode *xml = (xmlNode *) node;
-    xmlNode *n;
-    char *val;
+    xmlNode *child;
 
-    /* Get the default if needed - untranslated */
-    if (!value)
-    {
-        value = (char *) xmlGetProp (node, (xmlChar *) "default");
-    }
+    if (node == NULL)
+        return;
 
-    /* Find the VALUE node with this value */
-    for (n = xml->children; n && value; n = n->next)
+    child = node->children;
+    while (child)
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        if (depth == 0 && child->ns && child->ns->prefix && !_sch_ns_native (instance, child->ns))
         {
-            val = (char *) xmlGetProp (n, (xmlChar *) "value");
-            if (val && strcmp (value, val) == 0)
-            {
-                free (value);
-                free (val);
-                return (char *) xmlGetProp (n, (xmlChar *) "name");
-            }
-            free (val);
+            /* Replace top-level nodes of non-native models with the namespace prefixed name */
+            char *old = sch_name (child);
+            char *name = g_strdup_printf ("%s:%s",child->ns->prefix, old);
+            xmlSetProp (child, (const xmlChar *)"name", (const xmlChar *)name);
+            free (name);
+            free (old);
         }
+        format_api_namespaces (instance, ns, child, depth + 1);
+        /* Everything in the apteryx namespace */
+        child->ns = ns;
+        child = child->next;
     }
-    return value;
-}
 
-char *
-sch_translate_from (sch_node * node, char *value)
-{
-    xmlNode *xml = (xmlNode *) node;
-    xmlNode *n;
-    char *val;
-
-    /* Find the VALUE node with this name */
-    for (n = xml->children; n && value; n = n->next)
+    /* Get rid of all non default namespace definitions on the root node */
+    if (depth == 0)
     {
-        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        xmlNs *cur = node->nsDef;
+        while (cur != NULL)
         {
-            val = (char *) xmlGetProp (n, (xmlChar *) "name");
-            if (val && strcmp (value, val) == 0)
-            {
-                free (value);
-                free (val);
-                return (char *) xmlGetProp (n, (xmlChar *) "value");
-            }
-            free (val);
+            xmlNs *next = cur->next;
+            if (cur != ns)
+                xmlFreeNs (cur);
+            cur = next;
         }
+        node->nsDef = ns;
+        ns->next = NULL;
+        xmlNewNs (node, (const xmlChar *) "http://www.w3.org/2001/XMLSchema-instance", (const xmlChar *) "xsi");
     }
-    return value;
+
+    return;
 }
 
-static bool
-parse_integer (int flags, const char *value, bool *neg, uint64_t *vint)
+static gint
+xmlNodeCmp (gconstpointer a, gconstpointer b)
 {
-    char *endptr = NULL;
+    char *aname = (char *) xmlGetProp ((xmlNode *) a, (xmlChar *) "name");
+    char *bname = (char *) xmlGetProp ((xmlNode *) b, (xmlChar *) "name");
+    gint result = g_strcmp0 (aname, bname);
+    free (aname);
+    free (bname);
+    return result;
+}
 
-    *neg = false;
-    if (value[0] == '+' || value[0] == '-')
+static void
+sort_root_nodes (xmlNode *module)
+{
+    GList *nodes = NULL;
+    xmlNode *child = module->children;
+    while (child)
     {
-        *neg = (value[0] == '-');
-        value++;
+        xmlNode *next = child->next;
+        nodes = g_list_prepend (nodes, child);
+        xmlUnlinkNode (child);
+        child = next;
     }
-    *vint = strtoull (value, &endptr, 10);
-    if ((*vint == ULLONG_MAX && errno == ERANGE) || !endptr || endptr[0] != '\0')
+    nodes = g_list_sort (nodes, xmlNodeCmp);
+    xmlNode *prev = NULL;
+    for (GList *iter = nodes; iter; iter = iter->next)
     {
-        DEBUG (flags, "Failed to parse integer \"%s\"\n", value);
-        return false;
+        child = (xmlNode *) iter->data;
+        if (prev)
+            xmlAddNextSibling (prev, child);
+        else
+            xmlAddChild (module, child);
+        prev = child;
     }
-    return true;
+    g_list_free (nodes);
+}
+
+char *
+sch_dump_xml (sch_instance * instance)
+{
+    instance = sch_current (instance);
+    xmlNode *xml;
+
+    if (instance->lazy)
+        lazy_require_ns (instance, NULL, NULL, NULL);
+    xml = xmlDocGetRootElement (instance->doc);
+    xmlChar *xmlbuf = NULL;
+    int bufsize;
+
+    xmlDoc *copy = xmlCopyDoc (xml->doc, 1);
+    remove_hidden_children (xmlDocGetRootElement (copy));
+    format_api_namespaces (instance, xmlDocGetRootElement (copy)->ns, xmlDocGetRootElement (copy), 0);
+    sort_root_nodes (xmlDocGetRootElement (copy));
+    xmlDocDumpFormatMemory (copy, &xmlbuf, &bufsize, 1);
+    xmlFreeDoc (copy);
+    return (char *) xmlbuf;
 }
 
 static bool
-parse_minmax (int flags, char *minmax, bool *min_neg, uint64_t *min, bool *max_neg, uint64_t *max)
+_sch_ns_match (xmlNode *node, xmlNs *ns)
 {
-    char *divider;
-    bool rc = true;
+    sch_instance *instance = node->doc->_private;
+    sch_node_info *info = node->_private;
+    sch_ns_info *want = ns ? NS_INFO (ns) : NULL;
+    sch_ns_info *have = node->ns ? NS_INFO (node->ns) : NULL;
 
-    divider = strstr (minmax, "..");
-    if (divider)
-        divider[0] = '\0';
-    if (!parse_integer (flags, minmax, min_neg, min))
-    {
-        rc = false;
-    }
-    if (rc && divider && !parse_integer (flags, divider + 2, max_neg, max))
+    /* Actually the same namespace (object) */
+    if (node->ns == ns)
+        return true;
+
+    /* Interned ids: both native, or the id is in the node's ancestor mask */
+    if (info && (!ns || want) && (!node->ns || have))
     {
-        rc = false;
+        if ((!want || want->native) && (!have || have->native))
+            return true;
+        if (!want || !(info->ns_mask & NS_BIT (want->id)))
+            return false;
+        if (!info->ns_wide && want->id <= SCH_NS_BITS)
+            return true;
+        for (; node && node->type == XML_ELEMENT_NODE && node->name[0] == 'N'; node = node->parent)
+        {
+            if (node->ns && NS_INFO (node->ns) && NS_INFO (node->ns)->id == want->id)
+                return true;
+        }
+        return false;
     }
-    if (divider)
-        divider[0] = '.';
-    else
+
+    /* NULL == the global namespace */
+    if (!ns && node->ns == xmlDocGetRootElement (instance->doc)->ns)
+        return true;
+
+    /* Check if both namespaces are part of the global namespace */
+    if (_sch_ns_native (instance, ns) && _sch_ns_native (instance, node->ns))
+        return true;
+
+    /* Search up the tree until the root<MODULE> for an exact namespace match */
+    while (ns && node && node->type == XML_ELEMENT_NODE && node->name[0] == 'N')
     {
-        *max_neg = *min_neg;
-        *max = *min;
+        if (node->ns && node->ns->href &&
+            g_strcmp0 ((const char *) node->ns->href, (const char *) ns->href) == 0)
+            return true;
+        node = node->parent;
     }
-    return rc;
+
+    /* No match */
+    return false;
 }
 
 bool
-_sch_validate_pattern (sch_node * node, const char *value, int flags)
+sch_ns_match (sch_node *node, sch_ns *ns)
+{
+    return _sch_ns_match (node, ns);
+}
+
+sch_ns *
+sch_node_ns (sch_node * node)
 {
     xmlNode *xml = (xmlNode *) node;
-    sch_instance *instance = xml ? xml->doc->_private : NULL;
-    char message[100];
-    int rc;
+    return xml ? (sch_ns *) xml->ns : NULL;
+}
 
-    if (!value)
-        return false;
-    /* Store compiled regex on the node */
-    if (!xml->_private)
-    {
-        char *pattern = (char *) xmlGetProp (node, (xmlChar *) "pattern");
-        if (pattern)
-        {
-            char message[100];
-            regex_t *regex_obj = NULL;
-            int rc;
-            char *d_pattern = g_strdup_printf ("^%s$", pattern);
-
-            regex_obj = g_malloc0 (sizeof (regex_t));
-            rc = regcomp (regex_obj, d_pattern, REG_EXTENDED);
-            if (rc != 0)
-            {
-                regerror (rc, NULL, message, sizeof (message));
-                ERROR (flags, SCH_E_PATREGEX, "%i (\"%s\") for regex %s", rc, message, pattern);
-                xmlFree (pattern);
-                g_free (d_pattern);
-                return false;
-            }
-            if (instance)
-                instance->regexes = g_list_prepend (instance->regexes, regex_obj);
-            xml->_private = (void *)regex_obj;
-            g_free (d_pattern);
-            xmlFree (pattern);
-        }
-    }
-    if (xml->_private)
-    {
-        regex_t *regex_obj = (regex_t *)xml->_private;
-        rc = regexec (regex_obj, value, 0, NULL, 0);
-        if (rc == REG_ESPACE)
-        {
-            regerror (rc, NULL, message, sizeof (message));
-            ERROR (flags, SCH_E_PATREGEX, "%i (\"%s\") for regex", rc, message);
-            return false;
-        }
-        return (rc == 0);
-    }
-    char *range = (char *) xmlGetProp (node, (xmlChar *) "range");
-    if (range)
-    {
-        bool vint_neg, min_neg, max_neg;
-        uint64_t vint, min, max;
+const char *
+sch_ns_prefix (sch_instance *instance, sch_ns *ns)
+{
+    return ns ? (const char *) ((xmlNs *)ns)->prefix : NULL;
+}
 
-        if (!parse_integer (flags, value, &vint_neg, &vint))
-        {
-            ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, range);
-            xmlFree (range);
-            return false;
-        }
+const char *
+sch_ns_href (sch_instance *instance, sch_ns *ns)
+{
+    return ns ? (const char *) ((xmlNs *)ns)->href : NULL;
+}
 
-        char *ptr = NULL;
-        char *minmax = strtok_r (range, "|", &ptr);
-        while (minmax)
-        {
-            if (!parse_minmax (flags, minmax, &min_neg, &min, &max_neg, &max))
-            {
-                ERROR (flags, SCH_E_INTERNAL, "Can't parse minmax \"%s\"", minmax);
-                xmlFree (range);
-                return false;
-            }
+sch_node *
+sch_get_root_schema (sch_instance * instance)
+{
+    instance = sch_current (instance);
+    return (instance ? xmlDocGetRootElement (instance->doc) : NULL);
+}
 
-            DEBUG (flags, "Checking %s%" PRIu64 " for range %s%" PRIu64 "..%s%" PRIu64 "\n",
-                   vint_neg ? "-" : "", vint,
-                   min_neg ? "-" : "", min,
-                   max_neg ? "-" : "", max);
+/* First schema child without merging any lazy models into the root */
+static xmlNode *
+_sch_node_child_first (xmlNode *xml)
+{
+    xmlNode *n = XML_CHILDREN (xml);
 
-            bool ok = true;
-            if (vint_neg && !min_neg) ok = false;
-            if (vint_neg && min_neg && vint > min) ok = false;
-            if (!vint_neg && !min_neg && vint < min) ok = false;
-            if (!vint_neg && max_neg) ok = false;
-            if (vint_neg && max_neg && vint < max) ok = false;
-            if (!vint_neg && !max_neg && vint > max) ok = false;
-            if (ok)
-            {
-                xmlFree (range);
-                return true;
-            }
-            minmax = strtok_r (NULL, "|", &ptr);
-        }
-        ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, range);
-        xmlFree (range);
-        return false;
+    while (n)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+            break;
+        n = XML_NEXT (n);
     }
-    if (xml->children)
+    return n;
+}
+
+static xmlNs *
+_sch_lookup_ns (sch_instance * instance, xmlNode *schema, const char *name, int flags, bool href)
+{
+    xmlNs *ns = NULL;
+    xmlNode *xml;
+
+    if (!schema)
+        schema = xmlDocGetRootElement (instance->doc);
+    if (schema->parent && schema->parent->type == XML_DOCUMENT_NODE &&
+        schema->doc->_private && ((sch_instance *) schema->doc->_private)->lazy)
     {
-        bool enumeration = false;
-        bool rc = false;
-        xmlNode *n;
-        char *val;
+        lazy_require_ns ((sch_instance *) schema->doc->_private, href ? name : NULL,
+                         href ? NULL : name, (flags & SCH_F_NS_MODEL_NAME) ? name : NULL);
+    }
 
-        for (n = xml->children; n && value; n = n->next)
+    xml = _sch_node_child_first (schema);
+    while (xml && xml->type == XML_ELEMENT_NODE)
+    {
+        if (flags & SCH_F_NS_MODEL_NAME)
         {
-            if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+            char *model;
+
+            model = (char *) xmlGetProp (xml, (xmlChar *) "model");
+            if (model)
             {
-                enumeration = true;
-                val = (char *) xmlGetProp (n, (xmlChar *) "name");
-                if (val && strcmp (value, val) == 0)
-                {
-                    free (val);
-                    rc = true;
-                    break;
-                }
-                free (val);
-                val = (char *) xmlGetProp (n, (xmlChar *) "value");
-                if (val && strcmp (value, val) == 0)
+                if (g_strcmp0 (model, name) == 0)
                 {
-                    free (val);
-                    rc = true;
+                    free (model);
+                    ns = xml->ns;
                     break;
                 }
-                free (val);
+                free (model);
             }
         }
-        if (enumeration && !rc)
+
+        if (xml->ns &&
+            ((href && xml->ns->href && g_strcmp0 ((char *) xml->ns->href, name) == 0) ||
+             (!href && xml->ns->prefix && g_strcmp0 ((char *) xml->ns->prefix, name) == 0)))
         {
-            ERROR (flags, SCH_E_ENUMINVALID, "\"%s\" not in enumeration\n", value);
-            return false;
+            ns = xml->ns;
+            break;
         }
+        xml = XML_NEXT (xml);
     }
-    return true;
+
+    return ns;
 }
 
-bool
-sch_validate_pattern (sch_node * node, const char *value)
+sch_ns *
+sch_lookup_ns (sch_instance * instance, sch_node *schema, const char *name, int flags, bool href)
 {
-    tl_error = SCH_E_SUCCESS;
-    return _sch_validate_pattern (node, value, 0);
+    instance = sch_current (instance);
+    return (sch_ns *) _sch_lookup_ns (instance, (xmlNode *)schema, name, flags, href);
 }
 
-/* Data translation/manipulation */
+/* First child in the index whose normalised name matches (any namespace) */
+static xmlNode *
+index_lookup (GHashTable *children, const char *child)
+{
+    xmlNode *n;
+    char buf[128];
+    char *key;
+    size_t len;
+
+    len = strlen (child);
+    key = len < sizeof (buf) ? memcpy (buf, child, len + 1) : g_strdup (child);
+    normalise_name (key);
+    n = g_hash_table_lookup (children, key);
+    if (key != buf)
+        g_free (key);
+    return n;
+}
 
-static GList*
-q2n_split_params (const char *params, char separator)
+/* Find the first NODE child of an indexed parent that matches a name.
+ * Wide parents use the hash index, the rest scan the descriptors. */
+static xmlNode *
+index_child (xmlNs *ns, xmlNode *parent, const char *child)
 {
-    GList *list = NULL;
-    int depth = 0;
-    GString *result = g_string_new (NULL);
-    int i = 0;
-    for (i = 0; i < strlen (params); i++)
-    {
-        char c = params[i];
-        if (c == '(' || c == '[' || c == '{')
-            depth += 1;
-        else if (c == ')' || c == ']' || c == '}')
-            depth -= 1;
-        else if (depth == 0 && c == separator)
-        {
-            /* Save string if there's something in it, otherwise just keep using it. */
-            if (result->len > 0)
-            {
-                list = g_list_append (list, g_string_free (result, false));
-                result = g_string_new (NULL);
-            }
-            else
-            {
-                g_list_free_full (list, g_free);
-                g_string_free (result, true);
-                return NULL;
-            }
-            continue;
-        }
-        g_string_append_c (result, c);
-    }
-    if (result)
+    GHashTable *children;
+    xmlNode *n;
+    xmlNode *w;
+
+    /* Lazy instances merge models as they are first looked up at the root */
+    if (parent->parent && parent->parent->type == XML_DOCUMENT_NODE &&
+        parent->doc->_private && ((sch_instance *) parent->doc->_private)->lazy)
+        lazy_require ((sch_instance *) parent->doc->_private, child);
+
+    children = NODE_CHILDREN (NODE_INFO (parent));
+    if (!children)
     {
-        if (result->len > 0)
-        {
-            list = g_list_append (list, g_string_free (result, false));
-        }
-        else
+        for (n = XML_CHILDREN (parent); n; n = XML_NEXT (n))
         {
-            g_list_free_full (list, g_free);
-            g_string_free (result, true);
-            return NULL;
+            const char *name;
+
+            if (n->type != XML_ELEMENT_NODE || n->name[0] != 'N')
+                continue;
+            name = NODE_INFO (n)->name;
+            if (name && (name[0] == '*' || sch_match_name (name, child)) && _sch_ns_match (n, ns))
+                return n;
         }
+        return NULL;
     }
-    return list;
-}
 
-static bool
-_check_tail (const gchar *tail)
-{
-    size_t len = strlen (tail);
+    n = index_lookup (children, child);
+    while (n && !_sch_ns_match (n, ns))
+        n = NODE_ALIAS (n);
 
-    if (len < 2)
-    {
-        return false;
-    }
-    if (tail[0] != '/')
-    {
-        return false;
-    }
-    return true;
+    /* Wildcards match any name so the earliest of the two wins */
+    w = g_hash_table_lookup (children, "*");
+    while (w && !_sch_ns_match (w, ns))
+        w = NODE_ALIAS (w);
+    if (n && w)
+        return NODE_INFO (n)->ordinal < NODE_INFO (w)->ordinal ? n : w;
+    return n ? n : w;
 }
 
-static bool
-add_all_query_nodes (sch_node *schema, GNode *parent, bool config, bool state, int flags, int depth, int max)
+/* Find the child of node for one path element. key may be modified and ns is
+ * updated if the element has a namespace prefix */
+static xmlNode *
+lookup_step (sch_instance *instance, xmlNs **rns, xmlNode *node, char **rkey)
 {
-    GNode *node = parent;
+    char *key = *rkey;
+    xmlNs *ns = *rns;
+    xmlNode *n;
+    xmlNode *x;
     char *name;
+    char *lk = NULL;
+    char *colon;
 
-    if (depth >= max)
-        return true;
-
-    name = sch_name (schema);
-    if (sch_is_leaf (schema))
+    colon = strchr (key, ':');
+    if (colon)
     {
-        if ((config && sch_is_writable (schema)) ||
-            (state && !sch_is_writable (schema) && sch_is_readable (schema)))
+        colon[0] = '\0';
+        xmlNs *nns = _sch_lookup_ns (instance, node, key, 0/*flags*/, false);
+        if (!nns)
         {
-            APTERYX_NODE (parent, name);
-            DEBUG (flags, "%*s%s\n", depth * 2, " ", name);
-            name = NULL;
+            /* No namespace found assume the node is supposed to have a colon in it */
+            colon[0] = ':';
         }
-    }
-    else
-    {
-        node = APTERYX_NODE (parent, name);
-        DEBUG (flags, "%*s%s\n", depth * 2, " ", name);
-        name = NULL;
-
-        /* Star nodes do not count when counting depth */
-        if (!sch_is_list (sch_node_parent (schema)))
-            depth++;
-        for (sch_node *s = sch_node_child_first (schema); s && depth < max; s = sch_node_next_sibling (s))
+        else
         {
-            if (!add_all_query_nodes (s, node, config, state, flags, depth, max))
-                return false;
+            /* We found a namespace. Remove the prefix */
+            char *_key = key;
+            key = g_strdup (colon + 1);
+            free (_key);
+            ns = nns;
         }
     }
 
-    free (name);
-    return true;
-}
-
-/**
- * Split a node by ':' character into module and name. Only one ':' allowed, if line is split both
- * parts must be >0 characters. Return pointers point to original string, ':' is replaced by '\0'.
- */
-static void
-_split_module_name (char *node, char **name, char **module)
-{
-    char *c_pt;
-    int count_sep = 0;
-    bool on_sep = false;
-    char *first_sep = NULL;
-
-    *module = *name = node;
-    for (c_pt = node; *c_pt != '\0'; c_pt++)
+    /* NODE children come from the index, anything else by a scan */
+    n = NODE_INFO (node) ? index_child (ns, node, key) : NULL;
+    if (NODE_INFO (node))
+        stats_hit (SCH_STAT_LOOKUP, n != NULL);
+    for (x = n ? NULL : node->children; x; x = x->next)
     {
-        if (*c_pt == ':')
+        if (x->type != XML_ELEMENT_NODE || (NODE_INFO (node) && x->name[0] == 'N'))
         {
-            count_sep++;
-            if (first_sep == NULL)
-            {
-                first_sep = c_pt;
-                *first_sep = '\0';
-                on_sep = true;
-            }
-            else
-            {
-                break;
-            }
+            continue;
         }
-        else if (on_sep)
+        name = (char *) xmlGetProp (x, (xmlChar *) "name");
+        if (name && name[0] == '*')
         {
-            *name = c_pt;
-            on_sep = false;
+            lk = strchr (key, '=');
+            if (lk)
+                key[lk - key] = '\0';
+        }
+        if (name && (name[0] == '*' || sch_match_name (name, key)) && _sch_ns_match (x, ns))
+        {
+            xmlFree (name);
+            n = x;
+            break;
         }
-    }
 
-    /* Clean up. */
-    if (count_sep == 0)
-    {
-        *module = NULL;
-    }
-    else if (count_sep > 1 || on_sep || strlen (*module) == 0 || strlen (*name) == 0)
-    {
-        *module = NULL;
-        *name = node;
-        if (first_sep != NULL)
+        if (name)
         {
-            *first_sep = ':';
+            xmlFree (name);
         }
     }
+    *rkey = key;
+    *rns = ns;
+    return n;
 }
 
-static bool
-_check_model (char *module, sch_node *schema)
+static xmlNode *
+lookup_node (sch_instance *instance, xmlNs *ns, xmlNode *node, const char *path)
 {
-    bool ret = true;
-    char *model;
+    xmlNode *n;
+    char *key = NULL;
+    int len;
 
-    if (module == NULL || strlen (module) == 0)
+    if (!node)
     {
-        return ret;
+        return NULL;
     }
-    model = sch_model (schema, false);
-    if (model != NULL)
+
+    if (path[0] == '/')
     {
-        ret = (g_strcmp0 (module, model) == 0);
+        path++;
     }
-    g_free (model);
-    return ret;
+    key = strchr (path, '/');
+    if (key)
+    {
+        len = key - path;
+        key = g_strndup (path, len);
+        path += len;
+    }
+    else
+    {
+        key = g_strdup (path);
+        path = NULL;
+    }
+
+    n = lookup_step (instance, &ns, node, &key);
+    free (key);
+
+    if (n && path)
+    {
+        if (sch_is_proxy (n))
+        {
+            /* restart search from root */
+            return lookup_node (instance, ns, xmlDocGetRootElement (node->doc), path);
+        }
+        return lookup_node (instance, ns, n, path);
+    }
+    return n;
 }
 
-static GNode*
-q2n_append_path (sch_node * schema, GNode *root, const char *path, int flags, int depth, sch_node **rschema, bool expand_non_leaf, bool config, bool nonconfig)
+sch_node *
+sch_lookup (sch_instance * instance, const char *path)
 {
-    char **nodes = g_strsplit (path, "/", -1);
-    char **node = nodes;
-    sch_node *index;
-    sch_node *child;
-    GNode *existing;
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    xmlNode *node = lookup_node (instance, NULL, xmlDocGetRootElement (instance->doc), path);
+    stats_record (SCH_STAT_LOOKUP, start);
+    return node;
+}
 
-    while (*node)
-    {
-        char *name;
-        char *module;
+sch_node *
+sch_lookup_child (sch_instance * instance, sch_node * parent, sch_ns ** ns, const char *name)
+{
+    instance = sch_current (instance);
+    xmlNode *node = (xmlNode *) parent;
+    xmlNs *_ns = *ns;
+    xmlNode *n;
+    char *key;
 
-        _split_module_name (*node, &name, &module);
+    /* Proxies continue from the root */
+    if (!node || sch_is_proxy (node))
+        node = xmlDocGetRootElement (instance->doc);
+    if (!node)
+        return NULL;
+    key = g_strdup (name);
+    n = lookup_step (instance, &_ns, node, &key);
+    free (key);
+    if (n)
+        *ns = _ns;
+    return n;
+}
 
-        /* Find schema node - since it might be an index node, call it such. */
-        index = sch_node_child (schema, name);
-        if (index == NULL)
-        {
-            ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for %s\n", name);
-            g_strfreev (nodes);
-            return NULL;
-        }
-        if (!sch_is_readable (index))
+static sch_node *
+_sch_node_child (xmlNs *ns, sch_node * parent, const char *child)
+{
+    xmlNode *xml = (xmlNode *) parent;
+    xmlNode *n = xml->children;
+
+    if (NODE_INFO (xml))
+        return index_child (ns, xml, child);
+
+    while (n)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
         {
-            ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s\n", name);
-            g_strfreev (nodes);
-            return NULL;
+            char *name = (char *) xmlGetProp (n, (xmlChar *) "name");
+            if (name && (name[0] == '*' || sch_match_name (name, child)) && _sch_ns_match (n, ns))
+            {
+                xmlFree (name);
+                break;
+            }
+            xmlFree (name);
         }
+        n = n->next;
+    }
+    return n;
+}
 
-        /* Because we allow for implicit wild-card index, need to check if this node is actually
-         * for a child of a wildcard node.
-         */
-        if (sch_is_list (schema) && (child = sch_node_child (index, name)))
+sch_node *
+sch_ns_node_child (sch_ns *ns, sch_node * parent, const char *child)
+{
+    return _sch_node_child ((xmlNs *)ns, parent, child);
+}
+
+static bool
+_sch_node_find_name (xmlNs *ns, sch_node * parent, const char *path_name, GList **path_list)
+{
+    xmlNode *xml = (xmlNode *) parent;
+    xmlNode *n = NULL;
+    bool found = false;
+
+    n = xml->children;
+    while (n)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
         {
-            if (!sch_is_readable (child))
+            char *name = (char *) xmlGetProp (n, (xmlChar *) "name");
+            if (sch_match_name (name, path_name) && _sch_ns_match (n, ns))
             {
-                ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s\n", name);
-                g_strfreev (nodes);
-                return NULL;
+                xmlFree (name);
+                found = true;
+                break;
             }
-            existing = apteryx_find_child (root, "*");
-            if (!existing)
+            if (n->children)
             {
-                existing = APTERYX_NODE (root, g_strdup ("*"));
+                found = _sch_node_find_name (ns, n, path_name, path_list);
+                if (found)
+                {
+                    *path_list = g_list_prepend (*path_list, g_strdup (name));
+                    xmlFree (name);
+                    break;
+                }
             }
-            root = existing;
-            schema = child;
-        }
-        else
-        {
-            schema = index;
-        }
-
-        /* Should be pointing at a true schema node, check that module matches if specified. */
-        if (!_check_model (module, schema))
-        {
-            ERROR (flags, SCH_E_NOSCHEMANODE, "No model match for %s\n", module);
-            g_strfreev (nodes);
-            return NULL;
+            xmlFree (name);
         }
-
-        /* Create the node if it does not already exist */
-        DEBUG (flags, "%*s%s\n", depth * 2, " ", name);
-        existing = apteryx_find_child (root, name);
-        if (existing)
-            root = existing;
-        else
-            root = g_node_append_data (root, g_strdup (name));
-        node++;
-        depth++;
+        n = n->next;
     }
+    return found;
+}
 
-    /* If schema is not a leaf, expand query with all subsequent children, if allowed. */
-    if (!sch_is_leaf (schema) && expand_non_leaf)
+static void
+name_index_add (sch_name_index *index, xmlNode *parent)
+{
+    for (xmlNode *n = parent->children; n; n = n->next)
     {
-        for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
+        sch_name_entry entry = { n, 0 };
+        guint position = index->entries->len;
+
+        if (n->type != XML_ELEMENT_NODE || n->name[0] != 'N')
+            continue;
+        g_array_append_val (index->entries, entry);
+        g_hash_table_insert (index->positions, n, GUINT_TO_POINTER (position + 1));
+        if (NODE_INFO (n) && NODE_INFO (n)->index_name)
         {
-            /* Recurse tree adding all elements */
-            add_all_query_nodes (s, root, config, nonconfig, flags, depth + 1, INT_MAX);
+            GArray *list = g_hash_table_lookup (index->names, NODE_INFO (n)->index_name);
+
+            if (!list)
+            {
+                list = g_array_new (FALSE, FALSE, sizeof (guint));
+                g_hash_table_insert (index->names, (gpointer) NODE_INFO (n)->index_name, list);
+            }
+            g_array_append_val (list, position);
         }
+        name_index_add (index, n);
+        g_array_index (index->entries, sch_name_entry, position).last = index->entries->len - 1;
     }
+}
 
-    g_strfreev (nodes);
-    if (rschema)
-        *rschema = schema;
-    return root;
+/* The name index for the current schema, built if needed. Unref when done */
+static sch_name_index *
+name_index_get (sch_instance *instance)
+{
+    sch_name_index *index;
+    xmlDoc *doc;
+    guint gen;
+
+    g_mutex_lock (&instance->cache_lock);
+    index = instance->names;
+    if (index)
+        g_atomic_int_inc (&index->refs);
+    gen = instance->cache_gen;
+    doc = instance->doc;
+    g_mutex_unlock (&instance->cache_lock);
+    if (index)
+        return index;
+
+    index = g_new0 (sch_name_index, 1);
+    index->refs = 1;
+    index->doc = doc;
+    index->entries = g_array_new (FALSE, FALSE, sizeof (sch_name_entry));
+    index->positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+    index->names = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify) g_array_unref);
+    name_index_add (index, xmlDocGetRootElement (doc));
+
+    /* Only keep it if the schema has not changed since (reload or lazy merge) */
+    g_mutex_lock (&instance->cache_lock);
+    if (gen == instance->cache_gen && !instance->names)
+    {
+        g_atomic_int_inc (&index->refs);
+        instance->names = index;
+    }
+    g_mutex_unlock (&instance->cache_lock);
+    return index;
 }
 
+/* Find the first node below parent called path_name using the name index.
+ * False if the index does not cover parent */
 static bool
-_field_query_to_node (sch_node * schema, const char *fields, GNode *parent, int flags, int depth, const char *tail, bool config, bool nonconfig)
+name_index_find (sch_instance *instance, xmlNs *ns, xmlNode *parent, const char *path_name,
+                 GList **path_list, bool *found)
 {
-    GList *params = q2n_split_params (fields, ';');
-    bool rc = true;
-    gchar *left_side = NULL;
-    gchar *middle = NULL;
-    gchar *right_side = NULL;
+    sch_name_index *index = name_index_get (instance);
+    char *name = index_name (path_name);
+    GArray *list = g_hash_table_lookup (index->names, name);
+    guint first = 0;
+    guint last = index->entries->len - 1;
+    guint lo = 0;
+    guint hi = list ? list->len : 0;
+    xmlNode *match = NULL;
 
-    if (params == NULL)
+    g_free (name);
+    if (parent->doc != index->doc)
     {
+        name_index_unref (index);
         return false;
     }
-    for (GList *iter = g_list_first (params); rc && iter; iter = g_list_next (iter))
+    if (parent != xmlDocGetRootElement (index->doc))
     {
-        sch_node *nschema = schema;
-        GNode *rroot = parent;
-        fields = iter->data;
-        if (strlen (fields) == 0) {
-            rc = false;
-            goto exit;
-        }
+        guint position = GPOINTER_TO_UINT (g_hash_table_lookup (index->positions, parent));
 
-        char *left = g_strstr_len (fields, -1, "(");
-        char *right = g_strrstr_len (fields, -1, ")");
-        if (right < left)
-        {
-            rc = false;
-            goto exit;
-        }
-        if (left == NULL && right == NULL)
-        {
-            rroot = q2n_append_path (schema, rroot, fields, flags, depth, &nschema, tail == NULL, config, nonconfig);
-            if (!rroot)
-            {
-                rc = false;
-                goto exit;
-            }
-            if (rc && tail)
-            {
-                if (!_check_tail (tail))
-                {
-                    rc = false;
-                    goto exit;
-                }
-                rroot = q2n_append_path (nschema, rroot, &tail[1], flags, depth, NULL, true, config, nonconfig);
-                if (!rroot)
-                {
-                    rc = false;
-                    goto exit;
-                }
-            }
-            continue;
-        }
-        if (left == NULL || right == NULL)
+        if (!position)
         {
-            rc = false;
-            goto exit;
-        }
-        left_side = (left - fields) > 0 ? g_strndup (fields, left - fields) : NULL;
-        middle = g_strndup (left + 1, right - left - 1);
-        right_side = strlen (right + 1) > 0 ? g_strdup (right + 1) : NULL;
-        if (left_side)
-        {
-            rroot = q2n_append_path (nschema, rroot, left_side, flags, depth, &nschema, middle == NULL, config, nonconfig);
-            if (!rroot)
-            {
-                rc = false;
-                goto exit1;
-            }
-        }
-        if (rc && middle)
-        {
-            if (!_field_query_to_node (nschema, middle, rroot, flags, depth, right_side ?: tail, config, nonconfig))
-            {
-                rc = false;
-                goto exit1;
-            }
-        }
-        else if (rc && tail)
-        {
-            rroot = q2n_append_path (nschema, rroot, tail, flags, depth, NULL, true, config, nonconfig);
-            if (!rroot)
-            {
-                rc = false;
-                goto exit1;
-            }
+            name_index_unref (index);
+            return false;
         }
-        free (left_side);
-        free (middle);
-        free (right_side);
-        left_side = NULL;
-        middle = NULL;
-        right_side = NULL;
-
+        first = position;
+        last = g_array_index (index->entries, sch_name_entry, position - 1).last;
     }
-exit1:
-    g_free (left_side);
-    g_free (middle);
-    g_free (right_side);
-exit:
-    g_list_free_full (params, g_free);
-    return rc;
-}
-
-static bool
-parse_query_fields (sch_node * schema, char *fields, GNode *parent, int flags, int depth, bool config, bool nonconfig)
-{
-    return _field_query_to_node (schema, fields, parent, flags, depth, NULL, config, nonconfig);
-}
-
-static bool
-_sch_query_to_gnode (GNode *root, sch_node *schema, char *query, int *rflags, int depth)
-{
-    int flags = rflags? * rflags : 0;
-    GNode *node;
-    char *ptr = NULL;
-    char *parameter;
-    bool content_seen = false;
-    bool depth_seen = false;
-    bool with_defaults_seen = false;
-    bool config = true;
-    bool nonconfig = true;
-    char *qfields = NULL;
-    int qdepth = INT_MAX;
-
-    bool rc = false;
 
-    /* Parse all queries out of uri first */
-    query = g_strdup (query);
-    parameter = strtok_r (query, "&", &ptr);
-    while (parameter)
+    /* The first candidate at or after first, then the rest until the end of parent's range */
+    while (lo < hi)
     {
-        char *value = strchr (parameter, '=') + 1;
-        if (strncmp (parameter, "fields=", strlen ("fields=")) == 0 && strlen (value) > 0)
-        {
-            if (qfields)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"field\" queries\n");
-                goto exit;
-            }
-            qfields = g_strdup (parameter + strlen ("fields="));
-        }
-        else if (strncmp (parameter, "content=", strlen ("content=")) == 0)
-        {
-            if (content_seen)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"content\" queries\n");
-                goto exit;
-            }
-            if (g_strcmp0 (value, "config") == 0)
-                nonconfig = false;
-            else if (g_strcmp0 (value, "nonconfig") == 0)
-                config = false;
-            else if (g_strcmp0 (value, "all") != 0)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support content query type \"%s\"\n", value);
-                goto exit;
-            }
-            content_seen = true;
-        }
-        else if (strncmp (parameter, "depth=", strlen ("depth=")) == 0)
-        {
-            if (depth_seen)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"depth\" queries\n");
-                goto exit;
-            }
-            if (g_strcmp0 (value, "unbounded") != 0)
-            {
-                qdepth = g_ascii_strtoll (value, NULL, 10);
-                if (qdepth <= 0 || qdepth > 65535)
-                {
-                    ERROR (flags, SCH_E_INVALIDQUERY, "Do not support depth query of \"%s\"\n", value);
-                    goto exit;
-                }
-                if (qdepth == 1)
-                    flags |= SCH_F_DEPTH_ONE;
-            }
-            depth_seen = true;
-        }
-        else if (strncmp (parameter, "with-defaults=", strlen ("with-defaults=")) == 0)
-        {
-            if (with_defaults_seen)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"with-defaults\" queries\n");
-                goto exit;
-            }
-            if (g_strcmp0 (value, "report-all") == 0)
-                flags |= SCH_F_ADD_DEFAULTS;
-            else if (g_strcmp0 (value, "trim") == 0)
-                flags |= SCH_F_TRIM_DEFAULTS;
-            else if (g_strcmp0 (value, "explicit") != 0)
-            {
-                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support with-defaults query type \"%s\"\n", value);
-                goto exit;
-            }
-            with_defaults_seen = true;
-        }
+        guint mid = lo + (hi - lo) / 2;
+
+        if (g_array_index (list, guint, mid) < first)
+            lo = mid + 1;
         else
-        {
-            ERROR (flags, SCH_E_INVALIDQUERY, "Do not support query \"%s\"\n", parameter);
-            goto exit;
-        }
-        parameter = strtok_r (NULL, "&", &ptr);
+            hi = mid;
     }
-
-    /* May not have anything much */
-    if (!qfields && config && nonconfig && qdepth == INT_MAX)
+    for (; list && lo < list->len && g_array_index (list, guint, lo) <= last; lo++)
     {
-        rc = true;
-        goto exit;
-    }
-
-    /* Find end of the path node */
-    node = root;
-    while (node->children)
-        node = node->children;
+        xmlNode *n = g_array_index (index->entries, sch_name_entry, g_array_index (list, guint, lo)).node;
 
-    /* Support fields || (depth AND/OR content) */
-    if (qfields)
-    {
-        if (!parse_query_fields (schema, qfields, node, flags, depth + 1, config, nonconfig))
+        if (sch_match_name (NODE_INFO (n)->name, path_name) && _sch_ns_match (n, ns))
         {
-            rc = false;
-            goto exit;
+            match = n;
+            break;
         }
     }
-    else
+
+    *found = match != NULL;
+    if (match)
     {
-        if (qdepth != INT_MAX)
-            qdepth += depth;
-        for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
-        {
-            /* Recurse tree only adding config elements */
-            if (!add_all_query_nodes (s, node, config, nonconfig, flags, depth + 1, qdepth))
-            {
-                rc = false;
-                goto exit;
-            }
-        }
+        for (xmlNode *n = match->parent; n != parent; n = n->parent)
+            *path_list = g_list_prepend (*path_list, g_strdup (NODE_INFO (n)->name));
     }
-
-    rc = true;
-
-exit:
-    free (qfields);
-    free (query);
-    if (rc && rflags)
-        *rflags = flags;
-    return rc;
-}
-
-bool sch_query_to_gnode (sch_instance * instance, sch_node * schema, GNode *parent, const char * query, int flags, int *rflags)
-{
-    int _flags = flags;
-    bool rc = _sch_query_to_gnode (parent, schema ?: xmlDocGetRootElement (instance->doc), (char *) query, &_flags, 0);
-    if (rflags)
-        *rflags = _flags;
-    return rc;
+    name_index_unref (index);
+    return true;
 }
 
-static GNode *
-_sch_path_to_gnode (sch_instance * instance, sch_node ** rschema, xmlNs *ns, const char *path, int flags, int depth)
+static bool
+sch_node_find_name (sch_instance *instance, xmlNs *ns, sch_node *parent, const char *path, int flags, GList **path_list)
 {
-    sch_node *schema = rschema && *rschema ? *rschema : xmlDocGetRootElement (instance->doc);
-    xmlNs *nns = NULL;
-    const char *next = NULL;
-    GNode *node = NULL;
-    GNode *rnode = NULL;
-    GNode *child = NULL;
-    char *query = NULL;
-    char *pred = NULL;
-    char *equals = NULL;
-    char *new_path = NULL;
+    char *name;
+    char *next;
     char *colon;
-    char *name = NULL;
-    sch_node *last_good_schema = NULL;
-    bool is_proxy = false;
+    bool found = false;
 
     if (path && path[0] == '/')
     {
         path++;
+        lazy_require_root ((xmlNode *) parent);
 
         /* Parse path element */
-        query = strchr (path, '?');
         next = strchr (path, '/');
-        if (query && (!next || query < next))
-            name = g_strndup (path, query - path);
-        else if (next)
+        if (next)
             name = g_strndup (path, next - path);
         else
             name = g_strdup (path);
@@ -2608,7 +3995,7 @@ _sch_path_to_gnode (sch_instance * instance, sch_node ** rschema, xmlNs *ns, con
         if (colon)
         {
             colon[0] = '\0';
-            nns = _sch_lookup_ns (instance, schema, name, flags, false);
+            xmlNs *nns = _sch_lookup_ns (instance, parent, name, flags, false);
             if (!nns)
             {
                 /* No namespace found assume the node is supposed to have a colon in it */
@@ -2623,1070 +4010,4765 @@ _sch_path_to_gnode (sch_instance * instance, sch_node ** rschema, xmlNs *ns, con
                 ns = nns;
             }
         }
-        if (query && next && query < next)
-            next = NULL;
-        if (flags & SCH_F_XPATH)
+        if (!instance->queries || !name_index_find (instance, ns, parent, name, path_list, &found))
+            found = _sch_node_find_name (ns, parent, name, path_list);
+        g_free (name);
+    }
+    return found;
+}
+
+sch_node *
+sch_child_first (sch_instance * instance)
+{
+    instance = sch_current (instance);
+    /* Walking the root needs every model */
+    if (instance && instance->lazy)
+        lazy_require_ns (instance, NULL, NULL, NULL);
+    return instance ? _sch_node_child_first (xmlDocGetRootElement (instance->doc)) : NULL;
+}
+
+sch_node *
+sch_node_parent (sch_node *node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    if (!node)
+        return NULL;
+    if (xml->type == XML_ELEMENT_NODE && xml->name[0] == 'N')
+        return (sch_node *) xml->parent;
+    return NULL;
+}
+
+sch_node *
+sch_node_child (sch_node * parent, const char *child)
+{
+    xmlNs *ns = parent ? ((xmlNode *) parent)->ns : NULL;
+    return _sch_node_child (ns, parent, child);
+}
+
+sch_node *
+sch_node_namespace_child (sch_node * parent, const char *namespace, const char *child)
+{
+    /* Matching only looks at the href so a temporary is sufficient */
+    xmlNs ns = { .type = XML_NAMESPACE_DECL, .href = (const xmlChar *) namespace };
+
+    return _sch_node_child (&ns, parent, child);
+}
+
+sch_node *
+sch_node_by_namespace (sch_instance * instance, const char *namespace, const char *prefix)
+{
+    instance = sch_current (instance);
+    xmlNode *xml;
+
+    if (instance->lazy)
+        lazy_require_ns (instance, namespace, namespace ? NULL : prefix, NULL);
+    xml = _sch_node_child_first (xmlDocGetRootElement (instance->doc));
+
+    while (xml && xml->type == XML_ELEMENT_NODE)
+    {
+        if (xml->ns &&
+            ((namespace && xml->ns->href && g_strcmp0 ((char *) xml->ns->href, namespace) == 0) ||
+             (!namespace && prefix &&
+              xml->ns->prefix && g_strcmp0 ((char *) xml->ns->prefix, prefix) == 0)))
+            return xml;
+
+        xml = XML_NEXT (xml);
+    }
+    return NULL;
+}
+
+sch_node *
+sch_node_child_first (sch_node *parent)
+{
+    lazy_require_root ((xmlNode *) parent);
+    return _sch_node_child_first ((xmlNode *) parent);
+}
+
+sch_node *
+sch_node_next_sibling (sch_node *node)
+{
+    xmlNode *n = XML_NEXT (node);
+
+    while (n)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+            break;
+        n = XML_NEXT (n);
+    }
+    return n;
+}
+
+/*
+ * Returns the next node in a preorder traversal of the schema tree, or NULL if this would be the last in the traversal.
+ * Only traverses nodes from root downwards. If root is null, will traverse all of tree
+ */
+sch_node *
+sch_preorder_next(sch_node *current, sch_node *root) {
+    /* Handle null */
+    if (!current) {
+        return NULL;
+    }
+
+    /* Check if this node has children */
+    sch_node *next = sch_node_child_first(current);
+    if (next) {
+        return next;
+    }
+
+    /* Check if this node has siblings */
+    next = sch_node_next_sibling(current);
+    if (next) {
+        return next;
+    }
+
+    /* Go up the tree, looking for siblings of ancestors */
+    next = ((xmlNode *) current)->parent;
+    while(next) {
+        if (root && next == root) {
+            break;
+        }
+        if (sch_node_next_sibling(next)) {
+            next = sch_node_next_sibling(next);
+            break;
+        }
+        next = ((xmlNode *) next)->parent;
+    }
+
+    /* At this stage either we have a next node or we have finished the tree */
+    return next == root ? NULL : next;
+}
+
+/* Borrow an attribute value from the document when it is a single text node.
+ * An empty attribute has no children and is "" as xmlGetProp would return */
+static const char *
+attr_ref (xmlNode *node, const char *name)
+{
+    xmlAttr *attr = xmlHasProp (node, (const xmlChar *) name);
+
+    if (!attr || attr->type != XML_ATTRIBUTE_NODE)
+        return NULL;
+    if (!attr->children)
+        return "";
+    if (attr->children->type == XML_TEXT_NODE && !attr->children->next)
+        return (const char *) attr->children->content;
+    return NULL;
+}
+
+char *
+sch_name (sch_node * node)
+{
+    xmlNode *n = (xmlNode *) node;
+    sch_instance *instance = n ? n->doc->_private : NULL;
+    char *name;
+
+    if (NODE_INFO (n))
+        return g_strdup (NODE_INFO (n)->qname);
+    name = (char *) xmlGetProp (n, (xmlChar *) "name");
+    if (!_sch_ns_native (instance, n->ns) && !sch_node_parent (sch_node_parent (node)))
+    {
+        char *_name = g_strdup_printf ("%s:%s", n->ns->prefix, name);
+        free (name);
+        name = _name;
+    }
+    return name;
+}
+
+const char *
+sch_name_ref (sch_node * node)
+{
+    xmlNode *n = (xmlNode *) node;
+    sch_instance *instance = n ? n->doc->_private : NULL;
+    const char *name;
+    char *qname;
+
+    if (NODE_INFO (n))
+        return NODE_INFO (n)->qname;
+    name = attr_ref (n, "name");
+    if (!name || !instance || !instance->strings || _sch_ns_native (instance, n->ns) ||
+        sch_node_parent (sch_node_parent (node)))
+        return name;
+
+    /* Prefixed as sch_name does. Lazy merges add descriptor strings under the lazy lock */
+    qname = g_strdup_printf ("%s:%s", n->ns->prefix, name);
+    if (instance->lazy)
+        g_rec_mutex_lock (&instance->lazy->lock);
+    else
+        g_mutex_lock (&instance->cache_lock);
+    name = g_string_chunk_insert_const (instance->strings, qname);
+    if (instance->lazy)
+        g_rec_mutex_unlock (&instance->lazy->lock);
+    else
+        g_mutex_unlock (&instance->cache_lock);
+    g_free (qname);
+    return name;
+}
+
+/* Ignoring ancestors allows checking that this is a node with the model data directly attached. */
+char *
+sch_model (sch_node * node, bool ignore_ancestors)
+{
+    char *model = NULL;
+    while (node)
+    {
+        model = (char *) xmlGetProp (node, (xmlChar *) "model");
+        if (model || ignore_ancestors)
+        {
+            break;
+        }
+        node = ((xmlNode *) node)->parent;
+    }
+    return model;
+}
+
+const char *
+sch_model_ref (sch_node * node, bool ignore_ancestors)
+{
+    const char *model = NULL;
+    while (node)
+    {
+        model = attr_ref (node, "model");
+        if (model || ignore_ancestors)
+        {
+            break;
+        }
+        node = ((xmlNode *) node)->parent;
+    }
+    return model;
+}
+
+char *
+sch_organization (sch_node * node)
+{
+    char *organization = NULL;
+    while (node)
+    {
+        organization = (char *) xmlGetProp (node, (xmlChar *) "organization");
+        if (organization)
+        {
+            break;
+        }
+        node = ((xmlNode *) node)->parent;
+    }
+    return organization;
+}
+
+char *
+sch_version (sch_node * node)
+{
+    char *version = NULL;
+    while (node)
+    {
+        version = (char *) xmlGetProp (node, (xmlChar *) "version");
+        if (version)
+        {
+            break;
+        }
+        node = ((xmlNode *) node)->parent;
+    }
+    return version;
+}
+
+char *
+sch_namespace (sch_node * node)
+{
+    xmlNode *xml = ((xmlNode *) node);
+    if (xml->ns && xml->ns->href)
+    {
+        return g_strdup ((char *) xml->ns->href);
+    }
+    return NULL;
+}
+
+const char *
+sch_namespace_ref (sch_node * node)
+{
+    xmlNode *xml = ((xmlNode *) node);
+    return xml->ns ? (const char *) xml->ns->href : NULL;
+}
+
+char *
+sch_prefix (sch_node * node)
+{
+    xmlNode *xml = ((xmlNode *) node);
+    if (xml->ns && xml->ns->prefix)
+    {
+        return g_strdup ((char *) xml->ns->prefix);
+    }
+    return NULL;
+}
+
+const char *
+sch_prefix_ref (sch_node * node)
+{
+    xmlNode *xml = ((xmlNode *) node);
+    return xml->ns ? (const char *) xml->ns->prefix : NULL;
+}
+
+char *
+sch_default_value (sch_node * node)
+{
+    if (NODE_INFO (node))
+        return g_strdup (NODE_INFO (node)->default_value);
+    return (char *) xmlGetProp (node, (xmlChar *) "default");
+}
+
+const char *
+sch_default_value_ref (sch_node * node)
+{
+    if (NODE_INFO (node))
+        return NODE_INFO (node)->default_value;
+    return attr_ref (node, "default");
+}
+
+char *
+sch_path (sch_node * node)
+{
+    char *path = NULL;
+
+    while (node)
+    {
+        char *tmp = NULL;
+        char *name = (char *) xmlGetProp (node, (xmlChar *) "name");
+        if (name == NULL)
+        {
+            break;
+        }
+        tmp = g_strdup_printf ("/%s%s", name, path ? : "");
+        free (path);
+        path = tmp;
+        free (name);
+        node = ((xmlNode *) node)->parent;
+    }
+    return path;
+}
+
+bool
+sch_is_leaf (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    xmlNode *n;
+
+    if (NODE_INFO (xml))
+        return (NODE_INFO (xml)->kind & SCH_K_LEAF) != 0;
+    if (!xml->children && xmlHasProp (xml, (const xmlChar *)"mode"))
+    {
+        /* Defintely a leaf */
+        return true;
+    }
+    for (n = xml->children; n; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'N')
+        {
+            /* Defintely not a leaf */
+            return false;
+        }
+    }
+    if (!xml->children && !xmlHasProp (xml, (const xmlChar *)"mode"))
+    {
+        /* Probably an empty container - so not a leaf */
+        return false;
+    }
+    return true;
+}
+
+/* Elements can have different names (e.g. NODE, WATCH, REFRESH),
+ * but only count the ones whose name is NODE
+ */
+static int
+get_child_count (xmlNode *parent)
+{
+    xmlNode *iter;
+    int count = 0;
+
+    for (iter = parent->children; iter; iter = iter->next)
+    {
+        if (iter->name[0] == 'N')
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool
+sch_is_list (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    xmlNode *child = xml->children;
+
+    if (NODE_INFO (xml))
+        return (NODE_INFO (xml)->kind & SCH_K_LIST) != 0;
+    if (child && get_child_count (xml) == 1 && child->type == XML_ELEMENT_NODE && child->name[0] == 'N')
+    {
+        char *name = (char *) xmlGetProp (child, (xmlChar *) "name");
+        if (name && g_strcmp0 (name, "*") == 0)
+        {
+            xmlFree (name);
+            return true;
+        }
+        if (name)
+            xmlFree (name);
+    }
+    return false;
+}
+
+bool
+sch_is_leaf_list (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    xmlNode *child = xml->children;
+
+    if (NODE_INFO (xml))
+        return (NODE_INFO (xml)->kind & SCH_K_LEAF_LIST) != 0;
+    if (!sch_is_list (node) || get_child_count (child) > 0)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+char *
+sch_list_key (sch_node * node)
+{
+    char *key = NULL;
+
+    if (NODE_INFO (node))
+        return NODE_INFO (node)->key ? sch_name (NODE_INFO (node)->key) : NULL;
+    if (sch_is_list (node) && sch_node_child_first (sch_node_child_first (node)))
+        key = sch_name (sch_node_child_first (sch_node_child_first (node)));
+    return key;
+}
+
+bool
+sch_is_readable (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return !(info->mode & SCH_M_PRESENT) || (info->mode & (SCH_M_READ | SCH_M_PROXY));
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (!mode || strchr (mode, 'r') != NULL || strchr (mode, 'p') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+bool
+sch_is_writable (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return (info->mode & SCH_M_WRITE) != 0;
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (mode && strchr (mode, 'w') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+bool
+sch_is_executable (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return (info->mode & SCH_M_EXEC) != 0;
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (mode && strchr (mode, 'x') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+bool
+sch_is_hidden (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return (info->mode & SCH_M_HIDDEN) != 0;
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (mode && strchr (mode, 'h') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+bool
+sch_is_config (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return (info->mode & SCH_M_CONFIG) != 0;
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (mode && strchr (mode, 'c') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+bool
+sch_is_proxy (sch_node * node)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    bool access = false;
+    char *mode;
+
+    if (info)
+        return (info->mode & SCH_M_PROXY) != 0;
+    mode = (char *) xmlGetProp (xml, (xmlChar *) "mode");
+    if (mode && strchr (mode, 'p') != NULL)
+    {
+        access = true;
+    }
+    free (mode);
+    return access;
+}
+
+char *
+sch_translate_to (sch_node * node, char *value)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    xmlNode *n;
+    char *val;
+
+    if (info)
+    {
+        const sch_enum *e;
+
+        if (!value)
+            value = g_strdup (info->default_value);
+        e = value ? enum_by_value (info, value) : NULL;
+        if (e)
+        {
+            free (value);
+            return g_strdup (e->name);
+        }
+        return value;
+    }
+
+    /* Get the default if needed - untranslated */
+    if (!value)
+    {
+        value = (char *) xmlGetProp (node, (xmlChar *) "default");
+    }
+
+    /* Find the VALUE node with this value */
+    for (n = xml->children; n && value; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        {
+            val = (char *) xmlGetProp (n, (xmlChar *) "value");
+            if (val && strcmp (value, val) == 0)
+            {
+                free (value);
+                free (val);
+                return (char *) xmlGetProp (n, (xmlChar *) "name");
+            }
+            free (val);
+        }
+    }
+    return value;
+}
+
+char *
+sch_translate_from (sch_node * node, char *value)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = NODE_INFO (xml);
+    xmlNode *n;
+    char *val;
+
+    if (info)
+    {
+        const sch_enum *e = value ? enum_by_name (info, value) : NULL;
+        if (e)
+        {
+            free (value);
+            return g_strdup (e->value);
+        }
+        return value;
+    }
+
+    /* Find the VALUE node with this name */
+    for (n = xml->children; n && value; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        {
+            val = (char *) xmlGetProp (n, (xmlChar *) "name");
+            if (val && strcmp (value, val) == 0)
+            {
+                free (value);
+                free (val);
+                return (char *) xmlGetProp (n, (xmlChar *) "value");
+            }
+            free (val);
+        }
+    }
+    return value;
+}
+
+/* Returns the schema's name for value, the leaf default for NULL or value itself */
+const char *
+sch_translate_to_ref (sch_node * node, const char *value)
+{
+    xmlNode *xml = (xmlNode *) node;
+    xmlNode *n;
+
+    /* Get the default if needed - untranslated */
+    if (!value)
+    {
+        value = sch_default_value_ref (node);
+    }
+
+    if (NODE_INFO (xml))
+    {
+        const sch_enum *e = value ? enum_by_value (NODE_INFO (xml), value) : NULL;
+        return e ? e->name : value;
+    }
+
+    /* Find the VALUE node with this value */
+    for (n = xml->children; n && value; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        {
+            const char *val = attr_ref (n, "value");
+            if (val && strcmp (value, val) == 0)
+            {
+                return attr_ref (n, "name");
+            }
+        }
+    }
+    return value;
+}
+
+/* Returns the stored value for a schema name or value itself */
+const char *
+sch_translate_from_ref (sch_node * node, const char *value)
+{
+    xmlNode *xml = (xmlNode *) node;
+    xmlNode *n;
+
+    if (NODE_INFO (xml))
+    {
+        const sch_enum *e = value ? enum_by_name (NODE_INFO (xml), value) : NULL;
+        return e ? e->value : value;
+    }
+
+    /* Find the VALUE node with this name */
+    for (n = xml->children; n && value; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+        {
+            const char *val = attr_ref (n, "name");
+            if (val && strcmp (value, val) == 0)
+            {
+                return attr_ref (n, "value");
+            }
+        }
+    }
+    return value;
+}
+
+static bool
+parse_integer (int flags, const char *value, bool *neg, uint64_t *vint)
+{
+    char *endptr = NULL;
+
+    *neg = false;
+    if (value[0] == '+' || value[0] == '-')
+    {
+        *neg = (value[0] == '-');
+        value++;
+    }
+    *vint = strtoull (value, &endptr, 10);
+    if ((*vint == ULLONG_MAX && errno == ERANGE) || !endptr || endptr[0] != '\0')
+    {
+        DEBUG (flags, "Failed to parse integer \"%s\"\n", value);
+        return false;
+    }
+    return true;
+}
+
+static bool
+parse_minmax (int flags, char *minmax, bool *min_neg, uint64_t *min, bool *max_neg, uint64_t *max)
+{
+    char *divider;
+    bool rc = true;
+
+    divider = strstr (minmax, "..");
+    if (divider)
+        divider[0] = '\0';
+    if (!parse_integer (flags, minmax, min_neg, min))
+    {
+        rc = false;
+    }
+    if (rc && divider && !parse_integer (flags, divider + 2, max_neg, max))
+    {
+        rc = false;
+    }
+    if (divider)
+        divider[0] = '.';
+    else
+    {
+        *max_neg = *min_neg;
+        *max = *min;
+    }
+    return rc;
+}
+
+/* Integer in the sign and magnitude form returned by parse_integer.
+ * Ordered so that -0 sorts before +0 as the interval checks always have. */
+typedef struct _sch_int
+{
+    bool neg;
+    uint64_t mag;
+} sch_int;
+
+typedef struct _sch_range
+{
+    sch_int min;
+    sch_int max;
+} sch_range;
+
+static int
+sch_int_cmp (const sch_int *a, const sch_int *b)
+{
+    if (a->neg != b->neg)
+        return a->neg ? -1 : 1;
+    if (a->mag == b->mag)
+        return 0;
+    return ((a->mag < b->mag) != a->neg) ? -1 : 1;
+}
+
+static gint
+sch_range_cmp (gconstpointer a, gconstpointer b)
+{
+    return sch_int_cmp (&((const sch_range *) a)->min, &((const sch_range *) b)->min);
+}
+
+/* Parse the range attribute into sorted, non-overlapping intervals.
+ * Parsing stops at the first bad interval which is reported when a
+ * value falls outside those before it (as checking in order would). */
+static void
+compile_range (sch_instance *instance, sch_node_info *info)
+{
+    char *range = g_strdup (info->range);
+    char *ptr = NULL;
+    char *minmax;
+    GArray *ranges = g_array_new (FALSE, FALSE, sizeof (sch_range));
+    sch_range *r;
+    int count = 0;
+
+    for (minmax = strtok_r (range, "|", &ptr); minmax; minmax = strtok_r (NULL, "|", &ptr))
+    {
+        sch_range interval;
+
+        if (!parse_minmax (0, minmax, &interval.min.neg, &interval.min.mag,
+                           &interval.max.neg, &interval.max.mag))
+        {
+            info->range_error = g_string_chunk_insert_const (instance->strings, minmax);
+            break;
+        }
+        /* Empty intervals can never match */
+        if (sch_int_cmp (&interval.min, &interval.max) <= 0)
+            g_array_append_val (ranges, interval);
+    }
+    g_array_sort (ranges, sch_range_cmp);
+
+    /* Merge overlapping intervals */
+    r = (sch_range *) ranges->data;
+    for (guint i = 0; i < ranges->len; i++)
+    {
+        if (count && sch_int_cmp (&r[i].min, &r[count - 1].max) <= 0)
+        {
+            if (sch_int_cmp (&r[i].max, &r[count - 1].max) > 0)
+                r[count - 1].max = r[i].max;
+        }
+        else
+        {
+            r[count++] = r[i];
+        }
+    }
+    info->range_count = count;
+    info->ranges = (sch_range *) g_array_free (ranges, count == 0);
+    g_free (range);
+}
+
+/* Memory accounting. Hash tables are counted as a bucket per entry and
+ * strings once however many nodes share them */
+#define HASH_BYTES(table) ((table) ? g_hash_table_size (table) * (2 * sizeof (gpointer) + sizeof (guint)) : 0)
+
+static void
+memory_string (sch_memory *usage, GHashTable *seen, const void *str)
+{
+    if (str && !g_hash_table_contains (seen, str))
+    {
+        g_hash_table_add (seen, (gpointer) str);
+        usage->strings += strlen (str) + 1;
+    }
+}
+
+static void
+memory_node (sch_memory *usage, GHashTable *seen, xmlNode *node, bool described)
+{
+    sch_node_info *info = described ? node->_private : NULL;
+
+    usage->nodes += sizeof (xmlNode);
+    memory_string (usage, seen, node->name);
+    for (xmlAttr *attr = node->properties; attr; attr = attr->next)
+    {
+        usage->nodes += sizeof (xmlAttr);
+        memory_string (usage, seen, attr->name);
+        for (xmlNode *text = attr->children; text; text = text->next)
+        {
+            usage->nodes += sizeof (xmlNode);
+            if (text->content != (xmlChar *) &text->properties)
+                memory_string (usage, seen, text->content);
+        }
+    }
+    for (xmlNs *ns = __atomic_load_n (&node->nsDef, __ATOMIC_ACQUIRE); ns; ns = NS_NEXT (ns))
+    {
+        usage->nodes += sizeof (xmlNs) + (ns->_private ? sizeof (sch_ns_info) : 0);
+        memory_string (usage, seen, ns->href);
+        memory_string (usage, seen, ns->prefix);
+    }
+    if (info)
+    {
+        sch_pattern *pattern = g_atomic_pointer_get (&info->pattern);
+
+        usage->nodes += sizeof (sch_node_info) + info->range_count * sizeof (sch_range) +
+            info->value_count * sizeof (sch_enum);
+        memory_string (usage, seen, info->name);
+        memory_string (usage, seen, info->qname);
+        memory_string (usage, seen, info->default_value);
+        memory_string (usage, seen, info->index_name);
+        memory_string (usage, seen, info->range);
+        for (int i = 0; i < info->value_count; i++)
+        {
+            memory_string (usage, seen, info->values[i].name);
+            memory_string (usage, seen, info->values[i].value);
+        }
+        usage->indexes += HASH_BYTES (info->children) + HASH_BYTES (info->by_name) +
+            HASH_BYTES (info->by_value);
+        if (pattern)
+        {
+            usage->regexes += sizeof (sch_pattern);
+#ifdef HAVE_PCRE2
+            if (pattern->code)
+            {
+                size_t size = 0;
+
+                pcre2_pattern_info (pattern->code, PCRE2_INFO_SIZE, &size);
+                usage->regexes += size;
+            }
+#endif
+        }
+    }
+    for (xmlNode *n = node->children; n; n = n->next)
+    {
+        if (n->type == XML_ELEMENT_NODE)
+            memory_node (usage, seen, n, described && n->name[0] == 'N');
+    }
+}
+
+static size_t
+memory_table (GHashTable *table, GHashTable *seen, sch_memory *usage)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    if (!table)
+        return 0;
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        memory_string (usage, seen, key);
+        memory_string (usage, seen, value);
+    }
+    return HASH_BYTES (table);
+}
+
+/**
+ * Approximate heap use of the merged schema, its descriptors and caches.
+ * Only the handle of a POSIX regex is counted as its compiled form is opaque.
+ * Models a lazy instance has not merged yet are not included.
+ */
+void
+sch_memory_usage (sch_instance * instance, sch_memory *usage)
+{
+    GHashTable *seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+    GHashTable *parsed = instance->parsed;
+    xmlNode *root;
+
+    instance = sch_current (instance);
+    root = xmlDocGetRootElement (instance->doc);
+
+    *usage = (sch_memory) { 0 };
+    usage->nodes += sizeof (sch_instance) + sizeof (xmlDoc);
+    if (root)
+        memory_node (usage, seen, root, true);
+    if (parsed)
+    {
+        GHashTableIter iter;
+        gpointer file;
+
+        /* Model files kept to speed up the next reload */
+        g_hash_table_iter_init (&iter, parsed);
+        while (g_hash_table_iter_next (&iter, NULL, &file))
+        {
+            xmlDoc *doc = ((sch_parsed_file *) file)->doc;
+
+            usage->nodes += sizeof (sch_parsed_file) + sizeof (xmlDoc);
+            if (doc && xmlDocGetRootElement (doc))
+                memory_node (usage, seen, xmlDocGetRootElement (doc), false);
+        }
+    }
+    usage->indexes += memory_table (instance->map_hash_table, seen, usage);
+    if (instance->ns_ids)
+        usage->indexes += HASH_BYTES (instance->ns_ids) + instance->ns_info->len * sizeof (gpointer);
+
+    if (instance->queries)
+    {
+        g_mutex_lock (&instance->cache_lock);
+        usage->indexes += HASH_BYTES (instance->queries) + HASH_BYTES (instance->paths) +
+            g_hash_table_size (instance->queries) * (sizeof (sch_query_key) + sizeof (sch_query_template)) +
+            g_hash_table_size (instance->paths) * sizeof (sch_path_entry);
+        if (instance->names)
+        {
+            GHashTableIter iter;
+            gpointer list;
+
+            usage->indexes += instance->names->entries->len * sizeof (sch_name_entry) +
+                HASH_BYTES (instance->names->positions) + HASH_BYTES (instance->names->names);
+            g_hash_table_iter_init (&iter, instance->names->names);
+            while (g_hash_table_iter_next (&iter, NULL, &list))
+                usage->indexes += ((GArray *) list)->len * sizeof (guint);
+        }
+        g_mutex_unlock (&instance->cache_lock);
+    }
+    g_hash_table_destroy (seen);
+    usage->total = usage->nodes + usage->strings + usage->regexes + usage->indexes;
+}
+
+static bool
+_sch_validate_range (sch_node_info *info, const char *value, int flags)
+{
+    int lo = 0;
+    int hi = info->range_count - 1;
+    int found = -1;
+    sch_int vint;
+
+    if (!parse_integer (flags, value, &vint.neg, &vint.mag))
+    {
+        ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, info->range);
+        return false;
+    }
+
+    /* Last interval starting at or below the value */
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (sch_int_cmp (&info->ranges[mid].min, &vint) <= 0)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    if (found >= 0 && sch_int_cmp (&vint, &info->ranges[found].max) <= 0)
+    {
+        DEBUG (flags, "Checking %s%" PRIu64 " for range %s%" PRIu64 "..%s%" PRIu64 "\n",
+               vint.neg ? "-" : "", vint.mag,
+               info->ranges[found].min.neg ? "-" : "", info->ranges[found].min.mag,
+               info->ranges[found].max.neg ? "-" : "", info->ranges[found].max.mag);
+        return true;
+    }
+    if (info->range_error)
+    {
+        ERROR (flags, SCH_E_INTERNAL, "Can't parse minmax \"%s\"", info->range_error);
+        return false;
+    }
+    ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, info->range);
+    return false;
+}
+
+/* Native validators for patterns generated by pyang-apteryx-xml.py and
+ * common YANG types. Each accepts exactly what the anchored regex does. */
+static bool
+all_digits (const char *value, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!g_ascii_isdigit (value[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool
+validate_int64 (const char *value)
+{
+    bool neg = value[0] == '-';
+    const char *digits = value + neg;
+    size_t len = strlen (digits);
+
+    if (len < 1 || len > 19 || !all_digits (digits, len))
+        return false;
+    if (len < 19)
+        return true;
+    return digits[0] != '0' &&
+        strcmp (digits, neg ? "9223372036854775808" : "9223372036854775807") <= 0;
+}
+
+static bool
+validate_uint64 (const char *value)
+{
+    size_t len = strlen (value);
+
+    if (len < 1 || len > 20 || !all_digits (value, len))
+        return false;
+    if (len < 20)
+        return true;
+    return value[0] == '1' && strcmp (value, "18446744073709551615") <= 0;
+}
+
+/* Six colon separated pairs of hex digits */
+static bool
+validate_mac (const char *value)
+{
+    for (int i = 0; i < 6; i++, value += 3)
+    {
+        if (!g_ascii_isxdigit (value[0]) || !g_ascii_isxdigit (value[1]))
+            return false;
+        if (value[2] != (i < 5 ? ':' : '\0'))
+            return false;
+    }
+    return true;
+}
+
+/* Dotted quad of 0..255 without leading zeros */
+static bool
+validate_ipv4 (const char *value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        int len = 0;
+        int octet = 0;
+
+        while (g_ascii_isdigit (value[len]) && len < 3)
+        {
+            octet = octet * 10 + value[len] - '0';
+            len++;
+        }
+        if (len == 0 || (len > 1 && value[0] == '0') || octet > 255)
+            return false;
+        value += len;
+        if (*value != (i < 3 ? '.' : '\0'))
+            return false;
+        value++;
+    }
+    return true;
+}
+
+static const struct
+{
+    const char *pattern;
+    bool (*validate) (const char *value);
+} native_patterns[] = {
+    { "(-([0-9]{1,18}|[1-8][0-9]{18}|9([01][0-9]{17}|2([01][0-9]{16}|2([0-2][0-9]{15}|3([0-2][0-9]{14}|3([0-6][0-9]{13}|7([01][0-9]{12}|20([0-2][0-9]{10}|3([0-5][0-9]{9}|6([0-7][0-9]{8}|8([0-4][0-9]{7}|5([0-3][0-9]{6}|4([0-6][0-9]{5}|7([0-6][0-9]{4}|7([0-4][0-9]{3}|5([0-7][0-9]{2}|80[0-8]))))))))))))))))|([0-9]{1,18}|[1-8][0-9]{18}|9([01][0-9]{17}|2([01][0-9]{16}|2([0-2][0-9]{15}|3([0-2][0-9]{14}|3([0-6][0-9]{13}|7([01][0-9]{12}|20([0-2][0-9]{10}|3([0-5][0-9]{9}|6([0-7][0-9]{8}|8([0-4][0-9]{7}|5([0-3][0-9]{6}|4([0-6][0-9]{5}|7([0-6][0-9]{4}|7([0-4][0-9]{3}|5([0-7][0-9]{2}|80[0-7])))))))))))))))))",
+      validate_int64 },
+    { "([0-9]{1,19}|1([0-7][0-9]{18}|8([0-3][0-9]{17}|4([0-3][0-9]{16}|4([0-5][0-9]{15}|6([0-6][0-9]{14}|7([0-3][0-9]{13}|4([0-3][0-9]{12}|40([0-6][0-9]{10}|7([0-2][0-9]{9}|3([0-6][0-9]{8}|70([0-8][0-9]{6}|9([0-4][0-9]{5}|5([0-4][0-9]{4}|5(0[0-9]{3}|1([0-5][0-9]{2}|6(0[0-9]|1[0-5])))))))))))))))))",
+      validate_uint64 },
+    { "[0-9a-fA-F]{2}(:[0-9a-fA-F]{2}){5}", validate_mac },
+    { "(([0-9]|[1-9][0-9]|1[0-9][0-9]|2[0-4][0-9]|25[0-5])\\.){3}([0-9]|[1-9][0-9]|1[0-9][0-9]|2[0-4][0-9]|25[0-5])",
+      validate_ipv4 },
+};
+
+#ifdef HAVE_PCRE2
+/* Per thread match data (one pair is enough to learn if there was a match) */
+static GPrivate pcre2_match_key = G_PRIVATE_INIT ((GDestroyNotify) pcre2_match_data_free);
+
+/* Whether a POSIX extended regex means the same to PCRE2 compiled with DOTALL
+ * and DOLLAR_ENDONLY. Escapes and syntax the two treat differently
+ * (backslashes in brackets, escaped letters, possessive or lazy quantifiers,
+ * group extensions, collating elements) make the pattern POSIX only. */
+static bool
+pattern_is_portable (const char *pattern)
+{
+    bool atom = false;
+
+    for (const char *p = pattern; *p; p++)
+    {
+        if ((unsigned char) *p >= 0x80)
+            return false;
+        switch (*p)
+        {
+        case '\\':
+            if (!p[1] || g_ascii_isalnum (p[1]) || (unsigned char) p[1] >= 0x80)
+                return false;
+            p++;
+            atom = true;
+            break;
+        case '[':
+            p++;
+            if (*p == '^')
+                p++;
+            if (*p == ']')
+                p++;
+            for (; *p && *p != ']'; p++)
+            {
+                if (*p == '\\' || (unsigned char) *p >= 0x80)
+                    return false;
+                if (*p == '[' && (p[1] == '.' || p[1] == '='))
+                    return false;
+                if (*p == '[' && p[1] == ':')
+                {
+                    const char *end = strstr (p + 2, ":]");
+                    if (!end)
+                        return false;
+                    p = end + 1;
+                }
+            }
+            if (!*p)
+                return false;
+            atom = true;
+            break;
+        case '*':
+        case '+':
+        case '?':
+            if (!atom)
+                return false;
+            atom = false;
+            break;
+        case '{':
+            if (!atom || !g_ascii_isdigit (p[1]))
+                return false;
+            for (p++; g_ascii_isdigit (*p); p++);
+            if (*p == ',')
+                for (p++; g_ascii_isdigit (*p); p++);
+            if (*p != '}')
+                return false;
+            atom = false;
+            break;
+        case '(':
+            if (p[1] == '?' || p[1] == '*')
+                return false;
+            atom = false;
+            break;
+        case '|':
+        case '^':
+        case '$':
+            atom = false;
+            break;
+        default:
+            atom = true;
+            break;
+        }
+    }
+    return true;
+}
+#endif
+
+static sch_pattern *
+compile_pattern (int flags, const char *pattern)
+{
+    char *d_pattern = g_strdup_printf ("^%s$", pattern);
+    sch_pattern *pattern_obj = g_malloc0 (sizeof (sch_pattern));
+    char message[100];
+    int rc;
+
+    rc = regcomp (&pattern_obj->regex, d_pattern, REG_EXTENDED);
+    if (rc != 0)
+    {
+        regerror (rc, NULL, message, sizeof (message));
+        ERROR (flags, SCH_E_PATREGEX, "%i (\"%s\") for regex %s", rc, message, pattern);
+        g_free (pattern_obj);
+        g_free (d_pattern);
+        return NULL;
+    }
+
+    for (int i = 0; i < G_N_ELEMENTS (native_patterns); i++)
+    {
+        if (strcmp (pattern, native_patterns[i].pattern) == 0)
+        {
+            pattern_obj->native = native_patterns[i].validate;
+            break;
+        }
+    }
+#ifdef HAVE_PCRE2
+    if (!pattern_obj->native && pattern_is_portable (pattern))
+    {
+        PCRE2_SIZE offset;
+        int error;
+
+        pattern_obj->code = pcre2_compile ((PCRE2_SPTR) d_pattern, PCRE2_ZERO_TERMINATED,
+                                           PCRE2_DOTALL | PCRE2_DOLLAR_ENDONLY |
+                                           PCRE2_NEVER_UTF | PCRE2_NEVER_UCP,
+                                           &error, &offset, NULL);
+        /* Matching still works if JIT is unavailable, just more slowly */
+        if (pattern_obj->code)
+            pcre2_jit_compile (pattern_obj->code, PCRE2_JIT_COMPLETE);
+    }
+#endif
+    g_free (d_pattern);
+    return pattern_obj;
+}
+
+/* Returns 0 on a match or a regexec error code */
+static int
+match_pattern (sch_pattern *pattern, const char *value)
+{
+    const char *p;
+
+    /* The fast paths are ASCII only. Anything else depends on the locale */
+    for (p = value; *p && (unsigned char) *p < 0x80; p++);
+    if (*p == '\0')
+    {
+        if (pattern->native)
+            return pattern->native (value) ? 0 : REG_NOMATCH;
+#ifdef HAVE_PCRE2
+        if (pattern->code)
+        {
+            pcre2_match_data *match_data = g_private_get (&pcre2_match_key);
+            int rc;
+
+            if (!match_data)
+            {
+                match_data = pcre2_match_data_create (1, NULL);
+                g_private_set (&pcre2_match_key, match_data);
+            }
+            if (match_data)
+            {
+                rc = pcre2_match (pattern->code, (PCRE2_SPTR) value, p - value, 0, 0, match_data, NULL);
+                if (rc >= 0)
+                    return 0;
+                if (rc == PCRE2_ERROR_NOMATCH)
+                    return REG_NOMATCH;
+                /* Resource limits fall back to POSIX matching */
+            }
+        }
+#endif
+    }
+    return regexec (&pattern->regex, value, 0, NULL, 0);
+}
+
+bool
+_sch_validate_pattern (sch_node * node, const char *value, int flags)
+{
+    xmlNode *xml = (xmlNode *) node;
+    sch_node_info *info = xml ? NODE_INFO (xml) : NULL;
+    sch_pattern *pattern_obj;
+    char message[100];
+    int rc;
+
+    if (!value)
+        return false;
+    /* Store compiled pattern on the node */
+    pattern_obj = info ? g_atomic_pointer_get (&info->pattern) : NULL;
+    if (!pattern_obj)
+    {
+        char *pattern = (char *) xmlGetProp (node, (xmlChar *) "pattern");
+        if (pattern)
+        {
+            pattern_obj = compile_pattern (flags, pattern);
+            xmlFree (pattern);
+            if (!pattern_obj)
+                return false;
+            /* Publish it for other threads. If another thread got there first use theirs */
+            if (info && !g_atomic_pointer_compare_and_exchange (&info->pattern, NULL, pattern_obj))
+            {
+                free_pattern (pattern_obj);
+                pattern_obj = g_atomic_pointer_get (&info->pattern);
+            }
+        }
+    }
+    if (pattern_obj)
+    {
+        rc = match_pattern (pattern_obj, value);
+        if (!info)
+            free_pattern (pattern_obj);
+        if (rc == REG_ESPACE)
+        {
+            regerror (rc, NULL, message, sizeof (message));
+            ERROR (flags, SCH_E_PATREGEX, "%i (\"%s\") for regex", rc, message);
+            return false;
+        }
+        return (rc == 0);
+    }
+    if (info && info->range)
+        return _sch_validate_range (info, value, flags);
+    if (info)
+    {
+        if (info->value_count && !enum_by_name (info, value) && !enum_by_value (info, value))
+        {
+            ERROR (flags, SCH_E_ENUMINVALID, "\"%s\" not in enumeration\n", value);
+            return false;
+        }
+        return true;
+    }
+    char *range = info ? NULL : (char *) xmlGetProp (node, (xmlChar *) "range");
+    if (range)
+    {
+        bool vint_neg, min_neg, max_neg;
+        uint64_t vint, min, max;
+
+        if (!parse_integer (flags, value, &vint_neg, &vint))
+        {
+            ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, range);
+            xmlFree (range);
+            return false;
+        }
+
+        char *ptr = NULL;
+        char *minmax = strtok_r (range, "|", &ptr);
+        while (minmax)
+        {
+            if (!parse_minmax (flags, minmax, &min_neg, &min, &max_neg, &max))
+            {
+                ERROR (flags, SCH_E_INTERNAL, "Can't parse minmax \"%s\"", minmax);
+                xmlFree (range);
+                return false;
+            }
+
+            DEBUG (flags, "Checking %s%" PRIu64 " for range %s%" PRIu64 "..%s%" PRIu64 "\n",
+                   vint_neg ? "-" : "", vint,
+                   min_neg ? "-" : "", min,
+                   max_neg ? "-" : "", max);
+
+            bool ok = true;
+            if (vint_neg && !min_neg) ok = false;
+            if (vint_neg && min_neg && vint > min) ok = false;
+            if (!vint_neg && !min_neg && vint < min) ok = false;
+            if (!vint_neg && max_neg) ok = false;
+            if (vint_neg && max_neg && vint < max) ok = false;
+            if (!vint_neg && !max_neg && vint > max) ok = false;
+            if (ok)
+            {
+                xmlFree (range);
+                return true;
+            }
+            minmax = strtok_r (NULL, "|", &ptr);
+        }
+        ERROR (flags, SCH_E_OUTOFRANGE, "\"%s\" out of range \"%s\"", value, range);
+        xmlFree (range);
+        return false;
+    }
+    if (xml->children)
+    {
+        bool enumeration = false;
+        bool rc = false;
+        xmlNode *n;
+        char *val;
+
+        for (n = xml->children; n && value; n = n->next)
+        {
+            if (n->type == XML_ELEMENT_NODE && n->name[0] == 'V')
+            {
+                enumeration = true;
+                val = (char *) xmlGetProp (n, (xmlChar *) "name");
+                if (val && strcmp (value, val) == 0)
+                {
+                    free (val);
+                    rc = true;
+                    break;
+                }
+                free (val);
+                val = (char *) xmlGetProp (n, (xmlChar *) "value");
+                if (val && strcmp (value, val) == 0)
+                {
+                    free (val);
+                    rc = true;
+                    break;
+                }
+                free (val);
+            }
+        }
+        if (enumeration && !rc)
+        {
+            ERROR (flags, SCH_E_ENUMINVALID, "\"%s\" not in enumeration\n", value);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+sch_validate_pattern (sch_node * node, const char *value)
+{
+    tl_error = SCH_E_SUCCESS;
+    return _sch_validate_pattern (node, value, 0);
+}
+
+/* Record the current error against path */
+static void
+validate_fail (GList **errors, GString *path)
+{
+    sch_validation_error *error = g_malloc0 (sizeof (sch_validation_error));
+
+    error->path = g_strdup (path->len ? path->str : "/");
+    error->error = tl_error;
+    error->message = g_strchomp (g_strdup (tl_errmsg));
+    *errors = g_list_prepend (*errors, error);
+}
+
+static void
+validate_value (sch_node *schema, const char *value, int flags, GList **errors, GString *path)
+{
+    if (!value || value[0] == '\0')
+        return;
+    tl_error = SCH_E_SUCCESS;
+    if (!_sch_validate_pattern (schema, value, flags))
+    {
+        if (tl_error == SCH_E_SUCCESS)
+            ERROR (flags, SCH_E_PATREGEX, "\"%s\" does not match pattern\n", value);
+        validate_fail (errors, path);
+    }
+}
+
+static void
+_sch_validate_tree (sch_instance *instance, sch_node *parent, xmlNs *ns, GNode *node, int flags,
+                    GList **errors, GString *path)
+{
+    const char *name = APTERYX_NAME (node);
+    size_t len = path->len;
+    sch_node *schema;
+    const char *colon;
+
+    if (name[0] == '/')
+        name++;
+    g_string_append_c (path, '/');
+    g_string_append (path, name);
+
+    /* Check for a change in namespace */
+    if (!parent)
+        parent = xmlDocGetRootElement (instance->doc);
+    colon = strchr (name, ':');
+    if (colon)
+    {
+        char *namespace = g_strndup (name, colon - name);
+        xmlNs *nns = _sch_lookup_ns (instance, parent, namespace, flags, false);
+        free (namespace);
+        if (nns)
+        {
+            name = colon + 1;
+            ns = nns;
+        }
+    }
+
+    schema = _sch_node_child (ns, parent, name);
+    if (!schema && sch_is_proxy (parent))
+        schema = _sch_node_child (ns, xmlDocGetRootElement (instance->doc), name);
+    if (!schema)
+    {
+        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for %s\n", name);
+        validate_fail (errors, path);
+    }
+    else if (sch_is_leaf (schema))
+    {
+        if (!sch_is_writable (schema))
+        {
+            ERROR (flags, SCH_E_NOTWRITABLE, "Node \"%s\" not writable\n", name);
+            validate_fail (errors, path);
+        }
+        else if (APTERYX_HAS_VALUE (node))
+            validate_value (schema, APTERYX_VALUE (node), flags, errors, path);
+    }
+    else if (sch_is_list (schema) && !sch_is_leaf_list (schema))
+    {
+        sch_node *entry = sch_node_child_first (schema);
+        sch_node *key = NODE_INFO (schema) ? NODE_INFO (schema)->key : sch_node_child_first (entry);
+        const char *kname = key ? sch_name_ref (key) : NULL;
+
+        for (GNode *child = node->children; child; child = child->next)
+        {
+            size_t elen = path->len;
+            GNode *kchild;
+
+            g_string_append_c (path, '/');
+            g_string_append (path, APTERYX_NAME (child));
+
+            /* The entry is named by its key so both must be valid and agree */
+            if (key && APTERYX_NAME (child)[0] == '\0')
+            {
+                ERROR (flags, SCH_E_KEYMISSING, "List \"%s\" missing key \"%s\"\n", name, kname);
+                validate_fail (errors, path);
+            }
+            else if (key && g_strcmp0 (APTERYX_NAME (child), "*") != 0)
+            {
+                validate_value (key, APTERYX_NAME (child), flags, errors, path);
+                kchild = apteryx_find_child (child, kname);
+                if (kchild && APTERYX_HAS_VALUE (kchild) && APTERYX_VALUE (kchild) &&
+                    APTERYX_VALUE (kchild)[0] != '\0' &&
+                    g_strcmp0 (APTERYX_VALUE (kchild), APTERYX_NAME (child)) != 0)
+                {
+                    ERROR (flags, SCH_E_KEYMISMATCH, "List key \"%s\" is \"%s\" in entry \"%s\"\n",
+                           kname, APTERYX_VALUE (kchild), APTERYX_NAME (child));
+                    validate_fail (errors, path);
+                }
+            }
+            for (GNode *field = child->children; field; field = field->next)
+                _sch_validate_tree (instance, entry, ns, field, flags, errors, path);
+            g_string_truncate (path, elen);
+        }
+    }
+    else
+    {
+        for (GNode *child = node->children; child; child = child->next)
+            _sch_validate_tree (instance, schema, ns, child, flags, errors, path);
+    }
+    g_string_truncate (path, len);
+}
+
+GList *
+sch_validate_tree (sch_instance * instance, sch_node * schema, GNode * node, int flags)
+{
+    instance = sch_current (instance);
+    GString *path = g_string_new (NULL);
+    GList *errors = NULL;
+
+    if (schema)
+    {
+        /* The node is the schema node. Check its children */
+        char *spath = sch_path (schema);
+        g_string_assign (path, spath);
+        free (spath);
+        for (GNode *child = node->children; child; child = child->next)
+            _sch_validate_tree (instance, schema, ((xmlNode *) schema)->ns, child, flags, &errors, path);
+    }
+    else if (strlen (APTERYX_NAME (node)) == 1)
+    {
+        for (GNode *child = node->children; child; child = child->next)
+            _sch_validate_tree (instance, NULL, NULL, child, flags, &errors, path);
+    }
+    else
+    {
+        _sch_validate_tree (instance, NULL, NULL, node, flags, &errors, path);
+    }
+    g_string_free (path, true);
+
+    errors = g_list_reverse (errors);
+    if (errors)
+    {
+        sch_validation_error *first = errors->data;
+        tl_error = first->error;
+        snprintf (tl_errmsg, BUFSIZ - 1, "%s", first->message);
+    }
+    else
+        tl_error = SCH_E_SUCCESS;
+    return errors;
+}
+
+static void
+sch_validation_error_free (gpointer data)
+{
+    sch_validation_error *error = data;
+
+    g_free (error->path);
+    g_free (error->message);
+    g_free (error);
+}
+
+void
+sch_validation_errors_free (GList *errors)
+{
+    g_list_free_full (errors, sch_validation_error_free);
+}
+
+/* Data translation/manipulation */
+
+static GList*
+q2n_split_params (const char *params, char separator)
+{
+    GList *list = NULL;
+    int depth = 0;
+    GString *result = g_string_new (NULL);
+    int i = 0;
+    for (i = 0; i < strlen (params); i++)
+    {
+        char c = params[i];
+        if (c == '(' || c == '[' || c == '{')
+            depth += 1;
+        else if (c == ')' || c == ']' || c == '}')
+            depth -= 1;
+        else if (depth == 0 && c == separator)
+        {
+            /* Save string if there's something in it, otherwise just keep using it. */
+            if (result->len > 0)
+            {
+                list = g_list_append (list, g_string_free (result, false));
+                result = g_string_new (NULL);
+            }
+            else
+            {
+                g_list_free_full (list, g_free);
+                g_string_free (result, true);
+                return NULL;
+            }
+            continue;
+        }
+        g_string_append_c (result, c);
+    }
+    if (result)
+    {
+        if (result->len > 0)
+        {
+            list = g_list_append (list, g_string_free (result, false));
+        }
+        else
+        {
+            g_list_free_full (list, g_free);
+            g_string_free (result, true);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+static bool
+_check_tail (const gchar *tail)
+{
+    size_t len = strlen (tail);
+
+    if (len < 2)
+    {
+        return false;
+    }
+    if (tail[0] != '/')
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool
+add_all_query_nodes (sch_node *schema, GNode *parent, bool config, bool state, int flags, int depth, int max)
+{
+    GNode *node = parent;
+    char *name;
+
+    if (depth >= max)
+        return true;
+
+    name = sch_name (schema);
+    if (sch_is_leaf (schema))
+    {
+        if ((config && sch_is_writable (schema)) ||
+            (state && !sch_is_writable (schema) && sch_is_readable (schema)))
+        {
+            node_add (parent, node_take (name));
+            DEBUG (flags, "%*s%s\n", depth * 2, " ", sch_name_ref (schema));
+            name = NULL;
+        }
+    }
+    else
+    {
+        node = node_add (parent, node_take (name));
+        DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (node));
+        name = NULL;
+
+        /* Star nodes do not count when counting depth */
+        if (!sch_is_list (sch_node_parent (schema)))
+            depth++;
+        for (sch_node *s = sch_node_child_first (schema); s && depth < max; s = sch_node_next_sibling (s))
+        {
+            if (!add_all_query_nodes (s, node, config, state, flags, depth, max))
+                return false;
+        }
+    }
+
+    free (name);
+    return true;
+}
+
+/**
+ * Split a node by ':' character into module and name. Only one ':' allowed, if line is split both
+ * parts must be >0 characters. Return pointers point to original string, ':' is replaced by '\0'.
+ */
+static void
+_split_module_name (char *node, char **name, char **module)
+{
+    char *c_pt;
+    int count_sep = 0;
+    bool on_sep = false;
+    char *first_sep = NULL;
+
+    *module = *name = node;
+    for (c_pt = node; *c_pt != '\0'; c_pt++)
+    {
+        if (*c_pt == ':')
+        {
+            count_sep++;
+            if (first_sep == NULL)
+            {
+                first_sep = c_pt;
+                *first_sep = '\0';
+                on_sep = true;
+            }
+            else
+            {
+                break;
+            }
+        }
+        else if (on_sep)
+        {
+            *name = c_pt;
+            on_sep = false;
+        }
+    }
+
+    /* Clean up. */
+    if (count_sep == 0)
+    {
+        *module = NULL;
+    }
+    else if (count_sep > 1 || on_sep || strlen (*module) == 0 || strlen (*name) == 0)
+    {
+        *module = NULL;
+        *name = node;
+        if (first_sep != NULL)
+        {
+            *first_sep = ':';
+        }
+    }
+}
+
+static bool
+_check_model (char *module, sch_node *schema)
+{
+    bool ret = true;
+    const char *model;
+
+    if (module == NULL || strlen (module) == 0)
+    {
+        return ret;
+    }
+    model = sch_model_ref (schema, false);
+    if (model != NULL)
+    {
+        ret = (g_strcmp0 (module, model) == 0);
+    }
+    return ret;
+}
+
+static GNode*
+q2n_append_path (sch_node * schema, GNode *root, const char *path, int flags, int depth, sch_node **rschema, bool expand_non_leaf, bool config, bool nonconfig)
+{
+    char **nodes = g_strsplit (path, "/", -1);
+    char **node = nodes;
+    sch_node *index;
+    sch_node *child;
+    GNode *existing;
+
+    while (*node)
+    {
+        char *name;
+        char *module;
+
+        _split_module_name (*node, &name, &module);
+
+        /* Find schema node - since it might be an index node, call it such. */
+        index = sch_node_child (schema, name);
+        if (index == NULL)
+        {
+            ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for %s\n", name);
+            g_strfreev (nodes);
+            return NULL;
+        }
+        if (!sch_is_readable (index))
+        {
+            ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s\n", name);
+            g_strfreev (nodes);
+            return NULL;
+        }
+
+        /* Because we allow for implicit wild-card index, need to check if this node is actually
+         * for a child of a wildcard node.
+         */
+        if (sch_is_list (schema) && (child = sch_node_child (index, name)))
+        {
+            if (!sch_is_readable (child))
+            {
+                ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s\n", name);
+                g_strfreev (nodes);
+                return NULL;
+            }
+            existing = apteryx_find_child (root, "*");
+            if (!existing)
+            {
+                existing = node_add (root, node_strdup ("*"));
+            }
+            root = existing;
+            schema = child;
+        }
+        else
+        {
+            schema = index;
+        }
+
+        /* Should be pointing at a true schema node, check that module matches if specified. */
+        if (!_check_model (module, schema))
+        {
+            ERROR (flags, SCH_E_NOSCHEMANODE, "No model match for %s\n", module);
+            g_strfreev (nodes);
+            return NULL;
+        }
+
+        /* Create the node if it does not already exist */
+        DEBUG (flags, "%*s%s\n", depth * 2, " ", name);
+        existing = apteryx_find_child (root, name);
+        if (existing)
+            root = existing;
+        else
+            root = node_add (root, node_strdup (name));
+        node++;
+        depth++;
+    }
+
+    /* If schema is not a leaf, expand query with all subsequent children, if allowed. */
+    if (!sch_is_leaf (schema) && expand_non_leaf)
+    {
+        for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
+        {
+            /* Recurse tree adding all elements */
+            add_all_query_nodes (s, root, config, nonconfig, flags, depth + 1, INT_MAX);
+        }
+    }
+
+    g_strfreev (nodes);
+    if (rschema)
+        *rschema = schema;
+    return root;
+}
+
+static bool
+_field_query_to_node (sch_node * schema, const char *fields, GNode *parent, int flags, int depth, const char *tail, bool config, bool nonconfig)
+{
+    GList *params = q2n_split_params (fields, ';');
+    bool rc = true;
+    gchar *left_side = NULL;
+    gchar *middle = NULL;
+    gchar *right_side = NULL;
+
+    if (params == NULL)
+    {
+        return false;
+    }
+    for (GList *iter = g_list_first (params); rc && iter; iter = g_list_next (iter))
+    {
+        sch_node *nschema = schema;
+        GNode *rroot = parent;
+        fields = iter->data;
+        if (strlen (fields) == 0) {
+            rc = false;
+            goto exit;
+        }
+
+        char *left = g_strstr_len (fields, -1, "(");
+        char *right = g_strrstr_len (fields, -1, ")");
+        if (right < left)
+        {
+            rc = false;
+            goto exit;
+        }
+        if (left == NULL && right == NULL)
+        {
+            rroot = q2n_append_path (schema, rroot, fields, flags, depth, &nschema, tail == NULL, config, nonconfig);
+            if (!rroot)
+            {
+                rc = false;
+                goto exit;
+            }
+            if (rc && tail)
+            {
+                if (!_check_tail (tail))
+                {
+                    rc = false;
+                    goto exit;
+                }
+                rroot = q2n_append_path (nschema, rroot, &tail[1], flags, depth, NULL, true, config, nonconfig);
+                if (!rroot)
+                {
+                    rc = false;
+                    goto exit;
+                }
+            }
+            continue;
+        }
+        if (left == NULL || right == NULL)
+        {
+            rc = false;
+            goto exit;
+        }
+        left_side = (left - fields) > 0 ? g_strndup (fields, left - fields) : NULL;
+        middle = g_strndup (left + 1, right - left - 1);
+        right_side = strlen (right + 1) > 0 ? g_strdup (right + 1) : NULL;
+        if (left_side)
+        {
+            rroot = q2n_append_path (nschema, rroot, left_side, flags, depth, &nschema, middle == NULL, config, nonconfig);
+            if (!rroot)
+            {
+                rc = false;
+                goto exit1;
+            }
+        }
+        if (rc && middle)
+        {
+            if (!_field_query_to_node (nschema, middle, rroot, flags, depth, right_side ?: tail, config, nonconfig))
+            {
+                rc = false;
+                goto exit1;
+            }
+        }
+        else if (rc && tail)
+        {
+            rroot = q2n_append_path (nschema, rroot, tail, flags, depth, NULL, true, config, nonconfig);
+            if (!rroot)
+            {
+                rc = false;
+                goto exit1;
+            }
+        }
+        free (left_side);
+        free (middle);
+        free (right_side);
+        left_side = NULL;
+        middle = NULL;
+        right_side = NULL;
+
+    }
+exit1:
+    g_free (left_side);
+    g_free (middle);
+    g_free (right_side);
+exit:
+    g_list_free_full (params, g_free);
+    return rc;
+}
+
+static bool
+parse_query_fields (sch_node * schema, char *fields, GNode *parent, int flags, int depth, bool config, bool nonconfig)
+{
+    return _field_query_to_node (schema, fields, parent, flags, depth, NULL, config, nonconfig);
+}
+
+/* Parse a limit or offset value */
+static bool
+page_number (const char *value, guint *number)
+{
+    guint64 parsed;
+    char *end;
+
+    if (!g_ascii_isdigit (value[0]))
+        return false;
+    parsed = g_ascii_strtoull (value, &end, 10);
+    if (*end != '\0' || parsed > G_MAXUINT)
+        return false;
+    *number = parsed;
+    return true;
+}
+
+static bool
+_sch_query_parse (GNode *root, sch_node *schema, char *query, int *rflags, int depth, sch_page *page)
+{
+    int flags = rflags? * rflags : 0;
+    sch_page qpage = { 0 };
+    bool limit_seen = false;
+    bool offset_seen = false;
+    GNode *node;
+    char *ptr = NULL;
+    char *parameter;
+    bool content_seen = false;
+    bool depth_seen = false;
+    bool with_defaults_seen = false;
+    bool config = true;
+    bool nonconfig = true;
+    char *qfields = NULL;
+    int qdepth = INT_MAX;
+
+    bool rc = false;
+
+    /* Parse all queries out of uri first */
+    query = g_strdup (query);
+    parameter = strtok_r (query, "&", &ptr);
+    while (parameter)
+    {
+        char *value = strchr (parameter, '=') + 1;
+        if (strncmp (parameter, "fields=", strlen ("fields=")) == 0 && strlen (value) > 0)
+        {
+            if (qfields)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"field\" queries\n");
+                goto exit;
+            }
+            qfields = g_strdup (parameter + strlen ("fields="));
+        }
+        else if (strncmp (parameter, "content=", strlen ("content=")) == 0)
+        {
+            if (content_seen)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"content\" queries\n");
+                goto exit;
+            }
+            if (g_strcmp0 (value, "config") == 0)
+                nonconfig = false;
+            else if (g_strcmp0 (value, "nonconfig") == 0)
+                config = false;
+            else if (g_strcmp0 (value, "all") != 0)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support content query type \"%s\"\n", value);
+                goto exit;
+            }
+            content_seen = true;
+        }
+        else if (strncmp (parameter, "depth=", strlen ("depth=")) == 0)
+        {
+            if (depth_seen)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"depth\" queries\n");
+                goto exit;
+            }
+            if (g_strcmp0 (value, "unbounded") != 0)
+            {
+                qdepth = g_ascii_strtoll (value, NULL, 10);
+                if (qdepth <= 0 || qdepth > 65535)
+                {
+                    ERROR (flags, SCH_E_INVALIDQUERY, "Do not support depth query of \"%s\"\n", value);
+                    goto exit;
+                }
+                if (qdepth == 1)
+                    flags |= SCH_F_DEPTH_ONE;
+            }
+            depth_seen = true;
+        }
+        else if (strncmp (parameter, "with-defaults=", strlen ("with-defaults=")) == 0)
+        {
+            if (with_defaults_seen)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"with-defaults\" queries\n");
+                goto exit;
+            }
+            if (g_strcmp0 (value, "report-all") == 0)
+                flags |= SCH_F_ADD_DEFAULTS;
+            else if (g_strcmp0 (value, "trim") == 0)
+                flags |= SCH_F_TRIM_DEFAULTS;
+            else if (g_strcmp0 (value, "explicit") != 0)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support with-defaults query type \"%s\"\n", value);
+                goto exit;
+            }
+            with_defaults_seen = true;
+        }
+        else if (page && strncmp (parameter, "limit=", strlen ("limit=")) == 0)
+        {
+            if (limit_seen)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"limit\" queries\n");
+                goto exit;
+            }
+            if (g_strcmp0 (value, "unbounded") != 0 &&
+                (!page_number (value, &qpage.limit) || qpage.limit == 0))
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support limit query of \"%s\"\n", value);
+                goto exit;
+            }
+            flags |= SCH_F_PAGED;
+            limit_seen = true;
+        }
+        else if (page && strncmp (parameter, "offset=", strlen ("offset=")) == 0)
+        {
+            if (offset_seen)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"offset\" queries\n");
+                goto exit;
+            }
+            if (!page_number (value, &qpage.offset))
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support offset query of \"%s\"\n", value);
+                goto exit;
+            }
+            flags |= SCH_F_PAGED;
+            offset_seen = true;
+        }
+        else if (page && strncmp (parameter, "cursor=", strlen ("cursor=")) == 0)
+        {
+            if (qpage.cursor)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support multiple \"cursor\" queries\n");
+                goto exit;
+            }
+            if (strlen (value) == 0)
+            {
+                ERROR (flags, SCH_E_INVALIDQUERY, "Do not support an empty cursor query\n");
+                goto exit;
+            }
+            qpage.cursor = g_strdup (value);
+            flags |= SCH_F_PAGED;
+        }
+        else
+        {
+            ERROR (flags, SCH_E_INVALIDQUERY, "Do not support query \"%s\"\n", parameter);
+            goto exit;
+        }
+        parameter = strtok_r (NULL, "&", &ptr);
+    }
+
+    /* May not have anything much */
+    if (!qfields && config && nonconfig && qdepth == INT_MAX)
+    {
+        rc = true;
+        goto exit;
+    }
+
+    /* Find end of the path node */
+    node = root;
+    while (node->children)
+        node = node->children;
+
+    /* Support fields || (depth AND/OR content) */
+    if (qfields)
+    {
+        if (!parse_query_fields (schema, qfields, node, flags, depth + 1, config, nonconfig))
+        {
+            rc = false;
+            goto exit;
+        }
+    }
+    else
+    {
+        if (qdepth != INT_MAX)
+            qdepth += depth;
+        for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
+        {
+            /* Recurse tree only adding config elements */
+            if (!add_all_query_nodes (s, node, config, nonconfig, flags, depth + 1, qdepth))
+            {
+                rc = false;
+                goto exit;
+            }
+        }
+    }
+
+    rc = true;
+
+exit:
+    free (qfields);
+    free (query);
+    if (rc && rflags)
+        *rflags = flags;
+    if (rc && page)
+        *page = qpage;
+    else
+        g_free (qpage.cursor);
+    return rc;
+}
+
+static bool
+_sch_query_to_gnode (GNode *root, sch_node *schema, char *query, int *rflags, int depth, sch_page *page)
+{
+    sch_instance *instance = ((xmlNode *) schema)->doc->_private;
+    sch_query_key lookup = { schema, query, rflags ? *rflags : 0, depth, page != NULL };
+    sch_query_template *template;
+    GNode *end;
+    guint gen;
+    bool rc;
+
+    /* Debug output comes from parsing so is not cached */
+    if (!instance || !instance->queries || !root || (lookup.flags & SCH_F_DEBUG))
+        return _sch_query_parse (root, schema, query, rflags, depth, page);
+
+    /* Query nodes go below the end of the path */
+    end = root;
+    while (end->children)
+        end = end->children;
+
+    g_mutex_lock (&instance->cache_lock);
+    template = g_hash_table_lookup (instance->queries, &lookup);
+    if (template)
+        g_atomic_int_inc (&template->refs);
+    gen = instance->cache_gen;
+    g_mutex_unlock (&instance->cache_lock);
+    stats_hit (SCH_STAT_QUERY_TO_GNODE, template != NULL);
+    if (template)
+    {
+        query_template_copy (template->tree, end);
+        if (rflags)
+            *rflags = template->flags;
+        if (page)
+        {
+            *page = template->page;
+            page->cursor = g_strdup (template->page.cursor);
+        }
+        query_template_unref (template);
+        return true;
+    }
+
+    rc = _sch_query_parse (root, schema, query, rflags, depth, page);
+    if (!rc)
+        return false;
+
+    /* Each page of a walk has its own cursor or offset, so caching those would
+     * only push out the templates other requests reuse */
+    if (page && (page->cursor || page->offset))
+        return true;
+
+    /* Only keep it if the schema has not changed since (reload or lazy merge) */
+    template = g_new0 (sch_query_template, 1);
+    template->refs = 1;
+    template->flags = rflags ? *rflags : 0;
+    if (page)
+    {
+        template->page = *page;
+        template->page.cursor = g_strdup (page->cursor);
+    }
+    template->tree = g_node_copy_deep (end, (GCopyFunc) g_strdup, NULL);
+    g_mutex_lock (&instance->cache_lock);
+    if (gen == instance->cache_gen && ((xmlNode *) schema)->doc == instance->doc)
+    {
+        sch_query_key *key = g_new (sch_query_key, 1);
+
+        *key = lookup;
+        key->query = g_strdup (query);
+        if (g_hash_table_size (instance->queries) >= SCH_QUERY_CACHE_SIZE)
+            g_hash_table_remove_all (instance->queries);
+        g_hash_table_replace (instance->queries, key, template);
+        template = NULL;
+    }
+    g_mutex_unlock (&instance->cache_lock);
+    if (template)
+        query_template_unref (template);
+    return true;
+}
+
+bool sch_query_to_gnode (sch_instance * instance, sch_node * schema, GNode *parent, const char * query, int flags, int *rflags)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    int _flags = flags;
+    bool rc = _sch_query_to_gnode (parent, schema ?: xmlDocGetRootElement (instance->doc), (char *) query, &_flags, 0, NULL);
+    if (rflags)
+        *rflags = _flags;
+    stats_record (SCH_STAT_QUERY_TO_GNODE, start);
+    return rc;
+}
+
+bool
+sch_query_to_gnode_paged (sch_instance * instance, sch_node * schema, GNode *parent, const char * query,
+                          int flags, int *rflags, sch_page *page)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    int _flags = flags;
+    bool rc;
+
+    *page = (sch_page) { 0 };
+    rc = _sch_query_to_gnode (parent, schema ?: xmlDocGetRootElement (instance->doc), (char *) query, &_flags, 0, page);
+    if (rflags)
+        *rflags = _flags;
+    stats_record (SCH_STAT_QUERY_TO_GNODE, start);
+    return rc;
+}
+
+void
+sch_page_clear (sch_page *page)
+{
+    if (page)
+    {
+        g_free (page->cursor);
+        *page = (sch_page) { 0 };
+    }
+}
+
+typedef int (*sch_key_cmp) (const char *a, const char *b);
+
+/* Integer keys in numeric order, with anything that is not a number after them */
+static int
+page_int_cmp (const char *a, const char *b)
+{
+    sch_int ia;
+    sch_int ib;
+    bool va = a && a[0] && parse_integer (0, a, &ia.neg, &ia.mag);
+    bool vb = b && b[0] && parse_integer (0, b, &ib.neg, &ib.mag);
+
+    if (va && vb)
+        return sch_int_cmp (&ia, &ib);
+    if (va != vb)
+        return va ? -1 : 1;
+    return g_strcmp0 (a, b);
+}
+
+/* The order of the entries of a list with entry as its "*" node. Keys with a
+ * range are integers */
+static sch_key_cmp
+page_order (sch_node *entry)
+{
+    sch_node *key = entry && !sch_is_leaf (entry) ? sch_node_child_first (entry) : entry;
+
+    return key && NODE_INFO (key) && NODE_INFO (key)->range ? page_int_cmp : g_strcmp0;
+}
+
+static gint
+page_entry_cmp (gconstpointer a, gconstpointer b, gpointer cmp)
+{
+    return ((sch_key_cmp) cmp) (APTERYX_NAME (*(GNode **) a), APTERYX_NAME (*(GNode **) b));
+}
+
+/* The entries of list in the page in key order, picked while walking the
+ * children. With a limit no more than offset + limit are held in order at a
+ * time, so the rest of the list is never sorted. A cursor that matches no
+ * entry (say it was deleted) starts the page at the next greater key, so a
+ * walk carries on where it left off */
+static GPtrArray *
+page_entries (GNode *list, const sch_page *page, sch_key_cmp cmp)
+{
+    guint keep = page->limit ? page->offset + page->limit : G_MAXUINT;
+    GPtrArray *entries = g_ptr_array_new ();
+
+    for (GNode *entry = list->children; entry; entry = entry->next)
+    {
+        const char *name = APTERYX_NAME (entry);
+        guint lo = 0;
+        guint hi = entries->len;
+
+        if (page->cursor && cmp (name, page->cursor) <= 0)
+            continue;
+        if (!page->limit)
+        {
+            g_ptr_array_add (entries, entry);
+            continue;
+        }
+        while (lo < hi)
+        {
+            guint mid = lo + (hi - lo) / 2;
+
+            if (cmp (APTERYX_NAME ((GNode *) g_ptr_array_index (entries, mid)), name) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo >= keep)
+            continue;
+        g_ptr_array_insert (entries, lo, entry);
+        if (entries->len > keep)
+            g_ptr_array_remove_index (entries, keep);
+    }
+    if (!page->limit)
+        g_ptr_array_sort_with_data (entries, page_entry_cmp, cmp);
+    g_ptr_array_remove_range (entries, 0, MIN (page->offset, entries->len));
+    return entries;
+}
+
+static GNode *
+_sch_path_to_gnode (sch_instance * instance, sch_node ** rschema, xmlNs *ns, const char *path, int flags, int depth)
+{
+    sch_node *schema = rschema && *rschema ? *rschema : xmlDocGetRootElement (instance->doc);
+    xmlNs *nns = NULL;
+    const char *next = NULL;
+    GNode *node = NULL;
+    GNode *rnode = NULL;
+    GNode *child = NULL;
+    char *query = NULL;
+    char *pred = NULL;
+    char *equals = NULL;
+    char *new_path = NULL;
+    char *colon;
+    char *name = NULL;
+    sch_node *last_good_schema = NULL;
+    bool is_proxy = false;
+
+    if (path && path[0] == '/')
+    {
+        path++;
+
+        /* Parse path element */
+        query = strchr (path, '?');
+        next = strchr (path, '/');
+        if (query && (!next || query < next))
+            name = g_strndup (path, query - path);
+        else if (next)
+            name = g_strndup (path, next - path);
+        else
+            name = g_strdup (path);
+        colon = strchr (name, ':');
+        if (colon)
+        {
+            colon[0] = '\0';
+            nns = _sch_lookup_ns (instance, schema, name, flags, false);
+            if (!nns)
+            {
+                /* No namespace found assume the node is supposed to have a colon in it */
+                colon[0] = ':';
+            }
+            else
+            {
+                /* We found a namespace. Remove the prefix */
+                char *_name = name;
+                name = g_strdup (colon + 1);
+                free (_name);
+                ns = nns;
+            }
+        }
+        if (query && next && query < next)
+            next = NULL;
+        if (flags & SCH_F_XPATH)
+        {
+            pred = strchr (name, '[');
+            if (pred)
+            {
+                char *temp = g_strndup (name, pred - name);
+                pred = g_strdup (pred);
+                free (name);
+                name = temp;
+            }
+        }
+        else
+        {
+            equals = strchr (name, '=');
+            if (equals)
+            {
+                char *temp = g_strndup (name, equals - name);
+                equals = g_strdup (equals + 1);
+                free (name);
+                name = temp;
+            }
+        }
+
+        /* Find schema node */
+        if (schema && sch_is_proxy (schema))
+        {
+            /* The schema containing the proxy node can have children */
+            sch_node *child = sch_ns_node_child (ns, schema, name);
+            if (!child)
+            {
+                is_proxy = sch_is_proxy (schema);
+            }
+        }
+
+        if (!schema || is_proxy)
+        {
+            schema = xmlDocGetRootElement (instance->doc);
+            /* Detect change in namespace with the new schema */
+            colon = strchr (name, ':');
+            if (colon)
+            {
+                colon[0] = '\0';
+                nns = _sch_lookup_ns (instance, schema, name, flags, false);
+                if (!nns)
+                {
+                    /* No namespace found assume the node is supposed to have a colon in it */
+                    colon[0] = ':';
+                }
+                else
+                {
+                    /* We found a namespace. Remove the prefix */
+                    char *_name = name;
+                    name = g_strdup (colon + 1);
+                    free (_name);
+                    ns = nns;
+                }
+            }
+        }
+
+        last_good_schema = schema;
+        schema = _sch_node_child (ns, schema, name);
+        if ((flags & SCH_F_XPATH) && schema == NULL && g_strcmp0 (name, "*") == 0)
+        {
+            GList *path_list = NULL;
+            bool found = sch_node_find_name (instance, ns, last_good_schema, next, flags, &path_list);
+            if (found)
+            {
+                GList *list;
+                int len = 0;
+                bool first = true;
+                for (list = g_list_first (path_list); list; list = g_list_next (list))
+                {
+                    len += strlen ((char *) list->data);
+                }
+
+                if (len)
+                {
+                    /* Note - the 64 bytes added to the length is to allow for extra slashes being added to the path */
+                    len += strlen (path) +  64;
+                    new_path = g_malloc0 (len);
+                    len = 0;
+                    /* Ammend the path with the new information. Note we drop the last list
+                     * item as it contains a duplicate star slash already in the path */
+                    for (list = g_list_first (path_list); list; list = g_list_next (list))
+                    {
+                        if (first)
+                        {
+                            g_free (name);
+                            name = (char *) list->data;
+                            first = false;
+                        }
+                        else
+                        {
+                            if (list->next)
+                                len += sprintf (new_path + len, "/%s", (char *) list->data);
+                            g_free (list->data);
+                        }
+                    }
+                    sprintf (new_path + len, "/%s", path);
+                    next = new_path;
+                }
+                g_list_free (path_list);
+                if (new_path)
+                    schema = _sch_node_child (ns, last_good_schema, name);
+            }
+        }
+
+        /* Check RPC's are not bypassed */
+        if (schema && next && next[0] != '\0' && sch_is_executable (schema))
+        {
+            DEBUG (flags, "Tried to access parameter node of RPC\n");
+            schema = NULL;
+        }
+
+        if (schema == NULL)
+        {
+            ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for %s%s%s\n", ns ? (char *) ns->prefix : "",
+                   ns ? ":" : "", name);
+            goto exit;
+        }
+
+        /* Create node - include namespace node mapping if required */
+        if (depth == 0 || nns || is_proxy)
+        {
+            if (ns && ns->prefix && !_sch_ns_native (instance, ns))
+            {
+                rnode = node_add (NULL, node_take (g_strdup_printf ("%s%s:%s", depth == 0 ? "/" : "", ns->prefix, name)));
+            }
+            else
+            {
+                rnode = node_add (NULL, node_take (g_strdup_printf ("%s%s", depth == 0 ? "/" : "", name)));
+            }
+            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (rnode));
+        }
+        else
+        {
+            rnode = node_add (NULL, node_take (name));
+            name = NULL;
+        }
+        DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (rnode));
+
+        /* XPATH predicates */
+        if (pred && sch_is_list (schema))
+        {
+            char key[128 + 1];
+            char value[128 + 1];
+
+            schema = sch_node_child_first (schema);
+            if (sscanf (pred, "[%128[^=]='%128[^']']", key, value) == 2) {
+                // TODO make sure this key is the list key
+                child = node_add (NULL, node_strdup (value));
+                g_node_prepend (rnode, child);
+                depth++;
+                DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
+                if (next)
+                {
+                    if ((flags & SCH_F_XPATH) == 0 || !sch_is_proxy (schema) )
+                        node_add (child, node_strdup (key));
+                    depth++;
+                    DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
+                }
+            }
+        }
+        else if (equals && sch_is_list (schema))
+        {
+            child = node_add (NULL, node_strdup (equals));
+            g_node_prepend (rnode, child);
+            depth++;
+            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
+            schema = sch_node_child_first (schema);
+        }
+
+        if (next)
+        {
+            node = _sch_path_to_gnode (instance, &schema, ns, next, flags, depth + 1);
+            if (!node)
+            {
+                node_free_tree (rnode);
+                rnode = NULL;
+                goto exit;
+            }
+            g_node_prepend (child ? : rnode, node);
+        }
+    }
+
+exit:
+    if (rschema)
+        *rschema = schema;
+    free (name);
+    g_free (pred);
+    g_free (equals);
+    g_free (new_path);
+    return rnode;
+}
+
+/* The schema node for one path element below schema, or NULL once the
+ * element needs more than a plain child lookup to resolve */
+static sch_node *
+path_shape_child (sch_node *schema, const char *name, size_t len)
+{
+    char *child;
+    sch_node *found;
+
+    if (!schema || sch_is_proxy (schema) || memchr (name, ':', len))
+        return NULL;
+    child = g_strndup (name, len);
+    found = _sch_node_child (NULL, schema, child);
+    g_free (child);
+    return found;
+}
+
+/* The path up to any query with its list key values taken out, e.g.
+ * /a/b=1/c?depth=1 becomes /a/b=/c with keys [1]. Keys given as their own
+ * element are found by following the schema from schema, so /a/b/1/c
+ * becomes /a/b/=/c. Where the schema cannot be followed the rest of the
+ * path is kept as it is. Returns the number of path elements, or 0 for
+ * paths that are not cached */
+static guint
+path_shape (sch_node *schema, const char *path, GString *shape, GPtrArray *keys)
+{
+    const char *end = strchr (path, '?');
+    guint count = 0;
+    bool key = false;
+
+    if (path[0] != '/')
+        return 0;
+    if (!end)
+        end = path + strlen (path);
+    while (path < end)
+    {
+        const char *next = memchr (path + 1, '/', end - path - 1);
+        const char *equals;
+
+        if (!next)
+            next = end;
+        equals = memchr (path, '=', next - path);
+        if (key && !equals && !memchr (path, ':', next - path))
+        {
+            /* A list key element. An empty name before '=' cannot match so "/=" is only this */
+            g_string_append (shape, "/=");
+            g_ptr_array_add (keys, g_strndup (path + 1, next - path - 1));
+            schema = sch_node_child_first (schema);
+        }
+        else if (key)
+        {
+            /* The value may be read as a namespace prefix or another key */
+            if (equals == path + 1)
+                return 0;
+            g_string_append_len (shape, path, next - path);
+            schema = NULL;
+        }
+        else if (equals)
+        {
+            /* A namespace prefix is looked for before the key is split off */
+            if (equals == path + 1 || memchr (equals, ':', next - equals))
+                return 0;
+            g_string_append_len (shape, path, equals - path + 1);
+            g_ptr_array_add (keys, g_strndup (equals + 1, next - equals - 1));
+            schema = path_shape_child (schema, path + 1, equals - path - 1);
+            schema = schema && sch_is_list (schema) ? sch_node_child_first (schema) : NULL;
+        }
+        else
+        {
+            g_string_append_len (shape, path, next - path);
+            schema = path_shape_child (schema, path + 1, next - path - 1);
+        }
+        key = schema && sch_is_list (schema);
+        path = next;
+        count++;
+    }
+    return count;
+}
+
+/* Remember how a path resolved. The result must be a chain of one node per
+ * path element, each followed by its key value if it is a list */
+static void
+path_cache_add (sch_instance *instance, sch_path_key *key, guint elements, GPtrArray *keys,
+                GNode *root, sch_node *schema, guint gen)
+{
+    guint length = 0;
+    guint split = 0;
+    guint i = 0;
+    guint k = 0;
+    sch_path_entry *entry;
+    bool with_keys;
+    GNode *node;
+
+    for (node = root; node; node = node->children)
+    {
+        if (node->children && node->children->next)
+            return;
+        length++;
+    }
+    for (const char *element = strstr (key->shape, "/="); element; element = strstr (element + 2, "/="))
+    {
+        if (element[2] == '/' || element[2] == '\0')
+            split++;
+    }
+    /* Every key after '=' or none was used. Otherwise the key values cannot be placed */
+    if (length == elements + keys->len - split)
+        with_keys = true;
+    else if (length == elements)
+        with_keys = false;
+    else
+        return;
+
+    entry = g_malloc0 (sizeof (sch_path_entry) + length * sizeof (sch_path_step));
+    entry->key.schema = key->schema;
+    entry->key.shape = g_strdup (key->shape);
+    entry->key.flags = key->flags;
+    entry->link.data = entry;
+    entry->schema = schema;
+    entry->length = length;
+    /* Elements with a key end in '=' in the shape, and are only "/=" for a
+     * key given as its own element */
+    node = root;
+    for (const char *element = key->shape; node; element = strchr (element + 1, '/'))
+    {
+        const char *end = strchr (element + 1, '/') ?: element + strlen (element);
+
+        if (end - element == 2 && element[1] == '=')
+        {
+            entry->steps[i++].key = k++;
+            node = node->children;
+            continue;
+        }
+        entry->steps[i].key = -1;
+        entry->steps[i++].name = g_strdup (APTERYX_NAME (node));
+        node = node->children;
+        if (end[-1] == '=')
+        {
+            if (with_keys)
+            {
+                entry->steps[i++].key = k;
+                node = node->children;
+            }
+            k++;
+        }
+    }
+
+    g_mutex_lock (&instance->cache_lock);
+    if (gen == instance->cache_gen && !g_hash_table_contains (instance->paths, &entry->key))
+    {
+        if (g_hash_table_size (instance->paths) >= SCH_PATH_CACHE_SIZE)
+        {
+            GList *last = g_queue_pop_tail_link (&instance->path_lru);
+            g_hash_table_remove (instance->paths, &((sch_path_entry *) last->data)->key);
+        }
+        g_hash_table_insert (instance->paths, &entry->key, entry);
+        g_queue_push_head_link (&instance->path_lru, &entry->link);
+        entry = NULL;
+    }
+    g_mutex_unlock (&instance->cache_lock);
+    if (entry)
+        path_entry_free (entry);
+}
+
+/* _sch_path_to_gnode from the top of a path, using the path cache */
+static GNode *
+sch_path_resolve (sch_instance *instance, sch_node **rschema, const char *path, int flags)
+{
+    sch_path_key key = { NULL, NULL, flags };
+    GString *shape;
+    GPtrArray *keys;
+    sch_path_entry *entry = NULL;
+    GNode *root = NULL;
+    guint elements;
+    guint gen;
+    bool cached;
+
+    /* XPATH wildcards search the schema and debug output comes from resolving */
+    if (!instance->paths || !path || (flags & (SCH_F_XPATH | SCH_F_DEBUG)))
+        return _sch_path_to_gnode (instance, rschema, NULL, path, flags, 0);
+
+    /* Take the generation before the schema so a shape resolved against a
+     * document dropped after this point is not stored. Only shapes below this
+     * instance's own document are cached, as in _sch_query_to_gnode */
+    g_mutex_lock (&instance->cache_lock);
+    gen = instance->cache_gen;
+    key.schema = rschema && *rschema ? *rschema : xmlDocGetRootElement (instance->doc);
+    cached = ((xmlNode *) key.schema)->doc == instance->doc;
+    g_mutex_unlock (&instance->cache_lock);
+
+    shape = g_string_new (NULL);
+    keys = g_ptr_array_new_with_free_func (g_free);
+    elements = cached ? path_shape (key.schema, path, shape, keys) : 0;
+    if (!elements)
+    {
+        g_string_free (shape, TRUE);
+        g_ptr_array_free (keys, TRUE);
+        return _sch_path_to_gnode (instance, rschema, NULL, path, flags, 0);
+    }
+    key.shape = shape->str;
+
+    g_mutex_lock (&instance->cache_lock);
+    entry = g_hash_table_lookup (instance->paths, &key);
+    if (entry)
+    {
+        GNode *node = NULL;
+
+        g_queue_unlink (&instance->path_lru, &entry->link);
+        g_queue_push_head_link (&instance->path_lru, &entry->link);
+        for (guint i = 0; i < entry->length; i++)
+        {
+            const sch_path_step *step = &entry->steps[i];
+
+            node = node_add (node, node_strdup (step->key < 0 ? step->name :
+                                                g_ptr_array_index (keys, step->key)));
+            if (!root)
+                root = node;
+        }
+        if (rschema)
+            *rschema = entry->schema;
+    }
+    g_mutex_unlock (&instance->cache_lock);
+    stats_hit (SCH_STAT_PATH_TO_GNODE, entry != NULL);
+
+    if (!entry)
+    {
+        sch_node *schema = key.schema;
+
+        root = _sch_path_to_gnode (instance, &schema, NULL, path, flags, 0);
+        if (root)
+            path_cache_add (instance, &key, elements, keys, root, schema, gen);
+        if (rschema)
+            *rschema = schema;
+    }
+    g_string_free (shape, TRUE);
+    g_ptr_array_free (keys, TRUE);
+    return root;
+}
+
+GNode *
+sch_path_to_gnode (sch_instance * instance, sch_node * schema, const char *path, int flags, sch_node ** rschema)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    GNode *node;
+    char *_path = NULL;
+
+    if ((flags & SCH_F_XPATH))
+    {
+        if (strstr (path, "//"))
+        {
+            char **split = g_strsplit (path, "//", -1);
+            _path = g_strjoinv ("/*/", split);
+            g_strfreev (split);
+            path = _path;
+        }
+    }
+    node = sch_path_resolve (instance, rschema, path, flags);
+    g_free (_path);
+
+    stats_record (SCH_STAT_PATH_TO_GNODE, start);
+    return node;
+}
+
+GNode *
+sch_path_to_query (sch_instance * instance, sch_node * schema, const char *path, int flags)
+{
+    instance = sch_current (instance);
+    char *_path = NULL;
+    char *query;
+    GNode *root;
+    int depth;
+
+    /* Split off any query first */
+    query = strchr (path, '?');
+    if (query)
+    {
+        path = _path = g_strndup (path, query - path);
+        query++; /* Skip past the '?' */
+    }
+
+    /* Parse the path first */
+    tl_error = SCH_E_SUCCESS;
+    root = sch_path_resolve (instance, &schema, path, flags);
+    if (!root || !schema)
+    {
+        free (_path);
+        return NULL;
+    }
+    if (sch_is_leaf (schema) && !sch_is_readable (schema))
+    {
+        free (_path);
+        return NULL;
+    }
+
+    /* Process the query */
+    depth = g_node_max_height (root);
+    if (query && !_sch_query_to_gnode (root, schema, query, &flags, depth, NULL))
+    {
+        node_free_tree (root);
+        root = NULL;
+    }
+
+    /* Without a query we may need to add a wildcard to get everything from here down */
+    if (!query || (depth == g_node_max_height (root) && !(flags & SCH_F_DEPTH_ONE)))
+    {
+        if (schema && sch_node_child_first (schema) && !(flags & SCH_F_STRIP_DATA))
+        {
+            /* Find end of the path node */
+            GNode *node = root;
+            while (node->children)
+                node = node->children;
+            /* Get everything from here down if we do not already have a star */
+            if (node && !g_node_first_child(node) && g_strcmp0 (APTERYX_NAME (node), "*") != 0)
+            {
+                node_add (node, node_strdup ("*"));
+                DEBUG (flags, "%*s%s\n", g_node_max_height (root) * 2, " ", "*");
+            }
+        }
+    }
+
+    free (_path);
+    return root;
+}
+
+/* Schema ordinal of a data node, or the number of schema children if unknown */
+static int
+get_index (GNode * node, sch_node * schema)
+{
+    sch_node_info *info = NODE_INFO (schema);
+    const char *name = (const char *) node->data;
+    const char *colon;
+    int index = 0;
+    sch_node *n;
+    GHashTable *children = info ? NODE_CHILDREN (info) : NULL;
+
+    if (children && name)
+    {
+        /* Names must match exactly so check along the chain */
+        for (n = index_lookup (children, name); n; n = NODE_ALIAS (n))
+        {
+            if (strcmp (NODE_INFO (n)->qname, name) == 0)
+                return NODE_INFO (n)->ordinal;
+        }
+        /* Top level non-native nodes are indexed without their prefix */
+        colon = strchr (name, ':');
+        for (n = colon ? index_lookup (children, colon + 1) : NULL; n; n = NODE_ALIAS (n))
+        {
+            if (strcmp (NODE_INFO (n)->qname, name) == 0)
+                return NODE_INFO (n)->ordinal;
+        }
+        return info->child_count;
+    }
+    for (n = sch_node_child_first (schema); n; index++, n = sch_node_next_sibling (n))
+    {
+        if (g_strcmp0 (sch_name_ref (n), name) == 0)
+            break;
+    }
+    return index;
+}
+
+typedef struct _sch_sort_item
+{
+    GNode *node;
+    int index;
+} sch_sort_item;
+
+/* Order data children as they appear in the schema. Unknown names go last
+ * and nodes with the same position keep their relative order. */
+void
+sch_gnode_sort_children (sch_node * schema, GNode * parent)
+{
+    sch_sort_item *items;
+    sch_sort_item *from;
+    sch_sort_item *to;
+    sch_sort_item *tmp;
+    GNode *child;
+    guint count = 0;
+    guint i;
+    bool sorted = true;
+
+    if (!parent || !parent->children || !parent->children->next)
+        return;
+
+    for (child = parent->children; child; child = child->next)
+        count++;
+    items = g_new (sch_sort_item, count * 2);
+    from = items;
+    to = items + count;
+    for (child = parent->children, i = 0; child; child = child->next, i++)
+    {
+        from[i].node = child;
+        from[i].index = get_index (child, schema);
+        if (i && from[i].index < from[i - 1].index)
+            sorted = false;
+    }
+
+    if (!sorted)
+    {
+        /* Bottom up merge sort so long lists cannot exhaust the stack */
+        for (guint width = 1; width < count; width *= 2)
+        {
+            for (guint lo = 0; lo < count; lo += 2 * width)
+            {
+                guint mid = MIN (lo + width, count);
+                guint hi = MIN (lo + 2 * width, count);
+                guint l = lo, r = mid, k = lo;
+
+                while (l < mid && r < hi)
+                    to[k++] = from[r].index < from[l].index ? from[r++] : from[l++];
+                while (l < mid)
+                    to[k++] = from[l++];
+                while (r < hi)
+                    to[k++] = from[r++];
+            }
+            tmp = from;
+            from = to;
+            to = tmp;
+        }
+
+        /* Relink the children in their new order */
+        parent->children = from[0].node;
+        for (i = 0; i < count; i++)
+        {
+            from[i].node->prev = i ? from[i - 1].node : NULL;
+            from[i].node->next = i + 1 < count ? from[i + 1].node : NULL;
+        }
+    }
+    g_free (items);
+}
+
+static char *
+decode_json_type (json_t *json)
+{
+    char *value;
+    if (json_is_integer (json))
+        value = g_strdup_printf ("%" JSON_INTEGER_FORMAT, json_integer_value (json));
+    else if (json_is_boolean (json))
+        value = g_strdup_printf ("%s", json_is_true (json) ? "true" : "false");
+    else
+        value = g_strdup (json_string_value (json));
+    return value;
+}
+
+static bool
+is_bool (xmlNodePtr parent)
+{
+    unsigned long value_count = 0;
+    xmlNodePtr child;
+    bool have_true = false;
+    bool have_false = false;
+    char *name;
+
+    if (!parent || !parent->children)
+        return false;
+
+    if (NODE_INFO (parent))
+    {
+        sch_node_info *info = NODE_INFO (parent);
+        return info->value_count == 2 && enum_by_name (info, "true") && enum_by_name (info, "false");
+    }
+
+    child = parent->children;
+    while (child != NULL) {
+        /* Check for VALUE type nodes. Ignore nodes like WATCH or PROVIDE. */
+        if (child->type == XML_ELEMENT_NODE && g_strcmp0 ((char *)child->name, "VALUE") == 0) {
+            value_count++;
+            if (value_count > 2)
+                break;
+
+            name = (char *) xmlGetProp (child, (xmlChar *) "name");
+            if (g_strcmp0 (name, "true") == 0)
+                have_true = true;
+            else if (g_strcmp0 (name, "false") == 0)
+                have_false = true;
+            free (name);
+        }
+        child = child->next;
+    }
+
+    return value_count == 2 && have_true && have_false;
+}
+
+/* Work out which JSON type a schema value should be encoded as */
+static json_type
+json_value_type (sch_node *schema, const char *val, json_int_t *integer)
+{
+    json_int_t i;
+    char *p;
+
+    /* Only try and detect non string types if no pattern */
+    if (*val != '\0' && !xmlHasProp ((xmlNode *)schema, (const xmlChar *)"pattern"))
+    {
+        /* Integers MUST(in XML) have a range property */
+        if (xmlHasProp ((xmlNode *)schema, (const xmlChar *)"range"))
         {
-            pred = strchr (name, '[');
-            if (pred)
+            i = strtoll (val, &p, 10);
+            if (*p == '\0')
             {
-                char *temp = g_strndup (name, pred - name);
-                pred = g_strdup (pred);
-                free (name);
-                name = temp;
+                *integer = i;
+                return JSON_INTEGER;
             }
         }
+        /* boolean MUST(in xml) be an enum of exactly two entities */
+        if (is_bool ((xmlNode *)schema))
+        {
+            if (g_strcmp0 (val, "true") == 0)
+                return JSON_TRUE;
+            else if (g_strcmp0 (val, "false") == 0)
+                return JSON_FALSE;
+        }
+    }
+    return JSON_STRING;
+}
+
+static json_t *
+encode_json_type (sch_node *schema, const char *val)
+{
+    json_int_t i;
+
+    switch (json_value_type (schema, val, &i))
+    {
+    case JSON_INTEGER:
+        return json_integer (i);
+    case JSON_TRUE:
+        return json_true ();
+    case JSON_FALSE:
+        return json_false ();
+    default:
+        return json_string (val);
+    }
+}
+
+static sch_node *
+sch_traverse_get_schema (sch_instance * instance, GNode *node, int flags)
+{
+    sch_node *schema;
+    char *colon;
+    xmlNs *ns = NULL;
+    char *name = APTERYX_NAME (node);
+    if (name[0] == '/')
+        name = name + 1;
+
+    /* Check for a change in namespace */
+    schema = xmlDocGetRootElement (instance->doc);
+    colon = strchr (name, ':');
+    if (colon)
+    {
+        char *namespace = g_strndup (name, colon - name);
+        xmlNs *nns = _sch_lookup_ns (instance, schema, namespace, flags, false);
+        free (namespace);
+        if (nns)
+        {
+             /* We found a namespace. Skip the prefix */
+            name = colon + 1;
+            ns = nns;
+        }
+    }
+
+    /* Find schema node */
+    schema = _sch_node_child (ns, schema, name);
+    if (schema == NULL)
+    {
+        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for node %s\n", name);
+        return NULL;
+    }
+    return schema;
+}
+
+
+/* Parallel list processing (SCH_F_PARALLEL). List entries are independent so
+ * large lists are split into chunks of entries handled on a thread pool. The
+ * error reported is the one the sequential walk would have left: the first
+ * failure, or else the last error recorded. Chunks after a failed one stop,
+ * as the sequential walk would not have reached them */
+#define SCH_PARALLEL_MIN    1024
+#define SCH_PARALLEL_CHUNK  256
+
+typedef bool (*sch_entry_func) (GNode *entry, guint i, gpointer context);
+
+typedef struct _sch_parallel_job
+{
+    sch_entry_func func;
+    gpointer context;
+    gint failed;                /* First entry of the earliest failed chunk */
+} sch_parallel_job;
+
+typedef struct _sch_parallel_chunk
+{
+    GNode *first;
+    guint start;
+    guint count;
+    bool rc;
+    sch_err error;
+    char *errmsg;
+} sch_parallel_chunk;
+
+/* Set in workers so lists inside list entries are not split again */
+static __thread bool tl_parallel = false;
+
+static bool
+parallel_entries (GNode *parent, int flags)
+{
+    /* Arenas belong to one thread so trees built in one stay sequential */
+    return (flags & SCH_F_PARALLEL) && !(flags & SCH_F_DEBUG) && !tl_parallel &&
+        !tl_arena && g_node_n_children (parent) >= SCH_PARALLEL_MIN;
+}
+
+static void
+parallel_chunk_run (gpointer data, gpointer user_data)
+{
+    sch_parallel_chunk *chunk = data;
+    sch_parallel_job *job = user_data;
+    GNode *entry = chunk->first;
+
+    tl_parallel = true;
+    tl_error = SCH_E_SUCCESS;
+    chunk->rc = true;
+    for (guint i = 0; i < chunk->count && chunk->rc; i++, entry = entry->next)
+    {
+        if ((guint) g_atomic_int_get (&job->failed) < chunk->start)
+            break;
+        chunk->rc = job->func (entry, chunk->start + i, job->context);
+    }
+    if (!chunk->rc)
+    {
+        gint failed = g_atomic_int_get (&job->failed);
+
+        while ((guint) failed > chunk->start &&
+               !g_atomic_int_compare_and_exchange (&job->failed, failed, chunk->start))
+            failed = g_atomic_int_get (&job->failed);
+    }
+    chunk->error = tl_error;
+    if (tl_error != SCH_E_SUCCESS)
+        chunk->errmsg = g_strdup (tl_errmsg);
+    tl_parallel = false;
+}
+
+/* Call func for every child of parent, in chunks across threads */
+static bool
+sch_parallel_entries (GNode *parent, sch_entry_func func, gpointer context)
+{
+    sch_parallel_job job = { func, context, G_MAXINT };
+    guint count = g_node_n_children (parent);
+    guint chunks = (count + SCH_PARALLEL_CHUNK - 1) / SCH_PARALLEL_CHUNK;
+    sch_parallel_chunk *chunk = g_new0 (sch_parallel_chunk, chunks);
+    sch_parallel_chunk *report = NULL;
+    sch_err error = tl_error;
+    GList *list = NULL;
+    GNode *entry = parent->children;
+    bool rc = true;
+
+    for (guint c = 0; c < chunks; c++)
+    {
+        chunk[c].first = entry;
+        chunk[c].start = c * SCH_PARALLEL_CHUNK;
+        chunk[c].count = MIN (SCH_PARALLEL_CHUNK, count - chunk[c].start);
+        for (guint i = 0; i < chunk[c].count; i++)
+            entry = entry->next;
+        list = g_list_prepend (list, &chunk[c]);
+    }
+    list = g_list_reverse (list);
+    sch_parallel_foreach (list, parallel_chunk_run, &job);
+    g_list_free (list);
+
+    for (guint c = 0; c < chunks && rc; c++)
+    {
+        if (chunk[c].error != SCH_E_SUCCESS)
+            report = &chunk[c];
+        rc = chunk[c].rc;
+    }
+    if (report)
+    {
+        tl_error = report->error;
+        snprintf (tl_errmsg, BUFSIZ - 1, "%s", report->errmsg);
+    }
+    else
+    {
+        tl_error = error;
+    }
+    for (guint c = 0; c < chunks; c++)
+        g_free (chunk[c].errmsg);
+    g_free (chunk);
+    return rc;
+}
+
+/* Wide data nodes get a temporary index of their children by name so each
+ * schema child is found without scanning them all. Not worth it for a lone
+ * schema child such as the "*" of a list */
+#define SCH_TRAVERSE_INDEX_MIN 32
+
+static GHashTable *
+traverse_index_new (GNode *parent, sch_node *schema)
+{
+    GHashTable *index;
+
+    if (NODE_INFO (schema)->child_count < 2 || g_node_n_children (parent) < SCH_TRAVERSE_INDEX_MIN)
+        return NULL;
+    index = g_hash_table_new (g_str_hash, g_str_equal);
+    for (GNode *child = parent->children; child; child = child->next)
+    {
+        /* apteryx_find_child finds the first of any duplicates. Just scan for those */
+        if (!APTERYX_NAME (child) || g_hash_table_contains (index, APTERYX_NAME (child)))
+        {
+            g_hash_table_destroy (index);
+            return NULL;
+        }
+        g_hash_table_insert (index, APTERYX_NAME (child), child);
+    }
+    return index;
+}
+
+static void
+traverse_index_free (GHashTable *index)
+{
+    if (index)
+        g_hash_table_destroy (index);
+}
+
+/* Keep the index in step with children added to or removed from parent */
+static void
+traverse_index_add (GHashTable *index, GNode *parent, GNode *child)
+{
+    if (index && child->parent == parent)
+        g_hash_table_insert (index, APTERYX_NAME (child), child);
+}
+
+static void
+traverse_index_remove (GHashTable *index, GNode *parent, GNode *child)
+{
+    if (index && child->parent == parent)
+        g_hash_table_remove (index, APTERYX_NAME (child));
+}
+
+static bool _sch_traverse_nodes (sch_instance * instance, sch_node * schema, GNode * parent,
+                                 GHashTable * index, int flags, int depth, int rdepth,
+                                 const sch_page *page);
+
+/* Walk the schema children of schema over the data node node */
+static bool
+traverse_children (sch_instance * instance, sch_node * schema, GNode * node, int flags, int depth, int rdepth,
+                   const sch_page *page)
+{
+    GHashTable *index = traverse_index_new (node, schema);
+    bool rc = true;
+
+    for (sch_node *s = sch_node_child_first (schema); s && rc; s = sch_node_next_sibling (s))
+    {
+        if (flags & SCH_F_FILTER_RDEPTH)
+            rc = _sch_traverse_nodes (instance, s, node, index, flags, depth + 1, rdepth, page);
         else
+            rc = _sch_traverse_nodes (instance, s, node, index, flags, 0, 0, page);
+    }
+    traverse_index_free (index);
+    return rc;
+}
+
+typedef struct _sch_traverse_context
+{
+    sch_instance *instance;
+    sch_node *schema;
+    int flags;
+    int depth;
+    int rdepth;
+} sch_traverse_context;
+
+static bool
+traverse_entry (GNode *entry, guint i, gpointer data)
+{
+    sch_traverse_context *context = data;
+
+    return traverse_children (context->instance, context->schema, entry, context->flags,
+                              context->depth, context->rdepth, NULL);
+}
+
+static bool
+_sch_traverse_nodes (sch_instance * instance, sch_node * schema, GNode * parent, GHashTable * index,
+                     int flags, int depth, int rdepth, const sch_page *page)
+{
+    const char *name = sch_name_ref (schema);
+    char *pname = NULL;
+    GNode *child = index ? g_hash_table_lookup (index, name) : apteryx_find_child (parent, name);
+    bool rc = true;
+
+
+    if (sch_is_proxy (schema) && g_strcmp0 (name, "*") == 0)
+    {
+        xmlNs *nns = NULL;
+        char *colon;
+
+        /* move to the list index specifier */
+        child = parent->children;
+        if (!child)
         {
-            equals = strchr (name, '=');
-            if (equals)
+            rc = false;
+            goto exit;
+        }
+        /* skip over the list index specifier */
+        child = child->children;
+        if (!child)
+        {
+            rc = false;
+            goto exit;
+        }
+        pname = g_strdup (APTERYX_NAME (child));
+        schema = xmlDocGetRootElement (instance->doc);
+        colon = strchr (pname, ':');
+        if (schema && colon)
+        {
+            colon[0] = '\0';
+            nns = sch_lookup_ns (instance, schema, pname, flags, false);
+            if (!nns)
             {
-                char *temp = g_strndup (name, equals - name);
-                equals = g_strdup (equals + 1);
-                free (name);
-                name = temp;
+                /* No namespace found assume the node is supposed to have a colon in it */
+                colon[0] = ':';
+            }
+            else
+            {
+                /* We found a namespace. Remove the prefix */
+                char *_name = pname;
+                pname = g_strdup (colon + 1);
+                free (_name);
             }
         }
+        schema = _sch_node_child (nns, schema, pname);
+        name = schema ? sch_name_ref (schema) : pname;
+        depth++;
+    }
 
-        /* Find schema node */
-        if (schema && sch_is_proxy (schema))
+    if (sch_is_leaf (schema))
+    {
+        if ((!child && flags & SCH_F_ADD_MISSING_NULL))
         {
-            /* The schema containing the proxy node can have children */
-            sch_node *child = sch_ns_node_child (ns, schema, name);
-            if (!child)
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
             {
-                is_proxy = sch_is_proxy (schema);
+                child = APTERYX_LEAF (parent, g_strdup (name), g_strdup (""));
+                traverse_index_add (index, parent, child);
             }
         }
-
-        if (!schema || is_proxy)
+        else if (child && flags & SCH_F_SET_NULL)
         {
-            schema = xmlDocGetRootElement (instance->doc);
-            /* Detect change in namespace with the new schema */
-            colon = strchr (name, ':');
-            if (colon)
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
             {
-                colon[0] = '\0';
-                nns = _sch_lookup_ns (instance, schema, name, flags, false);
-                if (!nns)
+                if (sch_is_hidden (schema) ||
+                   (flags & SCH_F_CONFIG && !sch_is_writable (schema)))
                 {
-                    /* No namespace found assume the node is supposed to have a colon in it */
-                    colon[0] = ':';
+                    DEBUG (flags, "Silently ignoring node \"%s\"\n", name);
+                    traverse_index_remove (index, parent, child);
+                    free ((void *)child->children->data);
+                    free ((void *)child->data);
+                    g_node_destroy (child);
+                }
+                else if (!sch_is_writable (schema))
+                {
+                    ERROR (flags, SCH_E_NOTWRITABLE, "Node not writable \"%s\"\n", name);
+                    rc = false;
+                    goto exit;
                 }
                 else
                 {
-                    /* We found a namespace. Remove the prefix */
-                    char *_name = name;
-                    name = g_strdup (colon + 1);
-                    free (_name);
-                    ns = nns;
+                    free (child->children->data);
+                    child->children->data = g_strdup ("");
                 }
             }
         }
-
-        last_good_schema = schema;
-        schema = _sch_node_child (ns, schema, name);
-        if ((flags & SCH_F_XPATH) && schema == NULL && g_strcmp0 (name, "*") == 0)
+        else if (flags & SCH_F_ADD_DEFAULTS)
         {
-            GList *path_list = NULL;
-            bool found = sch_node_find_name (instance, ns, last_good_schema, next, flags, &path_list);
-            if (found)
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth ||
+                (depth == rdepth - 1 && child && g_strcmp0(name, APTERYX_NAME (child)) == 0)))
             {
-                GList *list;
-                int len = 0;
-                bool first = true;
-                for (list = g_list_first (path_list); list; list = g_list_next (list))
+                /* We do not need to do anything at all if this leaf does not have a default */
+                const char *value = sch_translate_from_ref (schema, sch_default_value_ref (schema));
+                if (value)
                 {
-                    len += strlen ((char *) list->data);
+                    /* Add completely missing leaves */
+                    if (!child)
+                    {
+                        child = APTERYX_LEAF (parent, g_strdup (name), g_strdup (value));
+                        traverse_index_add (index, parent, child);
+                    }
+                    /* Add missing values */
+                    else if (!APTERYX_HAS_VALUE (child))
+                    {
+                        APTERYX_NODE (child, g_strdup (value));
+                    }
+                    /* Replace empty value */
+                    else if (APTERYX_VALUE (child) == NULL || g_strcmp0 (APTERYX_VALUE (child), "") == 0)
+                    {
+                        free (child->children->data);
+                        child->children->data = g_strdup (value);
+                    }
                 }
-
-                if (len)
+            }
+        }
+        else if (child && (flags & SCH_F_TRIM_DEFAULTS))
+        {
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
+            {
+                const char *value = sch_translate_from_ref (schema, sch_default_value_ref (schema));
+                if (value)
                 {
-                    /* Note - the 64 bytes added to the length is to allow for extra slashes being added to the path */
-                    len += strlen (path) +  64;
-                    new_path = g_malloc0 (len);
-                    len = 0;
-                    /* Ammend the path with the new information. Note we drop the last list
-                     * item as it contains a duplicate star slash already in the path */
-                    for (list = g_list_first (path_list); list; list = g_list_next (list))
+                    if (g_strcmp0 (APTERYX_VALUE (child), value) == 0)
                     {
-                        if (first)
-                        {
-                            g_free (name);
-                            name = (char *) list->data;
-                            first = false;
-                        }
-                        else
-                        {
-                            if (list->next)
-                                len += sprintf (new_path + len, "/%s", (char *) list->data);
-                            g_free (list->data);
-                        }
+                        traverse_index_remove (index, parent, child);
+                        free ((void *)child->children->data);
+                        free ((void *)child->data);
+                        g_node_destroy (child);
+                        child = NULL;
                     }
-                    sprintf (new_path + len, "/%s", path);
-                    next = new_path;
                 }
-                g_list_free (path_list);
-                if (new_path)
-                    schema = _sch_node_child (ns, last_good_schema, name);
             }
         }
-
-        /* Check RPC's are not bypassed */
-        if (schema && next && next[0] != '\0' && sch_is_executable (schema))
+    }
+    else if (g_strcmp0 (name, "*") == 0)
+    {
+        /* Only the entries in the page are kept, in key order. Lists inside them are not paged */
+        if (page)
         {
-            DEBUG (flags, "Tried to access parameter node of RPC\n");
-            schema = NULL;
-        }
+            GPtrArray *entries = page_entries (parent, page, page_order (schema));
 
-        if (schema == NULL)
-        {
-            ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for %s%s%s\n", ns ? (char *) ns->prefix : "",
-                   ns ? ":" : "", name);
-            goto exit;
+            for (guint i = 0; i < entries->len; i++)
+                g_node_unlink (g_ptr_array_index (entries, i));
+            while (parent->children)
+                apteryx_free_tree (parent->children);
+            for (guint i = 0; i < entries->len; i++)
+                g_node_append (parent, g_ptr_array_index (entries, i));
+            g_ptr_array_free (entries, TRUE);
         }
-
-        /* Create node - include namespace node mapping if required */
-        if (depth == 0 || nns || is_proxy)
+        if (parallel_entries (parent, flags))
         {
-            if (ns && ns->prefix && !_sch_ns_native (instance, ns))
-            {
-                rnode = APTERYX_NODE (NULL, g_strdup_printf ("%s%s:%s", depth == 0 ? "/" : "", ns->prefix, name));
-            }
-            else
-            {
-                rnode = APTERYX_NODE (NULL, g_strdup_printf ("%s%s", depth == 0 ? "/" : "", name));
-            }
-            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (rnode));
+            sch_traverse_context context = { instance, schema, flags, depth, rdepth };
+
+            rc = sch_parallel_entries (parent, traverse_entry, &context);
+            if (!rc)
+                goto exit;
         }
         else
         {
-            rnode = APTERYX_NODE (NULL, name);
-            name = NULL;
+            for (GNode *child = parent->children; child; child = child->next)
+            {
+                rc = traverse_children (instance, schema, child, flags, depth, rdepth, NULL);
+                if (!rc)
+                    goto exit;
+            }
         }
-        DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (rnode));
-
-        /* XPATH predicates */
-        if (pred && sch_is_list (schema))
+    }
+    else if (sch_is_leaf_list (schema))
+    {
+        if (flags & SCH_F_SET_NULL)
         {
-            char key[128 + 1];
-            char value[128 + 1];
-
-            schema = sch_node_child_first (schema);
-            if (sscanf (pred, "[%128[^=]='%128[^']']", key, value) == 2) {
-                // TODO make sure this key is the list key
-                child = APTERYX_NODE (NULL, g_strdup (value));
-                g_node_prepend (rnode, child);
-                depth++;
-                DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
-                if (next)
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
+            {
+                for (GNode *child = parent->children->children; child; child = child->next)
                 {
-                    if ((flags & SCH_F_XPATH) == 0 || !sch_is_proxy (schema) )
-                        APTERYX_NODE (child, g_strdup (key));
-                    depth++;
-                    DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
+                    free (child->children->data);
+                    child->children->data = g_strdup ("");
                 }
             }
-            g_free (pred);
         }
-        else if (equals && sch_is_list (schema))
+    }
+    else
+    {
+        if (!child && !sch_is_list (schema) && (flags & (SCH_F_ADD_DEFAULTS|SCH_F_TRIM_DEFAULTS|SCH_F_ADD_MISSING_NULL)))
         {
-            child = APTERYX_NODE (NULL, g_strdup (equals));
-            g_node_prepend (rnode, child);
-            depth++;
-            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (child));
-            g_free (equals);
-            schema = sch_node_child_first (schema);
+            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
+            {
+                child = APTERYX_NODE (parent, g_strdup (name));
+                traverse_index_add (index, parent, child);
+            }
         }
-
-        if (next)
+        if (child)
         {
-            node = _sch_path_to_gnode (instance, &schema, ns, next, flags, depth + 1);
-            if (!node)
-            {
-                free ((void *)rnode->data);
-                g_node_destroy (rnode);
-                rnode = NULL;
+            rc = traverse_children (instance, schema, child, flags, depth, rdepth, page);
+            if (!rc)
                 goto exit;
-            }
-            g_node_prepend (child ? : rnode, node);
+        }
+    }
+
+    /* Prune empty branches (unless it's a presence container) */
+    if (child && !child->children && !sch_is_leaf (schema))
+    {
+        xmlNode *children = ((xmlNode *)schema)->children;
+        if ((!children && (flags & SCH_F_ADD_DEFAULTS)) ||
+            children || (flags & SCH_F_TRIM_DEFAULTS))
+        {
+            DEBUG (flags, "Throwing away node \"%s\"\n", APTERYX_NAME (child));
+            traverse_index_remove (index, parent, child);
+            free ((void *)child->data);
+            g_node_destroy (child);
         }
     }
 
 exit:
-    if (rschema)
-        *rschema = schema;
-    free (name);
-    g_free (new_path);
-    return rnode;
+    free (pname);
+    return rc;
 }
 
-GNode *
-sch_path_to_gnode (sch_instance * instance, sch_node * schema, const char *path, int flags, sch_node ** rschema)
+static bool
+traverse_tree (sch_instance * instance, sch_node * schema, GNode * node, int flags, int rdepth,
+               const sch_page *page)
 {
-    GNode *node;
-    char *_path = NULL;
+    bool rc = false;
+
+    /* Traversal adds and frees nodes individually */
+    if (node_in_arena (node))
+    {
+        ERROR (flags, SCH_E_INTERNAL, "Can't traverse a tree built in an arena");
+        return false;
+    }
+    if (flags & SCH_F_FILTER_RDEPTH)
+    {
+        schema = sch_traverse_get_schema (instance, node, flags);
+        if (schema)
+        {
+            GHashTable *index = traverse_index_new (node, schema);
+
+            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
+            {
+                rc = _sch_traverse_nodes (instance, s, node, index, flags, 1, rdepth, page);
+                if (!rc)
+                    break;
+            }
+            traverse_index_free (index);
+        }
+    }
+    else
+    {
+        schema = schema ?: xmlDocGetRootElement (instance->doc);
+        /* if this has been called from restconf, then the schema may be at a proxy node */
+        if (sch_is_proxy (schema))
+        {
+            xmlNs *nns = NULL;
+            char *colon;
+            char *name;
+
+            /* move to the list index specifier */
+            node = node->children;
+            if (!node)
+                return rc;
+            name = g_strdup (APTERYX_NAME (node));
+            schema = xmlDocGetRootElement (instance->doc);
+            colon = strchr (name, ':');
+            if (schema && colon)
+            {
+                colon[0] = '\0';
+                nns = sch_lookup_ns (instance, schema, name, flags, false);
+                if (!nns)
+                {
+                    /* No namespace found assume the node is supposed to have a colon in it */
+                    colon[0] = ':';
+                }
+                else
+                {
+                    /* We found a namespace. Remove the prefix */
+                    char *_name = name;
+                    name = g_strdup (colon + 1);
+                    free (_name);
+                }
+            }
+            schema = _sch_node_child (nns, schema, name);
+            g_free (name);
+            if (!schema)
+                return rc;
+        }
 
-    if ((flags & SCH_F_XPATH))
-    {
-        if (strstr (path, "//"))
+        if (sch_is_leaf (schema))
         {
-            char **split = g_strsplit (path, "//", -1);
-            _path = g_strjoinv ("/*/", split);
-            g_strfreev (split);
-            path = _path;
+            rc = _sch_traverse_nodes (instance, schema, node->parent, NULL, flags, 0, 0, page);
+        }
+        else
+        {
+            GHashTable *index = traverse_index_new (node, schema);
+
+            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
+            {
+                rc = _sch_traverse_nodes (instance, s, node, index, flags, 0, 0, page);
+                if (!rc)
+                    break;
+            }
+            traverse_index_free (index);
         }
     }
-    node = _sch_path_to_gnode (instance, rschema, NULL, path, flags, 0);
-    g_free (_path);
+    return rc;
+}
 
-    return node;
+bool
+sch_traverse_tree (sch_instance * instance, sch_node * schema, GNode * node, int flags, int rdepth)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    bool rc = traverse_tree (instance, schema, node, flags, rdepth, NULL);
+    stats_record (SCH_STAT_TRAVERSE_TREE, start);
+    return rc;
 }
 
-GNode *
-sch_path_to_query (sch_instance * instance, sch_node * schema, const char *path, int flags)
+bool
+sch_traverse_tree_paged (sch_instance * instance, sch_node * schema, GNode * node, int flags, int rdepth,
+                         const sch_page *page)
 {
-    char *_path = NULL;
-    char *query;
-    GNode *root;
-    int depth;
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    bool rc = traverse_tree (instance, schema, node, flags, rdepth, (flags & SCH_F_PAGED) ? page : NULL);
+    stats_record (SCH_STAT_TRAVERSE_TREE, start);
+    return rc;
+}
 
-    /* Split off any query first */
-    query = strchr (path, '?');
-    if (query)
-    {
-        path = _path = g_strndup (path, query - path);
-        query++; /* Skip past the '?' */
-    }
+/* Find the readable schema node for a GNode being encoded as JSON,
+ * following namespace prefixes and proxies. Updates the namespace */
+static sch_node *
+gnode_json_schema (sch_instance * instance, sch_node * schema, xmlNs **rns, GNode * node, int flags, int depth)
+{
+    xmlNs *ns = *rns;
+    char *colon;
+    char *name;
 
-    /* Parse the path first */
-    tl_error = SCH_E_SUCCESS;
-    root = _sch_path_to_gnode (instance, &schema, NULL, path, flags, 0);
-    if (!root || !schema)
+    if (depth == 0 && APTERYX_NAME (node)[0] == '/')
     {
-        free (_path);
-        return NULL;
+        name = g_strdup (APTERYX_NAME (node) + 1);
     }
-    if (sch_is_leaf (schema) && !sch_is_readable (schema))
+    else
     {
-        free (_path);
-        return NULL;
+        name = g_strdup (APTERYX_NAME (node));
     }
 
-    /* Process the query */
-    depth = g_node_max_height (root);
-    if (query && !_sch_query_to_gnode (root, schema, query, &flags, depth))
+    colon = strchr (name, ':');
+    if (colon)
     {
-        apteryx_free_tree (root);
-        root = NULL;
+        colon[0] = '\0';
+        xmlNs *nns = _sch_lookup_ns (instance, schema, name, flags, false);
+        if (!nns)
+        {
+            /* No namespace found assume the node is supposed to have a colon in it */
+            colon[0] = ':';
+        }
+        else
+        {
+            /* We found a namespace. Remove the prefix */
+            char *_name = name;
+            name = g_strdup (colon + 1);
+            free (_name);
+            ns = nns;
+        }
     }
 
-    /* Without a query we may need to add a wildcard to get everything from here down */
-    if (!query || (depth == g_node_max_height (root) && !(flags & SCH_F_DEPTH_ONE)))
+    /* Find schema node */
+    if (sch_is_proxy (schema))
     {
-        if (schema && sch_node_child_first (schema) && !(flags & SCH_F_STRIP_DATA))
+        /* Two possible cases, the node is a child of the proxy node or we need to
+         * move to access the remote database via the proxy */
+        schema = _sch_node_child (ns, schema, name);
+        if (!schema)
         {
-            /* Find end of the path node */
-            GNode *node = root;
-            while (node->children)
-                node = node->children;
-            /* Get everything from here down if we do not already have a star */
-            if (node && !g_node_first_child(node) && g_strcmp0 (APTERYX_NAME (node), "*") != 0)
+            schema = xmlDocGetRootElement (instance->doc);
+            colon = strchr (name, ':');
+            if (schema && colon)
             {
-                APTERYX_NODE (node, g_strdup ("*"));
-                DEBUG (flags, "%*s%s\n", g_node_max_height (root) * 2, " ", "*");
+                colon[0] = '\0';
+                xmlNs *nns = sch_lookup_ns (instance, schema, name, flags, false);
+                if (!nns)
+                {
+                    /* No namespace found assume the node is supposed to have a colon in it */
+                    colon[0] = ':';
+                }
+                else
+                {
+                    /* We found a namespace. Remove the prefix */
+                    char *_name = name;
+                    name = g_strdup (colon + 1);
+                    free (_name);
+                    ns = nns;
+                }
             }
+            schema = _sch_node_child (ns, schema, name);
         }
     }
-
-    free (_path);
-    return root;
-}
-
-static int
-get_index (GNode * node, sch_node * schema)
-{
-    int index = 0;
-    sch_node *n;
-    for (n = sch_node_child_first (schema); n; index++, n = sch_node_next_sibling (n))
+    else
     {
-        char *name = sch_name (n);
-        if (g_strcmp0 (name, (char *) node->data) == 0)
-        {
-            free (name);
-            break;
-        }
-        free (name);
+        if (!schema)
+            schema = xmlDocGetRootElement (instance->doc);
+        schema = _sch_node_child (ns, schema, name);
     }
-    return index;
-}
 
-static GNode *
-merge (GNode * left, GNode * right, sch_node * schema)
-{
-    if (!left)
-        return right;
-    if (!right)
-        return left;
-    int ri = get_index (right, schema);
-    int li = get_index (left, schema);
-    if (ri > li)
-    {
-        left->next = merge (left->next, right, schema);
-        left->next->prev = left;
-        left->prev = NULL;
-        return left;
-    }
-    else
+    if (schema == NULL)
     {
-        right->next = merge (left, right->next, schema);
-        right->next->prev = right;
-        right->prev = NULL;
-        return right;
+        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for gnode %s%s%s\n",
+               ns ? (char *) ns->prefix : "", ns ? ":" : "", name);
     }
-}
-
-static GNode *
-split (GNode * head)
-{
-    GNode *left, *right;
-    left = right = head;
-    while (right->next && right->next->next)
+    else if (!sch_is_readable (schema))
     {
-        right = right->next->next;
-        left = left->next;
+        ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s%s%s\n",
+               ns ? (char *) ns->prefix : "", ns ? ":" : "", name);
+        schema = NULL;
     }
-    right = left->next;
-    left->next = NULL;
-    return right;
-}
-
-static GNode *
-merge_sort (GNode * head, sch_node * schema)
-{
-    GNode *left, *right;
-    if (!head || !head->next)
-        return head;
-    left = head;
-    right = split (left);
-    left = merge_sort (left, schema);
-    right = merge_sort (right, schema);
-    return merge (left, right, schema);
+    *rns = ns;
+    free (name);
+    return schema;
 }
 
-void
-sch_gnode_sort_children (sch_node * schema, GNode * parent)
-{
-    if (parent)
-        parent->children = merge_sort (parent->children, schema);
-}
 
+/* With SCH_F_NS_PREFIX, members from a different model to their parent
+ * are named model:name. Returns NULL if the plain name should be used */
 static char *
-decode_json_type (json_t *json)
+json_member_name (xmlNs *ns, sch_node *parent, sch_node *schema, const char *name, int flags)
 {
-    char *value;
-    if (json_is_integer (json))
-        value = g_strdup_printf ("%" JSON_INTEGER_FORMAT, json_integer_value (json));
-    else if (json_is_boolean (json))
-        value = g_strdup_printf ("%s", json_is_true (json) ? "true" : "false");
-    else
-        value = g_strdup (json_string_value (json));
-    return value;
-}
-
-static bool
-is_bool (xmlNodePtr parent)
-{
-    unsigned long value_count = 0;
-    xmlNodePtr child;
-    bool have_true = false;
-    bool have_false = false;
-    char *name;
-
-    if (!parent || !parent->children)
-        return false;
-
-    child = parent->children;
-    while (child != NULL) {
-        /* Check for VALUE type nodes. Ignore nodes like WATCH or PROVIDE. */
-        if (child->type == XML_ELEMENT_NODE && g_strcmp0 ((char *)child->name, "VALUE") == 0) {
-            value_count++;
-            if (value_count > 2)
-                break;
-
-            name = (char *) xmlGetProp (child, (xmlChar *) "name");
-            if (g_strcmp0 (name, "true") == 0)
-                have_true = true;
-            else if (g_strcmp0 (name, "false") == 0)
-                have_false = true;
-            free (name);
+    if (flags & SCH_F_NS_PREFIX)
+    {
+        sch_node *cschema = _sch_node_child (ns, parent, name);
+        if (cschema && ((xmlNode *) cschema)->ns != ((xmlNode *) schema)->ns)
+        {
+            const char *model = sch_model_ref (cschema, false);
+            if (model)
+                return g_strdup_printf ("%s:%s", model, name);
         }
-        child = child->next;
     }
-
-    return value_count == 2 && have_true && have_false;
+    return NULL;
 }
 
+static json_t *_sch_gnode_to_json (sch_instance * instance, sch_node * schema, xmlNs *ns,
+                                   GNode * node, int flags, int depth, const sch_page *page);
+
+/* The object for one entry of a list as a JSON array */
 static json_t *
-encode_json_type (sch_node *schema, char *val)
+json_list_object (sch_instance * instance, sch_node * schema, xmlNs *ns, GNode * child, int flags, int depth)
 {
-    json_t *json = NULL;
-    json_int_t i;
-    char *p;
+    json_t *obj = json_object();
 
-    /* Only try and detect non string types if no pattern */
-    if (*val != '\0' && !xmlHasProp ((xmlNode *)schema, (const xmlChar *)"pattern"))
+    DEBUG (flags, "%*s%s[%s]\n", depth * 2, " ", APTERYX_NAME (child->parent),
+           APTERYX_NAME (child));
+    sch_gnode_sort_children (sch_node_child_first (schema), child);
+    for (GNode * field = child->children; field; field = field->next)
     {
-        /* Integers MUST(in XML) have a range property */
-        if (xmlHasProp ((xmlNode *)schema, (const xmlChar *)"range"))
-        {
-            i = strtoll (val, &p, 10);
-            if (*p == '\0')
-                json = json_integer (i);
-        }
-        /* boolean MUST(in xml) be an enum of exactly two entities */
-        if (!json && is_bool ((xmlNode *)schema))
-        {
-            if (g_strcmp0 (val, "true") == 0)
-                json = json_true ();
-            else if (g_strcmp0 (val, "false") == 0)
-                json = json_false ();
-        }
+        json_t *node = _sch_gnode_to_json (instance, sch_node_child_first (schema), ns, field, flags, depth + 1, NULL);
+        char *pname = json_member_name (((xmlNode *) schema)->ns, sch_node_child_first (schema),
+                                        schema, APTERYX_NAME (field), flags);
+        json_object_set_new (obj, pname ?: APTERYX_NAME (field), node);
+        free (pname);
     }
-    if (!json)
-        json = json_string (val);
-    return json;
+    return obj;
 }
 
-static sch_node *
-sch_traverse_get_schema (sch_instance * instance, GNode *node, int flags)
+typedef struct _sch_json_context
 {
+    sch_instance *instance;
     sch_node *schema;
-    char *colon;
-    xmlNs *ns = NULL;
-    char *name = APTERYX_NAME (node);
-    if (name[0] == '/')
-        name = name + 1;
-
-    /* Check for a change in namespace */
-    schema = xmlDocGetRootElement (instance->doc);
-    colon = strchr (name, ':');
-    if (colon)
-    {
-        char *namespace = g_strndup (name, colon - name);
-        xmlNs *nns = _sch_lookup_ns (instance, schema, namespace, flags, false);
-        free (namespace);
-        if (nns)
-        {
-             /* We found a namespace. Skip the prefix */
-            name = colon + 1;
-            ns = nns;
-        }
-    }
-
-    /* Find schema node */
-    schema = _sch_node_child (ns, schema, name);
-    if (schema == NULL)
-    {
-        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for node %s\n", name);
-        return NULL;
-    }
-    return schema;
-}
+    xmlNs *ns;
+    int flags;
+    int depth;
+    json_t **entries;           /* Encoded entries in order */
+} sch_json_context;
+
+static bool
+json_entry (GNode *entry, guint i, gpointer data)
+{
+    sch_json_context *context = data;
 
+    context->entries[i] = _sch_gnode_to_json (context->instance, context->schema, context->ns,
+                                              entry, context->flags, context->depth + 1, NULL);
+    return true;
+}
 
 static bool
-_sch_traverse_nodes (sch_instance * instance, sch_node * schema, GNode * parent, int flags, int depth, int rdepth)
+json_list_entry (GNode *entry, guint i, gpointer data)
 {
-    char *name = sch_name (schema);
-    GNode *child = apteryx_find_child (parent, name);
-    bool rc = true;
+    sch_json_context *context = data;
+
+    context->entries[i] = json_list_object (context->instance, context->schema, context->ns,
+                                            entry, context->flags, context->depth);
+    return true;
+}
 
+static json_t *
+_sch_gnode_to_json (sch_instance * instance, sch_node * schema, xmlNs *ns, GNode * node, int flags, int depth,
+                    const sch_page *page)
+{
+    json_t *data = NULL;
 
-    if (sch_is_proxy (schema) && g_strcmp0 (name, "*") == 0)
+    /* Get the actual node name */
+    if (depth == 0 && strlen (APTERYX_NAME (node)) == 1)
     {
-        xmlNs *nns = NULL;
-        char *colon;
+        return _sch_gnode_to_json (instance, schema, ns, node->children, flags, depth, page);
+    }
 
-        /* move to the list index specifier */
-        child = parent->children;
-        if (!child)
-        {
-            rc = false;
-            goto exit;
-        }
-        /* skip over the list index specifier */
-        child = child->children;
-        if (!child)
-        {
-            rc = false;
-            goto exit;
-        }
-        g_free (name);
-        name = g_strdup (APTERYX_NAME (child));
-        schema = xmlDocGetRootElement (instance->doc);
-        colon = strchr (name, ':');
-        if (schema && colon)
+    schema = gnode_json_schema (instance, schema, &ns, node, flags, depth);
+    if (schema == NULL)
+        return NULL;
+
+    if (sch_is_leaf_list (schema) && (flags & SCH_F_JSON_ARRAYS))
+    {
+        data = json_array ();
+        apteryx_sort_children (node, g_strcmp0);
+
+        DEBUG (flags, "%*s%s[", depth * 2, " ", APTERYX_NAME (node));
+        for (GNode * child = node->children; child; child = child->next)
         {
-            colon[0] = '\0';
-            nns = sch_lookup_ns (instance, schema, name, flags, false);
-            if (!nns)
+            bool added = false;
+            if (flags & SCH_F_JSON_TYPES)
             {
-                /* No namespace found assume the node is supposed to have a colon in it */
-                colon[0] = ':';
+                sch_node *cschema = sch_node_child_first (schema);
+                const char *value = sch_translate_to_ref (cschema, APTERYX_VALUE (child) ?: "");
+                json_array_append_new (data, encode_json_type (cschema, value));
+                DEBUG (flags, "%s%s", value, child->next ? ", " : "");
+                added = true;
             }
-            else
+            if (!added)
             {
-                /* We found a namespace. Remove the prefix */
-                char *_name = name;
-                name = g_strdup (colon + 1);
-                free (_name);
+                DEBUG (flags, "%s%s", APTERYX_VALUE (child), child->next ? ", " : "");
+                json_array_append_new (data, json_string ((const char* ) APTERYX_VALUE (child)));
             }
         }
-        schema = _sch_node_child (nns, schema, name);
-        if (schema)
+        DEBUG (flags, "]\n");
+    }
+    else if (sch_is_list (schema) && (flags & SCH_F_JSON_ARRAYS))
+    {
+        data = json_array ();
+        if (page)
         {
-            g_free (name);
-            name = sch_name (schema);
+            GPtrArray *entries = page_entries (node, page, page_order (sch_node_child_first (schema)));
+
+            for (guint i = 0; i < entries->len; i++)
+                json_array_append_new (data, json_list_object (instance, schema, ns,
+                                                               g_ptr_array_index (entries, i), flags, depth));
+            g_ptr_array_free (entries, TRUE);
         }
-        depth++;
-    }
+        else if (parallel_entries (node, flags))
+        {
+            json_t **entries = g_new0 (json_t *, g_node_n_children (node));
+            sch_json_context context = { instance, schema, ns, flags, depth, entries };
+            guint i = 0;
 
-    if (sch_is_leaf (schema))
+            apteryx_sort_children (node, g_strcmp0);
+            sch_parallel_entries (node, json_list_entry, &context);
+            for (GNode * child = node->children; child; child = child->next)
+                json_array_append_new (data, entries[i++]);
+            g_free (entries);
+        }
+        else
+        {
+            apteryx_sort_children (node, g_strcmp0);
+            for (GNode * child = node->children; child; child = child->next)
+                json_array_append_new (data, json_list_object (instance, schema, ns, child, flags, depth));
+        }
+    }
+    else if (!sch_is_leaf (schema))
     {
-        if ((!child && flags & SCH_F_ADD_MISSING_NULL))
+        json_t **entries = NULL;
+        GNode *first;
+        guint count = G_MAXUINT;
+        guint i = 0;
+
+        DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (node));
+        data = json_object();
+        sch_gnode_sort_children (schema, node);
+        first = node->children;
+        if (sch_is_list (schema) && page)
         {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
+            GPtrArray *picked = page_entries (node, page, page_order (sch_node_child_first (schema)));
+
+            /* Move the page to the front in order */
+            for (guint j = picked->len; j > 0; j--)
             {
-                child = APTERYX_LEAF (parent, name, g_strdup (""));
-                name = NULL;
+                g_node_unlink (g_ptr_array_index (picked, j - 1));
+                g_node_prepend (node, g_ptr_array_index (picked, j - 1));
             }
+            first = node->children;
+            count = picked->len;
+            g_ptr_array_free (picked, TRUE);
         }
-        else if (child && flags & SCH_F_SET_NULL)
+        else if (sch_is_list (schema) && parallel_entries (node, flags))
         {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
-            {
-                if (sch_is_hidden (schema) ||
-                   (flags & SCH_F_CONFIG && !sch_is_writable (schema)))
-                {
-                    DEBUG (flags, "Silently ignoring node \"%s\"\n", name);
-                    free ((void *)child->children->data);
-                    free ((void *)child->data);
-                    g_node_destroy (child);
-                }
-                else if (!sch_is_writable (schema))
-                {
-                    ERROR (flags, SCH_E_NOTWRITABLE, "Node not writable \"%s\"\n", name);
-                    rc = false;
-                    goto exit;
-                }
-                else
-                {
-                    free (child->children->data);
-                    child->children->data = g_strdup ("");
-                }
-            }
+            sch_json_context context = { instance, schema, ns, flags, depth, NULL };
+
+            entries = context.entries = g_new0 (json_t *, g_node_n_children (node));
+            sch_parallel_entries (node, json_entry, &context);
         }
-        else if (flags & SCH_F_ADD_DEFAULTS)
+        /* Entries of a list are not paged again */
+        if (sch_is_list (schema))
+            page = NULL;
+        for (GNode * child = first; child && count; child = child->next, count--)
         {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth ||
-                (depth == rdepth - 1 && child && g_strcmp0(name, APTERYX_NAME (child)) == 0)))
-            {
-                /* We do not need to do anything at all if this leaf does not have a default */
-                char *value = sch_translate_from (schema, sch_default_value (schema));
-                if (value)
-                {
-                    /* Add completely missing leaves */
-                    if (!child)
-                    {
-                        child = APTERYX_LEAF (parent, name, value);
-                        name = NULL;
-                        value = NULL;
-                    }
-                    /* Add missing values */
-                    else if (!APTERYX_HAS_VALUE (child))
-                    {
-                        APTERYX_NODE (child, value);
-                        value = NULL;
-                    }
-                    /* Replace empty value */
-                    else if (APTERYX_VALUE (child) == NULL || g_strcmp0 (APTERYX_VALUE (child), "") == 0)
-                    {
-                        free (child->children->data);
-                        child->children->data = value;
-                        value = NULL;
-                    }
-                    free (value);
-                }
-            }
+            json_t *node = entries ? entries[i++] : _sch_gnode_to_json (instance, schema, ns, child, flags, depth + 1, page);
+            char *pname = json_member_name (ns, schema, schema, APTERYX_NAME (child), flags);
+            json_object_set_new (data, pname ?: APTERYX_NAME (child), node);
+            free (pname);
         }
-        else if (child && (flags & SCH_F_TRIM_DEFAULTS))
+        g_free (entries);
+        /* Throw away this node if no chldren (unless it's a presence container) */
+        if (json_object_iter (data) == NULL && ((xmlNode *)schema)->children)
         {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
-            {
-                char *value = sch_translate_from (schema, sch_default_value (schema));
-                if (value)
-                {
-                    if (g_strcmp0 (APTERYX_VALUE (child), value) == 0)
-                    {
-                        free ((void *)child->children->data);
-                        free ((void *)child->data);
-                        g_node_destroy (child);
-                        child = NULL;
-                    }
-                    free (value);
-                }
-            }
+            json_decref (data);
+            data = NULL;
         }
     }
-    else if (g_strcmp0 (name, "*") == 0)
+    else if (APTERYX_HAS_VALUE (node))
     {
-        for (GNode *child = parent->children; child; child = child->next)
+        const char *value = APTERYX_VALUE (node) ? APTERYX_VALUE (node) : "";
+        if (flags & SCH_F_JSON_TYPES)
         {
-            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
-            {
-                if (flags & SCH_F_FILTER_RDEPTH)
-                {
-                    rc = _sch_traverse_nodes (instance, s, child, flags, depth+1, rdepth);
-                }
-                else
-                {
-                    rc = _sch_traverse_nodes (instance, s, child, flags, 0, 0);
-                }
-                if (!rc)
-                    goto exit;
-            }
+            value = sch_translate_to_ref (schema, value);
+            data = encode_json_type (schema, value);
         }
+        else
+            data = json_string (value);
+        DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", APTERYX_NAME (node), value);
     }
-    else if (sch_is_leaf_list (schema))
+
+    return data;
+}
+
+static gchar *
+_model_name (xmlNs *ns, char *model, char *name)
+{
+    gchar *ret;
+    gchar **n_split = g_strsplit (name, ":", 2);
+
+    /* If first part of name is actually the namespace prefix, we don't want to see it */
+    if (g_strv_length (n_split) == 2 && g_strcmp0 (n_split[0], (gchar *) ns->prefix) == 0)
     {
-        if (flags & SCH_F_SET_NULL)
+        ret = g_strdup_printf ("%s:%s", model, n_split[1]);
+    }
+    else
+    {
+        ret = g_strdup_printf ("%s:%s", model, name);
+    }
+    g_strfreev (n_split);
+    return ret;
+}
+
+static json_t *
+gnode_to_json (sch_instance * instance, sch_node * schema, GNode * node, int flags, const sch_page *page)
+{
+    sch_node *pschema = schema ? ((xmlNode *)schema)->parent : xmlDocGetRootElement (instance->doc);
+    xmlNs *ns = schema ? ((xmlNode *) schema)->ns : ((xmlNode *) pschema)->ns;
+    json_t *json = NULL;
+    json_t *child;
+
+    tl_error = SCH_E_SUCCESS;
+    child = _sch_gnode_to_json (instance, pschema, ns, node, flags, g_node_depth (node) - 1, page);
+    if (child)
+    {
+        char *name;
+        if (strlen (APTERYX_NAME (node)) == 1)
         {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
+            return child;
+        }
+        else if (APTERYX_NAME (node)[0] == '/')
+        {
+            name = APTERYX_NAME (node) + 1;
+        }
+        else
+        {
+            name = APTERYX_NAME (node);
+        }
+        if ((flags & SCH_F_NS_PREFIX) && schema)
+        {
+            char * model = sch_model (schema, false);
+            if (model)
             {
-                for (GNode *child = parent->children->children; child; child = child->next)
-                {
-                    free (child->children->data);
-                    child->children->data = g_strdup ("");
-                }
+                name = _model_name (ns, model, name);
+                json = json_object ();
+                json_object_set_new (json, name, child);
+                free (name);
+                free (model);
             }
         }
+        if (!json)
+        {
+            json = json_object ();
+            json_object_set_new (json, name, child);
+        }
+    }
+    return json;
+}
+
+json_t *
+sch_gnode_to_json (sch_instance * instance, sch_node * schema, GNode * node, int flags)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    json_t *json = gnode_to_json (instance, schema, node, flags, NULL);
+    stats_record (SCH_STAT_GNODE_TO_JSON, start);
+    return json;
+}
+
+json_t *
+sch_gnode_to_json_paged (sch_instance * instance, sch_node * schema, GNode * node, int flags,
+                         const sch_page *page)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    json_t *json = gnode_to_json (instance, schema, node, flags, (flags & SCH_F_PAGED) ? page : NULL);
+    stats_record (SCH_STAT_GNODE_TO_JSON, start);
+    return json;
+}
+
+/* Streaming JSON output. Text is collected in out and handed to the callback
+ * in chunks. Container openers are held in pending until something is
+ * written inside them, so empty containers are dropped without ever being
+ * output, the same as sch_gnode_to_json does. */
+typedef struct _sch_json_stream
+{
+    json_dump_callback_t callback;
+    void *data;
+    GString *out;
+    GString *pending;
+    bool failed;
+} sch_json_stream;
+
+#define SCH_JSON_STREAM_CHUNK 4096
+
+static void
+json_stream_flush (sch_json_stream *stream)
+{
+    if (stream->out->len && !stream->failed)
+    {
+        if (stream->callback (stream->out->str, stream->out->len, stream->data) != 0)
+            stream->failed = true;
     }
-    else
+    g_string_truncate (stream->out, 0);
+}
+
+/* Commit any pending openers and return the buffer to write to */
+static GString *
+json_stream_out (sch_json_stream *stream)
+{
+    if (stream->pending->len)
     {
-        if (!child && !sch_is_list (schema) && (flags & (SCH_F_ADD_DEFAULTS|SCH_F_TRIM_DEFAULTS|SCH_F_ADD_MISSING_NULL)))
-        {
-            if (!(flags & SCH_F_FILTER_RDEPTH) || (depth >= rdepth))
-            {
-                child = APTERYX_NODE (parent, name);
-                name = NULL;
-            }
-        }
-        if (child)
-        {
-            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
-            {
-                if (flags & SCH_F_FILTER_RDEPTH)
-                {
-                    rc = _sch_traverse_nodes (instance, s, child, flags, depth+1, rdepth);
-                }
-                else
-                {
-                    rc = _sch_traverse_nodes (instance, s, child, flags, 0, 0);
-                }
-                if (!rc)
-                    goto exit;
-            }
-        }
+        g_string_append_len (stream->out, stream->pending->str, stream->pending->len);
+        g_string_truncate (stream->pending, 0);
     }
+    if (stream->out->len >= SCH_JSON_STREAM_CHUNK)
+        json_stream_flush (stream);
+    return stream->out;
+}
 
-    /* Prune empty branches (unless it's a presence container) */
-    if (child && !child->children && !sch_is_leaf (schema))
+/* Append a quoted string escaped as jansson does. Like jansson we refuse
+ * anything that is not valid UTF-8 */
+static bool
+json_append_string (GString *buffer, const char *str)
+{
+    if (!g_utf8_validate (str, -1, NULL))
+        return false;
+    g_string_append_c (buffer, '"');
+    for (const char *p = str; *p; p++)
     {
-        xmlNode *children = ((xmlNode *)schema)->children;
-        if ((!children && (flags & SCH_F_ADD_DEFAULTS)) ||
-            children || (flags & SCH_F_TRIM_DEFAULTS))
+        switch (*p)
         {
-            DEBUG (flags, "Throwing away node \"%s\"\n", APTERYX_NAME (child));
-            free ((void *)child->data);
-            g_node_destroy (child);
+        case '"':
+            g_string_append (buffer, "\\\"");
+            break;
+        case '\\':
+            g_string_append (buffer, "\\\\");
+            break;
+        case '\b':
+            g_string_append (buffer, "\\b");
+            break;
+        case '\f':
+            g_string_append (buffer, "\\f");
+            break;
+        case '\n':
+            g_string_append (buffer, "\\n");
+            break;
+        case '\r':
+            g_string_append (buffer, "\\r");
+            break;
+        case '\t':
+            g_string_append (buffer, "\\t");
+            break;
+        default:
+            if ((unsigned char) *p < 0x20)
+                g_string_append_printf (buffer, "\\u%04X", (unsigned char) *p);
+            else
+                g_string_append_c (buffer, *p);
+            break;
         }
     }
+    g_string_append_c (buffer, '"');
+    return true;
+}
 
-exit:
-    free (name);
-    return rc;
+/* Build the ["," ]"name": text that goes before a member's value */
+static bool
+json_member_prefix (GString *prefix, bool first, const char *name)
+{
+    g_string_assign (prefix, first ? "" : ",");
+    if (!json_append_string (prefix, name))
+        return false;
+    g_string_append_c (prefix, ':');
+    return true;
 }
 
-bool
-sch_traverse_tree (sch_instance * instance, sch_node * schema, GNode * node, int flags, int rdepth)
+static bool
+json_stream_value (sch_json_stream *stream, sch_node *schema, const char *prefix, const char *value, int flags)
 {
-    bool rc = false;
-    if (flags & SCH_F_FILTER_RDEPTH)
+    json_type type = JSON_STRING;
+    json_int_t i = 0;
+    GString *out;
+
+    if (!value)
+        return false;
+    if (flags & SCH_F_JSON_TYPES)
+        type = json_value_type (schema, value, &i);
+    if (type == JSON_STRING && !g_utf8_validate (value, -1, NULL))
+        return false;
+    out = json_stream_out (stream);
+    g_string_append (out, prefix);
+    switch (type)
+    {
+    case JSON_INTEGER:
+        g_string_append_printf (out, "%" JSON_INTEGER_FORMAT, i);
+        break;
+    case JSON_TRUE:
+        g_string_append (out, "true");
+        break;
+    case JSON_FALSE:
+        g_string_append (out, "false");
+        break;
+    default:
+        json_append_string (out, value);
+        break;
+    }
+    return true;
+}
+
+/* Returns true if anything was written for this node */
+static bool
+_sch_gnode_to_json_stream (sch_json_stream *stream, sch_instance * instance, sch_node * schema, xmlNs *ns,
+                           GNode * node, int flags, int depth, const char *prefix)
+{
+    GString *member;
+    bool first = true;
+
+    /* Get the actual node name */
+    if (depth == 0 && strlen (APTERYX_NAME (node)) == 1)
     {
-        schema = sch_traverse_get_schema (instance, node, flags);
-        if (schema)
+        return _sch_gnode_to_json_stream (stream, instance, schema, ns, node->children, flags, depth, prefix);
+    }
+
+    schema = gnode_json_schema (instance, schema, &ns, node, flags, depth);
+    if (schema == NULL)
+        return false;
+
+    if (sch_is_leaf_list (schema) && (flags & SCH_F_JSON_ARRAYS))
+    {
+        sch_node *cschema = sch_node_child_first (schema);
+
+        apteryx_sort_children (node, g_strcmp0);
+        g_string_append (stream->pending, prefix);
+        g_string_append_c (stream->pending, '[');
+        for (GNode * child = node->children; child && !stream->failed; child = child->next)
         {
-            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
-            {
-                rc = _sch_traverse_nodes (instance, s, node, flags, 1, rdepth);
-                if (!rc)
-                    break;
-            }
+            const char *value = APTERYX_VALUE (child);
+            if (flags & SCH_F_JSON_TYPES)
+                value = sch_translate_to_ref (cschema, value ?: "");
+            if (json_stream_value (stream, cschema, first ? "" : ",", value, flags))
+                first = false;
         }
+        g_string_append_c (json_stream_out (stream), ']');
+        return true;
     }
-    else
+    else if (sch_is_list (schema) && (flags & SCH_F_JSON_ARRAYS))
     {
-        schema = schema ?: xmlDocGetRootElement (instance->doc);
-        /* if this has been called from restconf, then the schema may be at a proxy node */
-        if (sch_is_proxy (schema))
+        sch_node *entry = sch_node_child_first (schema);
+
+        member = g_string_new (NULL);
+        apteryx_sort_children (node, g_strcmp0);
+        g_string_append (stream->pending, prefix);
+        g_string_append_c (stream->pending, '[');
+        for (GNode * child = node->children; child && !stream->failed; child = child->next)
         {
-            xmlNs *nns = NULL;
-            char *colon;
-            char *name;
+            bool ffirst = true;
 
-            /* move to the list index specifier */
-            node = node->children;
-            if (!node)
-                return rc;
-            name = g_strdup (APTERYX_NAME (node));
-            schema = xmlDocGetRootElement (instance->doc);
-            colon = strchr (name, ':');
-            if (schema && colon)
+            g_string_append (json_stream_out (stream), first ? "{" : ",{");
+            first = false;
+            sch_gnode_sort_children (entry, child);
+            for (GNode * field = child->children; field && !stream->failed; field = field->next)
             {
-                colon[0] = '\0';
-                nns = sch_lookup_ns (instance, schema, name, flags, false);
-                if (!nns)
-                {
-                    /* No namespace found assume the node is supposed to have a colon in it */
-                    colon[0] = ':';
-                }
-                else
-                {
-                    /* We found a namespace. Remove the prefix */
-                    char *_name = name;
-                    name = g_strdup (colon + 1);
-                    free (_name);
-                }
+                char *pname = json_member_name (((xmlNode *) schema)->ns, entry, schema, APTERYX_NAME (field), flags);
+                if (json_member_prefix (member, ffirst, pname ?: APTERYX_NAME (field)) &&
+                    _sch_gnode_to_json_stream (stream, instance, entry, ns, field, flags, depth + 1, member->str))
+                    ffirst = false;
+                free (pname);
             }
-            schema = _sch_node_child (nns, schema, name);
-            g_free (name);
-            if (!schema)
-                return rc;
+            g_string_append_c (json_stream_out (stream), '}');
         }
+        g_string_append_c (json_stream_out (stream), ']');
+        g_string_free (member, true);
+        return true;
+    }
+    else if (!sch_is_leaf (schema))
+    {
+        size_t mark = stream->pending->len;
 
-        if (sch_is_leaf (schema))
+        member = g_string_new (NULL);
+        g_string_append (stream->pending, prefix);
+        g_string_append_c (stream->pending, '{');
+        sch_gnode_sort_children (schema, node);
+        for (GNode * child = node->children; child && !stream->failed; child = child->next)
         {
-            rc = _sch_traverse_nodes (instance, schema, node->parent, flags, 0, 0);
+            char *pname = json_member_name (ns, schema, schema, APTERYX_NAME (child), flags);
+            if (json_member_prefix (member, first, pname ?: APTERYX_NAME (child)) &&
+                _sch_gnode_to_json_stream (stream, instance, schema, ns, child, flags, depth + 1, member->str))
+                first = false;
+            free (pname);
         }
-        else
+        g_string_free (member, true);
+        /* Throw away this node if no chldren (unless it's a presence container) */
+        if (first && ((xmlNode *)schema)->children)
         {
-            for (sch_node *s = sch_node_child_first (schema); s; s = sch_node_next_sibling (s))
-            {
-                rc = _sch_traverse_nodes (instance, s, node, flags, 0, 0);
-                if (!rc)
-                    break;
-            }
+            g_string_truncate (stream->pending, mark);
+            return false;
         }
+        g_string_append_c (json_stream_out (stream), '}');
+        return true;
     }
-    return rc;
+    else if (APTERYX_HAS_VALUE (node))
+    {
+        const char *value = APTERYX_VALUE (node) ? APTERYX_VALUE (node) : "";
+        if (flags & SCH_F_JSON_TYPES)
+            value = sch_translate_to_ref (schema, value);
+        return json_stream_value (stream, schema, prefix, value, flags);
+    }
+    return false;
 }
 
-static json_t *
-_sch_gnode_to_json (sch_instance * instance, sch_node * schema, xmlNs *ns, GNode * node, int flags, int depth)
+bool
+sch_gnode_to_json_stream (sch_instance * instance, sch_node * schema, GNode * node, int flags,
+                          json_dump_callback_t callback, void *data)
 {
-    json_t *data = NULL;
-    char *colon;
-    char *name;
+    instance = sch_current (instance);
+    sch_node *pschema = schema ? ((xmlNode *)schema)->parent : xmlDocGetRootElement (instance->doc);
+    xmlNs *ns = schema ? ((xmlNode *) schema)->ns : ((xmlNode *) pschema)->ns;
+    guint64 start = stats_now ();
+    sch_json_stream stream = { callback, data };
+    GString *prefix = g_string_new (NULL);
+    bool wrap = strlen (APTERYX_NAME (node)) != 1;
+    bool written = true;
 
-    /* Get the actual node name */
-    if (depth == 0 && strlen (APTERYX_NAME (node)) == 1)
-    {
-        return _sch_gnode_to_json (instance, schema, ns, node->children, flags, depth);
-    }
-    else if (depth == 0 && APTERYX_NAME (node)[0] == '/')
-    {
-        name = g_strdup (APTERYX_NAME (node) + 1);
-    }
-    else
-    {
-        name = g_strdup (APTERYX_NAME (node));
-    }
+    tl_error = SCH_E_SUCCESS;
+    stream.out = g_string_sized_new (SCH_JSON_STREAM_CHUNK * 2);
+    stream.pending = g_string_new (NULL);
 
-    colon = strchr (name, ':');
-    if (colon)
+    /* Wrap the output in an object named for the node unless it is the root */
+    if (wrap)
     {
-        colon[0] = '\0';
-        xmlNs *nns = _sch_lookup_ns (instance, schema, name, flags, false);
-        if (!nns)
+        char *name = APTERYX_NAME (node)[0] == '/' ? APTERYX_NAME (node) + 1 : APTERYX_NAME (node);
+        char *model = NULL;
+
+        if ((flags & SCH_F_NS_PREFIX) && schema)
         {
-            /* No namespace found assume the node is supposed to have a colon in it */
-            colon[0] = ':';
+            model = sch_model (schema, false);
+            if (model)
+                name = _model_name (ns, model, name);
         }
-        else
+        written = json_member_prefix (prefix, true, name);
+        g_string_prepend_c (prefix, '{');
+        if (model)
         {
-            /* We found a namespace. Remove the prefix */
-            char *_name = name;
-            name = g_strdup (colon + 1);
-            free (_name);
-            ns = nns;
+            free (name);
+            free (model);
         }
     }
+    if (written)
+        written = _sch_gnode_to_json_stream (&stream, instance, pschema, ns, node, flags,
+                                             g_node_depth (node) - 1, prefix->str);
+    if (written && wrap)
+        g_string_append_c (json_stream_out (&stream), '}');
+    json_stream_flush (&stream);
 
-    /* Find schema node */
-    if (sch_is_proxy (schema))
+    g_string_free (stream.out, true);
+    g_string_free (stream.pending, true);
+    g_string_free (prefix, true);
+    stats_record (SCH_STAT_GNODE_TO_JSON, start);
+    return written && !stream.failed;
+}
+
+static GNode *
+_sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
+                   json_t * json, const char *name, int flags, int depth)
+{
+    char *colon;
+    json_t *child;
+    json_t *kchild;
+    const char *cname;
+    size_t index;
+    GNode *tree = NULL;
+    GNode *node = NULL;
+    char *key = NULL;
+    char *value;
+
+    /* Check for a change in namespace */
+    colon = strchr (name, ':');
+    if (colon)
     {
-        /* Two possible cases, the node is a child of the proxy node or we need to
-         * move to access the remote database via the proxy */
-        schema = _sch_node_child (ns, schema, name);
-        if (!schema)
+        char *namespace = g_strndup (name, colon - name);
+        xmlNs *nns = _sch_lookup_ns (instance, schema, namespace, flags, false);
+        free (namespace);
+        if (nns)
         {
-            schema = xmlDocGetRootElement (instance->doc);
-            colon = strchr (name, ':');
-            if (schema && colon)
-            {
-                colon[0] = '\0';
-                xmlNs *nns = sch_lookup_ns (instance, schema, name, flags, false);
-                if (!nns)
-                {
-                    /* No namespace found assume the node is supposed to have a colon in it */
-                    colon[0] = ':';
-                }
-                else
-                {
-                    /* We found a namespace. Remove the prefix */
-                    char *_name = name;
-                    name = g_strdup (colon + 1);
-                    free (_name);
-                    ns = nns;
-                }
-            }
-            schema = _sch_node_child (ns, schema, name);
+             /* We found a namespace. Skip the prefix */
+            name = colon + 1;
+            ns = nns;
         }
     }
-    else
-    {
-        if (!schema)
-            schema = xmlDocGetRootElement (instance->doc);
-        schema = _sch_node_child (ns, schema, name);
-    }
 
+    /* Find schema node */
+    if (!schema)
+        schema = xmlDocGetRootElement (instance->doc);
+    schema = _sch_node_child (ns, schema, name);
     if (schema == NULL)
     {
-        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for gnode %s%s%s\n",
-               ns ? (char *) ns->prefix : "", ns ? ":" : "", name);
-        free (name);
-        return NULL;
-    }
-    if (!sch_is_readable (schema))
-    {
-        ERROR (flags, SCH_E_NOTREADABLE, "Ignoring non-readable node %s%s%s\n",
-               ns ? (char *) ns->prefix : "", ns ? ":" : "", name);
-        free (name);
+        ERROR (flags, SCH_E_NOSCHEMANODE, "No schema match for json node %s\n", name);
         return NULL;
     }
 
-    if (sch_is_leaf_list (schema) && (flags & SCH_F_JSON_ARRAYS))
+    /* LEAF-LIST */
+    if (sch_is_leaf_list (schema) && json_is_array (json))
     {
-        data = json_array ();
-        apteryx_sort_children (node, g_strcmp0);
-
-        DEBUG (flags, "%*s%s[", depth * 2, " ", APTERYX_NAME (node));
-        for (GNode * child = node->children; child; child = child->next)
+        depth++;
+        tree = node = node_add (NULL, node_strdup (name));
+        schema = sch_node_child_first (schema);
+        json_array_foreach (json, index, child)
         {
-            bool added = false;
-            if (flags & SCH_F_JSON_TYPES)
-            {
-                sch_node *cschema = sch_node_child_first (schema);
-                char *value = g_strdup (APTERYX_VALUE (child) ?: "");
-                value = sch_translate_to (cschema, value);
-                json_array_append_new (data, encode_json_type (cschema, value));
-                DEBUG (flags, "%s%s", value, child->next ? ", " : "");
-                free (value);
-                added = true;
-            }
-            if (!added)
+            value = decode_json_type (child);
+            if (value && value[0] != '\0' && flags & SCH_F_JSON_TYPES)
             {
-                DEBUG (flags, "%s%s", APTERYX_VALUE (child), child->next ? ", " : "");
-                json_array_append_new (data, json_string ((const char* ) APTERYX_VALUE (child)));
+                value = sch_translate_from (schema, value);
+                if (!_sch_validate_pattern (schema, value, flags))
+                {
+                    DEBUG (flags, "Invalid value \"%s\" for node \"%s\"\n", value, name);
+                    free (value);
+                    node_free_tree (tree);
+                    return NULL;
+                }
             }
+            node_add (node_add (tree, node_strdup (value)), node_strdup (value));
+            DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", value, value);
+            free (value);
         }
-        DEBUG (flags, "]\n");
     }
-    else if (sch_is_list (schema) && (flags & SCH_F_JSON_ARRAYS))
+    /* LIST */
+    else if (sch_is_list (schema) && json_is_array (json))
     {
-        data = json_array ();
-        apteryx_sort_children (node, g_strcmp0);
-        for (GNode * child = node->children; child; child = child->next)
+        /* Get the key for this list */
+        char *kname = NULL;
+        key = sch_name (sch_node_child_first (sch_node_child_first (schema)));
+        DEBUG (flags, "%*s%s%s\n", depth * 2, " ", depth ? "" : "/", name);
+        depth++;
+        tree = node = node_add (NULL, node_strdup (name));
+        schema = sch_node_child_first (schema);
+        json_array_foreach (json, index, child)
         {
-            DEBUG (flags, "%*s%s[%s]\n", depth * 2, " ", APTERYX_NAME (node),
-                   APTERYX_NAME (child));
-            json_t *obj = json_object();
-            sch_gnode_sort_children (sch_node_child_first (schema), child);
-            for (GNode * field = child->children; field; field = field->next)
+            json_t *subchild;
+            const char *subname;
+
+            /* Get the key name for this json object and create a GNode with it */
+            kname = NULL;
+            kchild = json_object_get (child, key);
+            if (kchild)
+            {
+                kname = decode_json_type (kchild);
+            }
+            if (!kname)
+            {
+                ERROR (flags, SCH_E_KEYMISSING, "List \"%s\" missing key \"%s\"\n", name, key);
+                node_free_tree (tree);
+                free (key);
+                return NULL;
+            }
+
+            node = node_add (tree, node_take (kname));
+            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (node));
+
+            /* Prepend each key-value pair of this object into the node */
+            json_object_foreach (child, subname, subchild)
             {
-                json_t *node = _sch_gnode_to_json (instance, sch_node_child_first (schema), ns, field, flags, depth + 1);
-                bool added = false;
-                if (flags & SCH_F_NS_PREFIX)
+                GNode *cn = _sch_json_to_gnode (instance, schema, ns, subchild, subname, flags, depth + 1);
+                if (!cn)
                 {
-                    sch_node *cschema = _sch_node_child (((xmlNode *) schema)->ns, sch_node_child_first (schema), APTERYX_NAME (field));
-                    if (cschema && ((xmlNode *) cschema)->ns != ((xmlNode *) schema)->ns)
-                    {
-                        char * model = sch_model (cschema, false);
-                        if (model)
-                        {
-                            char *pname = g_strdup_printf ("%s:%s", model, APTERYX_NAME (field));
-                            json_object_set_new (obj, pname, node);
-                            free (pname);
-                            free (model);
-                            added = true;
-                        }
-                    }
+                    node_free_tree (tree);
+                    free (key);
+                    return NULL;
                 }
-                if (!added)
-                    json_object_set_new (obj, APTERYX_NAME (field), node);
+                g_node_prepend (node, cn);
             }
-            json_array_append_new (data, obj);
         }
     }
+    /* CONTAINER */
     else if (!sch_is_leaf (schema))
     {
-        DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (node));
-        data = json_object();
-        sch_gnode_sort_children (schema, node);
-        for (GNode * child = node->children; child; child = child->next)
+        DEBUG (flags, "%*s%s%s\n", depth * 2, " ", depth ? "" : "/", name);
+        tree = node = node_add (NULL, node_take (g_strdup_printf ("%s%s", depth ? "" : "/", name)));
+        json_object_foreach (json, cname, child)
         {
-            json_t *node = _sch_gnode_to_json (instance, schema, ns, child, flags, depth + 1);
-            bool added = false;
-            if (flags & SCH_F_NS_PREFIX)
+            GNode *cn = _sch_json_to_gnode (instance, schema, ns, child, cname, flags, depth + 1);
+            if (!cn)
             {
-                sch_node *cschema = _sch_node_child (ns, schema, APTERYX_NAME (child));
-                if (cschema && ((xmlNode *) cschema)->ns != ((xmlNode *) schema)->ns)
-                {
-                    char * model = sch_model (cschema, false);
-                    if (model)
-                    {
-                        char *pname = g_strdup_printf ("%s:%s", model, APTERYX_NAME (child));
-                        json_object_set_new (data, pname, node);
-                        free (pname);
-                        free (model);
-                        added = true;
-                    }
-                }
+                node_free_tree (tree);
+                return NULL;
             }
-            if (!added)
-                json_object_set_new (data, APTERYX_NAME (child), node);
-        }
-        /* Throw away this node if no chldren (unless it's a presence container) */
-        if (json_object_iter (data) == NULL && ((xmlNode *)schema)->children)
-        {
-            json_decref (data);
-            data = NULL;
+            g_node_append (node, cn);
         }
     }
-    else if (APTERYX_HAS_VALUE (node))
+    /* LEAF */
+    else
     {
-        char *value = g_strdup (APTERYX_VALUE (node) ? APTERYX_VALUE (node) : "");
-        if (flags & SCH_F_JSON_TYPES)
+        if (!sch_is_writable (schema))
         {
-            value = sch_translate_to (schema, value);
-            data = encode_json_type (schema, value);
+            ERROR (flags, SCH_E_NOTWRITABLE, "Node \"%s\" not writable\n", name);
+            return NULL;
         }
-        else
-            data = json_string (value);
-        DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", APTERYX_NAME (node), value);
-        free (value);
+
+        tree = node = node_add (NULL, node_strdup (name));
+        value = decode_json_type (json);
+        if (value && value[0] != '\0' && flags & SCH_F_JSON_TYPES)
+        {
+            value = sch_translate_from (schema, value);
+            if (!_sch_validate_pattern (schema, value, flags))
+            {
+                DEBUG (flags, "Invalid value \"%s\" for node \"%s\"\n", value, name);
+                free (value);
+                node_free_tree (tree);
+                return NULL;
+            }
+        }
+        node = node_add (tree, node_take (value));
+        DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", name, APTERYX_NAME (node));
+        return tree;
     }
 
-    free (name);
-    return data;
+    free (key);
+    return tree;
 }
 
-static gchar *
-_model_name (xmlNs *ns, char *model, char *name)
+static int
+sch_node_height (sch_node * schema)
 {
-    gchar *ret;
-    gchar **n_split = g_strsplit (name, ":", 2);
-
-    /* If first part of name is actually the namespace prefix, we don't want to see it */
-    if (g_strv_length (n_split) == 2 && g_strcmp0 (n_split[0], (gchar *) ns->prefix) == 0)
-    {
-        ret = g_strdup_printf ("%s:%s", model, n_split[1]);
-    }
-    else
+    xmlNode *xml = (xmlNode *) schema;
+    int depth = 0;
+    while (xml->parent)
     {
-        ret = g_strdup_printf ("%s:%s", model, name);
+        xml = xml->parent;
+        depth++;
     }
-    g_strfreev (n_split);
-    return ret;
+    return depth ? depth - 1 : 0;
 }
 
-json_t *
-sch_gnode_to_json (sch_instance * instance, sch_node * schema, GNode * node, int flags)
+static GNode *
+json_to_gnode (sch_instance * instance, sch_node * schema, json_t * json, int flags)
 {
-    sch_node *pschema = schema ? ((xmlNode *)schema)->parent : xmlDocGetRootElement (instance->doc);
-    xmlNs *ns = schema ? ((xmlNode *) schema)->ns : ((xmlNode *) pschema)->ns;
-    json_t *json = NULL;
+    xmlNs *ns = schema ? ((xmlNode *) schema)->ns : NULL;
+    const char *key;
     json_t *child;
+    GNode *root;
+    GNode *node;
+    int depth = 0;
 
     tl_error = SCH_E_SUCCESS;
-    child = _sch_gnode_to_json (instance, pschema, ns, node, flags, g_node_depth (node) - 1);
-    if (child)
+    root = node_add (NULL, node_strdup ("/"));
+    json_object_foreach (json, key, child)
     {
-        char *name;
-        if (strlen (APTERYX_NAME (node)) == 1)
-        {
-            return child;
-        }
-        else if (APTERYX_NAME (node)[0] == '/')
-        {
-            name = APTERYX_NAME (node) + 1;
-        }
-        else
-        {
-            name = APTERYX_NAME (node);
-        }
-        if ((flags & SCH_F_NS_PREFIX) && schema)
+        if (schema)
         {
-            char * model = sch_model (schema, false);
-            if (model)
+            sch_node * child_schema = sch_node_child (schema, key);
+            if (child_schema)
             {
-                name = _model_name (ns, model, name);
-                json = json_object ();
-                json_object_set_new (json, name, child);
-                free (name);
-                free (model);
+                depth = sch_node_height (child_schema);
+            }
+            else
+            {
+                depth = sch_node_height (schema);
             }
         }
-        if (!json)
+        node = _sch_json_to_gnode (instance, schema, ns, child, key, flags, depth);
+        if (!node)
         {
-            json = json_object ();
-            json_object_set_new (json, name, child);
+            node_free_tree (root);
+            return NULL;
         }
+        g_node_append (root, node);
     }
-    return json;
+    return root;
 }
 
-static GNode *
-_sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
-                   json_t * json, const char *name, int flags, int depth)
+GNode *
+sch_json_to_gnode (sch_instance * instance, sch_node * schema, json_t * json, int flags)
+{
+    instance = sch_current (instance);
+    guint64 start = stats_now ();
+    GNode *root = json_to_gnode (instance, schema, json, flags);
+    stats_record (SCH_STAT_JSON_TO_GNODE, start);
+    return root;
+}
+
+/* Incremental JSON to GNode. The lexer collects one token at a time, which
+ * may span calls to sch_json_parser_feed, and each complete token drives a
+ * stack with a frame for every open JSON object or array. Nodes are looked
+ * up in the schema and added to the tree as soon as their value starts, so
+ * the result is the same as sch_json_to_gnode without a json_t in between */
+typedef enum
+{
+    JSON_FRAME_ROOT,            /* Top level object */
+    JSON_FRAME_CONTAINER,       /* Object for a container (or a list keyed by object) */
+    JSON_FRAME_LIST,            /* Array of list entries */
+    JSON_FRAME_ENTRY,           /* Object for one list entry */
+    JSON_FRAME_LEAF_LIST,       /* Array of leaf-list values */
+    JSON_FRAME_SKIP,            /* Value with nothing to add to the tree */
+} json_frame_type;
+
+typedef enum
+{
+    JSON_EXPECT_VALUE,
+    JSON_EXPECT_KEY,
+    JSON_EXPECT_COLON,
+    JSON_EXPECT_NEXT,           /* ',' or the end of the object/array */
+} json_expect;
+
+typedef struct _json_frame
+{
+    json_frame_type type;
+    bool array;
+    json_expect expect;
+    int count;
+    sch_node *schema;
+    xmlNs *ns;
+    GNode *node;
+    int depth;
+    char *member;               /* Name for the next value in an object */
+    char *key;                  /* LIST: name of the key leaf, ENTRY: its value */
+    GHashTable *members;        /* Object members added so far by node name */
+} json_frame;
+
+typedef enum
+{
+    JSON_LEX_NONE,
+    JSON_LEX_STRING,
+    JSON_LEX_ESCAPE,
+    JSON_LEX_UNICODE,
+    JSON_LEX_NUMBER,
+    JSON_LEX_LITERAL,
+} json_lex;
+
+struct _sch_json_parser
+{
+    sch_instance *instance;
+    sch_arena *arena;
+    sch_node *schema;
+    int flags;
+    int depth;
+    GNode *root;
+    GArray *stack;
+    bool done;
+    bool failed;
+    size_t offset;
+    /* Lexer */
+    json_lex lex;
+    GString *token;
+    gunichar unicode;
+    int hex_count;
+    gunichar surrogate;
+};
+
+static void
+json_parser_error (sch_json_parser *parser, const char *reason)
+{
+    ERROR (parser->flags, SCH_E_INVALIDJSON, "Invalid JSON at offset %zu: %s\n", parser->offset, reason);
+    parser->failed = true;
+}
+
+static json_frame *
+json_parser_top (sch_json_parser *parser)
+{
+    if (parser->stack->len == 0)
+        return NULL;
+    return &g_array_index (parser->stack, json_frame, parser->stack->len - 1);
+}
+
+static void
+json_frame_push (sch_json_parser *parser, json_frame *frame)
+{
+    frame->expect = frame->array ? JSON_EXPECT_VALUE : JSON_EXPECT_KEY;
+    g_array_append_val (parser->stack, *frame);
+}
+
+static void
+json_frame_clear (json_frame *frame)
+{
+    free (frame->member);
+    free (frame->key);
+    if (frame->members)
+        g_hash_table_destroy (frame->members);
+}
+
+/* The value of a scalar as sch_json_to_gnode would store it */
+static char *
+json_scalar_value (json_type type, const char *text)
+{
+    switch (type)
+    {
+    case JSON_STRING:
+        return g_strdup (text);
+    case JSON_INTEGER:
+        return g_strdup_printf ("%" JSON_INTEGER_FORMAT, (json_int_t) strtoll (text, NULL, 10));
+    case JSON_TRUE:
+        return g_strdup ("true");
+    case JSON_FALSE:
+        return g_strdup ("false");
+    default:
+        return NULL;
+    }
+}
+
+/* Start the node for an object member. Returns false on error. If the
+ * value is an object or array, frame describes what to push for it */
+static GNode *
+json_member_start (sch_json_parser *parser, sch_node *schema, xmlNs *ns, const char *name,
+                   json_type type, const char *text, int depth, json_frame *frame)
 {
-    char *colon;
-    json_t *child;
-    json_t *kchild;
-    const char *cname;
-    size_t index;
+    bool nested = type == JSON_OBJECT || type == JSON_ARRAY;
+    int flags = parser->flags;
     GNode *tree = NULL;
-    GNode *node = NULL;
-    char *key = NULL;
+    char *colon;
     char *value;
 
+    frame->type = JSON_FRAME_SKIP;
+    frame->array = type == JSON_ARRAY;
+
     /* Check for a change in namespace */
     colon = strchr (name, ':');
     if (colon)
     {
         char *namespace = g_strndup (name, colon - name);
-        xmlNs *nns = _sch_lookup_ns (instance, schema, namespace, flags, false);
+        xmlNs *nns = _sch_lookup_ns (parser->instance, schema, namespace, flags, false);
         free (namespace);
         if (nns)
         {
@@ -3698,7 +8780,7 @@ _sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
 
     /* Find schema node */
     if (!schema)
-        schema = xmlDocGetRootElement (instance->doc);
+        schema = xmlDocGetRootElement (parser->instance->doc);
     schema = _sch_node_child (ns, schema, name);
     if (schema == NULL)
     {
@@ -3707,89 +8789,27 @@ _sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
     }
 
     /* LEAF-LIST */
-    if (sch_is_leaf_list (schema) && json_is_array (json))
+    if (sch_is_leaf_list (schema) && type == JSON_ARRAY)
     {
-        depth++;
-        tree = node = APTERYX_NODE (NULL, g_strdup (name));
-        schema = sch_node_child_first (schema);
-        json_array_foreach (json, index, child)
-        {
-            value = decode_json_type (child);
-            if (value && value[0] != '\0' && flags & SCH_F_JSON_TYPES)
-            {
-                value = sch_translate_from (schema, value);
-                if (!_sch_validate_pattern (schema, value, flags))
-                {
-                    DEBUG (flags, "Invalid value \"%s\" for node \"%s\"\n", value, name);
-                    free (value);
-                    apteryx_free_tree (tree);
-                    return NULL;
-                }
-            }
-            APTERYX_LEAF_STRING (tree, value, value);
-            DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", value, value);
-            free (value);
-        }
+        tree = node_add (NULL, node_strdup (name));
+        *frame = (json_frame) { JSON_FRAME_LEAF_LIST, true, .schema = sch_node_child_first (schema),
+                                .ns = ns, .node = tree, .depth = depth + 1 };
     }
     /* LIST */
-    else if (sch_is_list (schema) && json_is_array (json))
+    else if (sch_is_list (schema) && type == JSON_ARRAY)
     {
-        /* Get the key for this list */
-        char *kname = NULL;
-        key = sch_name (sch_node_child_first (sch_node_child_first (schema)));
-        DEBUG (flags, "%*s%s%s\n", depth * 2, " ", depth ? "" : "/", name);
-        depth++;
-        tree = node = APTERYX_NODE (NULL, g_strdup (name));
+        tree = node_add (NULL, node_strdup (name));
         schema = sch_node_child_first (schema);
-        json_array_foreach (json, index, child)
-        {
-            json_t *subchild;
-            const char *subname;
-
-            /* Get the key name for this json object and create a GNode with it */
-            kchild = json_object_get (child, key);
-            if (kchild)
-            {
-                kname = decode_json_type (kchild);
-            }
-            if (!kname)
-            {
-                ERROR (flags, SCH_E_KEYMISSING, "List \"%s\" missing key \"%s\"\n", name, key);
-                apteryx_free_tree (tree);
-                return NULL;
-            }
-
-            node = APTERYX_NODE (tree, kname);
-            DEBUG (flags, "%*s%s\n", depth * 2, " ", APTERYX_NAME (node));
-
-            /* Prepend each key-value pair of this object into the node */
-            json_object_foreach (child, subname, subchild)
-            {
-                GNode *cn = _sch_json_to_gnode (instance, schema, ns, subchild, subname, flags, depth + 1);
-                if (!cn)
-                {
-                    apteryx_free_tree (tree);
-                    return NULL;
-                }
-                g_node_prepend (node, cn);
-            }
-        }
+        *frame = (json_frame) { JSON_FRAME_LIST, true, .schema = schema, .ns = ns, .node = tree,
+                                .depth = depth + 1, .key = sch_name (sch_node_child_first (schema)) };
     }
     /* CONTAINER */
     else if (!sch_is_leaf (schema))
     {
-        DEBUG (flags, "%*s%s%s\n", depth * 2, " ", depth ? "" : "/", name);
-        tree = node = APTERYX_NODE (NULL, g_strdup_printf ("%s%s", depth ? "" : "/", name));
-        json_object_foreach (json, cname, child)
-        {
-            GNode *cn = _sch_json_to_gnode (instance, schema, ns, child, cname, flags, depth + 1);
-            if (!cn)
-            {
-                apteryx_free_tree (tree);
-                return NULL;
-            }
-            g_node_append (node, cn);
-        }
+        tree = node_add (NULL, node_take (g_strdup_printf ("%s%s", depth ? "" : "/", name)));
+        if (type == JSON_OBJECT)
+            *frame = (json_frame) { JSON_FRAME_CONTAINER, false, .schema = schema, .ns = ns,
+                                    .node = tree, .depth = depth };
     }
     /* LEAF */
     else
@@ -3800,8 +8820,8 @@ _sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
             return NULL;
         }
 
-        tree = node = APTERYX_NODE (NULL, g_strdup (name));
-        value = decode_json_type (json);
+        tree = node_add (NULL, node_strdup (name));
+        value = nested ? NULL : json_scalar_value (type, text);
         if (value && value[0] != '\0' && flags & SCH_F_JSON_TYPES)
         {
             value = sch_translate_from (schema, value);
@@ -3809,65 +8829,504 @@ _sch_json_to_gnode (sch_instance * instance, sch_node * schema, xmlNs *ns,
             {
                 DEBUG (flags, "Invalid value \"%s\" for node \"%s\"\n", value, name);
                 free (value);
-                apteryx_free_tree (tree);
+                node_free_tree (tree);
                 return NULL;
             }
         }
-        node = APTERYX_NODE (tree, value);
-        DEBUG (flags, "%*s%s = %s\n", depth * 2, " ", name, APTERYX_NAME (node));
-        return tree;
+        node_add (tree, node_take (value));
     }
-
-    free (key);
     return tree;
 }
 
-static int
-sch_node_height (sch_node * schema)
+/* Add the node for an object member. A repeated member replaces the earlier
+ * one in its place, as jansson keeps the last value for a duplicate key */
+static void
+json_member_add (json_frame *frame, GNode *node, bool prepend)
 {
-    xmlNode *xml = (xmlNode *) schema;
-    int depth = 0;
-    while (xml->parent)
+    GNode *old;
+
+    if (!frame->members)
+        frame->members = g_hash_table_new (g_str_hash, g_str_equal);
+    old = g_hash_table_lookup (frame->members, APTERYX_NAME (node));
+    /* Before old goes as the table holds its name */
+    g_hash_table_replace (frame->members, APTERYX_NAME (node), node);
+    if (old)
     {
-        xml = xml->parent;
-        depth++;
+        g_node_insert_before (frame->node, old, node);
+        g_node_unlink (old);
+        node_free_tree (old);
     }
-    return depth ? depth - 1 : 0;
+    else if (prepend)
+        g_node_prepend (frame->node, node);
+    else
+        g_node_append (frame->node, node);
 }
 
-GNode *
-sch_json_to_gnode (sch_instance * instance, sch_node * schema, json_t * json, int flags)
+/* A value has started: a scalar (text is its token) or an object or array */
+static void
+json_parser_value (sch_json_parser *parser, json_type type, const char *text)
 {
-    xmlNs *ns = schema ? ((xmlNode *) schema)->ns : NULL;
-    const char *key;
-    json_t *child;
-    GNode *root;
+    json_frame *top = json_parser_top (parser);
+    json_frame frame = { JSON_FRAME_SKIP, type == JSON_ARRAY };
+    bool nested = type == JSON_OBJECT || type == JSON_ARRAY;
     GNode *node;
-    int depth = 0;
+    char *value;
 
-    tl_error = SCH_E_SUCCESS;
-    root = g_node_new (g_strdup ("/"));
-    json_object_foreach (json, key, child)
+    if (!top)
     {
-        if (schema)
+        if (parser->done || type != JSON_OBJECT)
         {
-            sch_node * child_schema = sch_node_child (schema, key);
-            if (child_schema)
+            json_parser_error (parser, parser->done ? "data after the end" : "expected an object");
+            return;
+        }
+        frame = (json_frame) { JSON_FRAME_ROOT, false, .node = parser->root };
+        json_frame_push (parser, &frame);
+        return;
+    }
+    if (top->expect != JSON_EXPECT_VALUE)
+    {
+        json_parser_error (parser, "unexpected value");
+        return;
+    }
+    top->expect = JSON_EXPECT_NEXT;
+    top->count++;
+
+    switch (top->type)
+    {
+    case JSON_FRAME_ROOT:
+        if (parser->schema)
+        {
+            sch_node *child_schema = sch_node_child (parser->schema, top->member);
+            parser->depth = sch_node_height (child_schema ? child_schema : parser->schema);
+        }
+        node = json_member_start (parser, parser->schema, parser->schema ? ((xmlNode *) parser->schema)->ns : NULL,
+                                  top->member, type, text, parser->depth, &frame);
+        if (!node)
+        {
+            parser->failed = true;
+            return;
+        }
+        json_member_add (top, node, false);
+        break;
+    case JSON_FRAME_CONTAINER:
+    case JSON_FRAME_ENTRY:
+        /* The entry is named for the value of its key */
+        if (top->type == JSON_FRAME_ENTRY && g_strcmp0 (top->member,
+            g_array_index (parser->stack, json_frame, parser->stack->len - 2).key) == 0)
+        {
+            free (top->key);
+            top->key = nested ? NULL : json_scalar_value (type, text);
+        }
+        node = json_member_start (parser, top->schema, top->ns, top->member, type, text,
+                                  top->depth + 1, &frame);
+        if (!node)
+        {
+            parser->failed = true;
+            return;
+        }
+        json_member_add (top, node, top->type == JSON_FRAME_ENTRY);
+        break;
+    case JSON_FRAME_LIST:
+        if (type != JSON_OBJECT)
+        {
+            ERROR (parser->flags, SCH_E_KEYMISSING, "List \"%s\" missing key \"%s\"\n",
+                   APTERYX_NAME (top->node), top->key);
+            parser->failed = true;
+            return;
+        }
+        frame = (json_frame) { JSON_FRAME_ENTRY, false, .schema = top->schema, .ns = top->ns,
+                               .node = node_add (top->node, NULL), .depth = top->depth };
+        break;
+    case JSON_FRAME_LEAF_LIST:
+        value = nested ? NULL : json_scalar_value (type, text);
+        if (value && value[0] != '\0' && parser->flags & SCH_F_JSON_TYPES)
+        {
+            value = sch_translate_from (top->schema, value);
+            if (!_sch_validate_pattern (top->schema, value, parser->flags))
             {
-                depth = sch_node_height (child_schema);
+                DEBUG (parser->flags, "Invalid value \"%s\" for node \"%s\"\n", value, APTERYX_NAME (top->node));
+                free (value);
+                parser->failed = true;
+                return;
             }
-            else
+        }
+        node_add (node_add (top->node, node_strdup (value)), node_strdup (value));
+        free (value);
+        break;
+    case JSON_FRAME_SKIP:
+        break;
+    }
+    if (nested)
+        json_frame_push (parser, &frame);
+}
+
+/* A '}' or ']' */
+static void
+json_parser_close (sch_json_parser *parser, bool array)
+{
+    json_frame *top = json_parser_top (parser);
+
+    if (!top || top->array != array ||
+        (top->expect != JSON_EXPECT_NEXT &&
+         (top->count || top->expect != (array ? JSON_EXPECT_VALUE : JSON_EXPECT_KEY))))
+    {
+        json_parser_error (parser, array ? "unexpected ']'" : "unexpected '}'");
+        return;
+    }
+    if (top->type == JSON_FRAME_ENTRY)
+    {
+        json_frame *list = &g_array_index (parser->stack, json_frame, parser->stack->len - 2);
+        if (!top->key)
+        {
+            ERROR (parser->flags, SCH_E_KEYMISSING, "List \"%s\" missing key \"%s\"\n",
+                   APTERYX_NAME (list->node), list->key);
+            parser->failed = true;
+            return;
+        }
+        top->node->data = node_take (top->key);
+        top->key = NULL;
+    }
+    json_frame_clear (top);
+    g_array_set_size (parser->stack, parser->stack->len - 1);
+    if (parser->stack->len == 0)
+        parser->done = true;
+}
+
+/* A complete string token. Either a member name or a value */
+static void
+json_parser_string (sch_json_parser *parser, const char *text)
+{
+    json_frame *top = json_parser_top (parser);
+
+    if (top && !top->array && top->expect == JSON_EXPECT_KEY)
+    {
+        free (top->member);
+        top->member = g_strdup (text);
+        top->expect = JSON_EXPECT_COLON;
+    }
+    else if (top && !top->array && top->expect == JSON_EXPECT_NEXT)
+    {
+        json_parser_error (parser, "expected ',' or '}'");
+    }
+    else
+    {
+        json_parser_value (parser, JSON_STRING, text);
+    }
+}
+
+/* Validate a number token against the JSON grammar */
+static json_type
+json_number_type (const char *p)
+{
+    json_type type = JSON_INTEGER;
+
+    if (*p == '-')
+        p++;
+    if (*p == '0')
+        p++;
+    else if (g_ascii_isdigit (*p))
+        while (g_ascii_isdigit (*p))
+            p++;
+    else
+        return JSON_NULL;
+    if (*p == '.')
+    {
+        p++;
+        if (!g_ascii_isdigit (*p))
+            return JSON_NULL;
+        while (g_ascii_isdigit (*p))
+            p++;
+        type = JSON_REAL;
+    }
+    if (*p == 'e' || *p == 'E')
+    {
+        p++;
+        if (*p == '+' || *p == '-')
+            p++;
+        if (!g_ascii_isdigit (*p))
+            return JSON_NULL;
+        while (g_ascii_isdigit (*p))
+            p++;
+        type = JSON_REAL;
+    }
+    return *p == '\0' ? type : JSON_NULL;
+}
+
+/* A number or literal has ended */
+static void
+json_parser_word (sch_json_parser *parser)
+{
+    const char *text = parser->token->str;
+    json_type type;
+
+    if (parser->lex == JSON_LEX_NUMBER)
+    {
+        type = json_number_type (text);
+        if (type == JSON_NULL)
+        {
+            json_parser_error (parser, "invalid number");
+            return;
+        }
+        if (type == JSON_INTEGER)
+        {
+            errno = 0;
+            strtoll (text, NULL, 10);
+            if (errno == ERANGE)
             {
-                depth = sch_node_height (schema);
+                json_parser_error (parser, "too big integer");
+                return;
             }
         }
-        node = _sch_json_to_gnode (instance, schema, ns, child, key, flags, depth);
-        if (!node)
+    }
+    else if (strcmp (text, "true") == 0)
+        type = JSON_TRUE;
+    else if (strcmp (text, "false") == 0)
+        type = JSON_FALSE;
+    else if (strcmp (text, "null") == 0)
+        type = JSON_NULL;
+    else
+    {
+        json_parser_error (parser, "invalid token");
+        return;
+    }
+    parser->lex = JSON_LEX_NONE;
+    json_parser_value (parser, type, text);
+}
+
+static void
+json_parser_unicode (sch_json_parser *parser)
+{
+    gunichar c = parser->unicode;
+
+    if (parser->surrogate)
+    {
+        if (c < 0xDC00 || c > 0xDFFF)
         {
-            apteryx_free_tree (root);
-            return NULL;
+            json_parser_error (parser, "invalid Unicode surrogate pair");
+            return;
         }
-        g_node_append (root, node);
+        c = 0x10000 + ((parser->surrogate - 0xD800) << 10) + (c - 0xDC00);
+        parser->surrogate = 0;
+    }
+    else if (c >= 0xD800 && c <= 0xDBFF)
+    {
+        parser->surrogate = c;
+        return;
     }
+    else if ((c >= 0xDC00 && c <= 0xDFFF) || c == 0)
+    {
+        json_parser_error (parser, c ? "invalid Unicode surrogate" : "\\u0000 is not allowed");
+        return;
+    }
+    g_string_append_unichar (parser->token, c);
+}
+
+static void
+json_parser_char (sch_json_parser *parser, char c)
+{
+    switch (parser->lex)
+    {
+    case JSON_LEX_STRING:
+        if (parser->surrogate && c != '\\')
+            json_parser_error (parser, "invalid Unicode surrogate");
+        else if (c == '\\')
+            parser->lex = JSON_LEX_ESCAPE;
+        else if (c == '"')
+        {
+            parser->lex = JSON_LEX_NONE;
+            if (!g_utf8_validate (parser->token->str, parser->token->len, NULL))
+                json_parser_error (parser, "invalid UTF-8");
+            else
+                json_parser_string (parser, parser->token->str);
+        }
+        else if ((unsigned char) c < 0x20)
+            json_parser_error (parser, "control character in string");
+        else
+            g_string_append_c (parser->token, c);
+        return;
+    case JSON_LEX_ESCAPE:
+        parser->lex = JSON_LEX_STRING;
+        if (parser->surrogate && c != 'u')
+        {
+            json_parser_error (parser, "invalid Unicode surrogate");
+            return;
+        }
+        switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            g_string_append_c (parser->token, c);
+            break;
+        case 'b':
+            g_string_append_c (parser->token, '\b');
+            break;
+        case 'f':
+            g_string_append_c (parser->token, '\f');
+            break;
+        case 'n':
+            g_string_append_c (parser->token, '\n');
+            break;
+        case 'r':
+            g_string_append_c (parser->token, '\r');
+            break;
+        case 't':
+            g_string_append_c (parser->token, '\t');
+            break;
+        case 'u':
+            parser->lex = JSON_LEX_UNICODE;
+            parser->unicode = 0;
+            parser->hex_count = 0;
+            break;
+        default:
+            json_parser_error (parser, "invalid escape");
+            break;
+        }
+        return;
+    case JSON_LEX_UNICODE:
+        if (!g_ascii_isxdigit (c))
+        {
+            json_parser_error (parser, "invalid escape");
+            return;
+        }
+        parser->unicode = (parser->unicode << 4) | g_ascii_xdigit_value (c);
+        if (++parser->hex_count == 4)
+        {
+            parser->lex = JSON_LEX_STRING;
+            json_parser_unicode (parser);
+        }
+        return;
+    case JSON_LEX_NUMBER:
+        if (g_ascii_isdigit (c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+        {
+            g_string_append_c (parser->token, c);
+            return;
+        }
+        json_parser_word (parser);
+        break;
+    case JSON_LEX_LITERAL:
+        if (g_ascii_isalpha (c))
+        {
+            g_string_append_c (parser->token, c);
+            return;
+        }
+        json_parser_word (parser);
+        break;
+    case JSON_LEX_NONE:
+        break;
+    }
+    if (parser->failed)
+        return;
+
+    json_frame *top = json_parser_top (parser);
+    switch (c)
+    {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+        break;
+    case '{':
+    case '[':
+        json_parser_value (parser, c == '{' ? JSON_OBJECT : JSON_ARRAY, NULL);
+        break;
+    case '}':
+    case ']':
+        json_parser_close (parser, c == ']');
+        break;
+    case ':':
+        if (top && top->expect == JSON_EXPECT_COLON)
+            top->expect = JSON_EXPECT_VALUE;
+        else
+            json_parser_error (parser, "unexpected ':'");
+        break;
+    case ',':
+        if (top && top->expect == JSON_EXPECT_NEXT)
+            top->expect = top->array ? JSON_EXPECT_VALUE : JSON_EXPECT_KEY;
+        else
+            json_parser_error (parser, "unexpected ','");
+        break;
+    case '"':
+        parser->lex = JSON_LEX_STRING;
+        g_string_truncate (parser->token, 0);
+        break;
+    default:
+        g_string_truncate (parser->token, 0);
+        g_string_append_c (parser->token, c);
+        if (c == '-' || g_ascii_isdigit (c))
+            parser->lex = JSON_LEX_NUMBER;
+        else if (g_ascii_isalpha (c))
+            parser->lex = JSON_LEX_LITERAL;
+        else
+            json_parser_error (parser, "invalid token");
+        break;
+    }
+}
+
+sch_json_parser *
+sch_json_parser_new (sch_instance * instance, sch_node * schema, int flags)
+{
+    instance = sch_current (instance);
+    sch_json_parser *parser = g_malloc0 (sizeof (sch_json_parser));
+
+    tl_error = SCH_E_SUCCESS;
+    parser->instance = instance;
+    parser->schema = schema;
+    parser->flags = flags;
+    parser->arena = tl_arena;
+    parser->root = node_add (NULL, node_strdup ("/"));
+    parser->stack = g_array_new (FALSE, FALSE, sizeof (json_frame));
+    parser->token = g_string_new (NULL);
+    return parser;
+}
+
+bool
+sch_json_parser_feed (sch_json_parser *parser, const char *data, size_t len)
+{
+    /* Keep building in the arena in use when the parser was created */
+    sch_arena *arena = sch_arena_use (parser->arena);
+
+    for (size_t i = 0; i < len && !parser->failed; i++, parser->offset++)
+        json_parser_char (parser, data[i]);
+    sch_arena_use (arena);
+    return !parser->failed;
+}
+
+GNode *
+sch_json_parser_finish (sch_json_parser *parser)
+{
+    sch_arena *arena = sch_arena_use (parser->arena);
+    GNode *root = NULL;
+
+    /* Numbers and literals end at the end of the input */
+    if (!parser->failed && (parser->lex == JSON_LEX_NUMBER || parser->lex == JSON_LEX_LITERAL))
+        json_parser_word (parser);
+    if (!parser->failed && !parser->done)
+        json_parser_error (parser, "premature end of input");
+    if (!parser->failed)
+    {
+        root = parser->root;
+        parser->root = NULL;
+    }
+    sch_json_parser_free (parser);
+    sch_arena_use (arena);
     return root;
 }
+
+void
+sch_json_parser_free (sch_json_parser *parser)
+{
+    if (!parser)
+        return;
+    for (guint i = 0; i < parser->stack->len; i++)
+        json_frame_clear (&g_array_index (parser->stack, json_frame, i));
+    g_array_free (parser->stack, TRUE);
+    g_string_free (parser->token, TRUE);
+    if (parser->root)
+    {
+        sch_arena *arena = sch_arena_use (parser->arena);
+        node_free_tree (parser->root);
+        sch_arena_use (arena);
+    }
+    g_free (parser);
+}
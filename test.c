@@ -29,6 +29,7 @@
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <sys/poll.h>
+#include <dirent.h>
 #include <assert.h>
 #include <lua.h>
 #include <lualib.h>
@@ -36,6 +37,8 @@
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 #include <apteryx.h>
+#define APTERYX_XML_JSON
+#include "apteryx-xml.h"
 
 #define TEST_PATH           "/test"
 #define TEST_ITERATIONS     1000
@@ -187,6 +190,21 @@ test_lua_api_list (void)
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_lua_api_list_pairs (void)
+{
+    CU_ASSERT (_run_lua
+               ("api = require('apteryx.xml').api('" TEST_SCHEMA_PATH "')                  \n"
+                "api.test.animals.animal('cat').food('banana').name = 'banana'             \n"
+                "api.test.animals.animal('cat').food('orange').name = 'orange'             \n"
+                "seen = {}                                                                 \n"
+                "for k, v in api.test.animals.animal('cat').food:pairs() do seen[k] = v.name end\n"
+                "assert(seen['banana'] == 'banana' and seen['orange'] == 'orange')         \n"
+                "api.test.animals.animal('cat').food('banana').name = nil                  \n"
+                "api.test.animals.animal('cat').food('orange').name = nil                  \n"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 
 void
 test_lua_api_trivial_list (void)
@@ -222,6 +240,70 @@ test_lua_api_search (void)
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+void
+test_lua_api_set_table (void)
+{
+    char *value;
+    CU_ASSERT (_run_lua
+               ("api = require('apteryx.xml').api('" TEST_SCHEMA_PATH "')                  \n"
+                "api.test.settings = { priority = '1', debug = 'enable' }                  \n"
+                "assert(api.test.settings.priority == '1')                                 \n"
+                "assert(api.test.settings.debug == 'enable')                               \n"
+                "api.test.animals.animal = { cat = { name = 'cat', type = 'little' } }     \n"
+                "assert(api.test.animals.animal('cat').type == 'little')                   \n"));
+    value = apteryx_get ("/test/settings/debug");
+    CU_ASSERT (g_strcmp0 (value, "1") == 0);
+    free (value);
+    value = apteryx_get ("/test/animals/animal/cat/type");
+    CU_ASSERT (g_strcmp0 (value, "2") == 0);
+    free (value);
+    CU_ASSERT (_run_lua
+               ("api = require('apteryx.xml').api('" TEST_SCHEMA_PATH "')                  \n"
+                "api.test.settings.priority = nil                                          \n"
+                "api.test.settings.debug = nil                                             \n"
+                "api.test.animals.animal('cat').name = nil                                 \n"
+                "api.test.animals.animal('cat').type = nil                                 \n"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_set_table_invalid (void)
+{
+    CU_ASSERT (_run_lua
+               ("api = require('apteryx.xml').api('" TEST_SCHEMA_PATH "')                  \n"
+                "ok = pcall(function() api.test.settings = { priority = '1', cat = '1' } end)\n"
+                "assert(not ok)                                                            \n"
+                "ok = pcall(function() api.test.settings = { debug = 'enable', priority = '7' } end)\n"
+                "assert(not ok)                                                            \n"
+                "assert(api.test.settings.priority == nil)                                 \n"
+                "assert(api.test.settings.debug == nil)                                    \n"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
+void
+test_lua_api_get_tree (void)
+{
+    CU_ASSERT (_run_lua
+               ("xml = require('apteryx.xml')                                              \n"
+                "api = xml.api('" TEST_SCHEMA_PATH "')                                     \n"
+                "api.test.animals.animal = { cat = { name = 'cat', type = 'little' } }     \n"
+                "api.test.animals.animal = { dog = { name = 'dog', type = 'big' } }        \n"
+                "t = xml.get(api.test.animals)                                             \n"
+                "assert(t.animal.cat.name == 'cat' and t.animal.cat.type == 'little')      \n"
+                "assert(t.animal.dog.name == 'dog' and t.animal.dog.type == 'big')         \n"
+                "t = xml.get('/test/animals/animal/cat')                                   \n"
+                "assert(t.name == 'cat' and t.type == 'little')                            \n"
+                "api.test.animals.animal = xml.get(api.test.animals).animal                \n"
+                "assert(api.test.animals.animal('dog').type == 'big')                      \n"
+                "assert(xml.get('/test/settings') == nil)                                  \n"
+                "assert(not pcall(xml.get, '/test/settings/priority'))                     \n"
+                "api.test.animals.animal('cat').name = nil                                 \n"
+                "api.test.animals.animal('cat').type = nil                                 \n"
+                "api.test.animals.animal('dog').name = nil                                 \n"
+                "api.test.animals.animal('dog').type = nil                                 \n"));
+    CU_ASSERT (assert_apteryx_empty ());
+}
+
 void
 test_lua_load_api_memory (void)
 {
@@ -349,6 +431,1262 @@ test_lua_api_perf_set ()
     CU_ASSERT (assert_apteryx_empty ());
 }
 
+/* Each node on a line indented by depth, for comparing trees */
+static void
+_tree_append (GString *out, GNode *node, int depth)
+{
+    for (; node; node = node->next)
+    {
+        g_string_append_printf (out, "%*s%s\n", depth * 2, "", (char *) node->data);
+        _tree_append (out, node->children, depth + 1);
+    }
+}
+
+static char *
+_tree_string (GNode *node)
+{
+    GString *out = g_string_new (NULL);
+    _tree_append (out, node, 0);
+    return g_string_free (out, FALSE);
+}
+
+static bool
+_same_dump (sch_instance *a, sch_instance *b)
+{
+    char *xa = sch_dump_xml (a);
+    char *xb = sch_dump_xml (b);
+    bool same = xa && xb && strcmp (xa, xb) == 0;
+    free (xa);
+    free (xb);
+    return same;
+}
+
+/* Write a model with a top level container holding one leaf */
+static void
+_schema_write (const char *dir, const char *file, const char *name, const char *leaf)
+{
+    char *filename = g_build_filename (dir, file, NULL);
+    FILE *f = fopen (filename, "w");
+
+    CU_ASSERT (f != NULL);
+    if (f)
+    {
+        fprintf (f, "<?xml version='1.0' encoding='UTF-8'?>\n"
+                 "<MODULE xmlns=\"http://test.com/ns/yang/%s\"\n"
+                 "        model=\"%s\" organization=\"Test Ltd\" version=\"2024-01-01\">\n"
+                 "  <NODE name=\"%s\" help=\"container\">\n"
+                 "    <NODE name=\"%s\" mode=\"rw\" help=\"leaf\"/>\n"
+                 "  </NODE>\n"
+                 "</MODULE>\n", name, name, name, leaf);
+        fclose (f);
+    }
+    g_free (filename);
+}
+
+static void
+_schema_remove (const char *dir, const char *file)
+{
+    char *filename = g_build_filename (dir, file, NULL);
+    CU_ASSERT (unlink (filename) == 0);
+    g_free (filename);
+}
+
+static char *
+_schema_cache (const char *dir)
+{
+    char *real = realpath (dir, NULL);
+    char *cache = g_strdup_printf ("%s.cache", real);
+    free (real);
+    return cache;
+}
+
+static char *
+_schema_dir_new (void)
+{
+    char *dir = g_dir_make_tmp ("apteryx-xml-test-XXXXXX", NULL);
+
+    CU_ASSERT (dir != NULL);
+    _schema_write (dir, "alpha.xml", "alpha", "leaf");
+    return dir;
+}
+
+static void
+_schema_dir_free (char *dir)
+{
+    char *cache = _schema_cache (dir);
+    DIR *dp = opendir (dir);
+    struct dirent *ep;
+
+    while (dp && (ep = readdir (dp)))
+    {
+        if (ep->d_name[0] != '.')
+        {
+            char *filename = g_build_filename (dir, ep->d_name, NULL);
+            unlink (filename);
+            g_free (filename);
+        }
+    }
+    if (dp)
+        closedir (dp);
+    rmdir (dir);
+    unlink (cache);
+    g_free (cache);
+    g_free (dir);
+}
+
+void
+test_schema_cache_round_trip (void)
+{
+    char *dir = _schema_dir_new ();
+    char *cache = _schema_cache (dir);
+    sch_instance *parsed;
+    sch_instance *cached;
+    sch_instance *direct;
+
+    _schema_write (dir, "beta.xml", "beta", "leaf");
+    parsed = sch_load (dir);
+    CU_ASSERT (parsed != NULL);
+    CU_ASSERT (g_file_test (cache, G_FILE_TEST_EXISTS));
+    cached = sch_load (dir);
+    direct = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    CU_ASSERT (cached != NULL && direct != NULL);
+    CU_ASSERT (_same_dump (parsed, cached));
+    CU_ASSERT (_same_dump (direct, cached));
+    CU_ASSERT (sch_lookup (cached, "/alpha/leaf") != NULL);
+    CU_ASSERT (sch_lookup (cached, "/beta/leaf") != NULL);
+    CU_ASSERT (g_list_length (sch_get_loaded_models (cached)) ==
+               g_list_length (sch_get_loaded_models (direct)));
+    sch_free (parsed);
+    sch_free (cached);
+    sch_free (direct);
+    g_free (cache);
+    _schema_dir_free (dir);
+}
+
+void
+test_schema_cache_invalidate (void)
+{
+    char *dir = _schema_dir_new ();
+    sch_instance *instance;
+
+    instance = sch_load (dir);
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") != NULL);
+    sch_free (instance);
+
+    /* A changed file */
+    _schema_write (dir, "alpha.xml", "alpha", "changed");
+    instance = sch_load (dir);
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") == NULL);
+    CU_ASSERT (sch_lookup (instance, "/alpha/changed") != NULL);
+    sch_free (instance);
+
+    /* An added file */
+    _schema_write (dir, "beta.xml", "beta", "leaf");
+    instance = sch_load (dir);
+    CU_ASSERT (sch_lookup (instance, "/beta/leaf") != NULL);
+    sch_free (instance);
+
+    /* A removed file */
+    _schema_remove (dir, "beta.xml");
+    instance = sch_load (dir);
+    CU_ASSERT (sch_lookup (instance, "/beta/leaf") == NULL);
+    CU_ASSERT (sch_lookup (instance, "/alpha/changed") != NULL);
+    sch_free (instance);
+    _schema_dir_free (dir);
+}
+
+/* The incremental parser, fed in chunks of size bytes */
+static GNode *
+_json_parse (sch_instance *instance, const char *json, int flags, size_t size)
+{
+    sch_json_parser *parser = sch_json_parser_new (instance, NULL, flags);
+    size_t len = strlen (json);
+
+    for (size_t offset = 0; offset < len; offset += size)
+        sch_json_parser_feed (parser, json + offset, MIN (size, len - offset));
+    return sch_json_parser_finish (parser);
+}
+
+void
+test_schema_json_parser (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    const char *documents[] = {
+        "{\"test\":{\"settings\":{\"debug\":\"enable\",\"priority\":2}}}",
+        "{\"test\":{\"settings\":{\"time\":{\"hour\":1,\"minute\":30},\"description\":\"a \\\"quoted\\\" \\u00e9\"}}}",
+        "{\"test\":{\"settings\":{\"users\":[{\"name\":\"fred\",\"age\":5,\"groups\":[1,2]},{\"name\":\"bob\"}]}}}",
+        "{\"test\":{\"animals\":{\"animal\":[{\"name\":\"cat\",\"type\":\"little\",\"food\":[{\"name\":\"fish\"}]}]}}}",
+        "{\"test\":{\"settings\":{\"priority\":1,\"debug\":\"enable\",\"priority\":3}}}",
+        "{\"t2:test\":{\"settings\":{\"priority\":2}}}",
+        NULL,
+    };
+    int flags[] = { 0, SCH_F_JSON_ARRAYS, SCH_F_JSON_ARRAYS | SCH_F_JSON_TYPES };
+
+    CU_ASSERT (instance != NULL);
+    for (int i = 0; documents[i]; i++)
+    {
+        for (int f = 0; f < G_N_ELEMENTS (flags); f++)
+        {
+            json_t *json = json_loads (documents[i], 0, NULL);
+            GNode *expect = sch_json_to_gnode (instance, NULL, json, flags[f]);
+            char *want = _tree_string (expect);
+
+            for (size_t size = 1; size <= 7; size += 6)
+            {
+                GNode *tree = _json_parse (instance, documents[i], flags[f], size);
+                char *have = _tree_string (tree);
+
+                if (strcmp (want, have) != 0)
+                    fprintf (stderr, "\n%s (flags 0x%x)\n%s---\n%s", documents[i], flags[f], want, have);
+                CU_ASSERT (strcmp (want, have) == 0);
+                g_free (have);
+                if (tree)
+                    apteryx_free_tree (tree);
+            }
+            g_free (want);
+            if (expect)
+                apteryx_free_tree (expect);
+            json_decref (json);
+        }
+    }
+
+    /* Malformed input fails as a whole */
+    CU_ASSERT (_json_parse (instance, "{\"test\":{\"settings\":{\"debug\":}}}", 0, 3) == NULL);
+    CU_ASSERT (_json_parse (instance, "{\"test\":{\"settings\":{\"debug\":\"enable\"}}", 0, 3) == NULL);
+    CU_ASSERT (_json_parse (instance, "{\"test\":{\"nothere\":1}}", 0, 3) == NULL);
+    sch_free (instance);
+}
+
+/* A list entry without its key fails the whole list, also after a good entry */
+void
+test_schema_json_key_missing (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    const char *documents[] = {
+        "{\"test\":{\"animals\":{\"animal\":[{\"type\":\"big\"}]}}}",
+        "{\"test\":{\"animals\":{\"animal\":[{\"name\":\"cat\"},{\"type\":\"big\"}]}}}",
+        NULL,
+    };
+
+    for (int i = 0; documents[i]; i++)
+    {
+        json_t *json = json_loads (documents[i], 0, NULL);
+        CU_ASSERT (sch_json_to_gnode (instance, NULL, json, 0) == NULL);
+        CU_ASSERT (sch_last_err () == SCH_E_KEYMISSING);
+        json_decref (json);
+    }
+    sch_free (instance);
+}
+
+/* Every kind of built tree, freed unless it belongs to an arena */
+static char *
+_built_trees (sch_instance *instance, bool arena)
+{
+    const char *json = "{\"test\":{\"animals\":{\"animal\":[{\"name\":\"cat\",\"type\":\"little\"}]}}}";
+    GString *out = g_string_new (NULL);
+    sch_node *schema = NULL;
+    json_t *parsed = json_loads (json, 0, NULL);
+    GNode *trees[5];
+    char *tstring;
+
+    trees[0] = sch_path_to_gnode (instance, NULL, "/test/animals/animal/cat/name", 0, NULL);
+    trees[1] = sch_path_to_query (instance, NULL, "/test/animals/animal/*/type", 0);
+    trees[2] = sch_path_to_gnode (instance, NULL, "/test/settings", 0, &schema);
+    CU_ASSERT (sch_query_to_gnode (instance, schema, trees[2], "fields=debug;time(day;hour)", 0, NULL));
+    trees[3] = sch_json_to_gnode (instance, NULL, parsed, 0);
+    trees[4] = _json_parse (instance, json, 0, 5);
+    for (int i = 0; i < G_N_ELEMENTS (trees); i++)
+    {
+        CU_ASSERT (trees[i] != NULL);
+        tstring = _tree_string (trees[i]);
+        g_string_append_printf (out, "%s---\n", tstring);
+        g_free (tstring);
+        if (!arena && trees[i])
+            apteryx_free_tree (trees[i]);
+    }
+    if (arena)
+        CU_ASSERT (!sch_traverse_tree (instance, NULL, trees[0], 0, 1));
+    json_decref (parsed);
+    return g_string_free (out, FALSE);
+}
+
+void
+test_schema_arena (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    sch_arena *arena = sch_arena_new ();
+    char *heap = _built_trees (instance, false);
+    char *pooled;
+    char *before;
+    char *after;
+    GNode *tree;
+
+    CU_ASSERT (sch_arena_use (arena) == NULL);
+    pooled = _built_trees (instance, true);
+    CU_ASSERT (sch_arena_use (NULL) == arena);
+    sch_arena_free (arena);
+
+    /* Arena trees do not share memory with an instance that has gone */
+    arena = sch_arena_new ();
+    sch_arena_use (arena);
+    tree = sch_path_to_gnode (instance, NULL, "/test/settings/debug", 0, NULL);
+    before = _tree_string (tree);
+    sch_free (instance);
+    after = _tree_string (tree);
+    CU_ASSERT (strcmp (before, after) == 0);
+    g_free (before);
+    g_free (after);
+    sch_arena_use (NULL);
+    sch_arena_free (arena);
+
+    if (strcmp (heap, pooled) != 0)
+        fprintf (stderr, "\n%s===\n%s", heap, pooled);
+    CU_ASSERT (strcmp (heap, pooled) == 0);
+    g_free (heap);
+    g_free (pooled);
+}
+
+/* An instance matches a fresh load of its directory */
+static bool
+_same_as_load (sch_instance *instance, const char *dir)
+{
+    sch_instance *fresh = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    bool same = _same_dump (instance, fresh) &&
+        g_list_length (sch_get_loaded_models (instance)) == g_list_length (sch_get_loaded_models (fresh));
+    sch_free (fresh);
+    return same;
+}
+
+void
+test_schema_reload (void)
+{
+    char *dir = _schema_dir_new ();
+    sch_instance *instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    sch_node *old = sch_lookup (instance, "/alpha/leaf");
+
+    /* Nothing changed keeps the same nodes */
+    CU_ASSERT (old != NULL);
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") == old);
+
+    /* Added */
+    _schema_write (dir, "beta.xml", "beta", "leaf");
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/beta/leaf") != NULL);
+    CU_ASSERT (_same_as_load (instance, dir));
+
+    /* Nodes from before the reload stay usable until sch_reclaim */
+    CU_ASSERT (g_strcmp0 (sch_name_ref (old), "leaf") == 0);
+    CU_ASSERT (sch_is_leaf (old) && sch_is_writable (old));
+
+    /* Changed */
+    _schema_write (dir, "beta.xml", "beta", "changed");
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/beta/leaf") == NULL);
+    CU_ASSERT (sch_lookup (instance, "/beta/changed") != NULL);
+    CU_ASSERT (_same_as_load (instance, dir));
+    sch_reclaim (instance);
+
+    /* Removed */
+    _schema_remove (dir, "beta.xml");
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/beta/changed") == NULL);
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") != NULL);
+    CU_ASSERT (_same_as_load (instance, dir));
+    sch_free (instance);
+    _schema_dir_free (dir);
+}
+
+void
+test_schema_reload_lazy (void)
+{
+    char *dir = _schema_dir_new ();
+    sch_instance *instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_LAZY);
+
+    _schema_write (dir, "beta.xml", "beta", "leaf");
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/beta/leaf") != NULL);
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") != NULL);
+    _schema_remove (dir, "alpha.xml");
+    CU_ASSERT (sch_reload (instance));
+    CU_ASSERT (sch_lookup (instance, "/alpha/leaf") == NULL);
+    CU_ASSERT (_same_as_load (instance, dir));
+    sch_free (instance);
+    _schema_dir_free (dir);
+}
+
+/* Run one root level operation on a fresh lazy instance and an eager one */
+static void
+_lazy_compare (sch_instance *eager, int operation)
+{
+    sch_instance *lazy = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_LAZY);
+    sch_instance *instances[] = { eager, lazy };
+    char *result[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+        GNode *root = g_node_new (g_strdup ("/"));
+        sch_node *schema = NULL;
+        GNode *tree = NULL;
+
+        switch (operation)
+        {
+        case 0:
+            CU_ASSERT (sch_query_to_gnode (instances[i], NULL, root, "depth=2", 0, NULL));
+            break;
+        case 1:
+            CU_ASSERT (sch_traverse_tree (instances[i], NULL, root, SCH_F_ADD_DEFAULTS, 0));
+            break;
+        case 2:
+            tree = sch_path_to_gnode (instances[i], NULL, "/t2:test/settings/priority", 0, &schema);
+            CU_ASSERT (schema != NULL);
+            break;
+        case 3:
+            schema = sch_child_first (instances[i]);
+            for (; schema; schema = sch_node_next_sibling (schema))
+                APTERYX_NODE (root, g_strdup (sch_name_ref (schema)));
+            break;
+        }
+        result[i] = _tree_string (tree ? tree : root);
+        apteryx_free_tree (root);
+        if (tree)
+            apteryx_free_tree (tree);
+    }
+    if (strcmp (result[0], result[1]) != 0)
+        fprintf (stderr, "\neager\n%slazy\n%s", result[0], result[1]);
+    CU_ASSERT (strcmp (result[0], result[1]) == 0);
+    g_free (result[0]);
+    g_free (result[1]);
+    sch_free (lazy);
+}
+
+void
+test_schema_lazy_matches_eager (void)
+{
+    sch_instance *eager = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    sch_instance *lazy;
+
+    for (int operation = 0; operation < 4; operation++)
+        _lazy_compare (eager, operation);
+
+    /* Lookups merge only what they need, and the result ends up the same */
+    lazy = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_LAZY);
+    CU_ASSERT (sch_lookup (lazy, "/test/settings/debug") != NULL);
+    CU_ASSERT (sch_lookup (lazy, "/t2:test/settings/priority") != NULL);
+    CU_ASSERT (sch_node_by_namespace (lazy, "http://test.com/ns/yang/testing", NULL) != NULL);
+    CU_ASSERT (sch_lookup (lazy, "/nothere") == NULL);
+    CU_ASSERT (_same_dump (eager, lazy));
+    CU_ASSERT (g_list_length (sch_get_loaded_models (eager)) ==
+               g_list_length (sch_get_loaded_models (lazy)));
+    sch_free (lazy);
+    sch_free (eager);
+}
+
+void
+test_schema_lazy_root_index (void)
+{
+    char *dir = g_dir_make_tmp ("apteryx-xml-test-XXXXXX", NULL);
+    sch_instance *eager;
+    sch_instance *lazy;
+    sch_memory usage[2];
+
+    /* More top level nodes than the root needs to index its children */
+    for (int i = 0; i < 10; i++)
+    {
+        char *file = g_strdup_printf ("m%d.xml", i);
+        char *name = g_strdup_printf ("m%d", i);
+
+        _schema_write (dir, file, name, "leaf");
+        g_free (name);
+        g_free (file);
+    }
+    eager = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    lazy = sch_load_with_flags (dir, NULL, SCH_LOAD_F_LAZY);
+
+    /* Merge the models one at a time */
+    for (int i = 0; i < 10; i++)
+    {
+        char *path = g_strdup_printf ("/m%d/leaf", i);
+
+        CU_ASSERT (sch_lookup (eager, path) != NULL);
+        CU_ASSERT (sch_lookup (lazy, path) != NULL);
+        g_free (path);
+    }
+    CU_ASSERT (sch_lookup (lazy, "/m10/leaf") == NULL);
+    sch_memory_usage (eager, &usage[0]);
+    sch_memory_usage (lazy, &usage[1]);
+    CU_ASSERT (usage[0].indexes == usage[1].indexes);
+    CU_ASSERT (_same_dump (eager, lazy));
+    sch_free (lazy);
+    sch_free (eager);
+    _schema_dir_free (dir);
+}
+
+/* The tree and flags for path?query, with the query applied below the path */
+static char *
+_query_string (sch_instance *instance, const char *path, const char *query, bool *rc)
+{
+    sch_node *schema = NULL;
+    GNode *tree = sch_path_to_gnode (instance, NULL, path, 0, &schema);
+    int rflags = 0;
+    char *result;
+    char *tstring;
+
+    *rc = tree && sch_query_to_gnode (instance, schema, tree, query, 0, &rflags);
+    tstring = _tree_string (tree);
+    result = g_strdup_printf ("%s0x%x\n", tstring, rflags);
+    g_free (tstring);
+    if (tree)
+        apteryx_free_tree (tree);
+    return result;
+}
+
+void
+test_schema_query_cache (void)
+{
+    sch_instance *cached = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    const char *queries[] = {
+        "depth=2", "fields=debug;time(day;hour)", "content=config", "content=nonconfig&depth=3",
+        "with-defaults=report-all", "fields=users/name", "fields=bad()", "depth=x", NULL,
+    };
+
+    for (int i = 0; queries[i]; i++)
+    {
+        sch_instance *fresh = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+        bool expect_rc;
+        bool rc;
+        char *miss = _query_string (fresh, "/test/settings", queries[i], &expect_rc);
+
+        /* The second and later uses come from the cached template */
+        for (int repeat = 0; repeat < 3; repeat++)
+        {
+            char *hit = _query_string (cached, "/test/settings", queries[i], &rc);
+            CU_ASSERT (rc == expect_rc);
+            CU_ASSERT (strcmp (miss, hit) == 0);
+            g_free (hit);
+        }
+        g_free (miss);
+        sch_free (fresh);
+    }
+    sch_free (cached);
+}
+
+static char *
+_path_string (sch_instance *instance, const char *path, int flags)
+{
+    sch_node *schema = NULL;
+    GNode *tree = sch_path_to_gnode (instance, NULL, path, flags, &schema);
+    char *tstring = _tree_string (tree);
+    char *result = g_strdup_printf ("%s%s\n", tstring, schema ? sch_name_ref (schema) : "-");
+
+    g_free (tstring);
+    if (tree)
+        apteryx_free_tree (tree);
+    return result;
+}
+
+void
+test_schema_path_cache (void)
+{
+    sch_instance *cached = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    const char *paths[] = {
+        "/test/settings/users/fred/name", "/test/settings/users/bob/name",
+        "/test/settings/users=fred/age", "/test/settings/users=bob/age",
+        "/test/animals/animal/cat/food/fish/type", "/test/animals/animal/dog/food/bone/type",
+        "/test/settings/users/fred/groups/3", "/t2:test/settings/priority", "/test/nothere/x",
+        "/test/settings/debug?depth=1", "/test/settings/users/fe80::1/name", "/test/settings/users/t2:x/name",
+        "/test/settings/users/=/name", "/test/settings/users//name", NULL,
+    };
+    sch_stat stats[SCH_STAT_MAX];
+
+    for (int i = 0; paths[i]; i++)
+    {
+        sch_instance *fresh = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+        char *miss = _path_string (fresh, paths[i], 0);
+
+        /* Paths of the same shape with other keys were resolved before */
+        for (int repeat = 0; repeat < 2; repeat++)
+        {
+            char *hit = _path_string (cached, paths[i], 0);
+            if (strcmp (miss, hit) != 0)
+                fprintf (stderr, "\n%s\n%s---\n%s", paths[i], miss, hit);
+            CU_ASSERT (strcmp (miss, hit) == 0);
+            g_free (hit);
+        }
+        g_free (miss);
+        sch_free (fresh);
+    }
+    sch_free (cached);
+
+    /* List keys given as their own element share one entry */
+    cached = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    sch_stats_enable (true);
+    sch_stats_reset ();
+    for (int i = 0; i < 4; i++)
+    {
+        char *path = g_strdup_printf ("/test/animals/animal/a%d/food/f%d/name", i, i);
+        char *expect = g_strdup_printf ("/test\n  animals\n    animal\n      a%d\n        food\n"
+                                        "          f%d\n            name\nname\n", i, i);
+        char *have = _path_string (cached, path, 0);
+
+        CU_ASSERT (strcmp (expect, have) == 0);
+        g_free (path);
+        g_free (expect);
+        g_free (have);
+    }
+    sch_stats_snapshot (stats);
+    CU_ASSERT (stats[SCH_STAT_PATH_TO_GNODE].misses == 1);
+    CU_ASSERT (stats[SCH_STAT_PATH_TO_GNODE].hits == 3);
+    sch_stats_enable (false);
+    sch_free (cached);
+}
+
+/* The path and namespace a name search below top resolves to */
+static char *
+_find_name (sch_instance *instance, sch_node *top, const char *name)
+{
+    sch_node *schema = top;
+    char *path = g_strdup_printf ("//%s", name);
+    GNode *tree = sch_path_to_gnode (instance, NULL, path, SCH_F_XPATH, &schema);
+    char *found = NULL;
+
+    if (tree && schema)
+    {
+        char *spath = sch_path (schema);
+        char *href = sch_namespace (schema);
+        found = g_strdup_printf ("%s %s", spath, href ?: "");
+        free (spath);
+        free (href);
+    }
+    if (tree)
+        apteryx_free_tree (tree);
+    g_free (path);
+    return found;
+}
+
+/* The name index finds the same nodes as searching the schema. Nodes of a
+ * schema replaced by sch_reload are not in the new index so are searched */
+void
+test_schema_name_index (void)
+{
+    char *dir = g_dir_make_tmp ("apteryx-xml-test-XXXXXX", NULL);
+    GDir *models = g_dir_open (TEST_SCHEMA_PATH, 0, NULL);
+    GHashTable *names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    sch_instance *instance;
+    const char *file;
+    sch_node *root;
+    sch_node *old;
+    int checked = 0;
+
+    while ((file = g_dir_read_name (models)))
+    {
+        char *from = g_build_filename (TEST_SCHEMA_PATH, file, NULL);
+        char *to = g_build_filename (dir, file, NULL);
+        char *data;
+        gsize len;
+
+        CU_ASSERT (g_file_get_contents (from, &data, &len, NULL));
+        CU_ASSERT (g_file_set_contents (to, data, len, NULL));
+        g_free (data);
+        g_free (from);
+        g_free (to);
+    }
+    g_dir_close (models);
+
+    instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    old = sch_get_root_schema (instance);
+    _schema_write (dir, "zz.xml", "zz", "leaf");
+    CU_ASSERT (sch_reload (instance));
+    root = sch_get_root_schema (instance);
+    CU_ASSERT (root != old);
+
+    for (sch_node *n = sch_node_child_first (old); n; n = sch_preorder_next (n, old))
+    {
+        const char *prefix = sch_prefix_ref (n);
+        g_hash_table_add (names, sch_name (n));
+        if (prefix)
+            g_hash_table_add (names, g_strdup_printf ("%s:%s", prefix, sch_name_ref (n)));
+    }
+    /* The old root and each top level node against their match in the new */
+    for (sch_node *otop = old, *top = root; otop && top;
+         otop = otop == old ? sch_node_child_first (old) : sch_node_next_sibling (otop),
+         top = top == root ? sch_node_child_first (root) : sch_node_next_sibling (top))
+    {
+        GHashTableIter iter;
+        gpointer name;
+
+        CU_ASSERT (g_strcmp0 (sch_name_ref (otop), sch_name_ref (top)) == 0);
+        g_hash_table_iter_init (&iter, names);
+        while (g_hash_table_iter_next (&iter, &name, NULL))
+        {
+            char *indexed = _find_name (instance, top, name);
+            char *searched = _find_name (instance, otop, name);
+
+            if (g_strcmp0 (indexed, searched) != 0)
+                fprintf (stderr, "\n%s//%s: %s != %s\n", sch_name_ref (top) ?: "", (char *) name, indexed, searched);
+            CU_ASSERT (g_strcmp0 (indexed, searched) == 0);
+            checked += indexed != NULL;
+            g_free (indexed);
+            g_free (searched);
+        }
+    }
+    CU_ASSERT (checked > 0);
+    g_hash_table_destroy (names);
+    sch_free (instance);
+    _schema_dir_free (dir);
+}
+
+/* The path and namespace sch_lookup finds for path */
+static char *
+_lookup_string (sch_instance *instance, const char *path)
+{
+    sch_node *schema = sch_lookup (instance, path);
+    char *spath = schema ? sch_path (schema) : NULL;
+    char *href = schema ? sch_namespace (schema) : NULL;
+    char *result = schema ? g_strdup_printf ("%s %s", spath, href ?: "") : NULL;
+
+    free (spath);
+    free (href);
+    return result;
+}
+
+/* /wide/entry with entries of more fields than the traverse index threshold.
+ * With junk, two children the schema does not know force an unindexed walk */
+static GNode *
+_wide_tree (bool junk)
+{
+    GNode *root = g_node_new (g_strdup ("/"));
+    GNode *list = APTERYX_NODE (root, g_strdup ("wide"));
+
+    list = APTERYX_NODE (list, g_strdup ("entry"));
+    for (int e = 0; e < 3; e++)
+    {
+        GNode *entry = APTERYX_NODE (list, g_strdup_printf ("e%d", e));
+
+        if (junk)
+        {
+            APTERYX_LEAF (entry, g_strdup ("junk"), g_strdup ("1"));
+            APTERYX_LEAF (entry, g_strdup ("junk"), g_strdup ("2"));
+        }
+        APTERYX_LEAF (entry, g_strdup ("id"), g_strdup_printf ("e%d", e));
+        for (int f = e; f < 35 + e; f++)
+        {
+            const char *value = f % 3 == 0 ? "d" : f % 3 == 1 ? "" : "v";
+            APTERYX_LEAF (entry, g_strdup_printf ("f%02d", f), g_strdup (value));
+        }
+    }
+    return root;
+}
+
+static void
+_remove_junk (GNode *node)
+{
+    GNode *next;
+
+    for (GNode *child = node->children; child; child = next)
+    {
+        next = child->next;
+        if (strcmp (APTERYX_NAME (child), "junk") == 0)
+            apteryx_free_tree (child);
+        else
+            _remove_junk (child);
+    }
+}
+
+/* Traversing with the child index gives the same tree as without */
+void
+test_schema_traverse_index (void)
+{
+    char *dir = _schema_dir_new ();
+    char *filename = g_build_filename (dir, "wide.xml", NULL);
+    GString *model = g_string_new (NULL);
+    int flags[] = {
+        0, SCH_F_ADD_DEFAULTS, SCH_F_TRIM_DEFAULTS, SCH_F_ADD_MISSING_NULL, SCH_F_SET_NULL,
+        SCH_F_SET_NULL | SCH_F_CONFIG, SCH_F_ADD_DEFAULTS | SCH_F_FILTER_RDEPTH,
+    };
+    sch_instance *instance;
+
+    g_string_append (model, "<?xml version='1.0' encoding='UTF-8'?>\n"
+                     "<MODULE xmlns=\"http://test.com/ns/yang/wide\" model=\"wide\" organization=\"Test Ltd\" version=\"2024-01-01\">\n"
+                     "  <NODE name=\"wide\" help=\"container\">\n"
+                     "    <NODE name=\"entry\" help=\"list\">\n"
+                     "      <NODE name=\"*\" help=\"entry\">\n"
+                     "        <NODE name=\"id\" mode=\"rw\" help=\"key\"/>\n");
+    for (int f = 0; f < 40; f++)
+    {
+        g_string_append_printf (model, "        <NODE name=\"f%02d\" mode=\"%s\"%s help=\"field\"/>\n", f,
+                                f == 5 ? "h" : "rw", f % 2 ? "" : " default=\"d\"");
+    }
+    g_string_append (model, "      </NODE>\n    </NODE>\n  </NODE>\n</MODULE>\n");
+    CU_ASSERT (g_file_set_contents (filename, model->str, -1, NULL));
+    g_string_free (model, TRUE);
+    instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    CU_ASSERT (instance != NULL);
+
+    for (int i = 0; i < G_N_ELEMENTS (flags); i++)
+    {
+        GNode *indexed = _wide_tree (false);
+        GNode *walked = _wide_tree (true);
+        int rdepth = (flags[i] & SCH_F_FILTER_RDEPTH) ? 4 : 0;
+        bool irc = sch_traverse_tree (instance, NULL, indexed, flags[i], rdepth);
+        bool wrc = sch_traverse_tree (instance, NULL, walked, flags[i], rdepth);
+        char *istring;
+        char *wstring;
+
+        _remove_junk (walked);
+        istring = _tree_string (indexed);
+        wstring = _tree_string (walked);
+        if (irc != wrc || strcmp (istring, wstring) != 0)
+            fprintf (stderr, "\nflags 0x%x %d/%d\n%s---\n%s", flags[i], irc, wrc, istring, wstring);
+        CU_ASSERT (irc == wrc);
+        CU_ASSERT (strcmp (istring, wstring) == 0);
+        g_free (istring);
+        g_free (wstring);
+        apteryx_free_tree (indexed);
+        apteryx_free_tree (walked);
+    }
+    sch_free (instance);
+    g_free (filename);
+    _schema_dir_free (dir);
+}
+
+/* Borrowed attributes match the copied ones when empty, parsed or from the cache */
+void
+test_schema_empty_attribute (void)
+{
+    char *dir = g_dir_make_tmp ("apteryx-xml-test-XXXXXX", NULL);
+    char *filename = g_build_filename (dir, "empty.xml", NULL);
+    FILE *f = fopen (filename, "w");
+
+    CU_ASSERT (f != NULL);
+    if (f)
+    {
+        fprintf (f, "<?xml version='1.0' encoding='UTF-8'?>\n"
+                 "<MODULE xmlns=\"http://test.com/ns/yang/empty\" model=\"\">\n"
+                 "  <NODE name=\"empty\" help=\"container\">\n"
+                 "    <NODE name=\"leaf\" mode=\"rw\" default=\"\" help=\"leaf\"/>\n"
+                 "  </NODE>\n"
+                 "</MODULE>\n");
+        fclose (f);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        /* Parsed, then written to the cache, then read back from it */
+        sch_instance *instance = sch_load_with_flags (dir, NULL, i == 0 ? SCH_LOAD_F_NO_CACHE : 0);
+        sch_node *top = sch_lookup (instance, "/empty");
+        sch_node *leaf = sch_lookup (instance, "/empty/leaf");
+        char *model = top ? sch_model (top, true) : NULL;
+        char *value = leaf ? sch_default_value (leaf) : NULL;
+
+        CU_ASSERT (top != NULL && leaf != NULL);
+        CU_ASSERT (g_strcmp0 (model, "") == 0);
+        CU_ASSERT (g_strcmp0 (sch_model_ref (top, true), "") == 0);
+        CU_ASSERT (g_strcmp0 (value, "") == 0);
+        CU_ASSERT (g_strcmp0 (sch_default_value_ref (leaf), "") == 0);
+        free (model);
+        free (value);
+        sch_free (instance);
+    }
+    g_free (filename);
+    _schema_dir_free (dir);
+}
+
+/* A compacted schema answers like a normal one, without the help text */
+void
+test_schema_compact (void)
+{
+    sch_instance *normal = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    sch_instance *compact = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE | SCH_LOAD_F_COMPACT);
+    const char *values[] = {
+        "0", "1", "2", "enable", "disable", "big", "little", "true", "false", "7", "-3", "99",
+        "4294967296", "x", "flash:/a.cfg", "", NULL,
+    };
+    sch_node *nroot = sch_get_root_schema (normal);
+    sch_node *croot = sch_get_root_schema (compact);
+    sch_node *n;
+    sch_node *c;
+    int count = 0;
+    char *dump;
+
+    for (n = sch_node_child_first (nroot), c = sch_node_child_first (croot); n && c;
+         n = sch_preorder_next (n, nroot), c = sch_preorder_next (c, croot), count++)
+    {
+        char *npath = sch_path (n);
+        char *cpath = sch_path (c);
+        char *ndefault = sch_default_value (n);
+        char *cdefault = sch_default_value (c);
+        char *nlookup = _lookup_string (normal, npath);
+        char *clookup = _lookup_string (compact, npath);
+
+        CU_ASSERT (strcmp (npath, cpath) == 0);
+        CU_ASSERT (g_strcmp0 (ndefault, cdefault) == 0);
+        CU_ASSERT (sch_is_leaf (n) == sch_is_leaf (c));
+        CU_ASSERT (sch_is_list (n) == sch_is_list (c));
+        CU_ASSERT (sch_is_readable (n) == sch_is_readable (c));
+        CU_ASSERT (sch_is_writable (n) == sch_is_writable (c));
+        CU_ASSERT (sch_is_hidden (n) == sch_is_hidden (c));
+        CU_ASSERT (sch_is_config (n) == sch_is_config (c));
+        CU_ASSERT (g_strcmp0 (nlookup, clookup) == 0);
+        g_free (nlookup);
+        g_free (clookup);
+        for (int i = 0; sch_is_leaf (n) && values[i]; i++)
+        {
+            char *nto = sch_translate_to (n, g_strdup (values[i]));
+            char *cto = sch_translate_to (c, g_strdup (values[i]));
+            char *nfrom = sch_translate_from (n, g_strdup (values[i]));
+            char *cfrom = sch_translate_from (c, g_strdup (values[i]));
+            bool nvalid = sch_validate_pattern (n, values[i]);
+            sch_err nerr = sch_last_err ();
+            bool cvalid = sch_validate_pattern (c, values[i]);
+
+            CU_ASSERT (g_strcmp0 (nto, cto) == 0);
+            CU_ASSERT (g_strcmp0 (nfrom, cfrom) == 0);
+            CU_ASSERT (nvalid == cvalid);
+            CU_ASSERT (nerr == sch_last_err ());
+            free (nto);
+            free (cto);
+            free (nfrom);
+            free (cfrom);
+        }
+        free (npath);
+        free (cpath);
+        free (ndefault);
+        free (cdefault);
+    }
+    CU_ASSERT (n == NULL && c == NULL);
+    CU_ASSERT (count > 0);
+
+    /* Only the compacted schema has lost its help */
+    dump = sch_dump_xml (normal);
+    CU_ASSERT (dump && strstr (dump, "help=") != NULL);
+    free (dump);
+    dump = sch_dump_xml (compact);
+    CU_ASSERT (dump && strstr (dump, "help=") == NULL);
+    free (dump);
+    sch_free (normal);
+    sch_free (compact);
+}
+
+/* One call reports every invalid node in the tree with its path */
+void
+test_schema_validate_tree (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    GNode *root = g_node_new (g_strdup ("/"));
+    GNode *test = APTERYX_NODE (root, g_strdup ("test"));
+    GNode *settings = APTERYX_NODE (test, g_strdup ("settings"));
+    GNode *patterns = APTERYX_NODE (test, g_strdup ("patterns"));
+    GNode *users = APTERYX_NODE (settings, g_strdup ("users"));
+    GNode *fred = APTERYX_NODE (users, g_strdup ("fred"));
+    GNode *nokey = APTERYX_NODE (users, g_strdup (""));
+    struct
+    {
+        const char *path;
+        sch_err error;
+    } expect[] = {
+        { "/test/settings/readonly", SCH_E_NOTWRITABLE },
+        { "/test/settings/priority", SCH_E_OUTOFRANGE },
+        { "/test/settings/debug", SCH_E_ENUMINVALID },
+        { "/test/settings/nothere", SCH_E_NOSCHEMANODE },
+        { "/test/settings/users/fred", SCH_E_KEYMISMATCH },
+        { "/test/settings/users/", SCH_E_KEYMISSING },
+        { "/test/patterns/variable_1", SCH_E_PATREGEX },
+    };
+    GList *errors;
+
+    APTERYX_LEAF (settings, g_strdup ("description"), g_strdup ("valid"));
+    APTERYX_LEAF (settings, g_strdup ("readonly"), g_strdup ("yes"));
+    APTERYX_LEAF (settings, g_strdup ("priority"), g_strdup ("7"));
+    APTERYX_LEAF (settings, g_strdup ("debug"), g_strdup ("maybe"));
+    APTERYX_LEAF (settings, g_strdup ("nothere"), g_strdup ("1"));
+    APTERYX_LEAF (fred, g_strdup ("name"), g_strdup ("bob"));
+    APTERYX_LEAF (fred, g_strdup ("age"), g_strdup ("5"));
+    APTERYX_LEAF (nokey, g_strdup ("age"), g_strdup ("6"));
+    APTERYX_LEAF (patterns, g_strdup ("variable_1"), g_strdup ("nowhere.txt"));
+
+    errors = sch_validate_tree (instance, NULL, root, 0);
+    CU_ASSERT (g_list_length (errors) == G_N_ELEMENTS (expect));
+    for (int i = 0; i < G_N_ELEMENTS (expect); i++)
+    {
+        sch_validation_error *error = NULL;
+
+        for (GList *e = errors; e && !error; e = e->next)
+        {
+            if (strcmp (((sch_validation_error *) e->data)->path, expect[i].path) == 0)
+                error = e->data;
+        }
+        CU_ASSERT (error != NULL);
+        CU_ASSERT (error && error->error == expect[i].error);
+        CU_ASSERT (error && error->message && error->message[0] != '\0');
+    }
+    /* The first error is also the last error */
+    CU_ASSERT (errors && sch_last_err () == ((sch_validation_error *) errors->data)->error);
+    sch_validation_errors_free (errors);
+    apteryx_free_tree (root);
+
+    /* A valid tree has no errors */
+    root = g_node_new (g_strdup ("/"));
+    settings = APTERYX_NODE (root, g_strdup ("test"));
+    settings = APTERYX_NODE (settings, g_strdup ("settings"));
+    APTERYX_LEAF (settings, g_strdup ("priority"), g_strdup ("3"));
+    APTERYX_LEAF (settings, g_strdup ("debug"), g_strdup ("enable"));
+    CU_ASSERT (sch_validate_tree (instance, NULL, root, 0) == NULL);
+    CU_ASSERT (sch_last_err () == SCH_E_SUCCESS);
+    apteryx_free_tree (root);
+    sch_free (instance);
+}
+
+/* /test/animals/animal with count entries, added in an unsorted order */
+static GNode *
+_animals_tree (int count)
+{
+    GNode *root = g_node_new (g_strdup ("/"));
+    GNode *list = APTERYX_NODE (root, g_strdup ("test"));
+
+    list = APTERYX_NODE (list, g_strdup ("animals"));
+    list = APTERYX_NODE (list, g_strdup ("animal"));
+
+    for (int i = 0; i < count; i++)
+    {
+        char *name = g_strdup_printf ("a%05d", (i * 37) % count);
+        GNode *entry = APTERYX_NODE (list, name);
+        GNode *food;
+        GNode *f1;
+
+        APTERYX_LEAF (entry, g_strdup ("name"), g_strdup (name));
+        if (i % 3)
+            APTERYX_LEAF (entry, g_strdup ("type"), g_strdup (i % 2 ? "1" : "2"));
+        food = APTERYX_NODE (entry, g_strdup ("food"));
+        f1 = APTERYX_NODE (food, g_strdup ("f1"));
+        APTERYX_LEAF (f1, g_strdup ("name"), g_strdup ("f1"));
+    }
+    return root;
+}
+
+static char *
+_json_string (json_t *json)
+{
+    char *out = json ? json_dumps (json, JSON_SORT_KEYS) : NULL;
+    json_decref (json);
+    return out;
+}
+
+void
+test_schema_parallel_matches_sequential (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    int flags[] = { 0, SCH_F_ADD_DEFAULTS, SCH_F_JSON_ARRAYS | SCH_F_JSON_TYPES,
+                    SCH_F_JSON_ARRAYS | SCH_F_ADD_DEFAULTS | SCH_F_STRIP_KEY };
+
+    for (int f = 0; f < G_N_ELEMENTS (flags); f++)
+    {
+        char *result[2][2];
+
+        for (int parallel = 0; parallel < 2; parallel++)
+        {
+            int _flags = flags[f] | (parallel ? SCH_F_PARALLEL : 0);
+            GNode *tree = _animals_tree (3000);
+
+            result[parallel][0] = _json_string (sch_gnode_to_json (instance, NULL, tree, _flags));
+            CU_ASSERT (sch_traverse_tree (instance, NULL, tree, _flags, 0));
+            result[parallel][1] = _tree_string (tree);
+            apteryx_free_tree (tree);
+        }
+        CU_ASSERT (result[0][0] && result[1][0] && strcmp (result[0][0], result[1][0]) == 0);
+        CU_ASSERT (strcmp (result[0][1], result[1][1]) == 0);
+        for (int i = 0; i < 2; i++)
+        {
+            free (result[i][0]);
+            g_free (result[i][1]);
+        }
+    }
+    sch_free (instance);
+}
+
+static char *
+_page_names (json_t *json)
+{
+    json_t *list = json_object_get (json_object_get (json, "animals"), "animal");
+    GString *names = g_string_new (NULL);
+    json_t *entry;
+    size_t i;
+
+    json_array_foreach (list, i, entry)
+        g_string_append_printf (names, "%s ", json_string_value (json_object_get (entry, "name")));
+    json_decref (json);
+    return g_string_free (names, FALSE);
+}
+
+void
+test_schema_paged (void)
+{
+    sch_instance *instance = sch_load_with_flags (TEST_SCHEMA_PATH, NULL, SCH_LOAD_F_NO_CACHE);
+    const char *queries[][2] = {
+        { "limit=3", "a00000 a00001 a00002 " },
+        { "limit=2&offset=4", "a00004 a00005 " },
+        { "cursor=a00007&limit=3", "a00008 a00009 a00010 " },
+        /* An unknown cursor starts at the next greater key */
+        { "cursor=a000075", "a00008 a00009 a00010 a00011 " },
+        { "offset=100", "" },
+        { NULL, NULL },
+    };
+    GNode *query = g_node_new (g_strdup ("/"));
+
+    /* Paging parameters are only accepted by the _paged variant */
+    CU_ASSERT (!sch_query_to_gnode (instance, NULL, query, "limit=3", 0, NULL));
+    apteryx_free_tree (query);
+
+    for (int repeat = 0; repeat < 2; repeat++)
+    {
+        for (int i = 0; queries[i][0]; i++)
+        {
+            int flags = 0;
+            sch_page page;
+            GNode *tree;
+            char *names;
+
+            query = g_node_new (g_strdup ("/"));
+            CU_ASSERT (sch_query_to_gnode_paged (instance, NULL, query, queries[i][0], 0, &flags, &page));
+            CU_ASSERT (flags & SCH_F_PAGED);
+            apteryx_free_tree (query);
+            flags |= SCH_F_JSON_ARRAYS;
+
+            tree = _animals_tree (12);
+            names = _page_names (sch_gnode_to_json_paged (instance, NULL, tree, flags, &page));
+            CU_ASSERT (strcmp (names, queries[i][1]) == 0);
+            g_free (names);
+            apteryx_free_tree (tree);
+
+            tree = _animals_tree (12);
+            CU_ASSERT (sch_traverse_tree_paged (instance, NULL, tree, flags, 0, &page));
+            /* An empty page leaves nothing under the root */
+            names = tree->children ? _page_names (sch_gnode_to_json (instance, NULL, tree, flags)) : g_strdup ("");
+            CU_ASSERT (strcmp (names, queries[i][1]) == 0);
+            g_free (names);
+            apteryx_free_tree (tree);
+            sch_page_clear (&page);
+        }
+    }
+    sch_free (instance);
+}
+
+/* Integer keys are paged in numeric order */
+void
+test_schema_paged_integer_keys (void)
+{
+    char *dir = _schema_dir_new ();
+    char *filename = g_build_filename (dir, "ports.xml", NULL);
+    const char *model =
+        "<?xml version='1.0' encoding='UTF-8'?>\n"
+        "<MODULE xmlns=\"http://test.com/ns/yang/ports\" model=\"ports\" organization=\"Test Ltd\" version=\"2024-01-01\">\n"
+        "  <NODE name=\"ports\" help=\"container\">\n"
+        "    <NODE name=\"port\" help=\"list\">\n"
+        "      <NODE name=\"*\" help=\"entry\">\n"
+        "        <NODE name=\"id\" mode=\"rw\" help=\"key\" range=\"1..100\"/>\n"
+        "      </NODE>\n"
+        "    </NODE>\n"
+        "  </NODE>\n"
+        "</MODULE>\n";
+    const char *queries[][2] = {
+        { "limit=3", "1 2 3 " },
+        { "cursor=9&limit=3", "10 11 12 " },
+        { "offset=9", "10 11 12 " },
+        { NULL, NULL },
+    };
+    sch_instance *instance;
+
+    CU_ASSERT (g_file_set_contents (filename, model, -1, NULL));
+    instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    CU_ASSERT (instance != NULL);
+    for (int i = 0; queries[i][0]; i++)
+    {
+        GNode *query = g_node_new (g_strdup ("/"));
+        int flags = 0;
+        sch_page page;
+
+        CU_ASSERT (sch_query_to_gnode_paged (instance, NULL, query, queries[i][0], 0, &flags, &page));
+        apteryx_free_tree (query);
+        for (int traverse = 0; traverse < 2; traverse++)
+        {
+            GNode *root = g_node_new (g_strdup ("/"));
+            GNode *list = APTERYX_NODE (root, g_strdup ("ports"));
+            GString *names = g_string_new (NULL);
+            json_t *json;
+            json_t *entry;
+            size_t index;
+
+            list = APTERYX_NODE (list, g_strdup ("port"));
+            for (int id = 12; id > 0; id--)
+            {
+                GNode *e = APTERYX_NODE (list, g_strdup_printf ("%d", id));
+                APTERYX_LEAF (e, g_strdup ("id"), g_strdup_printf ("%d", id));
+            }
+            if (traverse)
+            {
+                CU_ASSERT (sch_traverse_tree_paged (instance, NULL, root, flags, 0, &page));
+                json = sch_gnode_to_json (instance, NULL, root, SCH_F_JSON_ARRAYS);
+            }
+            else
+            {
+                json = sch_gnode_to_json_paged (instance, NULL, root, flags | SCH_F_JSON_ARRAYS, &page);
+            }
+            /* The single top level container is not in the output */
+            json_array_foreach (json_object_get (json, "port"), index, entry)
+                g_string_append_printf (names, "%s ", json_string_value (json_object_get (entry, "id")));
+            CU_ASSERT (strcmp (names->str, queries[i][1]) == 0);
+            g_string_free (names, TRUE);
+            json_decref (json);
+            apteryx_free_tree (root);
+        }
+        sch_page_clear (&page);
+    }
+    sch_free (instance);
+    g_free (filename);
+    _schema_dir_free (dir);
+}
+
+/* Only a leaf with exactly the VALUE elements true and false is a JSON boolean */
+void
+test_schema_json_bool (void)
+{
+    char *dir = _schema_dir_new ();
+    char *filename = g_build_filename (dir, "flags.xml", NULL);
+    const char *model =
+        "<?xml version='1.0' encoding='UTF-8'?>\n"
+        "<MODULE xmlns=\"http://test.com/ns/yang/flags\" model=\"flags\" organization=\"Test Ltd\" version=\"2024-01-01\">\n"
+        "  <NODE name=\"flags\" help=\"container\">\n"
+        "    <NODE name=\"on\" mode=\"rw\" help=\"boolean\">\n"
+        "      <VALUE name=\"true\" value=\"true\"/>\n"
+        "      <VALUE name=\"false\" value=\"false\"/>\n"
+        "    </NODE>\n"
+        "    <NODE name=\"odd\" mode=\"rw\" help=\"not a boolean\">\n"
+        "      <VALUE name=\"true\" value=\"true\"/>\n"
+        "      <VARIANT name=\"false\" value=\"false\"/>\n"
+        "    </NODE>\n"
+        "  </NODE>\n"
+        "</MODULE>\n";
+    sch_instance *instance;
+    GNode *root;
+    GNode *node;
+    json_t *json;
+
+    CU_ASSERT (g_file_set_contents (filename, model, -1, NULL));
+    instance = sch_load_with_flags (dir, NULL, SCH_LOAD_F_NO_CACHE);
+    CU_ASSERT (instance != NULL);
+    root = g_node_new (g_strdup ("/"));
+    node = APTERYX_NODE (root, g_strdup ("flags"));
+    APTERYX_LEAF (node, g_strdup ("on"), g_strdup ("true"));
+    APTERYX_LEAF (node, g_strdup ("odd"), g_strdup ("true"));
+    json = sch_gnode_to_json (instance, NULL, root, SCH_F_JSON_TYPES);
+    CU_ASSERT (json_is_true (json_object_get (json, "on")));
+    CU_ASSERT (json_is_string (json_object_get (json, "odd")));
+    json_decref (json);
+    apteryx_free_tree (root);
+    sch_free (instance);
+    g_free (filename);
+    _schema_dir_free (dir);
+}
+
 static int
 suite_init (void)
 {
@@ -361,6 +1699,30 @@ suite_clean (void)
     return 0;
 }
 
+CU_TestInfo tests_schema[] = {
+    {"schema cache round trip", test_schema_cache_round_trip},
+    {"schema cache invalidate", test_schema_cache_invalidate},
+    {"schema json parser", test_schema_json_parser},
+    {"schema json key missing", test_schema_json_key_missing},
+    {"schema arena", test_schema_arena},
+    {"schema reload", test_schema_reload},
+    {"schema reload lazy", test_schema_reload_lazy},
+    {"schema lazy matches eager", test_schema_lazy_matches_eager},
+    {"schema lazy root index", test_schema_lazy_root_index},
+    {"schema query cache", test_schema_query_cache},
+    {"schema path cache", test_schema_path_cache},
+    {"schema validate tree", test_schema_validate_tree},
+    {"schema name index", test_schema_name_index},
+    {"schema compact", test_schema_compact},
+    {"schema empty attribute", test_schema_empty_attribute},
+    {"schema traverse index", test_schema_traverse_index},
+    {"schema parallel matches sequential", test_schema_parallel_matches_sequential},
+    {"schema paged", test_schema_paged},
+    {"schema paged integer keys", test_schema_paged_integer_keys},
+    {"schema json bool", test_schema_json_bool},
+    CU_TEST_INFO_NULL,
+};
+
 CU_TestInfo tests_lua[] = {
     {"lua load module", test_lua_lib_load},
     {"lua load models", test_lua_api_load},
@@ -368,8 +1730,12 @@ CU_TestInfo tests_lua[] = {
     {"lua ns default set get", test_lua_ns_default_set_get},
     {"lua ns other set get", test_lua_ns_other_set_get},
     {"lua api list", test_lua_api_list},
+    {"lua api list pairs", test_lua_api_list_pairs},
     {"lua api trivial list", test_lua_api_trivial_list},
     {"lua api search", test_lua_api_search},
+    {"lua api set table", test_lua_api_set_table},
+    {"lua api set table invalid", test_lua_api_set_table_invalid},
+    {"lua api get tree", test_lua_api_get_tree},
     {"lua load api memory usage", test_lua_load_api_memory},
     {"lua load api performance", test_lua_load_api_performance},
     {"lua api get performance", test_lua_api_perf_get},
@@ -379,6 +1745,7 @@ CU_TestInfo tests_lua[] = {
 
 static CU_SuiteInfo suites[] = {
     {"LUA API", suite_init, suite_clean, NULL, NULL, tests_lua},
+    {"SCHEMA API", suite_init, suite_clean, NULL, NULL, tests_schema},
     CU_SUITE_INFO_NULL,
 };
 